@@ -0,0 +1,322 @@
+/*
+ * binder-sg-bench.c - throughput of BC_TRANSACTION vs BC_TRANSACTION_SG
+ *
+ * The test becomes the binder context manager, forks a client and has
+ * it send synchronous transactions of 4KB to 1MB to handle 0.  Each
+ * parcel is made of several separately allocated fragments, the way a
+ * Parcel carrying a bitmap or cursor window is put together.  Three
+ * ways of sending it are compared:
+ *
+ *	copy	flatten the fragments into one buffer, then BC_TRANSACTION
+ *	sg	BC_TRANSACTION_SG straight from the fragments
+ *	sg-pg	BC_TRANSACTION_SG with BINDER_SG_FRAGMENT_PAGES set
+ *
+ * Like binder-stress, it must run where servicemanager is not running.
+ *
+ * Build with:
+ *	gcc -O2 -Wall -I drivers/staging/android -o binder-sg-bench \
+ *		Documentation/android/binder-sg-bench.c -lpthread
+ *
+ * Usage: binder-sg-bench [-f fragments] [-m megabytes_per_size]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(4 * 1024 * 1024)
+#define MIN_PARCEL	(4 * 1024)
+#define MAX_PARCEL	(1024 * 1024)
+#define MAX_FRAGMENTS	16
+
+/* Commands are packed back to back, so build them with memcpy */
+struct cmd_buf {
+	uint32_t data[32];
+	size_t len;
+};
+
+enum send_mode {
+	MODE_COPY,
+	MODE_SG,
+	MODE_SG_PAGES,
+};
+
+static const char *mode_names[] = { "copy", "sg", "sg-pg" };
+
+static int nr_fragments = 4;
+static int megabytes = 64;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void cmd_put(struct cmd_buf *cb, const void *p, size_t size)
+{
+	memcpy((char *)cb->data + cb->len, p, size);
+	cb->len += size;
+}
+
+static void cmd_put32(struct cmd_buf *cb, uint32_t v)
+{
+	cmd_put(cb, &v, sizeof(v));
+}
+
+static void cmd_put_ptr(struct cmd_buf *cb, const void *p)
+{
+	cmd_put(cb, &p, sizeof(p));
+}
+
+static int binder_open_map(void)
+{
+	struct binder_version vers;
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0)
+		die("open /dev/binder");
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, expected %d\n",
+			vers.protocol_version,
+			BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		die("mmap /dev/binder");
+	return fd;
+}
+
+static void binder_write_read(int fd, struct cmd_buf *cb,
+			      void *rbuf, size_t read_size, size_t *consumed)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)cb->data;
+	bwr.write_size = cb->len;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = read_size;
+	while (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0)
+		if (errno != EINTR)
+			die("BINDER_WRITE_READ");
+	if (bwr.write_consumed != bwr.write_size) {
+		fprintf(stderr, "short binder write %ld of %ld\n",
+			bwr.write_consumed, bwr.write_size);
+		exit(1);
+	}
+	cb->len = 0;
+	*consumed = bwr.read_consumed;
+}
+
+/* Frees every incoming buffer and answers with an empty reply */
+static void *server_thread(void *arg)
+{
+	int fd = (long)arg;
+	struct cmd_buf cb = { .len = 0 };
+	struct binder_transaction_data reply;
+	uint32_t rbuf[64];
+	size_t consumed;
+
+	cmd_put32(&cb, BC_ENTER_LOOPER);
+	for (;;) {
+		size_t off = 0;
+
+		binder_write_read(fd, &cb, rbuf, sizeof(rbuf), &consumed);
+		while (off < consumed) {
+			uint32_t cmd = *(uint32_t *)((char *)rbuf + off);
+			struct binder_transaction_data *tr =
+				(void *)((char *)rbuf + off + sizeof(cmd));
+
+			off += sizeof(cmd) + _IOC_SIZE(cmd);
+			if (cmd != BR_TRANSACTION)
+				continue;
+			cmd_put32(&cb, BC_FREE_BUFFER);
+			cmd_put_ptr(&cb, tr->data.ptr.buffer);
+			memset(&reply, 0, sizeof(reply));
+			reply.code = tr->code;
+			cmd_put32(&cb, BC_REPLY);
+			cmd_put(&cb, &reply, sizeof(reply));
+		}
+	}
+	return NULL;
+}
+
+/* Sends one parcel and waits for the reply, returns 0 on success */
+static int transact(int fd, enum send_mode mode, size_t size,
+		    char **frags, char *flat)
+{
+	struct cmd_buf cb = { .len = 0 };
+	struct binder_transaction_data_sg sgtr;
+	struct binder_transaction_data *tr = &sgtr.transaction_data;
+	struct binder_sg_fragment sg[MAX_FRAGMENTS];
+	size_t frag_size = size / nr_fragments;
+	uint32_t rbuf[64];
+	int i;
+
+	memset(&sgtr, 0, sizeof(sgtr));
+	tr->target.handle = 0;
+	tr->data_size = size;
+	if (mode == MODE_COPY) {
+		/* what Parcel does today: gather in userspace first */
+		for (i = 0; i < nr_fragments; i++)
+			memcpy(flat + i * frag_size, frags[i], frag_size);
+		tr->data.ptr.buffer = flat;
+		cmd_put32(&cb, BC_TRANSACTION);
+		cmd_put(&cb, tr, sizeof(*tr));
+	} else {
+		for (i = 0; i < nr_fragments; i++) {
+			sg[i].buffer = frags[i];
+			sg[i].length = frag_size;
+			sg[i].flags = mode == MODE_SG_PAGES ?
+				BINDER_SG_FRAGMENT_PAGES : 0;
+		}
+		sgtr.fragments = sg;
+		sgtr.fragment_count = nr_fragments;
+		cmd_put32(&cb, BC_TRANSACTION_SG);
+		cmd_put(&cb, &sgtr, sizeof(sgtr));
+	}
+
+	for (;;) {
+		size_t consumed, off = 0;
+
+		binder_write_read(fd, &cb, rbuf, sizeof(rbuf), &consumed);
+		while (off < consumed) {
+			uint32_t cmd = *(uint32_t *)((char *)rbuf + off);
+			struct binder_transaction_data *r =
+				(void *)((char *)rbuf + off + sizeof(cmd));
+
+			off += sizeof(cmd) + _IOC_SIZE(cmd);
+			switch (cmd) {
+			case BR_REPLY:
+				cmd_put32(&cb, BC_FREE_BUFFER);
+				cmd_put_ptr(&cb, r->data.ptr.buffer);
+				binder_write_read(fd, &cb, NULL, 0, &consumed);
+				return 0;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				return -1;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+static void run_client(void)
+{
+	char *frags[MAX_FRAGMENTS];
+	char *flat;
+	size_t size;
+	int fd, i;
+
+	fd = binder_open_map();
+	for (i = 0; i < nr_fragments; i++) {
+		if (posix_memalign((void **)&frags[i], getpagesize(),
+				   MAX_PARCEL / nr_fragments))
+			die("posix_memalign");
+		memset(frags[i], 0x5a + i, MAX_PARCEL / nr_fragments);
+	}
+	flat = malloc(MAX_PARCEL);
+	if (flat == NULL)
+		die("malloc");
+
+	printf("%8s %8s %10s %10s\n", "size", "mode", "MB/s", "us/call");
+	for (size = MIN_PARCEL; size <= MAX_PARCEL; size *= 4) {
+		int iterations = (megabytes << 20) / size;
+		enum send_mode mode;
+
+		if (iterations < 16)
+			iterations = 16;
+		for (mode = MODE_COPY; mode <= MODE_SG_PAGES; mode++) {
+			struct timeval start, stop;
+			double usecs;
+			int n;
+
+			/* page fragments must stay page aligned */
+			if (mode == MODE_SG_PAGES &&
+			    (size / nr_fragments) % getpagesize())
+				continue;
+			gettimeofday(&start, NULL);
+			for (n = 0; n < iterations; n++)
+				if (transact(fd, mode, size, frags, flat)) {
+					fprintf(stderr, "%s %zd: transaction "
+						"failed\n", mode_names[mode],
+						size);
+					exit(1);
+				}
+			gettimeofday(&stop, NULL);
+			usecs = (stop.tv_sec - start.tv_sec) * 1e6 +
+				(stop.tv_usec - start.tv_usec);
+			printf("%8zd %8s %10.1f %10.1f\n", size,
+			       mode_names[mode],
+			       (double)size * iterations / usecs,
+			       usecs / iterations);
+		}
+	}
+	exit(0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-f fragments] [-m megabytes_per_size]\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = 0;
+	pthread_t thread;
+	int status;
+	pid_t pid;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "f:m:")) != -1) {
+		switch (opt) {
+		case 'f':
+			nr_fragments = atoi(optarg);
+			break;
+		case 'm':
+			megabytes = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_fragments < 1 || nr_fragments > MAX_FRAGMENTS ||
+	    MIN_PARCEL % nr_fragments || megabytes < 1)
+		usage(argv[0]);
+
+	fd = binder_open_map();
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	if (ioctl(fd, BINDER_SET_MAX_THREADS, &max_threads) < 0)
+		die("BINDER_SET_MAX_THREADS");
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		close(fd);
+		run_client();
+	}
+	if (pthread_create(&thread, NULL, server_thread, (void *)(long)fd))
+		die("pthread_create");
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
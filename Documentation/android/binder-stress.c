@@ -0,0 +1,456 @@
+/*
+ * binder-stress.c - concurrency stress test for the binder driver
+ *
+ * The test becomes the binder context manager and serves transactions
+ * from a pool of looper threads.  It then forks a number of client
+ * processes, each running several threads that hammer handle 0 with
+ * synchronous and one-way transactions, optionally passing a local
+ * binder object along so that node and reference counting is exercised
+ * across processes as well.
+ *
+ * Because it registers as context manager it must run on a system where
+ * servicemanager is not running (BINDER_SET_CONTEXT_MGR fails with EBUSY
+ * otherwise), as root or as the uid the driver expects.
+ *
+ * Build with:
+ *	gcc -O2 -Wall -I drivers/staging/android -o binder-stress \
+ *		Documentation/android/binder-stress.c -lpthread
+ *
+ * Usage: binder-stress [-p procs] [-t threads] [-s servers] [-n iterations]
+ *			[-b bytes] [-o oneway_every] [-r object_every]
+ *
+ * Keep /proc/binder/stats and /proc/binder/failed_transaction_log open
+ * in another shell while it runs; a clean run ends with no failed
+ * transactions and the object counts in /proc/binder/stats back to
+ * their starting values.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define MAX_PAYLOAD	(16 * 1024)
+
+static int nr_procs = 4;
+static int nr_threads = 4;
+static int nr_servers = 4;
+static int nr_iterations = 10000;
+static int payload = 64;
+static int oneway_every = 8;
+static int object_every = 16;
+
+struct binder_conn {
+	int fd;
+	void *map;
+};
+
+/* Commands accumulated for the next BINDER_WRITE_READ */
+struct cmd_buf {
+	uint32_t data[64];
+	size_t len;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void binder_conn_open(struct binder_conn *bc)
+{
+	struct binder_version vers;
+
+	bc->fd = open("/dev/binder", O_RDWR);
+	if (bc->fd < 0)
+		die("open /dev/binder");
+	if (ioctl(bc->fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, expected %d\n",
+			vers.protocol_version,
+			BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	bc->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, bc->fd, 0);
+	if (bc->map == MAP_FAILED)
+		die("mmap /dev/binder");
+}
+
+static void cmd_put(struct cmd_buf *cb, const void *p, size_t size)
+{
+	if (cb->len + size > sizeof(cb->data)) {
+		fprintf(stderr, "command buffer overflow\n");
+		exit(1);
+	}
+	memcpy((char *)cb->data + cb->len, p, size);
+	cb->len += size;
+}
+
+static void cmd_put32(struct cmd_buf *cb, uint32_t v)
+{
+	cmd_put(cb, &v, sizeof(v));
+}
+
+static void cmd_put_ptr(struct cmd_buf *cb, void *p)
+{
+	cmd_put(cb, &p, sizeof(p));
+}
+
+/* Flush pending commands and read at most read_size bytes of returns */
+static int binder_write_read(struct binder_conn *bc, struct cmd_buf *cb,
+			     void *rbuf, size_t read_size, size_t *consumed)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)cb->data;
+	bwr.write_size = cb->len;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = read_size;
+	do {
+		if (ioctl(bc->fd, BINDER_WRITE_READ, &bwr) >= 0)
+			break;
+		if (errno != EINTR)
+			return -1;
+	} while (1);
+	if (bwr.write_consumed != bwr.write_size) {
+		fprintf(stderr, "short binder write %ld of %ld\n",
+			bwr.write_consumed, bwr.write_size);
+		return -1;
+	}
+	cb->len = 0;
+	*consumed = bwr.read_consumed;
+	return 0;
+}
+
+/* Returns the size of the payload following cmd in the read buffer */
+static size_t return_size(uint32_t cmd)
+{
+	return _IOC_SIZE(cmd);
+}
+
+static void *server_thread(void *arg)
+{
+	struct binder_conn *bc = arg;
+	struct cmd_buf cb = { .len = 0 };
+	static const char reply_data[MAX_PAYLOAD];
+	uint32_t rbuf[128];
+
+	cmd_put32(&cb, BC_ENTER_LOOPER);
+	for (;;) {
+		size_t consumed, off = 0;
+
+		if (binder_write_read(bc, &cb, rbuf, sizeof(rbuf), &consumed))
+			die("server BINDER_WRITE_READ");
+		while (off < consumed) {
+			uint32_t cmd = *(uint32_t *)((char *)rbuf + off);
+			void *p = (char *)rbuf + off + sizeof(uint32_t);
+
+			off += sizeof(uint32_t) + return_size(cmd);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_SPAWN_LOOPER:
+			case BR_TRANSACTION_COMPLETE:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE: {
+				struct binder_ptr_cookie *pc = p;
+
+				cmd_put32(&cb, cmd == BR_INCREFS ?
+					  BC_INCREFS_DONE : BC_ACQUIRE_DONE);
+				cmd_put_ptr(&cb, pc->ptr);
+				cmd_put_ptr(&cb, pc->cookie);
+				break;
+			}
+			case BR_RELEASE:
+			case BR_DECREFS:
+				break;
+			case BR_TRANSACTION: {
+				struct binder_transaction_data *tr = p;
+				struct binder_transaction_data reply;
+
+				/* releases any handle the client passed in */
+				cmd_put32(&cb, BC_FREE_BUFFER);
+				cmd_put_ptr(&cb, (void *)tr->data.ptr.buffer);
+				if (tr->flags & TF_ONE_WAY)
+					break;
+				memset(&reply, 0, sizeof(reply));
+				reply.code = tr->code;
+				reply.data_size = tr->data_size;
+				reply.data.ptr.buffer = reply_data;
+				cmd_put32(&cb, BC_REPLY);
+				cmd_put(&cb, &reply, sizeof(reply));
+				break;
+			}
+			default:
+				fprintf(stderr, "server: unexpected return "
+					"%08x\n", cmd);
+				exit(1);
+			}
+		}
+	}
+	return NULL;
+}
+
+struct client_stats {
+	unsigned long calls;
+	unsigned long oneway;
+	unsigned long errors;
+};
+
+static void *client_thread(void *arg)
+{
+	struct binder_conn *bc = arg;
+	struct client_stats *st;
+	struct cmd_buf cb = { .len = 0 };
+	char data[MAX_PAYLOAD + sizeof(struct flat_binder_object)];
+	size_t offsets[1] = { 0 };
+	uint32_t rbuf[128];
+	int local_object;
+	int i;
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL)
+		die("calloc");
+	memset(data, 0x5a, sizeof(data));
+
+	for (i = 0; i < nr_iterations; i++) {
+		struct binder_transaction_data tr;
+		int oneway = oneway_every && (i % oneway_every) == 0;
+		int pass_object = object_every && (i % object_every) == 0;
+		int done = 0;
+
+		memset(&tr, 0, sizeof(tr));
+		tr.target.handle = 0;
+		tr.code = i;
+		tr.flags = oneway ? TF_ONE_WAY : 0;
+		tr.data_size = payload;
+		tr.data.ptr.buffer = data;
+		if (pass_object) {
+			struct flat_binder_object *obj = (void *)data;
+
+			memset(obj, 0, sizeof(*obj));
+			obj->type = BINDER_TYPE_BINDER;
+			obj->binder = &local_object;
+			obj->cookie = &local_object;
+			if (tr.data_size < sizeof(*obj))
+				tr.data_size = sizeof(*obj);
+			tr.offsets_size = sizeof(offsets);
+			tr.data.ptr.offsets = offsets;
+		}
+		cmd_put32(&cb, BC_TRANSACTION);
+		cmd_put(&cb, &tr, sizeof(tr));
+
+		while (!done) {
+			size_t consumed, off = 0;
+
+			if (binder_write_read(bc, &cb, rbuf, sizeof(rbuf),
+					      &consumed))
+				die("client BINDER_WRITE_READ");
+			while (off < consumed) {
+				uint32_t cmd = *(uint32_t *)((char *)rbuf + off);
+				void *p = (char *)rbuf + off + sizeof(uint32_t);
+
+				off += sizeof(uint32_t) + return_size(cmd);
+				switch (cmd) {
+				case BR_NOOP:
+				case BR_SPAWN_LOOPER:
+				case BR_RELEASE:
+				case BR_DECREFS:
+					break;
+				case BR_TRANSACTION_COMPLETE:
+					if (oneway) {
+						st->oneway++;
+						done = 1;
+					}
+					break;
+				case BR_INCREFS:
+				case BR_ACQUIRE: {
+					struct binder_ptr_cookie *pc = p;
+
+					cmd_put32(&cb, cmd == BR_INCREFS ?
+						  BC_INCREFS_DONE :
+						  BC_ACQUIRE_DONE);
+					cmd_put_ptr(&cb, pc->ptr);
+					cmd_put_ptr(&cb, pc->cookie);
+					break;
+				}
+				case BR_REPLY: {
+					struct binder_transaction_data *r = p;
+
+					if (r->code != (unsigned int)i)
+						st->errors++;
+					cmd_put32(&cb, BC_FREE_BUFFER);
+					cmd_put_ptr(&cb,
+						    (void *)r->data.ptr.buffer);
+					st->calls++;
+					done = 1;
+					break;
+				}
+				case BR_DEAD_REPLY:
+				case BR_FAILED_REPLY:
+					st->errors++;
+					done = 1;
+					break;
+				default:
+					fprintf(stderr, "client: unexpected "
+						"return %08x\n", cmd);
+					exit(1);
+				}
+			}
+		}
+	}
+	/* flush the last BC_FREE_BUFFER / *_DONE commands */
+	if (cb.len) {
+		size_t consumed;
+
+		if (binder_write_read(bc, &cb, rbuf, 0, &consumed))
+			die("client BINDER_WRITE_READ");
+	}
+	return st;
+}
+
+static void run_client(int result_fd)
+{
+	struct binder_conn bc;
+	struct client_stats total = { 0, 0, 0 };
+	pthread_t *threads;
+	int i;
+
+	binder_conn_open(&bc);
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (threads == NULL)
+		die("calloc");
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, client_thread, &bc))
+			die("pthread_create");
+	for (i = 0; i < nr_threads; i++) {
+		struct client_stats *st;
+
+		pthread_join(threads[i], (void **)&st);
+		total.calls += st->calls;
+		total.oneway += st->oneway;
+		total.errors += st->errors;
+		free(st);
+	}
+	if (write(result_fd, &total, sizeof(total)) != sizeof(total))
+		die("write");
+	exit(0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p procs] [-t threads] [-s servers] "
+		"[-n iterations] [-b bytes] [-o oneway_every] "
+		"[-r object_every]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct binder_conn server;
+	struct client_stats total = { 0, 0, 0 };
+	struct timeval start, stop;
+	pthread_t thread;
+	int max_threads;
+	int pipefd[2];
+	double secs;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "p:t:s:n:b:o:r:")) != -1) {
+		switch (opt) {
+		case 'p':
+			nr_procs = atoi(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			nr_servers = atoi(optarg);
+			break;
+		case 'n':
+			nr_iterations = atoi(optarg);
+			break;
+		case 'b':
+			payload = atoi(optarg);
+			break;
+		case 'o':
+			oneway_every = atoi(optarg);
+			break;
+		case 'r':
+			object_every = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_procs < 1 || nr_threads < 1 || nr_servers < 1 ||
+	    payload < 0 || payload > MAX_PAYLOAD)
+		usage(argv[0]);
+
+	binder_conn_open(&server);
+	if (ioctl(server.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	max_threads = 0;
+	if (ioctl(server.fd, BINDER_SET_MAX_THREADS, &max_threads) < 0)
+		die("BINDER_SET_MAX_THREADS");
+	for (i = 0; i < nr_servers; i++)
+		if (pthread_create(&thread, NULL, server_thread, &server))
+			die("pthread_create");
+
+	if (pipe(pipefd))
+		die("pipe");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_procs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			die("fork");
+		if (pid == 0) {
+			/* the mapping is not inherited, use a fresh fd */
+			close(server.fd);
+			close(pipefd[0]);
+			run_client(pipefd[1]);
+		}
+	}
+	close(pipefd[1]);
+	for (i = 0; i < nr_procs; i++) {
+		struct client_stats st;
+		int status;
+
+		if (read(pipefd[0], &st, sizeof(st)) != sizeof(st)) {
+			fprintf(stderr, "client exited early\n");
+			total.errors++;
+			continue;
+		}
+		total.calls += st.calls;
+		total.oneway += st.oneway;
+		total.errors += st.errors;
+		wait(&status);
+	}
+	gettimeofday(&stop, NULL);
+	while (wait(NULL) > 0)
+		;
+
+	secs = (stop.tv_sec - start.tv_sec) +
+		(stop.tv_usec - start.tv_usec) / 1000000.0;
+	printf("%d procs x %d threads, %d server threads, %d bytes\n",
+	       nr_procs, nr_threads, nr_servers, payload);
+	printf("%lu calls, %lu one-way, %lu errors in %.2f s "
+	       "(%.0f transactions/s)\n", total.calls, total.oneway,
+	       total.errors, secs, (total.calls + total.oneway) / secs);
+	return total.errors ? 1 : 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * lmk-bench.c - low memory killer victim search latency vs process count
+ *
+ * The test forks idle processes with oom_adj values spread over 0..14,
+ * points the low memory killer at oom_adj 15 with a minfree that is always
+ * reached, and then makes the kernel call its shrinkers by writing to
+ * /proc/sys/vm/drop_caches.  Every shrinker call with work to do searches
+ * for a victim; the scan_count and scan_ns parameters of the driver give
+ * the number of searches and the time spent in them.  This is repeated for
+ * a growing number of processes.  On kernels without those parameters only
+ * the drop_caches time is reported.
+ *
+ * Any process with oom_adj 15 on the system (an empty or hidden app on
+ * Android) is fair game for the killer while this runs.  adj and minfree
+ * are restored on exit.  It must run as root.
+ *
+ * Build with:
+ *	gcc -O2 -Wall -o lmk-bench Documentation/android/lmk-bench.c
+ *
+ * Usage: lmk-bench [-n max_processes] [-s step] [-i iterations]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define LMK_PARAMS	"/sys/module/lowmemorykiller/parameters/"
+#define VICTIM_ADJ	15
+
+static int max_procs = 512;
+static int step = 64;
+static int iterations = 20;
+
+static pid_t *children;
+static int nr_children;
+static char saved_adj[256];
+static char saved_minfree[256];
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int read_file(const char *path, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+	return 0;
+}
+
+static int write_file(const char *path, const char *val)
+{
+	ssize_t len = strlen(val);
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	if (write(fd, val, len) != len) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+/* returns -1 if the kernel does not have the parameter */
+static long long read_param(const char *name)
+{
+	char path[128], buf[32];
+
+	snprintf(path, sizeof(path), LMK_PARAMS "%s", name);
+	if (read_file(path, buf, sizeof(buf)))
+		return -1;
+	return strtoll(buf, NULL, 10);
+}
+
+static void restore(void)
+{
+	int i;
+
+	for (i = 0; i < nr_children; i++)
+		kill(children[i], SIGKILL);
+	while (nr_children && wait(NULL) > 0)
+		;
+	nr_children = 0;
+	if (saved_adj[0])
+		write_file(LMK_PARAMS "adj", saved_adj);
+	if (saved_minfree[0])
+		write_file(LMK_PARAMS "minfree", saved_minfree);
+}
+
+static void on_signal(int sig)
+{
+	restore();
+	_exit(1);
+}
+
+static void spawn(int oom_adj)
+{
+	char path[64], val[16];
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		/* a little resident memory so the process is a candidate */
+		char *mem = malloc(16 * 4096);
+
+		if (mem)
+			memset(mem, 1, 16 * 4096);
+		for (;;)
+			pause();
+	}
+	snprintf(path, sizeof(path), "/proc/%d/oom_adj", pid);
+	snprintf(val, sizeof(val), "%d", oom_adj);
+	if (write_file(path, val))
+		die(path);
+	children[nr_children++] = pid;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n max_processes] [-s step] "
+		"[-i iterations]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	char minfree[32];
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "n:s:i:")) != -1) {
+		switch (opt) {
+		case 'n':
+			max_procs = atoi(optarg);
+			break;
+		case 's':
+			step = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_procs < 1 || step < 1 || iterations < 1)
+		usage(argv[0]);
+
+	children = calloc(max_procs, sizeof(*children));
+	if (children == NULL)
+		die("calloc");
+	if (read_file(LMK_PARAMS "adj", saved_adj, sizeof(saved_adj)) ||
+	    read_file(LMK_PARAMS "minfree", saved_minfree,
+		      sizeof(saved_minfree)))
+		die(LMK_PARAMS);
+	atexit(restore);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	/* only VICTIM_ADJ may be killed, and that level is always reached */
+	snprintf(minfree, sizeof(minfree), "%d", 0x7fffffff);
+	if (write_file(LMK_PARAMS "adj", "15") ||
+	    write_file(LMK_PARAMS "minfree", minfree))
+		die("set lowmemorykiller parameters");
+
+	printf("%8s %8s %10s %14s\n", "procs", "scans", "ns/scan",
+	       "us/drop_caches");
+	for (n = step; n <= max_procs; n += step) {
+		long long count, ns;
+		struct timeval start, stop;
+		double usecs;
+		int i;
+
+		while (nr_children < n)
+			spawn(nr_children % VICTIM_ADJ);
+
+		write_file(LMK_PARAMS "scan_count", "0");
+		write_file(LMK_PARAMS "scan_ns", "0");
+		gettimeofday(&start, NULL);
+		for (i = 0; i < iterations; i++)
+			if (write_file("/proc/sys/vm/drop_caches", "2"))
+				die("drop_caches");
+		gettimeofday(&stop, NULL);
+		usecs = (stop.tv_sec - start.tv_sec) * 1e6 +
+			(stop.tv_usec - start.tv_usec);
+
+		count = read_param("scan_count");
+		ns = read_param("scan_ns");
+		if (count > 0)
+			printf("%8d %8lld %10lld %14.1f\n", n, count,
+			       ns / count, usecs / iterations);
+		else
+			printf("%8d %8s %10s %14.1f\n", n, "-", "-",
+			       usecs / iterations);
+	}
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * s3cfb-flip-test.c - bounds checks of the s3cfb S3CFB_FLIP ioctl
+ *
+ * Queues flips with yoffsets that are out of range, including ones where
+ * yoffset + yres wraps around 32 bits, and checks that each is refused
+ * with EINVAL and leaves the panned offset alone.  The last in-range
+ * offset and 0 must then be accepted.  Nothing is drawn; the screen shows
+ * the bottom of the virtual buffer for a frame or two.
+ *
+ * Build with:
+ *	gcc -O2 -Wall -o s3cfb-flip-test Documentation/fb/s3cfb-flip-test.c
+ *
+ * Usage: s3cfb-flip-test [framebuffer device, /dev/graphics/fb0 by default]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fb.h>
+
+/* From drivers/video/samsung/s3cfb.h */
+struct s3cfb_user_flip {
+	unsigned int yoffset;
+	int          fence_fd;
+	unsigned int flags;
+};
+
+#define S3CFB_FLIP_SYNC	(1 << 0)
+#define S3CFB_FLIP	_IOW('F', 306, struct s3cfb_user_flip)
+
+static int fd;
+static int failed;
+
+static int flip(unsigned int yoffset)
+{
+	struct s3cfb_user_flip f = {
+		.yoffset = yoffset,
+		.fence_fd = -1,
+		.flags = S3CFB_FLIP_SYNC,
+	};
+
+	return ioctl(fd, S3CFB_FLIP, &f) ? errno : 0;
+}
+
+static unsigned int yoffset_now(void)
+{
+	struct fb_var_screeninfo var;
+
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &var)) {
+		perror("FBIOGET_VSCREENINFO");
+		return ~0u;
+	}
+	return var.yoffset;
+}
+
+static void expect(const char *what, unsigned int yoffset, int err)
+{
+	unsigned int before = yoffset_now();
+	int r = flip(yoffset);
+
+	if (r != err) {
+		printf("FAIL %s: yoffset %u gave %s, expected %s\n", what,
+		       yoffset, r ? strerror(r) : "success",
+		       err ? strerror(err) : "success");
+		failed = 1;
+		return;
+	}
+	if (err && yoffset_now() != before) {
+		printf("FAIL %s: refused flip moved yoffset to %u\n", what,
+		       yoffset_now());
+		failed = 1;
+		return;
+	}
+	printf("ok   %s: yoffset %u\n", what, yoffset);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/graphics/fb0";
+	struct fb_var_screeninfo var;
+	unsigned int last;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &var)) {
+		perror("FBIOGET_VSCREENINFO");
+		return 1;
+	}
+	printf("%s: yres %u, yres_virtual %u\n", dev, var.yres,
+	       var.yres_virtual);
+	last = var.yres_virtual - var.yres;
+
+	expect("wraps to 0", 0u - var.yres, EINVAL);
+	expect("wraps to 1 line", 0u - var.yres + 1, EINVAL);
+	expect("huge", ~0u, EINVAL);
+	expect("one line past the end", last + 1, EINVAL);
+	expect("last buffer", last, 0);
+	expect("first buffer", 0, 0);
+
+	close(fd);
+	printf("%s\n", failed ? "FAILED" : "PASS");
+	return failed;
+}
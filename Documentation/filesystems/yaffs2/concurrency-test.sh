@@ -0,0 +1,111 @@
+#!/bin/sh
+#
+# Mixed read/write stress of yaffs2 on the OneNAND simulator
+# (CONFIG_MTD_ONENAND_SIM), with and without concurrent file data
+# ("concurrent-data" and "no-concurrent-data" mount options).
+#
+# Readers loop over their own pre-written files while writers keep
+# rewriting theirs, all for the same number of seconds. The read and write
+# throughput of each run is printed, along with the garbage collections
+# /proc/yaffs counted, and the readers' files are checked against their
+# checksums at the end of every run.
+#
+# Must be run as root with nothing mounted from the simulator (see
+# sim-common.sh).
+# usage: concurrency-test.sh [readers] [writers] [seconds] [file size in MB]
+
+set -e
+. "$(dirname "$0")/sim-common.sh"
+readers="${1:-4}"
+writers="${2:-2}"
+seconds="${3:-30}"
+size_mb="${4:-1}"
+work="$(mktemp -d /tmp/yaffs_work.XXXXXX)"
+sim_files="$sim_files $work"
+
+# reader <n>: count the MB read of r<n> until the deadline
+reader()
+{
+	mb=0
+	while [ "$(date +%s)" -lt "$deadline" ]; do
+		dd if="$mnt/r$1" of=/dev/null bs=64k 2>/dev/null
+		mb=$((mb + size_mb))
+		# Go to the flash rather than the page cache every time
+		echo 1 >/proc/sys/vm/drop_caches
+	done
+	echo "$mb" >"$work/read.$1"
+}
+
+# writer <n>: count the MB written to w<n> until the deadline
+writer()
+{
+	mb=0
+	while [ "$(date +%s)" -lt "$deadline" ]; do
+		dd if="$work/pattern" of="$mnt/w$1" bs=64k conv=fsync \
+			2>/dev/null
+		mb=$((mb + size_mb))
+	done
+	echo "$mb" >"$work/write.$1"
+}
+
+# sum <prefix>: add up the counts the workers left behind
+sum()
+{
+	cat "$work/$1".* | awk '{ n += $1 } END { print n + 0 }'
+}
+
+dd if=/dev/urandom of="$work/pattern" bs=1M count="$size_mb" 2>/dev/null
+
+flash_eraseall -q "/dev/$mtd"
+mount -t yaffs2 -o no-concurrent-data "$blk" "$mnt"
+i=0
+while [ $i -lt "$readers" ]; do
+	dd if=/dev/urandom of="$mnt/r$i" bs=1M count="$size_mb" 2>/dev/null
+	i=$((i + 1))
+done
+(cd "$mnt" && md5sum r*) >"$work/sums"
+umount "$mnt"
+
+# run <mount options>
+run()
+{
+	mount -t yaffs2 -o "$1" "$blk" "$mnt"
+	echo "$1: concurrentData $(yaffs_stat concurrentData)," \
+		"backgroundGC $(yaffs_stat backgroundGC)"
+	rm -f "$work"/read.* "$work"/write.*
+
+	drop_caches
+	gc0="$(yaffs_stat garbageCollections)"
+	deadline=$(($(date +%s) + seconds))
+	i=0
+	while [ $i -lt "$readers" ]; do
+		reader $i &
+		i=$((i + 1))
+	done
+	i=0
+	while [ $i -lt "$writers" ]; do
+		writer $i &
+		i=$((i + 1))
+	done
+	wait
+	gc1="$(yaffs_stat garbageCollections)"
+
+	echo "    $readers readers: $(($(sum read) * 1024 / seconds)) KB/s," \
+		"$writers writers: $(($(sum write) * 1024 / seconds)) KB/s," \
+		"$((gc1 - gc0)) garbage collections"
+
+	drop_caches
+	if (cd "$mnt" && md5sum -c --quiet "$work/sums"); then
+		echo "    reader files intact"
+	else
+		echo "    reader files CORRUPTED"
+		status=1
+	fi
+
+	umount "$mnt"
+}
+
+status=0
+run no-concurrent-data
+run concurrent-data
+exit $status
@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Sequential and random read throughput of a large yaffs2 file on the
+# OneNAND simulator (CONFIG_MTD_ONENAND_SIM), with bit-packed tnodes and
+# with word-aligned ones ("packed-tnodes" and "flat-tnodes" mount options).
+# The tnode cursor hits and misses of each run are taken from /proc/yaffs.
+#
+# Word-aligned tnodes only differ from packed ones on arrays that need
+# tnodes wider than 16 bits, i.e. 256MB and up with 2k pages. The simulator
+# defaults to 16MB, so build it with e.g.
+#	-DCONFIG_ONENAND_SIM_DEVICE_ID=0x0044	(256MB)
+# The script still runs on smaller arrays, but then only the cursor is
+# measured.
+#
+# Must be run as root with nothing mounted from the simulator (see
+# sim-common.sh).
+# usage: read-bench.sh [file size in MB] [random reads]
+
+set -e
+. "$(dirname "$0")/sim-common.sh"
+size_mb="${1:-64}"
+nrandom="${2:-2000}"
+offsets="$(mktemp /tmp/yaffs_offsets.XXXXXX)"
+sim_files="$sim_files $offsets"
+
+# The same 4k pages are read in every run
+awk -v n="$nrandom" -v pages="$((size_mb * 256))" 'BEGIN {
+	srand(1);
+	for (i = 0; i < n; i++)
+		printf "%d\n", int(rand() * pages);
+}' >"$offsets"
+
+flash_eraseall -q "/dev/$mtd"
+mount -t yaffs2 -o packed-tnodes "$blk" "$mnt"
+dd if=/dev/urandom of="$mnt/big" bs=1M count="$size_mb" 2>/dev/null
+umount "$mnt"
+
+# run <mount options>
+run()
+{
+	mount -t yaffs2 -o "$1" "$blk" "$mnt"
+	echo "$1: tnodeWidth $(yaffs_stat tnodeWidth), flat $(yaffs_stat tnodeFlat)"
+
+	drop_caches
+	h0="$(yaffs_stat tnodeCursorHits)"
+	m0="$(yaffs_stat tnodeCursorMisses)"
+	t0="$(uptime_ms)"
+	dd if="$mnt/big" of=/dev/null bs=64k 2>/dev/null
+	t1="$(uptime_ms)"
+	h1="$(yaffs_stat tnodeCursorHits)"
+	m1="$(yaffs_stat tnodeCursorMisses)"
+	echo "    sequential: $((size_mb * 1000 / (t1 - t0 + 1))) MB/s," \
+		"cursor $((h1 - h0)) hits $((m1 - m0)) misses"
+
+	drop_caches
+	t0="$(uptime_ms)"
+	while read page; do
+		dd if="$mnt/big" of=/dev/null bs=4k count=1 skip="$page" \
+			2>/dev/null
+	done <"$offsets"
+	t1="$(uptime_ms)"
+	h2="$(yaffs_stat tnodeCursorHits)"
+	m2="$(yaffs_stat tnodeCursorMisses)"
+	echo "    random:     $((nrandom * 4 * 1000 / (t1 - t0 + 1))) KB/s" \
+		"($nrandom 4k reads), cursor $((h2 - h1)) hits $((m2 - m1)) misses"
+
+	umount "$mnt"
+}
+
+run packed-tnodes
+run flat-tnodes
@@ -0,0 +1,48 @@
+#
+# Fixture shared by the yaffs2 test scripts, sourced after "set -e".
+#
+# Finds the OneNAND simulator (CONFIG_MTD_ONENAND_SIM) and sets $mtd and
+# $blk, and makes a mount point $mnt. On exit, background jobs are
+# stopped, $mnt is unmounted and removed along with any paths the script
+# added to $sim_files.
+#
+# Must be run as root with nothing mounted from the simulator.
+
+mnt="$(mktemp -d /tmp/yaffs_mnt.XXXXXX)"
+sim_files="$mnt"
+
+sim_cleanup()
+{
+	kill $(jobs -p) 2>/dev/null || true
+	wait 2>/dev/null || true
+	umount "$mnt" 2>/dev/null || true
+	rm -rf $sim_files
+}
+trap sim_cleanup EXIT
+
+modprobe onenand_sim 2>/dev/null || true
+mtd="$(grep 'OneNAND simulator' /proc/mtd | cut -d: -f1)"
+if [ -z "$mtd" ]; then
+	echo "no OneNAND simulator in /proc/mtd"
+	exit 1
+fi
+blk="/dev/mtdblock${mtd#mtd}"
+
+# yaffs_stat <name>: a field of the simulator's section of /proc/yaffs
+yaffs_stat()
+{
+	awk -v name="$1" '
+		/^Device / { dev = index($0, "\"OneNAND simulator\"") }
+		dev && $1 ~ "^" name "\\.*$" { print $2; exit }' /proc/yaffs
+}
+
+uptime_ms()
+{
+	awk '{ printf "%d\n", $1 * 1000 }' /proc/uptime
+}
+
+drop_caches()
+{
+	sync
+	echo 3 >/proc/sys/vm/drop_caches
+}
@@ -0,0 +1,111 @@
+#!/bin/sh
+#
+# Compare yaffs2 mounts with and without block summaries on the OneNAND
+# simulator (CONFIG_MTD_ONENAND_SIM). The same tree is written once with
+# summaries and once without, and each image is then mounted both ways
+# with the checkpoint ignored, so that the mount scan runs. The mount
+# times and the kernel's scan lines are printed, and the listing and
+# checksums of every mount must match the source tree.
+#
+# An image made by mkyaffs2image can be given too. It has no summaries,
+# so mounting it with "summary" checks the fallback to the full scan.
+#
+# Needs flash_eraseall and nandwrite from mtd-utils, and must be run as
+# root with nothing mounted from the simulator (see sim-common.sh).
+# usage: summary-test.sh [mkyaffs2image_output]
+
+set -e
+. "$(dirname "$0")/sim-common.sh"
+image="$1"
+src="$(mktemp -d /tmp/yaffs_src.XXXXXX)"
+out="$(mktemp -d /tmp/yaffs_out.XXXXXX)"
+sim_files="$sim_files $src $out"
+
+# Files of assorted sizes in a few directories, links, and a file that
+# gets shrunk so that the scan sees a shrink header.
+i=0
+while [ $i -lt 300 ]; do
+	mkdir -p "$src/d$((i % 10))"
+	head -c "$((i * 997 % 262144))" /dev/urandom >"$src/d$((i % 10))/f$i"
+	i=$((i + 1))
+done
+head -c 200000 /dev/urandom >"$src/shrunk"
+ln -s d0/f10 "$src/symlink"
+ln "$src/d1/f11" "$src/hardlink"
+
+listing()
+{
+	(cd "$1" && find . ! -path './lost+found*' | sort &&
+		find . -type f ! -path './lost+found*' | sort | xargs md5sum)
+}
+
+# populate <mount options>
+populate()
+{
+	flash_eraseall -q "/dev/$mtd"
+	mount -t yaffs2 -o "$1" "$blk" "$mnt"
+	cp -a "$src/." "$mnt/"
+	# Rewrite a directory and shrink a file, leaving obsolete chunks
+	rm -rf "$mnt/d3"
+	cp -a "$src/d3" "$mnt/"
+	dd if=/dev/null of="$mnt/shrunk" bs=1 seek=5000 2>/dev/null
+	umount "$mnt"
+}
+
+# scan <label> <mount options> <expect summaries: 0|1>
+scan()
+{
+	dmesg -c >/dev/null
+	t0="$(uptime_ms)"
+	mount -t yaffs2 -o "no-checkpoint-read,$2" "$blk" "$mnt"
+	t1="$(uptime_ms)"
+	listing "$mnt" >"$out/$1"
+	lost="$(ls "$mnt/lost+found" | wc -l)"
+	umount "$mnt"
+
+	line="$(dmesg | grep 'scanned [0-9]* blocks' | tail -n 1)"
+	nsum="$(echo "$line" | sed -n 's/.*, \([0-9]*\) from summaries.*/\1/p')"
+	echo "$1: mount $((t1 - t0)) ms"
+	echo "    ${line#*yaffs: }"
+
+	if ! cmp -s "$out/reference" "$out/$1"; then
+		echo "$1: listing differs"
+		diff "$out/reference" "$out/$1" | head -n 20
+		exit 1
+	fi
+	if [ "$lost" -ne 0 ]; then
+		echo "$1: $lost entries in lost+found"
+		exit 1
+	fi
+	if [ "$3" -eq 1 ] && [ "${nsum:-0}" -eq 0 ]; then
+		echo "$1: no block was read from its summary"
+		exit 1
+	fi
+	if [ "$3" -eq 0 ] && [ "${nsum:-0}" -ne 0 ]; then
+		echo "$1: $nsum blocks read from summaries"
+		exit 1
+	fi
+}
+
+dd if=/dev/null of="$src/shrunk" bs=1 seek=5000 2>/dev/null
+listing "$src" >"$out/reference"
+
+populate no-summary
+scan "plain image, full scan" no-summary 0
+scan "plain image, summaries on" summary 0
+
+populate summary
+scan "summary image, full scan" no-summary 0
+scan "summary image, summaries on" summary 1
+
+if [ -n "$image" ]; then
+	# The image only has to match itself: list it once with a full scan
+	flash_eraseall -q "/dev/$mtd"
+	nandwrite -q -a -o "/dev/$mtd" "$image"
+	mount -t yaffs2 -o no-checkpoint-read,no-summary "$blk" "$mnt"
+	listing "$mnt" >"$out/reference"
+	umount "$mnt"
+	scan "mkyaffs2image, summaries on" summary 0
+fi
+
+echo "all mounts match"
@@ -119,6 +119,10 @@ static struct s3c_dma_map __initdata s5p6442_dma_mappings[] = {
 		.hw_addr.to     = S3C_DMA1_I2S0_TX,      
 		.sdma_sel       = 1 << S3C_DMA1_I2S0_TX,
 	}, 
+	[DMACH_ONENAND_IN] = {
+		.name		= "onenand-m2m",
+		.channels	= MAP0(S3C_DMA_M2M),
+	},
 
 };
 
@@ -16,9 +16,11 @@
  */
 
 #include <asm/cacheflush.h>
+#include <linux/debugfs.h>
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -29,12 +31,54 @@
 #include <linux/proc_fs.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 
 #include "binder.h"
+#include "binder_trace.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking overview
+ *
+ * There is no global lock serializing binder operations.  Each binder_proc
+ * has three locks, and a few small global locks protect the state that is
+ * not owned by any process.  When more than one lock is needed they must
+ * be taken in this order:
+ *
+ *   proc->lock (mutex)
+ *     proc->alloc_lock (mutex)
+ *       node->lock (spinlock)
+ *         proc->inner_lock (spinlock)
+ *           t->lock (spinlock)
+ *
+ * proc->lock:       refs_by_desc, refs_by_node, the refcounts and death
+ *                   pointer of the refs owned by proc, and proc->files.
+ * proc->alloc_lock: the buffer list and rbtrees, free_async_space, the
+ *                   page array and the allow_user_free bit of buffers.
+ * node->lock:       node->proc, and the counts of a node once its owner
+ *                   has died.  Holding it keeps node->proc alive.
+ * proc->inner_lock: threads, nodes, the todo and delivered_death lists,
+ *                   thread state and transaction stacks, the counts of
+ *                   nodes owned by proc, buffer->transaction for buffers
+ *                   owned by proc and the thread accounting fields.
+ * t->lock:          t->from, t->to_proc and t->to_thread.
+ *
+ * Two proc->lock or two proc->inner_lock are never held at the same time.
+ *
+ * binder_procs_lock protects binder_procs, binder_context_mgr_node_lock
+ * protects the context manager node and uid and nests inside proc->lock,
+ * and binder_dead_nodes_lock protects binder_dead_nodes and the tmp_refs
+ * of dead nodes.
+ * binder_deferred_lock protects the deferred work list.  It nests inside
+ * binder_procs_lock (the shrinker defers work while walking binder_procs,
+ * which keeps the procs alive) and no other binder lock is taken under it.
+ */
+
+static DEFINE_MUTEX(binder_procs_lock);
+static DEFINE_MUTEX(binder_context_mgr_node_lock);
+static DEFINE_SPINLOCK(binder_dead_nodes_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 
 static HLIST_HEAD(binder_procs);
@@ -43,9 +87,10 @@ static HLIST_HEAD(binder_dead_nodes);
 
 static struct proc_dir_entry *binder_proc_dir_entry_root;
 static struct proc_dir_entry *binder_proc_dir_entry_proc;
+static struct dentry *binder_debugfs_dir_entry_root;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 static int binder_read_proc_proc(char *page, char **start, off_t off,
@@ -89,6 +134,10 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+static int binder_buffer_cache_depth = 8;
+module_param_named(buffer_cache_depth, binder_buffer_cache_depth, int,
+		   S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -130,22 +179,22 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -161,7 +210,7 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
-	int next;
+	atomic_t cur;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
@@ -172,13 +221,12 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
-	log->next++;
-	if (log->next == ARRAY_SIZE(log->entry)) {
-		log->next = 0;
+	unsigned int cur = atomic_inc_return(&log->cur) - 1;
+
+	if (cur >= ARRAY_SIZE(log->entry) - 1)
 		log->full = 1;
-	}
+	e = &log->entry[cur % ARRAY_SIZE(log->entry)];
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
@@ -194,8 +242,17 @@ struct binder_work {
 	} type;
 };
 
+/*
+ * Per node latency histograms, log2 microsecond buckets: < 1us, < 2us,
+ * < 4us ... >= 32768us.  queue_latency is the time from BC_TRANSACTION
+ * until a thread of the node's process picks the transaction up,
+ * reply_latency the time until the matching BC_REPLY.
+ */
+#define BINDER_NODE_LATENCY_BUCKETS	16
+
 struct binder_node {
 	int debug_id;
+	spinlock_t lock;
 	struct binder_work work;
 	union {
 		struct rb_node rb_node;
@@ -206,6 +263,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -216,6 +274,9 @@ struct binder_node {
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
+	/* protected by lock */
+	u32 queue_latency[BINDER_NODE_LATENCY_BUCKETS];
+	u32 reply_latency[BINDER_NODE_LATENCY_BUCKETS];
 };
 
 struct binder_ref_death {
@@ -242,12 +303,16 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* free entry by size or allocated */
+					/* entry by address */
+		struct list_head cache_entry; /* entry in proc->buffer_cache */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
-	unsigned debug_id:29;
+	unsigned free_in_progress:1;
+	unsigned debug_id:28;
 
 	struct binder_transaction *transaction;
 
@@ -261,10 +326,30 @@ enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
 	BINDER_DEFERRED_RELEASE      = 0x04,
+	BINDER_DEFERRED_SHRINK       = 0x08,
+};
+
+/*
+ * Small buffers are not returned to the free tree right away.  They are
+ * kept, still mapped, on a per-size-class list and handed out again to
+ * the next allocation that fits, which saves the page map/unmap and the
+ * tree updates for the common small transaction.  Class i holds buffers
+ * of at least binder_buffer_cache_size[i] bytes.
+ */
+#define BINDER_BUFFER_CACHE_CLASSES	3
+static const size_t binder_buffer_cache_size[BINDER_BUFFER_CACHE_CLASSES] = {
+	0, 256, 1024
 };
+#define BINDER_BUFFER_CACHE_MAX_SIZE	4096
+
+/* Allocation latency buckets: < 1us, < 2us, < 4us ... >= 1024us */
+#define BINDER_ALLOC_LATENCY_BUCKETS	12
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	struct mutex lock;
+	struct mutex alloc_lock;
+	spinlock_t inner_lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -286,6 +371,13 @@ struct binder_proc {
 	struct page **pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
+	struct list_head buffer_cache[BINDER_BUFFER_CACHE_CLASSES];
+	int buffer_cache_count;
+	unsigned long buffer_cache_hits;
+	unsigned long buffer_cache_misses;
+	int pages_mapped;
+	int pages_high_water;
+	unsigned long alloc_latency[BINDER_ALLOC_LATENCY_BUCKETS];
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
@@ -295,6 +387,8 @@ struct binder_proc {
 	int requested_threads_started;
 	int ready_threads;
 	long default_priority;
+	int tmp_ref;
+	bool is_dead;
 };
 
 enum {
@@ -319,10 +413,13 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	atomic_t tmp_ref;
+	bool is_dead;
 };
 
 struct binder_transaction {
 	int debug_id;
+	spinlock_t lock;
 	struct binder_work work;
 	struct binder_thread *from;
 	struct binder_transaction *from_parent;
@@ -338,6 +435,8 @@ struct binder_transaction {
 	long	priority;
 	long	saved_priority;
 	uid_t	sender_euid;
+	struct binder_node *target_node; /* holds a tmp_ref, for latency */
+	ktime_t	start_time;
 };
 
 static void
@@ -590,6 +689,12 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+/*
+ * Called with proc->alloc_lock held.  The range is populated or torn down
+ * in one go: pages are allocated first and then mapped into the kernel
+ * with a single map_vm_area() call, and freeing zaps and unmaps the whole
+ * range at once, instead of walking the page tables for every page.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -598,7 +703,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
 	struct page **page;
+	struct page **page_array_ptr;
 	struct mm_struct *mm;
+	int ret;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -627,8 +734,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
-		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
 		BUG_ON(*page);
@@ -636,18 +741,24 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		if (*page == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
+			end = page_addr;
 			goto err_alloc_page_failed;
 		}
-		tmp_area.addr = page_addr;
-		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
-		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
-		if (ret) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "to map page at %p in kernel\n",
-			       proc->pid, page_addr);
-			goto err_map_kernel_failed;
-		}
+	}
+
+	tmp_area.addr = start;
+	tmp_area.size = (end - start) + PAGE_SIZE /* guard page? */;
+	page_array_ptr = &proc->pages[(start - proc->buffer) / PAGE_SIZE];
+	ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
+	if (ret) {
+		printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
+		       "to map pages at %p-%p in kernel\n",
+		       proc->pid, start, end);
+		goto err_map_kernel_failed;
+	}
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
 		ret = vm_insert_page(vma, user_page_addr, page[0]);
@@ -659,6 +770,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		/* vm_insert_page does not seem to increment the refcount */
 	}
+	proc->pages_mapped += (end - start) / PAGE_SIZE;
+	if (proc->pages_mapped > proc->pages_high_water)
+		proc->pages_high_water = proc->pages_mapped;
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
@@ -666,31 +780,141 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	return 0;
 
 free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+	proc->pages_mapped -= (end - start) / PAGE_SIZE;
+	if (vma)
+		zap_page_range(vma, (uintptr_t)start +
+			proc->user_buffer_offset, end - start, NULL);
+	unmap_kernel_range((unsigned long)start, end - start);
+	goto free_pages;
+
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	if (page_addr > start)
+		zap_page_range(vma, (uintptr_t)start +
+			proc->user_buffer_offset, page_addr - start, NULL);
 err_map_kernel_failed:
+	unmap_kernel_range((unsigned long)start, end - start);
+err_alloc_page_failed:
+free_pages:
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 		__free_page(*page);
 		*page = NULL;
-err_alloc_page_failed:
-		;
 	}
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
-	return -ENOMEM;
+	return allocate ? -ENOMEM : 0;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+static void binder_merge_free_buf(struct binder_proc *proc,
+				  struct binder_buffer *buffer);
+
+/* Maps a latency to a log2 bucket, the last bucket collects the rest */
+static int binder_latency_bucket(s64 us, int buckets)
+{
+	int bucket = us > 0 ? fls((u32)min_t(s64, us, INT_MAX)) : 0;
+
+	return min(bucket, buckets - 1);
+}
+
+static atomic_t binder_buffer_cache_total;
+
+static int binder_buffer_cache_class(size_t size)
+{
+	int i;
+
+	for (i = BINDER_BUFFER_CACHE_CLASSES - 1; i > 0; i--)
+		if (size >= binder_buffer_cache_size[i])
+			break;
+	return i;
+}
+
+/* Called with proc->alloc_lock held */
+static struct binder_buffer *binder_buffer_cache_get(struct binder_proc *proc,
+						     size_t size)
+{
+	struct binder_buffer *buffer;
+	int i;
+
+	if (size > BINDER_BUFFER_CACHE_MAX_SIZE)
+		return NULL;
+
+	/*
+	 * Buffers in the request's own class may still be too small, every
+	 * buffer in a larger class fits.
+	 */
+	i = binder_buffer_cache_class(size);
+	list_for_each_entry(buffer, &proc->buffer_cache[i], cache_entry) {
+		if (binder_buffer_size(proc, buffer) >= size)
+			goto found;
+	}
+	for (i++; i < BINDER_BUFFER_CACHE_CLASSES; i++) {
+		if (!list_empty(&proc->buffer_cache[i])) {
+			buffer = list_first_entry(&proc->buffer_cache[i],
+						  struct binder_buffer,
+						  cache_entry);
+			goto found;
+		}
+	}
+	proc->buffer_cache_misses++;
+	return NULL;
+
+found:
+	list_del(&buffer->cache_entry);
+	proc->buffer_cache_count--;
+	atomic_dec(&binder_buffer_cache_total);
+	proc->buffer_cache_hits++;
+	return buffer;
+}
+
+/*
+ * Called with proc->alloc_lock held for a buffer that has just been
+ * removed from allocated_buffers.  Returns 1 if the buffer was cached.
+ */
+static int binder_buffer_cache_put(struct binder_proc *proc,
+				   struct binder_buffer *buffer,
+				   size_t buffer_size)
+{
+	int i;
+
+	if (buffer_size > BINDER_BUFFER_CACHE_MAX_SIZE || proc->vma == NULL)
+		return 0;
+	if (proc->buffer_cache_count >=
+	    binder_buffer_cache_depth * BINDER_BUFFER_CACHE_CLASSES)
+		return 0;
+
+	i = binder_buffer_cache_class(buffer_size);
+	list_add(&buffer->cache_entry, &proc->buffer_cache[i]);
+	proc->buffer_cache_count++;
+	atomic_inc(&binder_buffer_cache_total);
+	return 1;
+}
+
+/* Called with proc->alloc_lock held */
+static void binder_buffer_cache_drain(struct binder_proc *proc)
+{
+	struct binder_buffer *buffer;
+	int i;
+
+	for (i = 0; i < BINDER_BUFFER_CACHE_CLASSES; i++) {
+		while (!list_empty(&proc->buffer_cache[i])) {
+			buffer = list_first_entry(&proc->buffer_cache[i],
+						  struct binder_buffer,
+						  cache_entry);
+			list_del(&buffer->cache_entry);
+			proc->buffer_cache_count--;
+			atomic_dec(&binder_buffer_cache_total);
+			binder_merge_free_buf(proc, buffer);
+		}
+	}
+}
+
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+						     size_t data_size,
+						     size_t offsets_size,
+						     int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -723,6 +947,16 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
+	buffer = binder_buffer_cache_get(proc, size);
+	if (buffer) {
+		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+			     "binder: %d: binder_alloc_buf size %zd got "
+			     "cached %p\n", proc->pid, size, buffer);
+		goto got_buffer;
+	}
+
+retry:
+	n = proc->free_buffers.rb_node;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
@@ -739,6 +973,10 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		}
 	}
 	if (best_fit == NULL) {
+		if (proc->buffer_cache_count) {
+			binder_buffer_cache_drain(proc);
+			goto retry;
+		}
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
@@ -770,7 +1008,6 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	rb_erase(best_fit, &proc->free_buffers);
 	buffer->free = 0;
-	binder_insert_allocated_buffer(proc, buffer);
 	if (buffer_size != size) {
 		struct binder_buffer *new_buffer = (void *)buffer->data + size;
 		list_add(&new_buffer->entry, &buffer->entry);
@@ -780,6 +1017,9 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got "
 		     "%p\n", proc->pid, size, buffer);
+got_buffer:
+	buffer->free_in_progress = 0;
+	binder_insert_allocated_buffer(proc, buffer);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
@@ -794,6 +1034,27 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+	ktime_t start = ktime_get();
+	s64 us;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 is_async);
+	/* includes the time spent waiting for alloc_lock */
+	us = ktime_us_delta(ktime_get(), start);
+	proc->alloc_latency[binder_latency_bucket(us,
+					BINDER_ALLOC_LATENCY_BUCKETS)]++;
+	mutex_unlock(&proc->alloc_lock);
+	trace_binder_alloc_buf(proc, data_size, offsets_size, is_async,
+			       buffer, us);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -851,8 +1112,8 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void binder_free_buf_locked(struct binder_proc *proc,
+				   struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
@@ -865,6 +1126,8 @@ static void binder_free_buf(struct binder_proc *proc,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
 		     "_size %zd\n", proc->pid, buffer, size, buffer_size);
 
+	trace_binder_free_buf(proc, buffer);
+
 	BUG_ON(buffer->free);
 	BUG_ON(size > buffer_size);
 	BUG_ON(buffer->transaction != NULL);
@@ -880,11 +1143,25 @@ static void binder_free_buf(struct binder_proc *proc,
 			     proc->free_async_space);
 	}
 
+	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
+	if (binder_buffer_cache_put(proc, buffer, buffer_size))
+		return;
+	binder_merge_free_buf(proc, buffer);
+}
+
+/*
+ * Return a buffer that is no longer in allocated_buffers to the free
+ * tree, releasing its pages and merging it with free neighbours.
+ */
+static void binder_merge_free_buf(struct binder_proc *proc,
+				  struct binder_buffer *buffer)
+{
+	size_t buffer_size = binder_buffer_size(proc, buffer);
+
 	binder_update_page_range(proc, 0,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
 		NULL);
-	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
 	buffer->free = 1;
 	if (!list_is_last(&buffer->entry, &proc->buffers)) {
 		struct binder_buffer *next = list_entry(buffer->entry.next,
@@ -906,8 +1183,45 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
-static struct binder_node *binder_get_node(struct binder_proc *proc,
-					   void __user *ptr)
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	binder_free_buf_locked(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
+static void binder_free_proc(struct binder_proc *proc);
+
+/*
+ * Lock node->lock and, while the node still has an owner, the owner's
+ * inner_lock.  node->proc cannot change while node->lock is held.
+ */
+static void binder_node_inner_lock(struct binder_node *node)
+{
+	spin_lock(&node->lock);
+	if (node->proc)
+		spin_lock(&node->proc->inner_lock);
+}
+
+static void binder_node_inner_unlock(struct binder_node *node)
+{
+	struct binder_proc *proc = node->proc;
+
+	if (proc)
+		spin_unlock(&proc->inner_lock);
+	spin_unlock(&node->lock);
+}
+
+static void binder_free_node(struct binder_node *node)
+{
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+/* Called with proc->inner_lock held, takes a temporary node reference */
+static struct binder_node *binder_get_node_ilocked(struct binder_proc *proc,
+						   void __user *ptr)
 {
 	struct rb_node *n = proc->nodes.rb_node;
 	struct binder_node *node;
@@ -919,20 +1233,45 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 			n = n->rb_left;
 		else if (ptr > node->ptr)
 			n = n->rb_right;
-		else
+		else {
+			node->tmp_refs++;
 			return node;
+		}
 	}
 	return NULL;
 }
 
+static struct binder_node *binder_get_node(struct binder_proc *proc,
+					   void __user *ptr)
+{
+	struct binder_node *node;
+
+	spin_lock(&proc->inner_lock);
+	node = binder_get_node_ilocked(proc, ptr);
+	spin_unlock(&proc->inner_lock);
+	return node;
+}
+
+/*
+ * Returns the node for ptr with a temporary reference held, creating it
+ * if needed.  If another thread created the node first that node is
+ * returned instead, so the caller must still check the cookie.
+ */
 static struct binder_node *binder_new_node(struct binder_proc *proc,
 					   void __user *ptr,
-					   void __user *cookie)
+					   void __user *cookie,
+					   unsigned long flags)
 {
 	struct rb_node **p = &proc->nodes.rb_node;
 	struct rb_node *parent = NULL;
 	struct binder_node *node;
+	struct binder_node *new_node;
 
+	new_node = kzalloc(sizeof(*new_node), GFP_KERNEL);
+	if (new_node == NULL)
+		return NULL;
+
+	spin_lock(&proc->inner_lock);
 	while (*p) {
 		parent = *p;
 		node = rb_entry(parent, struct binder_node, rb_node);
@@ -941,23 +1280,30 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 			p = &(*p)->rb_left;
 		else if (ptr > node->ptr)
 			p = &(*p)->rb_right;
-		else
-			return NULL;
+		else {
+			node->tmp_refs++;
+			spin_unlock(&proc->inner_lock);
+			kfree(new_node);
+			return node;
+		}
 	}
-
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (node == NULL)
-		return NULL;
+	node = new_node;
 	binder_stats_created(BINDER_STAT_NODE);
-	rb_link_node(&node->rb_node, parent, p);
-	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	spin_lock_init(&node->lock);
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
+	node->min_priority = flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+	node->accept_fds = !!(flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 	node->work.type = BINDER_WORK_NODE;
+	node->tmp_refs = 1;
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
+	rb_link_node(&node->rb_node, parent, p);
+	rb_insert_color(&node->rb_node, &proc->nodes);
+	spin_unlock(&proc->inner_lock);
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d:%d node %d u%p c%p created\n",
 		     proc->pid, current->pid, node->debug_id,
@@ -965,8 +1311,13 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
-static int binder_inc_node(struct binder_node *node, int strong, int internal,
-			   struct list_head *target_list)
+/*
+ * The *_nilocked node helpers are called with binder_node_inner_lock()
+ * held.  target_list, if not NULL, must belong to node->proc.
+ */
+static int binder_inc_node_nilocked(struct binder_node *node, int strong,
+				    int internal,
+				    struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
@@ -1000,50 +1351,112 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 	return 0;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+static int binder_inc_node(struct binder_node *node, int strong, int internal,
+			   struct list_head *target_list)
 {
+	int ret;
+
+	binder_node_inner_lock(node);
+	ret = binder_inc_node_nilocked(node, strong, internal, target_list);
+	binder_node_inner_unlock(node);
+	return ret;
+}
+
+/* Returns true if the caller must free the node after unlocking it */
+static bool binder_dec_node_nilocked(struct binder_node *node, int strong,
+				     int internal)
+{
+	struct binder_proc *proc = node->proc;
+
 	if (strong) {
 		if (internal)
 			node->internal_strong_refs--;
 		else
 			node->local_strong_refs--;
 		if (node->local_strong_refs || node->internal_strong_refs)
-			return 0;
+			return false;
 	} else {
 		if (!internal)
 			node->local_weak_refs--;
-		if (node->local_weak_refs || !hlist_empty(&node->refs))
-			return 0;
+		if (node->local_weak_refs || node->tmp_refs ||
+		    !hlist_empty(&node->refs))
+			return false;
 	}
-	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+	if (proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
-			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			list_add_tail(&node->work.entry, &proc->todo);
+			wake_up_interruptible(&proc->wait);
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
+		    !node->local_weak_refs && !node->tmp_refs) {
 			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
+			if (proc) {
+				rb_erase(&node->rb_node, &proc->nodes);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: refless node %d deleted\n",
 					     node->debug_id);
 			} else {
+				spin_lock(&binder_dead_nodes_lock);
+				/* procfs readers take tmp_refs under this lock */
+				if (node->tmp_refs) {
+					spin_unlock(&binder_dead_nodes_lock);
+					return false;
+				}
 				hlist_del(&node->dead_node);
+				spin_unlock(&binder_dead_nodes_lock);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+			return true;
 		}
 	}
 
-	return 0;
+	return false;
 }
 
+static void binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	bool free_node;
+
+	binder_node_inner_lock(node);
+	free_node = binder_dec_node_nilocked(node, strong, internal);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+static void binder_inc_node_tmpref(struct binder_node *node)
+{
+	binder_node_inner_lock(node);
+	if (!node->proc)
+		spin_lock(&binder_dead_nodes_lock);
+	node->tmp_refs++;
+	if (!node->proc)
+		spin_unlock(&binder_dead_nodes_lock);
+	binder_node_inner_unlock(node);
+}
 
+static void binder_put_node(struct binder_node *node)
+{
+	bool free_node;
+
+	binder_node_inner_lock(node);
+	if (!node->proc)
+		spin_lock(&binder_dead_nodes_lock);
+	node->tmp_refs--;
+	BUG_ON(node->tmp_refs < 0);
+	if (!node->proc)
+		spin_unlock(&binder_dead_nodes_lock);
+	/* let binder_dec_node_nilocked() clean up if this was the last ref */
+	free_node = binder_dec_node_nilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+/* The ref helpers below are called with ref->proc->lock held */
 static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 					 uint32_t desc)
 {
@@ -1086,7 +1499,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1114,24 +1527,22 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	}
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
-	if (node) {
-		hlist_add_head(&new_ref->node_entry, &node->refs);
 
-		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-			     "binder: %d new ref %d desc %d for "
-			     "node %d\n", proc->pid, new_ref->debug_id,
-			     new_ref->desc, node->debug_id);
-	} else {
-		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-			     "binder: %d new ref %d desc %d for "
-			     "dead node\n", proc->pid, new_ref->debug_id,
-			      new_ref->desc);
-	}
+	binder_node_inner_lock(node);
+	hlist_add_head(&new_ref->node_entry, &node->refs);
+	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+		     "binder: %d new ref %d desc %d for "
+		     "%snode %d\n", proc->pid, new_ref->debug_id,
+		     new_ref->desc, node->proc ? "" : "dead ",
+		     node->debug_id);
+	binder_node_inner_unlock(node);
 	return new_ref;
 }
 
 static void binder_delete_ref(struct binder_ref *ref)
 {
+	bool free_node;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
@@ -1139,16 +1550,24 @@ static void binder_delete_ref(struct binder_ref *ref)
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+
+	binder_node_inner_lock(ref->node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		binder_dec_node_nilocked(ref->node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	free_node = binder_dec_node_nilocked(ref->node, 0, 1);
+	binder_node_inner_unlock(ref->node);
+	if (free_node)
+		binder_free_node(ref->node);
+
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		spin_lock(&ref->proc->inner_lock);
 		list_del(&ref->death->work.entry);
+		spin_unlock(&ref->proc->inner_lock);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1190,12 +1609,8 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 			return -EINVAL;
 		}
 		ref->strong--;
-		if (ref->strong == 0) {
-			int ret;
-			ret = binder_dec_node(ref->node, strong, 1);
-			if (ret)
-				return ret;
-		}
+		if (ref->strong == 0)
+			binder_dec_node(ref->node, strong, 1);
 	} else {
 		if (ref->weak == 0) {
 			binder_user_error("binder: %d invalid dec weak, "
@@ -1211,30 +1626,132 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
-static void binder_pop_transaction(struct binder_thread *target_thread,
-				   struct binder_transaction *t)
+/*
+ * A dead proc is freed once its threads are gone and the last temporary
+ * reference, taken by senders that picked it as a target, is dropped.
+ */
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
 {
-	if (target_thread) {
-		BUG_ON(target_thread->transaction_stack != t);
-		BUG_ON(target_thread->transaction_stack->from != target_thread);
-		target_thread->transaction_stack =
-			target_thread->transaction_stack->from_parent;
-		t->from = NULL;
+	spin_lock(&proc->inner_lock);
+	proc->tmp_ref--;
+	if (proc->is_dead && RB_EMPTY_ROOT(&proc->threads) &&
+	    !proc->tmp_ref) {
+		spin_unlock(&proc->inner_lock);
+		binder_free_proc(proc);
+		return;
 	}
-	t->need_reply = 0;
-	if (t->buffer)
-		t->buffer->transaction = NULL;
+	spin_unlock(&proc->inner_lock);
+}
+
+static void binder_free_thread(struct binder_thread *thread)
+{
+	BUG_ON(!list_empty(&thread->todo));
+	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_proc_dec_tmpref(thread->proc);
+	kfree(thread);
+}
+
+static void binder_thread_dec_tmpref(struct binder_thread *thread)
+{
+	spin_lock(&thread->proc->inner_lock);
+	atomic_dec(&thread->tmp_ref);
+	if (thread->is_dead && !atomic_read(&thread->tmp_ref)) {
+		spin_unlock(&thread->proc->inner_lock);
+		binder_free_thread(thread);
+		return;
+	}
+	spin_unlock(&thread->proc->inner_lock);
+}
+
+/* Returns t->from with a temporary reference held, or NULL */
+static struct binder_thread *binder_get_txn_from(struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	spin_lock(&t->lock);
+	from = t->from;
+	if (from)
+		atomic_inc(&from->tmp_ref);
+	spin_unlock(&t->lock);
+	return from;
+}
+
+/*
+ * Like binder_get_txn_from(), but also returns with the inner_lock of the
+ * sender's proc held if the sender is still there.
+ */
+static struct binder_thread *binder_get_txn_from_and_acq_inner(
+		struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	from = binder_get_txn_from(t);
+	if (!from)
+		return NULL;
+	spin_lock(&from->proc->inner_lock);
+	if (t->from) {
+		BUG_ON(from != t->from);
+		return from;
+	}
+	spin_unlock(&from->proc->inner_lock);
+	binder_thread_dec_tmpref(from);
+	return NULL;
+}
+
+static void binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *target_proc;
+
+	spin_lock(&t->lock);
+	target_proc = t->to_proc;
+	spin_unlock(&t->lock);
+	if (target_proc) {
+		spin_lock(&target_proc->inner_lock);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		spin_unlock(&target_proc->inner_lock);
+	}
+	if (t->target_node)
+		binder_put_node(t->target_node);
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
 
+/* Adds a sample to one of node's histograms, returns the latency in us */
+static s64 binder_node_record_latency(struct binder_node *node,
+				      u32 *histogram, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+
+	spin_lock(&node->lock);
+	histogram[binder_latency_bucket(us, BINDER_NODE_LATENCY_BUCKETS)]++;
+	spin_unlock(&node->lock);
+	return us;
+}
+
+/* Called with target_thread->proc->inner_lock held */
+static void binder_pop_transaction_ilocked(struct binder_thread *target_thread,
+					   struct binder_transaction *t)
+{
+	BUG_ON(target_thread->transaction_stack != t);
+	BUG_ON(target_thread->transaction_stack->from != target_thread);
+	target_thread->transaction_stack =
+		target_thread->transaction_stack->from_parent;
+	spin_lock(&t->lock);
+	t->from = NULL;
+	spin_unlock(&t->lock);
+	t->need_reply = 0;
+}
+
 static void binder_send_failed_reply(struct binder_transaction *t,
 				     uint32_t error_code)
 {
 	struct binder_thread *target_thread;
+	struct binder_transaction *next;
+
 	BUG_ON(t->flags & TF_ONE_WAY);
 	while (1) {
-		target_thread = t->from;
+		target_thread = binder_get_txn_from_and_acq_inner(t);
 		if (target_thread) {
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
@@ -1249,37 +1766,42 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 					      t->debug_id, target_thread->proc->pid,
 					      target_thread->pid);
 
-				binder_pop_transaction(target_thread, t);
+				binder_pop_transaction_ilocked(target_thread, t);
 				target_thread->return_error = error_code;
+				trace_binder_wakeup(target_thread->proc,
+						    target_thread);
 				wake_up_interruptible(&target_thread->wait);
+				spin_unlock(&target_thread->proc->inner_lock);
+				binder_free_transaction(t);
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
 					"already\n", target_thread->proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
+				spin_unlock(&target_thread->proc->inner_lock);
 			}
+			binder_thread_dec_tmpref(target_thread);
 			return;
-		} else {
-			struct binder_transaction *next = t->from_parent;
-
-			binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-				     "binder: send failed reply "
-				     "for transaction %d, target dead\n",
-				     t->debug_id);
-
-			binder_pop_transaction(target_thread, t);
-			if (next == NULL) {
-				binder_debug(BINDER_DEBUG_DEAD_BINDER,
-					     "binder: reply failed,"
-					     " no target thread at root\n");
-				return;
-			}
-			t = next;
+		}
+		next = t->from_parent;
+
+		binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+			     "binder: send failed reply "
+			     "for transaction %d, target dead\n",
+			     t->debug_id);
+
+		binder_free_transaction(t);
+		if (next == NULL) {
 			binder_debug(BINDER_DEBUG_DEAD_BINDER,
-				     "binder: reply failed, no target "
-				     "thread -- retry %d\n", t->debug_id);
+				     "binder: reply failed,"
+				     " no target thread at root\n");
+			return;
 		}
+		t = next;
+		binder_debug(BINDER_DEBUG_DEAD_BINDER,
+			     "binder: reply failed, no target "
+			     "thread -- retry %d\n", t->debug_id);
 	}
 }
 
@@ -1327,11 +1849,16 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        node %d u%p\n",
 				     node->debug_id, node->ptr);
 			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+
+			mutex_lock(&proc->lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
 				printk(KERN_ERR "binder: transaction release %d"
 				       " bad handle %ld\n", debug_id,
 				       fp->handle);
@@ -1341,13 +1868,17 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        ref %d desc %d (node %d)\n",
 				     ref->debug_id, ref->desc, ref->node->debug_id);
 			binder_dec_ref(ref, fp->type == BINDER_TYPE_HANDLE);
+			mutex_unlock(&proc->lock);
 		} break;
 
 		case BINDER_TYPE_FD:
 			binder_debug(BINDER_DEBUG_TRANSACTION,
 				     "        fd %ld\n", fp->handle);
-			if (failed_at)
+			if (failed_at) {
+				mutex_lock(&proc->lock);
 				task_close_fd(proc, fp->handle);
+				mutex_unlock(&proc->lock);
+			}
 			break;
 
 		default:
@@ -1358,14 +1889,107 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+#define BINDER_SG_PIN_PAGES	16
+
+/*
+ * Copy a page aligned user range by pinning the source pages and copying
+ * them from the kernel mapping, so large fragments do not take a fault
+ * per page in copy_from_user.
+ */
+static int binder_copy_sg_pages(void *dst, unsigned long src, size_t len)
+{
+	struct page *pages[BINDER_SG_PIN_PAGES];
+	struct mm_struct *mm = current->mm;
+	int nr_pages = len >> PAGE_SHIFT;
+	int ret, i;
+
+	while (nr_pages) {
+		down_read(&mm->mmap_sem);
+		ret = get_user_pages(current, mm, src,
+				     min(nr_pages, BINDER_SG_PIN_PAGES),
+				     0, 0, pages, NULL);
+		up_read(&mm->mmap_sem);
+		if (ret <= 0)
+			return -EFAULT;
+		for (i = 0; i < ret; i++) {
+			void *kaddr = kmap(pages[i]);
+
+			memcpy(dst, kaddr, PAGE_SIZE);
+			kunmap(pages[i]);
+			put_page(pages[i]);
+			dst += PAGE_SIZE;
+		}
+		src += ret << PAGE_SHIFT;
+		nr_pages -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Gather the fragments of a BC_TRANSACTION_SG payload into the target
+ * buffer.  Each byte is copied exactly once, straight from the sender's
+ * fragment into its final place.
+ */
+static int binder_copy_sg(struct binder_proc *proc,
+			  struct binder_thread *thread, void *dst,
+			  size_t data_size,
+			  const struct binder_sg_fragment __user *fragments,
+			  size_t fragment_count)
+{
+	struct binder_sg_fragment frag;
+	size_t i;
+
+	if (fragment_count > BINDER_MAX_SG_FRAGMENTS) {
+		binder_user_error("binder: %d:%d got transaction with %zd "
+			"fragments\n", proc->pid, thread->pid,
+			fragment_count);
+		return -EINVAL;
+	}
+	for (i = 0; i < fragment_count; i++) {
+		if (copy_from_user(&frag, &fragments[i], sizeof(frag)))
+			return -EFAULT;
+		if (frag.length > data_size) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"fragments larger than data size %zd\n",
+				proc->pid, thread->pid, data_size);
+			return -EINVAL;
+		}
+		if (frag.flags & BINDER_SG_FRAGMENT_PAGES) {
+			if (((unsigned long)frag.buffer | frag.length) &
+			    ~PAGE_MASK) {
+				binder_user_error("binder: %d:%d got unaligned "
+					"page fragment %p size %zd\n",
+					proc->pid, thread->pid, frag.buffer,
+					frag.length);
+				return -EINVAL;
+			}
+			if (binder_copy_sg_pages(dst,
+				(unsigned long)frag.buffer, frag.length))
+				return -EFAULT;
+		} else if (copy_from_user(dst, frag.buffer, frag.length))
+			return -EFAULT;
+		dst += frag.length;
+		data_size -= frag.length;
+	}
+	if (data_size) {
+		binder_user_error("binder: %d:%d got transaction with "
+			"fragments %zd bytes short of data size\n",
+			proc->pid, thread->pid, data_size);
+		return -EINVAL;
+	}
+	return 0;
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       const struct binder_sg_fragment __user *fragments,
+			       size_t fragment_count)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	size_t *offp, *off_end;
-	struct binder_proc *target_proc;
+	struct binder_proc *target_proc = NULL;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
 	struct list_head *target_list;
@@ -1383,16 +2007,18 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		spin_lock(&proc->inner_lock);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			spin_unlock(&proc->inner_lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
+			spin_lock(&in_reply_to->lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
 				" transaction %d has target %d:%d\n",
@@ -1401,12 +2027,17 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			spin_unlock(&in_reply_to->lock);
+			spin_unlock(&proc->inner_lock);
+			binder_set_nice(in_reply_to->saved_priority);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
-		target_thread = in_reply_to->from;
+		spin_unlock(&proc->inner_lock);
+		binder_set_nice(in_reply_to->saved_priority);
+		target_thread = binder_get_txn_from_and_acq_inner(in_reply_to);
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
@@ -1419,17 +2050,22 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			spin_unlock(&target_thread->proc->inner_lock);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
-			target_thread = NULL;
 			goto err_dead_binder;
 		}
 		target_proc = target_thread->proc;
+		target_proc->tmp_ref++;
+		spin_unlock(&target_thread->proc->inner_lock);
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
+
+			mutex_lock(&proc->lock);
 			ref = binder_get_ref(proc, tr->target.handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
@@ -1437,23 +2073,36 @@ static void binder_transaction(struct binder_proc *proc,
 				goto err_invalid_target_handle;
 			}
 			target_node = ref->node;
+			binder_inc_node_tmpref(target_node);
+			mutex_unlock(&proc->lock);
 		} else {
+			mutex_lock(&binder_context_mgr_node_lock);
 			target_node = binder_context_mgr_node;
+			if (target_node)
+				binder_inc_node_tmpref(target_node);
+			mutex_unlock(&binder_context_mgr_node_lock);
 			if (target_node == NULL) {
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
 		}
 		e->to_node = target_node->debug_id;
+		binder_node_inner_lock(target_node);
 		target_proc = target_node->proc;
+		if (target_proc)
+			target_proc->tmp_ref++;
+		binder_node_inner_unlock(target_node);
 		if (target_proc == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
+
+			spin_lock(&proc->inner_lock);
 			tmp = thread->transaction_stack;
-			if (tmp->to_thread != thread) {
+			if (tmp && tmp->to_thread != thread) {
+				spin_lock(&tmp->lock);
 				binder_user_error("binder: %d:%d got new "
 					"transaction with bad transaction stack"
 					", transaction %d has target %d:%d\n",
@@ -1461,14 +2110,26 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				spin_unlock(&tmp->lock);
+				spin_unlock(&proc->inner_lock);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
 			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
+				struct binder_thread *from;
+
+				spin_lock(&tmp->lock);
+				from = tmp->from;
+				if (from && from->proc == target_proc) {
+					atomic_inc(&from->tmp_ref);
+					target_thread = from;
+					spin_unlock(&tmp->lock);
+					break;
+				}
+				spin_unlock(&tmp->lock);
 				tmp = tmp->from_parent;
 			}
+			spin_unlock(&proc->inner_lock);
 		}
 	}
 	if (target_thread) {
@@ -1488,6 +2149,7 @@ static void binder_transaction(struct binder_proc *proc,
 		goto err_alloc_t_failed;
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION);
+	spin_lock_init(&t->lock);
 
 	tcomplete = kzalloc(sizeof(*tcomplete), GFP_KERNEL);
 	if (tcomplete == NULL) {
@@ -1496,8 +2158,13 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
+	t->start_time = ktime_get();
+	if (target_node) {
+		binder_inc_node_tmpref(target_node);
+		t->target_node = target_node;
+	}
 
 	if (reply)
 		binder_debug(BINDER_DEBUG_TRANSACTION,
@@ -1541,7 +2208,16 @@ static void binder_transaction(struct binder_proc *proc,
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+	if (fragments) {
+		if (binder_copy_sg(proc, thread, t->buffer->data,
+				   tr->data_size, fragments, fragment_count)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid fragments\n", proc->pid, thread->pid);
+			return_error = BR_FAILED_REPLY;
+			goto err_copy_data_failed;
+		}
+	} else if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+				  tr->data_size)) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
 			"data ptr\n", proc->pid, thread->pid);
 		return_error = BR_FAILED_REPLY;
@@ -1579,13 +2255,12 @@ static void binder_transaction(struct binder_proc *proc,
 			struct binder_ref *ref;
 			struct binder_node *node = binder_get_node(proc, fp->binder);
 			if (node == NULL) {
-				node = binder_new_node(proc, fp->binder, fp->cookie);
+				node = binder_new_node(proc, fp->binder,
+						       fp->cookie, fp->flags);
 				if (node == NULL) {
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
-				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1593,10 +2268,15 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				binder_put_node(node);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
+			mutex_lock(&target_proc->lock);
 			ref = binder_get_ref_for_node(target_proc, node);
 			if (ref == NULL) {
+				mutex_unlock(&target_proc->lock);
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1612,11 +2292,19 @@ static void binder_transaction(struct binder_proc *proc,
 				     "        node %d u%p -> ref %d desc %d\n",
 				     node->debug_id, node->ptr, ref->debug_id,
 				     ref->desc);
+			mutex_unlock(&target_proc->lock);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+			struct binder_node *node;
+			struct binder_proc *node_proc;
+
+			mutex_lock(&proc->lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction with invalid "
 					"handle, %ld\n", proc->pid,
@@ -1624,32 +2312,47 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_failed;
 			}
-			if (ref->node->proc == target_proc) {
+			node = ref->node;
+			binder_inc_node_tmpref(node);
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        ref %d desc %d (node %d)\n",
+				     ref->debug_id, ref->desc, node->debug_id);
+			mutex_unlock(&proc->lock);
+
+			spin_lock(&node->lock);
+			node_proc = node->proc;
+			spin_unlock(&node->lock);
+			if (node_proc == target_proc) {
 				if (fp->type == BINDER_TYPE_HANDLE)
 					fp->type = BINDER_TYPE_BINDER;
 				else
 					fp->type = BINDER_TYPE_WEAK_BINDER;
-				fp->binder = ref->node->ptr;
-				fp->cookie = ref->node->cookie;
-				binder_inc_node(ref->node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				fp->binder = node->ptr;
+				fp->cookie = node->cookie;
+				binder_inc_node(node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
-					     "        ref %d desc %d -> node %d u%p\n",
-					     ref->debug_id, ref->desc, ref->node->debug_id,
-					     ref->node->ptr);
+					     "        -> node %d u%p\n",
+					     node->debug_id, node->ptr);
 			} else {
 				struct binder_ref *new_ref;
-				new_ref = binder_get_ref_for_node(target_proc, ref->node);
+
+				mutex_lock(&target_proc->lock);
+				new_ref = binder_get_ref_for_node(target_proc, node);
 				if (new_ref == NULL) {
+					mutex_unlock(&target_proc->lock);
+					binder_put_node(node);
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_get_ref_for_node_failed;
 				}
 				fp->handle = new_ref->desc;
 				binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
-					     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
-					     ref->debug_id, ref->desc, new_ref->debug_id,
-					     new_ref->desc, ref->node->debug_id);
+					     "        -> ref %d desc %d (node %d)\n",
+					     new_ref->debug_id, new_ref->desc,
+					     node->debug_id);
+				mutex_unlock(&target_proc->lock);
 			}
+			binder_put_node(node);
 		} break;
 
 		case BINDER_TYPE_FD: {
@@ -1677,13 +2380,16 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_fget_failed;
 			}
+			mutex_lock(&target_proc->lock);
 			target_fd = task_get_unused_fd_flags(target_proc, O_CLOEXEC);
 			if (target_fd < 0) {
+				mutex_unlock(&target_proc->lock);
 				fput(file);
 				return_error = BR_FAILED_REPLY;
 				goto err_get_unused_fd_failed;
 			}
 			task_fd_install(target_proc, target_fd, file);
+			mutex_unlock(&target_proc->lock);
 			binder_debug(BINDER_DEBUG_TRANSACTION,
 				     "        fd %ld -> %d\n", fp->handle, target_fd);
 			/* TODO: fput? */
@@ -1698,31 +2404,80 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	t->work.type = BINDER_WORK_TRANSACTION;
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	/* t may be consumed by the target as soon as it is queued */
+	trace_binder_transaction(reply, t, target_node);
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
+		spin_lock(&target_proc->inner_lock);
+		if (target_thread->is_dead) {
+			spin_unlock(&target_proc->inner_lock);
+			goto err_dead_proc_or_thread;
+		}
+		binder_pop_transaction_ilocked(target_thread, in_reply_to);
+		list_add_tail(&t->work.entry, target_list);
+		spin_unlock(&target_proc->inner_lock);
+		if (in_reply_to->target_node) {
+			s64 us;
+
+			us = binder_node_record_latency(
+				in_reply_to->target_node,
+				in_reply_to->target_node->reply_latency,
+				in_reply_to->start_time);
+			trace_binder_reply(in_reply_to, us);
+		}
+		binder_free_transaction(in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		spin_lock(&proc->inner_lock);
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
+		spin_unlock(&proc->inner_lock);
+		spin_lock(&target_proc->inner_lock);
+		if (target_proc->is_dead ||
+		    (target_thread && target_thread->is_dead)) {
+			spin_unlock(&target_proc->inner_lock);
+			spin_lock(&proc->inner_lock);
+			binder_pop_transaction_ilocked(thread, t);
+			spin_unlock(&proc->inner_lock);
+			goto err_dead_proc_or_thread;
+		}
+		list_add_tail(&t->work.entry, target_list);
+		spin_unlock(&target_proc->inner_lock);
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
+		binder_node_inner_lock(target_node);
+		if (target_node->proc != target_proc || target_proc->is_dead) {
+			binder_node_inner_unlock(target_node);
+			goto err_dead_proc_or_thread;
+		}
 		if (target_node->has_async_transaction) {
 			target_list = &target_node->async_todo;
 			target_wait = NULL;
 		} else
 			target_node->has_async_transaction = 1;
+		list_add_tail(&t->work.entry, target_list);
+		binder_node_inner_unlock(target_node);
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	spin_lock(&proc->inner_lock);
 	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
+	spin_unlock(&proc->inner_lock);
+	if (target_wait) {
+		trace_binder_wakeup(target_proc, target_thread);
 		wake_up_interruptible(target_wait);
+	}
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	binder_proc_dec_tmpref(target_proc);
+	if (target_node)
+		binder_put_node(target_node);
 	return;
 
+err_dead_proc_or_thread:
+	return_error = BR_DEAD_REPLY;
 err_get_unused_fd_failed:
 err_fget_failed:
 err_fd_not_allowed:
@@ -1733,12 +2488,16 @@ err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	spin_lock(&target_proc->inner_lock);
 	t->buffer->transaction = NULL;
+	spin_unlock(&target_proc->inner_lock);
 	binder_free_buf(target_proc, t->buffer);
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
+	if (t->target_node)
+		binder_put_node(t->target_node);
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
@@ -1747,6 +2506,13 @@ err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
 err_no_context_mgr_node:
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	if (target_proc)
+		binder_proc_dec_tmpref(target_proc);
+	if (target_node)
+		binder_put_node(target_node);
+
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1758,12 +2524,22 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
+	spin_lock(&proc->inner_lock);
+	/* a failed reply to an older transaction may have raced with us */
+	if (thread->return_error != BR_OK &&
+	    thread->return_error2 == BR_OK) {
+		thread->return_error2 = thread->return_error;
+		thread->return_error = BR_OK;
+	}
 	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
 		thread->return_error = BR_TRANSACTION_COMPLETE;
+		spin_unlock(&proc->inner_lock);
 		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	} else {
 		thread->return_error = return_error;
+		spin_unlock(&proc->inner_lock);
+	}
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1778,9 +2554,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1788,27 +2564,34 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 		case BC_RELEASE:
 		case BC_DECREFS: {
 			uint32_t target;
-			struct binder_ref *ref;
+			struct binder_ref *ref = NULL;
 			const char *debug_string;
 
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (target == 0 && binder_context_mgr_node &&
+			mutex_lock(&proc->lock);
+			if (target == 0 &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
-				ref = binder_get_ref_for_node(proc,
-					       binder_context_mgr_node);
-				if (ref->desc != target) {
-					binder_user_error("binder: %d:"
-						"%d tried to acquire "
-						"reference to desc 0, "
-						"got %d instead\n",
-						proc->pid, thread->pid,
-						ref->desc);
+				mutex_lock(&binder_context_mgr_node_lock);
+				if (binder_context_mgr_node) {
+					ref = binder_get_ref_for_node(proc,
+						       binder_context_mgr_node);
+					if (ref && ref->desc != target) {
+						binder_user_error("binder: %d:"
+							"%d tried to acquire "
+							"reference to desc 0, "
+							"got %d instead\n",
+							proc->pid, thread->pid,
+							ref->desc);
+					}
 				}
-			} else
+				mutex_unlock(&binder_context_mgr_node_lock);
+			}
+			if (ref == NULL)
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1817,26 +2600,28 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			switch (cmd) {
 			case BC_INCREFS:
 				debug_string = "IncRefs";
-				binder_inc_ref(ref, 0, NULL);
 				break;
 			case BC_ACQUIRE:
 				debug_string = "Acquire";
-				binder_inc_ref(ref, 1, NULL);
 				break;
 			case BC_RELEASE:
 				debug_string = "Release";
-				binder_dec_ref(ref, 1);
 				break;
 			case BC_DECREFS:
 			default:
 				debug_string = "DecRefs";
-				binder_dec_ref(ref, 0);
 				break;
 			}
+			/* print before the update, which may delete the ref */
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				     proc->pid, thread->pid, debug_string, ref->debug_id,
 				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			if (cmd == BC_INCREFS || cmd == BC_ACQUIRE)
+				binder_inc_ref(ref, cmd == BC_ACQUIRE, NULL);
+			else
+				binder_dec_ref(ref, cmd == BC_RELEASE);
+			mutex_unlock(&proc->lock);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1844,6 +2629,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			void __user *node_ptr;
 			void *cookie;
 			struct binder_node *node;
+			bool free_node;
 
 			if (get_user(node_ptr, (void * __user *)ptr))
 				return -EFAULT;
@@ -1870,8 +2656,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				binder_put_node(node);
 				break;
 			}
+			binder_node_inner_lock(node);
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
 					binder_user_error("binder: %d:%d "
@@ -1879,6 +2667,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1889,16 +2679,22 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			free_node = binder_dec_node_nilocked(node,
+					cmd == BC_ACQUIRE_DONE, 0);
+			WARN_ON(free_node);
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s node %d ls %d lw %d\n",
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			binder_node_inner_unlock(node);
+			binder_put_node(node);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1911,25 +2707,34 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 		case BC_FREE_BUFFER: {
 			void __user *data_ptr;
 			struct binder_buffer *buffer;
+			struct binder_node *buf_node;
 
 			if (get_user(data_ptr, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
-			if (!buffer->allow_user_free) {
+			if (!buffer->allow_user_free || buffer->free_in_progress) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* keep a racing BC_FREE_BUFFER off this buffer */
+			buffer->free_in_progress = 1;
+			mutex_unlock(&proc->alloc_lock);
+
+			spin_lock(&proc->inner_lock);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1939,12 +2744,17 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				buffer->transaction->buffer = NULL;
 				buffer->transaction = NULL;
 			}
-			if (buffer->async_transaction && buffer->target_node) {
-				BUG_ON(!buffer->target_node->has_async_transaction);
-				if (list_empty(&buffer->target_node->async_todo))
-					buffer->target_node->has_async_transaction = 0;
+			spin_unlock(&proc->inner_lock);
+			buf_node = buffer->target_node;
+			if (buffer->async_transaction && buf_node) {
+				binder_node_inner_lock(buf_node);
+				BUG_ON(!buf_node->has_async_transaction);
+				BUG_ON(buf_node->proc != proc);
+				if (list_empty(&buf_node->async_todo))
+					buf_node->has_async_transaction = 0;
 				else
-					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+					list_move_tail(buf_node->async_todo.next, &thread->todo);
+				binder_node_inner_unlock(buf_node);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
@@ -1958,7 +2768,21 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY,
+					   NULL, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, tr.fragments,
+					   tr.fragment_count);
 			break;
 		}
 
@@ -1966,6 +2790,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -1983,11 +2808,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -1996,12 +2823,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_EXIT_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			spin_unlock(&proc->inner_lock);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -2009,7 +2839,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			uint32_t target;
 			void __user *cookie;
 			struct binder_ref *ref;
-			struct binder_ref_death *death;
+			struct binder_ref_death *death = NULL;
 
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -2017,8 +2847,22 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
+				/* allocate up front, outside the node lock */
+				death = kzalloc(sizeof(*death), GFP_KERNEL);
+				if (death == NULL) {
+					thread->return_error = BR_ERROR;
+					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+						     "binder: %d:%d "
+						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
+						     proc->pid, thread->pid);
+					break;
+				}
+			}
+			mutex_lock(&proc->lock);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2026,6 +2870,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_REQUEST_DEATH_NOTIFICATION" :
 					"BC_CLEAR_DEATH_NOTIFICATION",
 					target);
+				kfree(death);
 				break;
 			}
 
@@ -2038,6 +2883,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     cookie, ref->debug_id, ref->desc,
 				     ref->strong, ref->weak, ref->node->debug_id);
 
+			spin_lock(&ref->node->lock);
 			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
 				if (ref->death) {
 					binder_user_error("binder: %d:%"
@@ -2045,15 +2891,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
-					break;
-				}
-				death = kzalloc(sizeof(*death), GFP_KERNEL);
-				if (death == NULL) {
-					thread->return_error = BR_ERROR;
-					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-						     "binder: %d:%d "
-						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
-						     proc->pid, thread->pid);
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->lock);
+					kfree(death);
 					break;
 				}
 				binder_stats_created(BINDER_STAT_DEATH);
@@ -2062,12 +2902,14 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					spin_lock(&proc->inner_lock);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
 						wake_up_interruptible(&proc->wait);
 					}
+					spin_unlock(&proc->inner_lock);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2076,6 +2918,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->lock);
 					break;
 				}
 				death = ref->death;
@@ -2087,9 +2931,12 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->lock);
 					break;
 				}
 				ref->death = NULL;
+				spin_lock(&proc->inner_lock);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
@@ -2102,7 +2949,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				spin_unlock(&proc->inner_lock);
 			}
+			spin_unlock(&ref->node->lock);
+			mutex_unlock(&proc->lock);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2112,6 +2962,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			spin_lock(&proc->inner_lock);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2123,6 +2974,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				spin_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2139,6 +2991,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			spin_unlock(&proc->inner_lock);
 		} break;
 
 		default:
@@ -2155,23 +3008,62 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
 static int binder_has_proc_work(struct binder_proc *proc,
 				struct binder_thread *thread)
 {
-	return !list_empty(&proc->todo) ||
+	int has_work;
+
+	spin_lock(&proc->inner_lock);
+	has_work = !list_empty(&proc->todo) ||
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
+	spin_unlock(&proc->inner_lock);
+	return has_work;
 }
 
 static int binder_has_thread_work(struct binder_thread *thread)
 {
-	return !list_empty(&thread->todo) || thread->return_error != BR_OK ||
+	int has_work;
+
+	spin_lock(&thread->proc->inner_lock);
+	has_work = !list_empty(&thread->todo) ||
+		thread->return_error != BR_OK ||
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
+	spin_unlock(&thread->proc->inner_lock);
+	return has_work;
+}
+
+static int binder_put_node_cmd(struct binder_proc *proc,
+			       struct binder_thread *thread,
+			       void __user **ptrp,
+			       void __user *node_ptr, void *node_cookie,
+			       int node_debug_id, uint32_t cmd,
+			       const char *cmd_name)
+{
+	void __user *ptr = *ptrp;
+
+	if (put_user(cmd, (uint32_t __user *)ptr))
+		return -EFAULT;
+	ptr += sizeof(uint32_t);
+	if (put_user(node_ptr, (void * __user *)ptr))
+		return -EFAULT;
+	ptr += sizeof(void *);
+	if (put_user(node_cookie, (void * __user *)ptr))
+		return -EFAULT;
+	ptr += sizeof(void *);
+
+	binder_stat_br(proc, thread, cmd);
+	binder_debug(BINDER_DEBUG_USER_REFS,
+		     "binder: %d:%d %s %d u%p c%p\n",
+		     proc->pid, thread->pid, cmd_name, node_debug_id,
+		     node_ptr, node_cookie);
+	*ptrp = ptr;
+	return 0;
 }
 
 static int binder_thread_read(struct binder_proc *proc,
@@ -2192,22 +3084,33 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
-		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+		uint32_t return_error = thread->return_error;
+		uint32_t return_error2 = thread->return_error2;
+
+		spin_unlock(&proc->inner_lock);
+		if (return_error2 != BR_OK) {
+			if (put_user(return_error2, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
 			if (ptr == end)
 				goto done;
+			spin_lock(&proc->inner_lock);
 			thread->return_error2 = BR_OK;
+			spin_unlock(&proc->inner_lock);
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
+		if (put_user(return_error, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
+		/* a failed reply may have replaced the error meanwhile */
+		spin_lock(&proc->inner_lock);
+		if (thread->return_error == return_error)
+			thread->return_error = BR_OK;
+		spin_unlock(&proc->inner_lock);
 		goto done;
 	}
 
@@ -2215,7 +3118,7 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2239,10 +3142,11 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	spin_lock(&proc->inner_lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	spin_unlock(&proc->inner_lock);
 
 	if (ret)
 		return ret;
@@ -2252,25 +3156,38 @@ retry:
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		struct binder_thread *t_from;
+		struct list_head *list;
 
+		spin_lock(&proc->inner_lock);
 		if (!list_empty(&thread->todo))
-			w = list_first_entry(&thread->todo, struct binder_work, entry);
+			list = &thread->todo;
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
-			w = list_first_entry(&proc->todo, struct binder_work, entry);
+			list = &proc->todo;
 		else {
+			spin_unlock(&proc->inner_lock);
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			spin_unlock(&proc->inner_lock);
 			break;
+		}
+		w = list_first_entry(list, struct binder_work, entry);
+		list_del_init(&w->entry);
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
+			spin_unlock(&proc->inner_lock);
 			t = container_of(w, struct binder_transaction, work);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			spin_unlock(&proc->inner_lock);
+			kfree(w);
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
+
 			cmd = BR_TRANSACTION_COMPLETE;
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -2280,105 +3197,131 @@ retry:
 			binder_debug(BINDER_DEBUG_TRANSACTION_COMPLETE,
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
-
-			list_del(&w->entry);
-			kfree(w);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
-			uint32_t cmd = BR_NOOP;
-			const char *cmd_name;
+			void __user *node_ptr = node->ptr;
+			void *node_cookie = node->cookie;
+			int node_debug_id = node->debug_id;
+			int has_weak_ref = node->has_weak_ref;
+			int has_strong_ref = node->has_strong_ref;
 			int strong = node->internal_strong_refs || node->local_strong_refs;
-			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
-			if (weak && !node->has_weak_ref) {
-				cmd = BR_INCREFS;
-				cmd_name = "BR_INCREFS";
+			int weak = !hlist_empty(&node->refs) || node->local_weak_refs ||
+				node->tmp_refs || strong;
+
+			/*
+			 * The work item has been dequeued, so apply every
+			 * pending state change now and report them below.
+			 */
+			if (weak && !has_weak_ref) {
 				node->has_weak_ref = 1;
 				node->pending_weak_ref = 1;
 				node->local_weak_refs++;
-			} else if (strong && !node->has_strong_ref) {
-				cmd = BR_ACQUIRE;
-				cmd_name = "BR_ACQUIRE";
+			}
+			if (strong && !has_strong_ref) {
 				node->has_strong_ref = 1;
 				node->pending_strong_ref = 1;
 				node->local_strong_refs++;
-			} else if (!strong && node->has_strong_ref) {
-				cmd = BR_RELEASE;
-				cmd_name = "BR_RELEASE";
+			}
+			if (!strong && has_strong_ref)
 				node->has_strong_ref = 0;
-			} else if (!weak && node->has_weak_ref) {
-				cmd = BR_DECREFS;
-				cmd_name = "BR_DECREFS";
+			if (!weak && has_weak_ref)
 				node->has_weak_ref = 0;
+			if (!weak && !strong) {
+				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+					     "binder: %d:%d node %d u%p c%p deleted\n",
+					     proc->pid, thread->pid, node_debug_id,
+					     node_ptr, node_cookie);
+				rb_erase(&node->rb_node, &proc->nodes);
+				spin_unlock(&proc->inner_lock);
+				/* wait out anyone still inside node->lock */
+				spin_lock(&node->lock);
+				spin_unlock(&node->lock);
+				binder_free_node(node);
+			} else
+				spin_unlock(&proc->inner_lock);
+
+			if (weak && !has_weak_ref) {
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+						node_ptr, node_cookie,
+						node_debug_id, BR_INCREFS,
+						"BR_INCREFS");
+				if (ret)
+					return ret;
 			}
-			if (cmd != BR_NOOP) {
-				if (put_user(cmd, (uint32_t __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-
-				binder_stat_br(proc, thread, cmd);
-				binder_debug(BINDER_DEBUG_USER_REFS,
-					     "binder: %d:%d %s %d u%p c%p\n",
-					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
-			} else {
-				list_del_init(&w->entry);
-				if (!weak && !strong) {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p deleted\n",
-						     proc->pid, thread->pid, node->debug_id,
-						     node->ptr, node->cookie);
-					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
-					binder_stats_deleted(BINDER_STAT_NODE);
-				} else {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p state unchanged\n",
-						     proc->pid, thread->pid, node->debug_id, node->ptr,
-						     node->cookie);
-				}
+			if (strong && !has_strong_ref) {
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+						node_ptr, node_cookie,
+						node_debug_id, BR_ACQUIRE,
+						"BR_ACQUIRE");
+				if (ret)
+					return ret;
 			}
+			if (!strong && has_strong_ref) {
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+						node_ptr, node_cookie,
+						node_debug_id, BR_RELEASE,
+						"BR_RELEASE");
+				if (ret)
+					return ret;
+			}
+			if (!weak && has_weak_ref) {
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+						node_ptr, node_cookie,
+						node_debug_id, BR_DECREFS,
+						"BR_DECREFS");
+				if (ret)
+					return ret;
+			}
+			if (weak == has_weak_ref && strong == has_strong_ref &&
+			    (weak || strong))
+				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+					     "binder: %d:%d node %d u%p c%p state unchanged\n",
+					     proc->pid, thread->pid, node_debug_id,
+					     node_ptr, node_cookie);
 		} break;
 		case BINDER_WORK_DEAD_BINDER:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
+			void __user *cookie;
 			uint32_t cmd;
 
 			death = container_of(w, struct binder_ref_death, work);
+			cookie = death->cookie;
 			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
 			else
 				cmd = BR_DEAD_BINDER;
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
+				spin_unlock(&proc->inner_lock);
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			} else {
+				list_add(&w->entry, &proc->delivered_death);
+				spin_unlock(&proc->inner_lock);
+			}
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_stat_br(proc, thread, cmd);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
 				     "binder: %d:%d %s %p\n",
 				      proc->pid, thread->pid,
 				      cmd == BR_DEAD_BINDER ?
 				      "BR_DEAD_BINDER" :
 				      "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				      death->cookie);
+				      cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
+		default:
+			spin_unlock(&proc->inner_lock);
+			break;
 		}
 
 		if (!t)
@@ -2406,8 +3349,9 @@ retry:
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
 
-		if (t->from) {
-			struct task_struct *sender = t->from->proc->tsk;
+		t_from = binder_get_txn_from(t);
+		if (t_from) {
+			struct task_struct *sender = t_from->proc->tsk;
 			tr.sender_pid = task_tgid_nr_ns(sender,
 							current->nsproxy->pid_ns);
 		} else {
@@ -2422,11 +3366,17 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
+		if (put_user(cmd, (uint32_t __user *)ptr) ||
+		    copy_to_user(ptr + sizeof(uint32_t), &tr, sizeof(tr))) {
+			if (t_from)
+				binder_thread_dec_tmpref(t_from);
+			/* leave the transaction queued for the next read */
+			spin_lock(&proc->inner_lock);
+			list_add(&t->work.entry, list);
+			spin_unlock(&proc->inner_lock);
 			return -EFAULT;
+		}
 		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
 		ptr += sizeof(tr);
 
 		binder_stat_br(proc, thread, cmd);
@@ -2436,21 +3386,31 @@ retry:
 			     proc->pid, thread->pid,
 			     (cmd == BR_TRANSACTION) ? "BR_TRANSACTION" :
 			     "BR_REPLY",
-			     t->debug_id, t->from ? t->from->proc->pid : 0,
-			     t->from ? t->from->pid : 0, cmd,
+			     t->debug_id, t_from ? t_from->proc->pid : 0,
+			     t_from ? t_from->pid : 0, cmd,
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
+		if (t_from)
+			binder_thread_dec_tmpref(t_from);
+		if (cmd == BR_TRANSACTION && t->target_node) {
+			s64 us;
+
+			us = binder_node_record_latency(t->target_node,
+				t->target_node->queue_latency, t->start_time);
+			trace_binder_transaction_received(t, us);
+		}
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
+			spin_lock(&proc->inner_lock);
 			t->to_parent = thread->transaction_stack;
+			spin_lock(&t->lock);
 			t->to_thread = thread;
+			spin_unlock(&t->lock);
 			thread->transaction_stack = t;
+			spin_unlock(&proc->inner_lock);
 		} else {
-			t->buffer->transaction = NULL;
-			kfree(t);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION);
+			binder_free_transaction(t);
 		}
 		break;
 	}
@@ -2458,39 +3418,68 @@ retry:
 done:
 
 	*consumed = ptr - buffer;
+	spin_lock(&proc->inner_lock);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		spin_unlock(&proc->inner_lock);
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
-	}
+	} else
+		spin_unlock(&proc->inner_lock);
 	return 0;
 }
 
-static void binder_release_work(struct list_head *list)
+static void binder_release_work(struct binder_proc *proc,
+				struct list_head *list)
 {
 	struct binder_work *w;
-	while (!list_empty(list)) {
+
+	while (1) {
+		spin_lock(&proc->inner_lock);
+		if (list_empty(list)) {
+			spin_unlock(&proc->inner_lock);
+			break;
+		}
 		w = list_first_entry(list, struct binder_work, entry);
 		list_del_init(&w->entry);
+		spin_unlock(&proc->inner_lock);
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			struct binder_transaction *t;
 
 			t = container_of(w, struct binder_transaction, work);
-			if (t->buffer->target_node && !(t->flags & TF_ONE_WAY))
+			if (t->buffer->target_node && !(t->flags & TF_ONE_WAY)) {
 				binder_send_failed_reply(t, BR_DEAD_REPLY);
+			} else {
+				binder_debug(BINDER_DEBUG_DEAD_TRANSACTION,
+					     "binder: undelivered transaction %d\n",
+					     t->debug_id);
+				binder_free_transaction(t);
+			}
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
 			kfree(w);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
+		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
+		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
+			struct binder_ref_death *death;
+
+			/* no longer reachable through ref->death */
+			death = container_of(w, struct binder_ref_death, work);
+			binder_debug(BINDER_DEBUG_DEAD_TRANSACTION,
+				     "binder: undelivered death notification, %p\n",
+				     death->cookie);
+			kfree(death);
+			binder_stats_deleted(BINDER_STAT_DEATH);
+		} break;
 		default:
 			break;
 		}
@@ -2498,7 +3487,9 @@ static void binder_release_work(struct list_head *list)
 
 }
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+/* Called with proc->inner_lock held; inserts new_thread if not found */
+static struct binder_thread *binder_get_thread_ilocked(
+		struct binder_proc *proc, struct binder_thread *new_thread)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
@@ -2513,38 +3504,71 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		else if (current->pid > thread->pid)
 			p = &(*p)->rb_right;
 		else
-			break;
-	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
-		binder_stats_created(BINDER_STAT_THREAD);
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
+			return thread;
 	}
+	if (!new_thread)
+		return NULL;
+	thread = new_thread;
+	binder_stats_created(BINDER_STAT_THREAD);
+	thread->proc = proc;
+	thread->pid = current->pid;
+	atomic_set(&thread->tmp_ref, 0);
+	init_waitqueue_head(&thread->wait);
+	INIT_LIST_HEAD(&thread->todo);
+	rb_link_node(&thread->rb_node, parent, p);
+	rb_insert_color(&thread->rb_node, &proc->threads);
+	thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	thread->return_error = BR_OK;
+	thread->return_error2 = BR_OK;
+	return thread;
+}
+
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *new_thread;
+
+	spin_lock(&proc->inner_lock);
+	thread = binder_get_thread_ilocked(proc, NULL);
+	spin_unlock(&proc->inner_lock);
+	if (thread)
+		return thread;
+
+	new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+	if (new_thread == NULL)
+		return NULL;
+	spin_lock(&proc->inner_lock);
+	thread = binder_get_thread_ilocked(proc, new_thread);
+	spin_unlock(&proc->inner_lock);
+	if (thread != new_thread)
+		kfree(new_thread);
 	return thread;
 }
 
-static int binder_free_thread(struct binder_proc *proc,
-			      struct binder_thread *thread)
+static int binder_thread_release(struct binder_proc *proc,
+				 struct binder_thread *thread)
 {
 	struct binder_transaction *t;
+	struct binder_transaction *last_t;
 	struct binder_transaction *send_reply = NULL;
 	int active_transactions = 0;
 
+	spin_lock(&proc->inner_lock);
+	/* dropped by binder_free_thread() */
+	proc->tmp_ref++;
+	/* keep the thread around until we are done with it */
+	atomic_inc(&thread->tmp_ref);
 	rb_erase(&thread->rb_node, &proc->threads);
 	t = thread->transaction_stack;
-	if (t && t->to_thread == thread)
-		send_reply = t;
+	if (t) {
+		spin_lock(&t->lock);
+		if (t->to_thread == thread)
+			send_reply = t;
+	}
+	thread->is_dead = true;
+
 	while (t) {
+		last_t = t;
 		active_transactions++;
 		binder_debug(BINDER_DEBUG_DEAD_TRANSACTION,
 			     "binder: release %d:%d transaction %d "
@@ -2565,12 +3589,16 @@ static int binder_free_thread(struct binder_proc *proc,
 			t = t->from_parent;
 		} else
 			BUG();
+		spin_unlock(&last_t->lock);
+		if (t)
+			spin_lock(&t->lock);
 	}
+	spin_unlock(&proc->inner_lock);
+
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
-	binder_release_work(&thread->todo);
-	kfree(thread);
-	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_release_work(proc, &thread->todo);
+	binder_thread_dec_tmpref(thread);
 	return active_transactions;
 }
 
@@ -2581,12 +3609,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
+	if (thread == NULL)
+		return POLLERR;
 
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2618,7 +3648,6 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2652,8 +3681,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		if (bwr.read_size > 0) {
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
+			spin_lock(&proc->inner_lock);
 			if (!list_empty(&proc->todo))
 				wake_up_interruptible(&proc->wait);
+			spin_unlock(&proc->inner_lock);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2670,20 +3701,31 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		spin_lock(&proc->inner_lock);
+		proc->max_threads = max_threads;
+		spin_unlock(&proc->inner_lock);
 		break;
-	case BINDER_SET_CONTEXT_MGR:
+	}
+	case BINDER_SET_CONTEXT_MGR: {
+		struct binder_node *new_node;
+
+		mutex_lock(&binder_context_mgr_node_lock);
 		if (binder_context_mgr_node != NULL) {
+			mutex_unlock(&binder_context_mgr_node_lock);
 			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
 			ret = -EBUSY;
 			goto err;
 		}
 		if (binder_context_mgr_uid != -1) {
 			if (binder_context_mgr_uid != current->cred->euid) {
+				mutex_unlock(&binder_context_mgr_node_lock);
 				printk(KERN_ERR "binder: BINDER_SET_"
 				       "CONTEXT_MGR bad uid %d != %d\n",
 				       current->cred->euid,
@@ -2693,20 +3735,27 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			}
 		} else
 			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
-		if (binder_context_mgr_node == NULL) {
+		new_node = binder_new_node(proc, NULL, NULL, 0);
+		if (new_node == NULL) {
+			mutex_unlock(&binder_context_mgr_node_lock);
 			ret = -ENOMEM;
 			goto err;
 		}
-		binder_context_mgr_node->local_weak_refs++;
-		binder_context_mgr_node->local_strong_refs++;
-		binder_context_mgr_node->has_strong_ref = 1;
-		binder_context_mgr_node->has_weak_ref = 1;
+		binder_node_inner_lock(new_node);
+		new_node->local_weak_refs++;
+		new_node->local_strong_refs++;
+		new_node->has_strong_ref = 1;
+		new_node->has_weak_ref = 1;
+		binder_context_mgr_node = new_node;
+		binder_node_inner_unlock(new_node);
+		binder_put_node(new_node);
+		mutex_unlock(&binder_context_mgr_node_lock);
 		break;
+	}
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
 			     proc->pid, thread->pid);
-		binder_free_thread(proc, thread);
+		binder_thread_release(proc, thread);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2725,9 +3774,11 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		spin_lock(&proc->inner_lock);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		spin_unlock(&proc->inner_lock);
+	}
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2786,6 +3837,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	}
 	vma->vm_flags = (vma->vm_flags | VM_DONTCOPY) & ~VM_MAYWRITE;
 
+	mutex_lock(&proc->alloc_lock);
 	if (proc->buffer) {
 		ret = -EBUSY;
 		failure_string = "already mapped";
@@ -2832,8 +3884,12 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	binder_insert_free_buffer(proc, buffer);
 	proc->free_async_space = proc->buffer_size / 2;
 	barrier();
-	proc->files = get_files_struct(current);
 	proc->vma = vma;
+	mutex_unlock(&proc->alloc_lock);
+
+	mutex_lock(&proc->lock);
+	proc->files = get_files_struct(current);
+	mutex_unlock(&proc->lock);
 
 	/*printk(KERN_INFO "binder_mmap: %d %lx-%lx maps %p\n",
 		 proc->pid, vma->vm_start, vma->vm_end, proc->buffer);*/
@@ -2847,6 +3903,7 @@ err_alloc_pages_failed:
 	proc->buffer = NULL;
 err_get_vm_area_failed:
 err_already_mapped:
+	mutex_unlock(&proc->alloc_lock);
 err_bad_arg:
 	printk(KERN_ERR "binder_mmap: %d %lx-%lx %s failed %d\n",
 	       proc->pid, vma->vm_start, vma->vm_end, failure_string, ret);
@@ -2856,6 +3913,7 @@ err_bad_arg:
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE, "binder_open: %d:%d\n",
 		     current->group_leader->pid, current->pid);
@@ -2863,18 +3921,23 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc = kzalloc(sizeof(*proc), GFP_KERNEL);
 	if (proc == NULL)
 		return -ENOMEM;
+	mutex_init(&proc->lock);
+	mutex_init(&proc->alloc_lock);
+	spin_lock_init(&proc->inner_lock);
 	get_task_struct(current);
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
 	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
+	for (i = 0; i < BINDER_BUFFER_CACHE_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->buffer_cache[i]);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	mutex_lock(&binder_procs_lock);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_procs_lock);
 
 	if (binder_proc_dir_entry_proc) {
 		char strbuf[11];
@@ -2901,6 +3964,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2909,6 +3974,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	spin_unlock(&proc->inner_lock);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -2930,82 +3996,167 @@ static int binder_release(struct inode *nodp, struct file *filp)
 	return 0;
 }
 
-static void binder_deferred_release(struct binder_proc *proc)
+static int binder_node_release(struct binder_node *node, int refs)
 {
+	struct binder_ref *ref;
 	struct hlist_node *pos;
-	struct binder_transaction *t;
+	struct binder_proc *proc = node->proc;
+	int death = 0;
+
+	binder_release_work(proc, &node->async_todo);
+
+	binder_node_inner_lock(node);
+	list_del_init(&node->work.entry);
+	/*
+	 * The caller holds a temporary reference, so the node is only
+	 * unused if that is the last one.
+	 */
+	if (hlist_empty(&node->refs) && node->tmp_refs == 1) {
+		binder_node_inner_unlock(node);
+		binder_free_node(node);
+		return refs;
+	}
+
+	node->proc = NULL;
+	node->local_strong_refs = 0;
+	node->local_weak_refs = 0;
+	spin_unlock(&proc->inner_lock);
+
+	spin_lock(&binder_dead_nodes_lock);
+	hlist_add_head(&node->dead_node, &binder_dead_nodes);
+	spin_unlock(&binder_dead_nodes_lock);
+
+	hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
+		refs++;
+		if (!ref->death)
+			continue;
+
+		death++;
+		spin_lock(&ref->proc->inner_lock);
+		if (list_empty(&ref->death->work.entry)) {
+			ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+			list_add_tail(&ref->death->work.entry, &ref->proc->todo);
+			wake_up_interruptible(&ref->proc->wait);
+		} else
+			BUG();
+		spin_unlock(&ref->proc->inner_lock);
+	}
+
+	binder_debug(BINDER_DEBUG_DEAD_BINDER,
+		     "binder: node %d now dead, "
+		     "refs %d, death %d\n", node->debug_id,
+		     refs, death);
+	spin_unlock(&node->lock);
+	binder_put_node(node);
+
+	return refs;
+}
+
+static void binder_deferred_release(struct binder_proc *proc)
+{
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_del(&proc->proc_node);
+	mutex_unlock(&binder_procs_lock);
+
+	/* The shrinker may have queued more work since we were dequeued */
+	mutex_lock(&binder_deferred_lock);
+	if (!hlist_unhashed(&proc->deferred_work_node))
+		hlist_del_init(&proc->deferred_work_node);
+	proc->deferred_work = 0;
+	mutex_unlock(&binder_deferred_lock);
+
+	mutex_lock(&binder_context_mgr_node_lock);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder_release: %d context_mgr_node gone\n",
 			     proc->pid);
 		binder_context_mgr_node = NULL;
 	}
+	mutex_unlock(&binder_context_mgr_node_lock);
 
+	spin_lock(&proc->inner_lock);
+	/*
+	 * Hold a reference so proc is not freed until we are done, even
+	 * if the last thread goes away underneath us.
+	 */
+	proc->tmp_ref++;
+	proc->is_dead = true;
 	threads = 0;
 	active_transactions = 0;
 	while ((n = rb_first(&proc->threads))) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
+
+		spin_unlock(&proc->inner_lock);
 		threads++;
-		active_transactions += binder_free_thread(proc, thread);
+		active_transactions += binder_thread_release(proc, thread);
+		spin_lock(&proc->inner_lock);
 	}
+
 	nodes = 0;
 	incoming_refs = 0;
 	while ((n = rb_first(&proc->nodes))) {
 		struct binder_node *node = rb_entry(n, struct binder_node, rb_node);
 
 		nodes++;
+		/*
+		 * Take a temporary reference and erase the node so that
+		 * nobody else can find it while it is being released.
+		 */
+		node->tmp_refs++;
 		rb_erase(&node->rb_node, &proc->nodes);
-		list_del_init(&node->work.entry);
-		if (hlist_empty(&node->refs)) {
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
-		} else {
-			struct binder_ref *ref;
-			int death = 0;
-
-			node->proc = NULL;
-			node->local_strong_refs = 0;
-			node->local_weak_refs = 0;
-			hlist_add_head(&node->dead_node, &binder_dead_nodes);
-
-			hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
-				incoming_refs++;
-				if (ref->death) {
-					death++;
-					if (list_empty(&ref->death->work.entry)) {
-						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
-						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
-						wake_up_interruptible(&ref->proc->wait);
-					} else
-						BUG();
-				}
-			}
-			binder_debug(BINDER_DEBUG_DEAD_BINDER,
-				     "binder: node %d now dead, "
-				     "refs %d, death %d\n", node->debug_id,
-				     incoming_refs, death);
-		}
+		spin_unlock(&proc->inner_lock);
+		incoming_refs = binder_node_release(node, incoming_refs);
+		spin_lock(&proc->inner_lock);
 	}
+	spin_unlock(&proc->inner_lock);
+
 	outgoing_refs = 0;
+	mutex_lock(&proc->lock);
 	while ((n = rb_first(&proc->refs_by_desc))) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
 		outgoing_refs++;
 		binder_delete_ref(ref);
 	}
-	binder_release_work(&proc->todo);
-	buffers = 0;
+	mutex_unlock(&proc->lock);
+
+	binder_release_work(proc, &proc->todo);
+	binder_release_work(proc, &proc->delivered_death);
+
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d threads %d, nodes %d (ref %d), "
+		     "refs %d, active transactions %d\n",
+		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
+		     active_transactions);
+
+	binder_proc_dec_tmpref(proc);
+}
+
+/*
+ * Called once the proc is dead and the last temporary reference to it
+ * is gone, so nobody else can reach it any more.
+ */
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	BUG_ON(!list_empty(&proc->todo));
+	BUG_ON(!list_empty(&proc->delivered_death));
 
+	buffers = 0;
+	mutex_lock(&proc->alloc_lock);
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
+		spin_lock(&proc->inner_lock);
 		t = buffer->transaction;
 		if (t) {
 			t->buffer = NULL;
@@ -3015,11 +4166,11 @@ static void binder_deferred_release(struct binder_proc *proc)
 			       proc->pid, t->debug_id);
 			/*BUG();*/
 		}
-		binder_free_buf(proc, buffer);
+		spin_unlock(&proc->inner_lock);
+		binder_free_buf_locked(proc, buffer);
 		buffers++;
 	}
-
-	binder_stats_deleted(BINDER_STAT_PROC);
+	binder_buffer_cache_drain(proc);
 
 	page_count = 0;
 	if (proc->pages) {
@@ -3041,16 +4192,15 @@ static void binder_deferred_release(struct binder_proc *proc)
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
+	mutex_unlock(&proc->alloc_lock);
 
 	put_task_struct(proc->tsk);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
-		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
-		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     "binder_release: %d buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
 
+	binder_stats_deleted(BINDER_STAT_PROC);
 	kfree(proc);
 }
 
@@ -3061,7 +4211,6 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3077,18 +4226,25 @@ static void binder_deferred_func(struct work_struct *work)
 
 		files = NULL;
 		if (defer & BINDER_DEFERRED_PUT_FILES) {
+			mutex_lock(&proc->lock);
 			files = proc->files;
 			if (files)
 				proc->files = NULL;
+			mutex_unlock(&proc->lock);
 		}
 
 		if (defer & BINDER_DEFERRED_FLUSH)
 			binder_deferred_flush(proc);
 
+		if (defer & BINDER_DEFERRED_SHRINK) {
+			mutex_lock(&proc->alloc_lock);
+			binder_buffer_cache_drain(proc);
+			mutex_unlock(&proc->alloc_lock);
+		}
+
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3108,20 +4264,37 @@ binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer)
 	mutex_unlock(&binder_deferred_lock);
 }
 
+/*
+ * Called with proc->inner_lock held.  t->buffer can only be looked at
+ * safely if proc is the process that owns it.
+ */
 static char *print_binder_transaction(char *buf, char *end, const char *prefix,
+				      struct binder_proc *proc,
 				      struct binder_transaction *t)
 {
+	struct binder_proc *to_proc;
+	int do_lock = !binder_debug_no_lock;
+
+	if (do_lock)
+		spin_lock(&t->lock);
+	to_proc = t->to_proc;
 	buf += snprintf(buf, end - buf,
 			"%s %d: %p from %d:%d to %d:%d code %x "
 			"flags %x pri %ld r%d",
 			prefix, t->debug_id, t,
 			t->from ? t->from->proc->pid : 0,
 			t->from ? t->from->pid : 0,
-			t->to_proc ? t->to_proc->pid : 0,
+			to_proc ? to_proc->pid : 0,
 			t->to_thread ? t->to_thread->pid : 0,
 			t->code, t->flags, t->priority, t->need_reply);
+	if (do_lock)
+		spin_unlock(&t->lock);
 	if (buf >= end)
 		return buf;
+	if (proc != to_proc) {
+		buf += snprintf(buf, end - buf, "\n");
+		return buf;
+	}
 	if (t->buffer == NULL) {
 		buf += snprintf(buf, end - buf, " buffer free\n");
 		return buf;
@@ -3150,6 +4323,7 @@ static char *print_binder_buffer(char *buf, char *end, const char *prefix,
 
 static char *print_binder_work(char *buf, char *end, const char *prefix,
 			       const char *transaction_prefix,
+			       struct binder_proc *proc,
 			       struct binder_work *w)
 {
 	struct binder_node *node;
@@ -3158,7 +4332,8 @@ static char *print_binder_work(char *buf, char *end, const char *prefix,
 	switch (w->type) {
 	case BINDER_WORK_TRANSACTION:
 		t = container_of(w, struct binder_transaction, work);
-		buf = print_binder_transaction(buf, end, transaction_prefix, t);
+		buf = print_binder_transaction(buf, end, transaction_prefix,
+					       proc, t);
 		break;
 	case BINDER_WORK_TRANSACTION_COMPLETE:
 		buf += snprintf(buf, end - buf,
@@ -3189,10 +4364,12 @@ static char *print_binder_work(char *buf, char *end, const char *prefix,
 	return buf;
 }
 
+/* Called with thread->proc->inner_lock held */
 static char *print_binder_thread(char *buf, char *end,
 				 struct binder_thread *thread,
 				 int print_always)
 {
+	struct binder_proc *proc = thread->proc;
 	struct binder_transaction *t;
 	struct binder_work *w;
 	char *start_buf = buf;
@@ -3207,15 +4384,15 @@ static char *print_binder_thread(char *buf, char *end,
 			break;
 		if (t->from == thread) {
 			buf = print_binder_transaction(buf, end,
-						"    outgoing transaction", t);
+						"    outgoing transaction", proc, t);
 			t = t->from_parent;
 		} else if (t->to_thread == thread) {
 			buf = print_binder_transaction(buf, end,
-						"    incoming transaction", t);
+						"    incoming transaction", proc, t);
 			t = t->to_parent;
 		} else {
 			buf = print_binder_transaction(buf, end,
-						"    bad transaction", t);
+						"    bad transaction", proc, t);
 			t = NULL;
 		}
 	}
@@ -3223,13 +4400,14 @@ static char *print_binder_thread(char *buf, char *end,
 		if (buf >= end)
 			break;
 		buf = print_binder_work(buf, end, "    ",
-					"    pending transaction", w);
+					"    pending transaction", proc, w);
 	}
 	if (!print_always && buf == header_buf)
 		buf = start_buf;
 	return buf;
 }
 
+/* Called with binder_node_inner_lock() held */
 static char *print_binder_node(char *buf, char *end, struct binder_node *node)
 {
 	struct binder_ref *ref;
@@ -3243,11 +4421,11 @@ static char *print_binder_node(char *buf, char *end, struct binder_node *node)
 
 	buf += snprintf(buf, end - buf,
 			"  node %d: u%p c%p hs %d hw %d ls %d lw %d "
-			"is %d iw %d",
+			"is %d iw %d tr %d",
 			node->debug_id, node->ptr, node->cookie,
 			node->has_strong_ref, node->has_weak_ref,
 			node->local_strong_refs, node->local_weak_refs,
-			node->internal_strong_refs, count);
+			node->internal_strong_refs, count, node->tmp_refs);
 	if (buf >= end)
 		return buf;
 	if (count) {
@@ -3265,18 +4443,26 @@ static char *print_binder_node(char *buf, char *end, struct binder_node *node)
 		if (buf >= end)
 			break;
 		buf = print_binder_work(buf, end, "    ",
-					"    pending async transaction", w);
+					"    pending async transaction",
+					node->proc, w);
 	}
 	return buf;
 }
 
+/* Called with ref->proc->lock held */
 static char *print_binder_ref(char *buf, char *end, struct binder_ref *ref)
 {
+	int do_lock = !binder_debug_no_lock;
+
+	if (do_lock)
+		spin_lock(&ref->node->lock);
 	buf += snprintf(buf, end - buf,
 			"  ref %d: desc %d %snode %d s %d w %d d %p\n",
 			ref->debug_id, ref->desc,
 			ref->node->proc ? "" : "dead ", ref->node->debug_id,
 			ref->strong, ref->weak, ref->death);
+	if (do_lock)
+		spin_unlock(&ref->node->lock);
 	return buf;
 }
 
@@ -3287,10 +4473,13 @@ static char *print_binder_proc(char *buf, char *end,
 	struct rb_node *n;
 	char *start_buf = buf;
 	char *header_buf;
+	int do_lock = !binder_debug_no_lock;
 
 	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
 	header_buf = buf;
 
+	if (do_lock)
+		spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads);
 	     n != NULL && buf < end;
 	     n = rb_next(n))
@@ -3302,28 +4491,44 @@ static char *print_binder_proc(char *buf, char *end,
 	     n = rb_next(n)) {
 		struct binder_node *node = rb_entry(n, struct binder_node,
 						    rb_node);
+		/*
+		 * node->proc is this proc and cannot change while its
+		 * inner_lock is held, so node->lock is not needed here.
+		 */
 		if (print_all || node->has_async_transaction)
 			buf = print_binder_node(buf, end, node);
 	}
+	if (do_lock)
+		spin_unlock(&proc->inner_lock);
 	if (print_all) {
+		if (do_lock)
+			mutex_lock(&proc->lock);
 		for (n = rb_first(&proc->refs_by_desc);
 		     n != NULL && buf < end;
 		     n = rb_next(n))
 			buf = print_binder_ref(buf, end,
 					       rb_entry(n, struct binder_ref,
 							rb_node_desc));
+		if (do_lock)
+			mutex_unlock(&proc->lock);
 	}
+	if (do_lock)
+		mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers);
 	     n != NULL && buf < end;
 	     n = rb_next(n))
 		buf = print_binder_buffer(buf, end, "  buffer",
 					  rb_entry(n, struct binder_buffer,
 						   rb_node));
+	if (do_lock)
+		mutex_unlock(&proc->alloc_lock);
+	if (do_lock)
+		spin_lock(&proc->inner_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		if (buf >= end)
 			break;
 		buf = print_binder_work(buf, end, "  ",
-					"  pending transaction", w);
+					"  pending transaction", proc, w);
 	}
 	list_for_each_entry(w, &proc->delivered_death, entry) {
 		if (buf >= end)
@@ -3332,6 +4537,8 @@ static char *print_binder_proc(char *buf, char *end,
 				"  has delivered dead binder\n");
 		break;
 	}
+	if (do_lock)
+		spin_unlock(&proc->inner_lock);
 	if (!print_all && buf == header_buf)
 		buf = start_buf;
 	return buf;
@@ -3375,7 +4582,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3396,10 +4605,11 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 			ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int count = atomic_read(&stats->bc[i]);
+
+		if (count)
 			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_command_strings[i],
-					stats->bc[i]);
+					binder_command_strings[i], count);
 		if (buf >= end)
 			return buf;
 	}
@@ -3407,9 +4617,11 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 			ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int count = atomic_read(&stats->br[i]);
+
+		if (count)
 			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_return_strings[i], stats->br[i]);
+					binder_return_strings[i], count);
 		if (buf >= end)
 			return buf;
 	}
@@ -3419,51 +4631,102 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 			ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			buf += snprintf(buf, end - buf,
 					"%s%s: active %d total %d\n", prefix,
 					binder_objstat_strings[i],
-					stats->obj_created[i] -
-						stats->obj_deleted[i],
-					stats->obj_created[i]);
+					created - deleted, created);
 		if (buf >= end)
 			return buf;
 	}
 	return buf;
 }
 
+/*
+ * Cached buffers keep their pages mapped.  Reclaim cannot take
+ * alloc_lock (or mmap_sem, which zap_page_range needs) so the caches are
+ * drained from the binder workqueue instead.
+ */
+static int binder_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+
+	if (nr_to_scan) {
+		if (!mutex_trylock(&binder_procs_lock))
+			return -1;
+		hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+			if (proc->buffer_cache_count)
+				binder_defer_work(proc, BINDER_DEFERRED_SHRINK);
+		}
+		mutex_unlock(&binder_procs_lock);
+	}
+	return atomic_read(&binder_buffer_cache_total);
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static char *print_binder_proc_stats(char *buf, char *end,
 				     struct binder_proc *proc)
 {
 	struct binder_work *w;
 	struct rb_node *n;
 	int count, strong, weak;
+	int requested_threads, requested_threads_started;
+	int max_threads, ready_threads;
+	size_t free_async_space;
+	int pages_mapped, pages_high_water, cached;
+	unsigned long cache_hits, cache_misses;
+	unsigned long alloc_latency[BINDER_ALLOC_LATENCY_BUCKETS];
+	int i;
+	int do_lock = !binder_debug_no_lock;
 
 	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
 	if (buf >= end)
 		return buf;
 	count = 0;
+	if (do_lock)
+		spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		count++;
+	requested_threads = proc->requested_threads;
+	requested_threads_started = proc->requested_threads_started;
+	max_threads = proc->max_threads;
+	ready_threads = proc->ready_threads;
+	if (do_lock)
+		spin_unlock(&proc->inner_lock);
+	free_async_space = proc->free_async_space;
 	buf += snprintf(buf, end - buf, "  threads: %d\n", count);
 	if (buf >= end)
 		return buf;
 	buf += snprintf(buf, end - buf, "  requested threads: %d+%d/%d\n"
 			"  ready threads %d\n"
-			"  free async space %zd\n", proc->requested_threads,
-			proc->requested_threads_started, proc->max_threads,
-			proc->ready_threads, proc->free_async_space);
+			"  free async space %zd\n", requested_threads,
+			requested_threads_started, max_threads,
+			ready_threads, free_async_space);
 	if (buf >= end)
 		return buf;
 	count = 0;
+	if (do_lock)
+		spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
+	if (do_lock)
+		spin_unlock(&proc->inner_lock);
 	buf += snprintf(buf, end - buf, "  nodes: %d\n", count);
 	if (buf >= end)
 		return buf;
 	count = 0;
 	strong = 0;
 	weak = 0;
+	if (do_lock)
+		mutex_lock(&proc->lock);
 	for (n = rb_first(&proc->refs_by_desc); n != NULL; n = rb_next(n)) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
@@ -3471,19 +4734,52 @@ static char *print_binder_proc_stats(char *buf, char *end,
 		strong += ref->strong;
 		weak += ref->weak;
 	}
+	if (do_lock)
+		mutex_unlock(&proc->lock);
 	buf += snprintf(buf, end - buf, "  refs: %d s %d w %d\n",
 			count, strong, weak);
 	if (buf >= end)
 		return buf;
 
 	count = 0;
+	if (do_lock)
+		mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	pages_mapped = proc->pages_mapped;
+	pages_high_water = proc->pages_high_water;
+	cached = proc->buffer_cache_count;
+	cache_hits = proc->buffer_cache_hits;
+	cache_misses = proc->buffer_cache_misses;
+	memcpy(alloc_latency, proc->alloc_latency, sizeof(alloc_latency));
+	if (do_lock)
+		mutex_unlock(&proc->alloc_lock);
 	buf += snprintf(buf, end - buf, "  buffers: %d\n", count);
+	if (buf >= end)
+		return buf;
+	buf += snprintf(buf, end - buf, "  pages: %d mapped, %d high water\n",
+			pages_mapped, pages_high_water);
+	if (buf >= end)
+		return buf;
+	buf += snprintf(buf, end - buf, "  buffer cache: %d cached, "
+			"%lu hits, %lu misses\n", cached, cache_hits,
+			cache_misses);
+	if (buf >= end)
+		return buf;
+	buf += snprintf(buf, end - buf, "  alloc latency (us):");
+	for (i = 0; i < BINDER_ALLOC_LATENCY_BUCKETS && buf < end; i++)
+		buf += snprintf(buf, end - buf, " %s%d:%lu",
+				i == BINDER_ALLOC_LATENCY_BUCKETS - 1 ?
+				">=" : "<", 1 << i, alloc_latency[i]);
+	if (buf >= end)
+		return buf;
+	buf += snprintf(buf, end - buf, "\n");
 	if (buf >= end)
 		return buf;
 
 	count = 0;
+	if (do_lock)
+		spin_lock(&proc->inner_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION:
@@ -3493,6 +4789,8 @@ static char *print_binder_proc_stats(char *buf, char *end,
 			break;
 		}
 	}
+	if (do_lock)
+		spin_unlock(&proc->inner_lock);
 	buf += snprintf(buf, end - buf, "  pending transactions: %d\n", count);
 	if (buf >= end)
 		return buf;
@@ -3509,6 +4807,7 @@ static int binder_read_proc_state(char *page, char **start, off_t off,
 	struct binder_proc *proc;
 	struct hlist_node *pos;
 	struct binder_node *node;
+	struct binder_node *last_node = NULL;
 	int len = 0;
 	char *buf = page;
 	char *end = page + PAGE_SIZE;
@@ -3517,26 +4816,41 @@ static int binder_read_proc_state(char *page, char **start, off_t off,
 	if (off)
 		return 0;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	buf += snprintf(buf, end - buf, "binder state:\n");
 
+	spin_lock(&binder_dead_nodes_lock);
 	if (!hlist_empty(&binder_dead_nodes))
 		buf += snprintf(buf, end - buf, "dead nodes:\n");
 	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node) {
 		if (buf >= end)
 			break;
+		/*
+		 * Pin the node so it stays on the list while the lock is
+		 * dropped to print it.
+		 */
+		node->tmp_refs++;
+		spin_unlock(&binder_dead_nodes_lock);
+		if (last_node)
+			binder_put_node(last_node);
+		spin_lock(&node->lock);
 		buf = print_binder_node(buf, end, node);
+		spin_unlock(&node->lock);
+		last_node = node;
+		spin_lock(&binder_dead_nodes_lock);
 	}
+	spin_unlock(&binder_dead_nodes_lock);
+	if (last_node)
+		binder_put_node(last_node);
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (buf >= end)
 			break;
 		buf = print_binder_proc(buf, end, proc, 1);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3563,20 +4877,19 @@ static int binder_read_proc_stats(char *page, char **start, off_t off,
 	if (off)
 		return 0;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
 
 	p = print_binder_stats(p, page + PAGE_SIZE, "", &binder_stats);
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (p >= page + PAGE_SIZE)
 			break;
 		p = print_binder_proc_stats(p, page + PAGE_SIZE, proc);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
 
@@ -3604,17 +4917,16 @@ static int binder_read_proc_transactions(char *page, char **start, off_t off,
 	if (off)
 		return 0;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	buf += snprintf(buf, end - buf, "binder transactions:\n");
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (buf >= end)
 			break;
 		buf = print_binder_proc(buf, end, proc, 0);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3635,17 +4947,12 @@ static int binder_read_proc_proc(char *page, char **start, off_t off,
 	struct binder_proc *proc = data;
 	int len = 0;
 	char *p = page;
-	int do_lock = !binder_debug_no_lock;
 
 	if (off)
 		return 0;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
 	p += snprintf(p, PAGE_SIZE, "binder proc state:\n");
 	p = print_binder_proc(p, page + PAGE_SIZE, proc, 1);
-	if (do_lock)
-		mutex_unlock(&binder_lock);
 
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
@@ -3679,21 +4986,24 @@ static int binder_read_proc_transaction_log(
 	struct binder_transaction_log *log = data;
 	int len = 0;
 	int i;
+	int next;
 	char *buf = page;
 	char *end = page + PAGE_SIZE;
 
 	if (off)
 		return 0;
 
+	/* entries may be overwritten while we copy them out */
+	next = atomic_read(&log->cur) % ARRAY_SIZE(log->entry);
 	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++) {
+		for (i = next; i < ARRAY_SIZE(log->entry); i++) {
 			if (buf >= end)
 				break;
 			buf = print_binder_transaction_log_entry(buf, end,
 								&log->entry[i]);
 		}
 	}
-	for (i = 0; i < log->next; i++) {
+	for (i = 0; i < next; i++) {
 		if (buf >= end)
 			break;
 		buf = print_binder_transaction_log_entry(buf, end,
@@ -3721,6 +5031,62 @@ static const struct file_operations binder_fops = {
 	.release = binder_release,
 };
 
+static void print_binder_latency_histogram(struct seq_file *m,
+					   const char *name, u32 *histogram)
+{
+	int i;
+
+	seq_printf(m, " %s", name);
+	for (i = 0; i < BINDER_NODE_LATENCY_BUCKETS; i++)
+		seq_printf(m, " %u", histogram[i]);
+}
+
+static int binder_node_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct binder_node *node;
+	struct hlist_node *pos;
+	struct rb_node *n;
+
+	seq_printf(m, "# proc node ptr cookie queue <%d log2 us buckets> "
+		   "reply <%d log2 us buckets>\n",
+		   BINDER_NODE_LATENCY_BUCKETS, BINDER_NODE_LATENCY_BUCKETS);
+	mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		spin_lock(&proc->inner_lock);
+		for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+			node = rb_entry(n, struct binder_node, rb_node);
+			/*
+			 * node->lock nests outside inner_lock, so the
+			 * counters are read without it.
+			 */
+			seq_printf(m, "%d %d u%p c%p", proc->pid,
+				   node->debug_id, node->ptr, node->cookie);
+			print_binder_latency_histogram(m, "queue",
+						       node->queue_latency);
+			print_binder_latency_histogram(m, "reply",
+						       node->reply_latency);
+			seq_putc(m, '\n');
+		}
+		spin_unlock(&proc->inner_lock);
+	}
+	mutex_unlock(&binder_procs_lock);
+	return 0;
+}
+
+static int binder_node_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, binder_node_latency_show, inode->i_private);
+}
+
+static const struct file_operations binder_node_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_node_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static struct miscdevice binder_miscdev = {
 	.minor = MISC_DYNAMIC_MINOR,
 	.name = "binder",
@@ -3767,9 +5133,20 @@ static int __init binder_init(void)
 				       binder_read_proc_transaction_log,
 				       &binder_transaction_log_failed);
 	}
+	binder_debugfs_dir_entry_root = debugfs_create_dir("binder", NULL);
+	if (!IS_ERR_OR_NULL(binder_debugfs_dir_entry_root))
+		debugfs_create_file("node_latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_node_latency_fops);
+	register_shrinker(&binder_shrinker);
 	return ret;
 }
 
 device_initcall(binder_init);
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 MODULE_LICENSE("GPL v2");
@@ -147,6 +147,37 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * Used by BC_TRANSACTION_SG and BC_REPLY_SG.  The payload is not taken
+ * from transaction_data.data.ptr.buffer but gathered from the fragments,
+ * which are copied back to back into the target buffer and must add up
+ * to transaction_data.data_size.  Offsets are relative to the gathered
+ * payload and are still read from transaction_data.data.ptr.offsets.
+ * A NULL fragment list falls back to transaction_data.data.ptr.buffer.
+ */
+enum binder_sg_fragment_flags {
+	/*
+	 * buffer and length are page aligned; the pages are pinned and
+	 * copied by the kernel instead of going through copy_from_user.
+	 */
+	BINDER_SG_FRAGMENT_PAGES = 0x01,
+};
+
+struct binder_sg_fragment {
+	const void	*buffer;
+	size_t		length;
+	unsigned long	flags;
+};
+
+struct binder_transaction_data_sg {
+	struct binder_transaction_data	transaction_data;
+	const struct binder_sg_fragment	*fragments;
+	size_t				fragment_count;
+};
+
+/* Maximum number of fragments in one scatter-gather transaction */
+#define BINDER_MAX_SG_FRAGMENTS		256
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +355,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with the payload
+	 * described by a list of fragments.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct binder_buffer;
+struct binder_node;
+struct binder_proc;
+struct binder_thread;
+struct binder_transaction;
+
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(bool reply, struct binder_transaction *t,
+		 struct binder_node *target_node),
+	TP_ARGS(reply, t, target_node),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(int, reply)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+		__field(size_t, data_size)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->target_node = target_node ? target_node->debug_id : 0;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply = reply;
+		__entry->code = t->code;
+		__entry->flags = t->flags;
+		__entry->data_size = t->buffer->data_size;
+	),
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x size=%zd",
+		  __entry->debug_id, __entry->target_node,
+		  __entry->to_proc, __entry->to_thread,
+		  __entry->reply, __entry->flags, __entry->code,
+		  __entry->data_size)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(struct binder_transaction *t, s64 queue_us),
+	TP_ARGS(t, queue_us),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(s64, queue_us)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->queue_us = queue_us;
+	),
+	TP_printk("transaction=%d queued=%lldus",
+		  __entry->debug_id, __entry->queue_us)
+);
+
+TRACE_EVENT(binder_reply,
+	TP_PROTO(struct binder_transaction *in_reply_to, s64 total_us),
+	TP_ARGS(in_reply_to, total_us),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(s64, total_us)
+	),
+	TP_fast_assign(
+		__entry->debug_id = in_reply_to->debug_id;
+		__entry->target_node = in_reply_to->target_node ?
+			in_reply_to->target_node->debug_id : 0;
+		__entry->total_us = total_us;
+	),
+	TP_printk("transaction=%d dest_node=%d total=%lldus",
+		  __entry->debug_id, __entry->target_node,
+		  __entry->total_us)
+);
+
+TRACE_EVENT(binder_wakeup,
+	TP_PROTO(struct binder_proc *proc, struct binder_thread *thread),
+	TP_ARGS(proc, thread),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, thread)
+	),
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->thread = thread ? thread->pid : 0;
+	),
+	TP_printk("proc=%d thread=%d", __entry->proc, __entry->thread)
+);
+
+TRACE_EVENT(binder_alloc_buf,
+	TP_PROTO(struct binder_proc *proc, size_t data_size,
+		 size_t offsets_size, int is_async,
+		 struct binder_buffer *buf, s64 alloc_us),
+	TP_ARGS(proc, data_size, offsets_size, is_async, buf, alloc_us),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(size_t, data_size)
+		__field(size_t, offsets_size)
+		__field(int, is_async)
+		__field(int, failed)
+		__field(s64, alloc_us)
+	),
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->data_size = data_size;
+		__entry->offsets_size = offsets_size;
+		__entry->is_async = is_async;
+		__entry->failed = buf == NULL;
+		__entry->alloc_us = alloc_us;
+	),
+	TP_printk("proc=%d size=%zd-%zd async=%d failed=%d took=%lldus",
+		  __entry->proc, __entry->data_size, __entry->offsets_size,
+		  __entry->is_async, __entry->failed, __entry->alloc_us)
+);
+
+TRACE_EVENT(binder_free_buf,
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+	TP_ARGS(proc, buf),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, debug_id)
+		__field(size_t, data_size)
+		__field(size_t, offsets_size)
+	),
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->debug_id = buf->debug_id;
+		__entry->data_size = buf->data_size;
+		__entry->offsets_size = buf->offsets_size;
+	),
+	TP_printk("proc=%d transaction=%d size=%zd-%zd",
+		  __entry->proc, __entry->debug_id, __entry->data_size,
+		  __entry->offsets_size)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
@@ -19,11 +19,15 @@
 
 #include <linux/sched.h>
 #include <linux/module.h>
+#include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/lzo.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -82,41 +86,86 @@ static struct struct_marks_ver_mark marks_ver_mark = {
 	.second_start_addr=0x40000000
 };
 
-static char klog_buf[256];
-
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * All offsets are free running and only reduced modulo the log size when the
+ * buffer is accessed, so that "a is before b" is simply (b - a) > 0.  Writers
+ * reserve space by advancing 'w_reserve' with cmpxchg and publish their entry
+ * by advancing 'w_off' in reservation order.  The mutex is only taken by a
+ * writer that has to move 'head' forward to make room, and by flush.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	wait_queue_head_t	commit_wq; /* writers waiting to publish */
+	struct mutex		mutex;	/* mutex protecting head */
+	size_t			w_off;	/* end of published entries */
+	size_t			w_reserve; /* end of reserved space */
+	size_t			head;	/* oldest entry still in the ring */
+	size_t			first;	/* oldest entry; new readers start here */
 	size_t			size;	/* size of the log */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	unsigned char		*archive; /* compressed entries */
+	size_t			archive_size;
+	struct logger_block	*blocks; /* compressed blocks, oldest first */
+	unsigned int		max_blocks;
+	unsigned int		first_block;
+	unsigned int		nr_blocks;
+	size_t			data_tail; /* end of the last block's data */
+	size_t			archived_bytes;
+	u64			comp_blocks;
+	u64			comp_orig_bytes;
+	u64			comp_bytes;
+	u64			comp_ns;
+	u64			decomp_blocks;
+	u64			decomp_ns;
+#endif
+};
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/*
+ * struct logger_block - entries between 'start' and 'start + raw_len',
+ * compressed into 'len' bytes at 'data' of the log's archive
+ */
+struct logger_block {
+	size_t			start;
+	size_t			data;
+	unsigned int		raw_len;
+	unsigned int		len;
 };
+#endif
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by reader->mutex.
+ *
+ * Readers do not lock the log. A reader that was lapped by the writers
+ * notices because its r_off is behind log->head, and restarts from head.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
+	struct mutex		mutex;	/* serializes reads on this file */
 	size_t			r_off;	/* current read head offset */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	unsigned char		*block_buf; /* last block decompressed */
+	size_t			block_start;
+	size_t			block_len;
+#endif
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* logger_before - is offset 'a' before offset 'b'? */
+#define logger_before(a, b)	((ssize_t)((b) - (a)) > 0)
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -140,38 +189,447 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
+/*
+ * do_read_log - copies 'count' bytes at offset 'off' of 'log' into 'buf'
+ */
+static void do_read_log(struct logger_log *log, size_t off, void *buf,
+			size_t count)
+{
+	size_t len;
+
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * The caller must make sure the entry is published and not yet overwritten,
+ * or check afterwards with logger_lapped() that it was.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
 	__u16 val;
 
-	switch (log->size - off) {
-	case 1:
-		memcpy(&val, log->buffer + off, 1);
-		memcpy(((char *) &val) + 1, log->buffer, 1);
-		break;
-	default:
-		memcpy(&val, log->buffer + off, 2);
-	}
+	do_read_log(log, off, &val, sizeof(val));
 
 	return sizeof(struct logger_entry) + val;
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * logger_lapped - has the entry at 'off' been dropped, and thus possibly
+ * overwritten, by the writers?
+ */
+static inline int logger_lapped(struct logger_log *log, size_t off)
+{
+	smp_rmb();
+	return logger_before(off, ACCESS_ONCE(log->head));
+}
+
+/*
+ * fix_up_reader - pull a reader that was lapped by the writers forward to
+ * the oldest entry still in the log.
+ *
+ * Caller must hold reader->mutex.
+ */
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	size_t first = ACCESS_ONCE(log->first);
+
+	if (logger_before(reader->r_off, first))
+		reader->r_off = first;
+}
+
+/* compressed history is kept in blocks of about this many raw bytes */
+#define LOGGER_BLOCK_SIZE	(8 * 1024)
+#define LOGGER_BLOCK_MAX	(LOGGER_BLOCK_SIZE + LOGGER_ENTRY_MAX_LEN)
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/*
+ * Compressed history
+ *
+ * In compressed mode only the first quarter of a log's buffer is used as
+ * the ring that writers append to. Entries dropped from the ring are
+ * compressed with LZO, about LOGGER_BLOCK_SIZE bytes of whole entries at a
+ * time, into the rest of the buffer. Readers that are behind head read from
+ * there, one decompressed block at a time, so they see one continuous log.
+ *
+ * Block data is addressed with free running offsets like the ring. A block
+ * is never split at the end of the archive; the space is skipped instead.
+ * Everything here is protected by log->mutex.
+ */
+
+static int logger_compress = 1;
+module_param_named(compress, logger_compress, bool, S_IRUGO);
+
+/* shared by all logs, protected by logger_compress_mutex */
+static DEFINE_MUTEX(logger_compress_mutex);
+static void *logger_compress_workmem;
+static unsigned char *logger_compress_src;
+static unsigned char *logger_compress_dst;
+
+static inline int logger_compressed(struct logger_log *log)
+{
+	return log->archive != NULL;
+}
+
+/* The configured size of the log: the ring and the archive together */
+static inline size_t logger_buffer_size(struct logger_log *log)
+{
+	return log->size + log->archive_size;
+}
+
+static struct logger_block *logger_block(struct logger_log *log,
+					 unsigned int i)
+{
+	return &log->blocks[(log->first_block + i) % log->max_blocks];
+}
+
+/*
+ * logger_drop_block - drops the oldest compressed block
+ *
+ * Caller must hold log->mutex.
+ */
+static void logger_drop_block(struct logger_log *log)
+{
+	struct logger_block *block = logger_block(log, 0);
+
+	log->first = block->start + block->raw_len;
+	log->archived_bytes -= block->len;
+	log->first_block = (log->first_block + 1) % log->max_blocks;
+	log->nr_blocks--;
+}
+
+/*
+ * logger_archive - compresses the entries between 'start' and 'end', which
+ * are about to be dropped from the ring, into a new block.
  *
  * Caller must hold log->mutex.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void logger_archive(struct logger_log *log, size_t start, size_t end)
+{
+	struct logger_block *block;
+	size_t raw_len = end - start;
+	size_t len, data;
+	ktime_t t0;
+
+	mutex_lock(&logger_compress_mutex);
+	t0 = ktime_get();
+	do_read_log(log, start, logger_compress_src, raw_len);
+	if (lzo1x_1_compress(logger_compress_src, raw_len,
+			     logger_compress_dst, &len,
+			     logger_compress_workmem) != LZO_E_OK ||
+	    len > log->archive_size) {
+		/* cannot happen, but losing history beats corrupting it */
+		mutex_unlock(&logger_compress_mutex);
+		while (log->nr_blocks)
+			logger_drop_block(log);
+		log->first = end;
+		return;
+	}
+
+	/* blocks are not split at the end of the archive */
+	data = log->data_tail;
+	if (data % log->archive_size + len > log->archive_size)
+		data += log->archive_size - data % log->archive_size;
+
+	while (log->nr_blocks &&
+	       (log->nr_blocks == log->max_blocks ||
+		data + len - logger_block(log, 0)->data > log->archive_size))
+		logger_drop_block(log);
+	if (!log->nr_blocks)
+		log->first = start;
+
+	memcpy(log->archive + data % log->archive_size, logger_compress_dst,
+	       len);
+	log->comp_ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+	mutex_unlock(&logger_compress_mutex);
+
+	block = logger_block(log, log->nr_blocks);
+	block->start = start;
+	block->raw_len = raw_len;
+	block->data = data;
+	block->len = len;
+	log->nr_blocks++;
+	log->data_tail = data + len;
+	log->archived_bytes += len;
+
+	log->comp_blocks++;
+	log->comp_orig_bytes += raw_len;
+	log->comp_bytes += len;
+}
+
+/*
+ * logger_load_block - makes sure the reader's decompressed block holds the
+ * entry at its read offset. Returns 1 if it does, 0 if that entry is no
+ * longer compressed history, or a negative error code.
+ */
+static int logger_load_block(struct logger_log *log,
+			     struct logger_reader *reader)
+{
+	struct logger_block *block = NULL;
+	size_t len = LOGGER_BLOCK_MAX;
+	unsigned int i;
+	ktime_t t0;
+	int ret;
+
+	if (reader->block_buf &&
+	    !logger_before(reader->r_off, reader->block_start) &&
+	    logger_before(reader->r_off,
+			  reader->block_start + reader->block_len))
+		return 1;
+
+	if (!reader->block_buf) {
+		reader->block_buf = kmalloc(LOGGER_BLOCK_MAX, GFP_KERNEL);
+		if (!reader->block_buf)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&log->mutex);
+	fix_up_reader(log, reader);
+	ret = 0;
+	if (!logger_before(reader->r_off, log->head))
+		goto out;
+
+	for (i = 0; i < log->nr_blocks; i++) {
+		block = logger_block(log, i);
+		if (logger_before(reader->r_off, block->start + block->raw_len))
+			break;
+	}
+	BUG_ON(i == log->nr_blocks);
+
+	t0 = ktime_get();
+	ret = lzo1x_decompress_safe(log->archive +
+				    block->data % log->archive_size,
+				    block->len, reader->block_buf, &len);
+	if (ret != LZO_E_OK || len != block->raw_len) {
+		printk(KERN_ERR "logger: bad compressed block in '%s'\n",
+		       log->misc.name);
+		reader->block_len = 0;
+		ret = -EIO;
+		goto out;
+	}
+	log->decomp_ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+	log->decomp_blocks++;
+
+	reader->block_start = block->start;
+	reader->block_len = block->raw_len;
+	ret = 1;
+out:
+	mutex_unlock(&log->mutex);
+	return ret;
+}
+
+/*
+ * logger_read_archived - like logger_read_entry, for an entry that was
+ * dropped from the ring. Returns 0 if it no longer is compressed history.
+ */
+static ssize_t logger_read_archived(struct logger_log *log,
+				    struct logger_reader *reader,
+				    char __user *buf, size_t count)
+{
+	struct logger_entry *entry;
+	size_t len;
+	int ret;
+
+	ret = logger_load_block(log, reader);
+	if (ret <= 0)
+		return ret;
+
+	entry = (void *)reader->block_buf + (reader->r_off -
+					     reader->block_start);
+	len = sizeof(struct logger_entry) + entry->len;
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, entry, len))
+		return -EFAULT;
+
+	reader->r_off += len;
+
+	return len;
+}
+
+static ssize_t logger_archived_entry_len(struct logger_log *log,
+					 struct logger_reader *reader)
+{
+	struct logger_entry *entry;
+	int ret;
+
+	ret = logger_load_block(log, reader);
+	if (ret <= 0)
+		return ret;
+
+	entry = (void *)reader->block_buf + (reader->r_off -
+					     reader->block_start);
+
+	return sizeof(struct logger_entry) + entry->len;
+}
+
+static inline struct logger_log *dev_to_log(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct logger_log, misc);
+}
+
+#define LOGGER_COMPRESS_ATTR(_name, _expr)				\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct logger_log *log = dev_to_log(dev);			\
+	u64 val;							\
+									\
+	mutex_lock(&log->mutex);					\
+	val = (_expr);							\
+	mutex_unlock(&log->mutex);					\
+	return sprintf(buf, "%llu\n", (unsigned long long)val);		\
+}									\
+static DEVICE_ATTR(_name, S_IRUGO, _name##_show, NULL)
+
+LOGGER_COMPRESS_ATTR(compr_blocks, log->comp_blocks);
+LOGGER_COMPRESS_ATTR(compr_orig_bytes, log->comp_orig_bytes);
+LOGGER_COMPRESS_ATTR(compr_bytes, log->comp_bytes);
+/* compressed size in percent of the original */
+LOGGER_COMPRESS_ATTR(compr_ratio, log->comp_orig_bytes ?
+	div64_u64(log->comp_bytes * 100, log->comp_orig_bytes) : 0);
+LOGGER_COMPRESS_ATTR(compr_ns_per_block, log->comp_blocks ?
+	div64_u64(log->comp_ns, log->comp_blocks) : 0);
+LOGGER_COMPRESS_ATTR(decompr_blocks, log->decomp_blocks);
+LOGGER_COMPRESS_ATTR(decompr_ns_per_block, log->decomp_blocks ?
+	div64_u64(log->decomp_ns, log->decomp_blocks) : 0);
+/* history currently kept: uncompressed size, and what it takes in RAM */
+LOGGER_COMPRESS_ATTR(history_bytes, ACCESS_ONCE(log->w_off) - log->first);
+LOGGER_COMPRESS_ATTR(archived_bytes, log->archived_bytes);
+
+static struct attribute *logger_compress_attrs[] = {
+	&dev_attr_compr_blocks.attr,
+	&dev_attr_compr_orig_bytes.attr,
+	&dev_attr_compr_bytes.attr,
+	&dev_attr_compr_ratio.attr,
+	&dev_attr_compr_ns_per_block.attr,
+	&dev_attr_decompr_blocks.attr,
+	&dev_attr_decompr_ns_per_block.attr,
+	&dev_attr_history_bytes.attr,
+	&dev_attr_archived_bytes.attr,
+	NULL,
+};
+
+static struct attribute_group logger_compress_attr_group = {
+	.attrs = logger_compress_attrs,
+};
+
+/*
+ * logger_compress_alloc - allocates the LZO work memory and the block
+ * buffers shared by all logs; compression is turned off without them
+ */
+static int __init logger_compress_alloc(void)
+{
+	if (!logger_compress)
+		return 0;
+
+	logger_compress_workmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	logger_compress_src = kmalloc(LOGGER_BLOCK_MAX, GFP_KERNEL);
+	logger_compress_dst = kmalloc(lzo1x_worst_compress(LOGGER_BLOCK_MAX),
+				      GFP_KERNEL);
+	if (!logger_compress_workmem || !logger_compress_src ||
+	    !logger_compress_dst) {
+		printk(KERN_ERR "logger: no memory for compression\n");
+		vfree(logger_compress_workmem);
+		kfree(logger_compress_src);
+		kfree(logger_compress_dst);
+		logger_compress = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * logger_compress_init - switches 'log' to compressed mode, keeping a
+ * quarter of its buffer as the ring. The ring must leave room for a whole
+ * block to be dropped while writers are busy in the rest of it.
+ */
+static int __init logger_compress_init(struct logger_log *log)
+{
+	size_t ring = log->size / 4;
+
+	if (!logger_compress || ring <= LOGGER_BLOCK_MAX + LOGGER_ENTRY_MAX_LEN)
+		return 0;
+
+	log->archive_size = log->size - ring;
+	log->max_blocks = log->archive_size / 512;
+	log->blocks = kcalloc(log->max_blocks, sizeof(struct logger_block),
+			      GFP_KERNEL);
+	if (!log->blocks) {
+		printk(KERN_ERR "logger: no memory for compressing '%s'\n",
+		       log->misc.name);
+		return 0;
+	}
+	log->archive = log->buffer + ring;
+	log->size = ring;
+
+	return sysfs_create_group(&log->misc.this_device->kobj,
+				  &logger_compress_attr_group);
+}
+
+static void logger_compress_flush(struct logger_log *log)
+{
+	log->nr_blocks = 0;
+	log->archived_bytes = 0;
+}
+#else
+static inline int logger_compressed(struct logger_log *log)
+{
+	return 0;
+}
+
+static inline size_t logger_buffer_size(struct logger_log *log)
+{
+	return log->size;
+}
+
+static inline void logger_archive(struct logger_log *log, size_t start,
+				  size_t end)
+{
+}
+
+static inline ssize_t logger_read_archived(struct logger_log *log,
+					   struct logger_reader *reader,
+					   char __user *buf, size_t count)
+{
+	return 0;
+}
+
+static inline ssize_t logger_archived_entry_len(struct logger_log *log,
+						struct logger_reader *reader)
+{
+	return 0;
+}
+
+static inline int logger_compress_alloc(void)
+{
+	return 0;
+}
+
+static inline int logger_compress_init(struct logger_log *log)
+{
+	return 0;
+}
+
+static inline void logger_compress_flush(struct logger_log *log)
+{
+}
+#endif /* CONFIG_ANDROID_LOGGER_COMPRESS */
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes from offset 'off' of
+ * 'log' into the user-space buffer 'buf'. Returns 'count' on success.
+ */
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
+				   char __user *buf, size_t count)
 {
 	size_t len;
 
@@ -180,8 +638,9 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -192,39 +651,70 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
 /*
- * logger_read - our log's read() method
- *
- * Behavior:
+ * logger_read_entry - copies the reader's next entry to 'buf'. Returns the
+ * size of the entry, 0 if there is nothing to read or -EINVAL if 'count' is
+ * too small for the entry.
  *
- * 	- O_NONBLOCK works
- * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
- *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Caller must hold reader->mutex.
  */
-static ssize_t logger_read(struct file *file, char __user *buf,
-			   size_t count, loff_t *pos)
+static ssize_t logger_read_entry(struct logger_log *log,
+				 struct logger_reader *reader,
+				 char __user *buf, size_t count)
 {
-	struct logger_reader *reader = file->private_data;
-	struct logger_log *log = reader->log;
 	ssize_t ret;
+	__u32 len;
+
+	for (;;) {
+		fix_up_reader(log, reader);
+		if (reader->r_off == ACCESS_ONCE(log->w_off))
+			return 0;
+		if (logger_lapped(log, reader->r_off)) {
+			/* the entry is only left in compressed history */
+			ret = logger_read_archived(log, reader, buf, count);
+			if (ret)
+				return ret;
+			continue;
+		}
+		/* read the entry only after seeing it published */
+		smp_rmb();
+
+		len = get_entry_len(log, reader->r_off);
+		if (logger_lapped(log, reader->r_off))
+			continue;
+		if (count < len)
+			return -EINVAL;
+
+		ret = do_read_log_to_user(log, reader->r_off, buf, len);
+		if (ret < 0)
+			return ret;
+		/* a writer may have reused the space while we copied it */
+		if (!logger_lapped(log, reader->r_off))
+			break;
+	}
+
+	reader->r_off += len;
+
+	return len;
+}
+
+/*
+ * logger_wait_readable - waits until the log has something for 'reader'.
+ * Returns 0 when it does, or a negative error code.
+ */
+static int logger_wait_readable(struct file *file, struct logger_log *log,
+				struct logger_reader *reader)
+{
 	DEFINE_WAIT(wait);
+	int ret = 0;
 
-start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
-		if (!ret)
+		if (ACCESS_ONCE(log->w_off) != ACCESS_ONCE(reader->r_off))
 			break;
 
 		if (file->f_flags & O_NONBLOCK) {
@@ -241,149 +731,223 @@ start:
 	}
 
 	finish_wait(&log->wq, &wait);
-	if (ret)
-		return ret;
-
-	mutex_lock(&log->mutex);
-
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
-
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
-
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
-
-out:
-	mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_read - our log's read() method
  *
- * Caller must hold log->mutex.
+ * Behavior:
+ *
+ * 	- O_NONBLOCK works
+ * 	- If there are no log entries to read, blocks until log is written to
+ * 	- Atomically reads exactly one log entry
+ *
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
+ * buffer is insufficient to hold next entry.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static ssize_t logger_read(struct file *file, char __user *buf,
+			   size_t count, loff_t *pos)
 {
-	size_t count = 0;
+	struct logger_reader *reader = file->private_data;
+	struct logger_log *log = reader->log;
+	ssize_t ret;
 
 	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+		ret = logger_wait_readable(file, log, reader);
+		if (ret)
+			return ret;
+
+		mutex_lock(&reader->mutex);
+		/* zero if another read on this file raced with us */
+		ret = logger_read_entry(log, reader, buf, count);
+		mutex_unlock(&reader->mutex);
+	} while (!ret);
 
-	return off;
+	return ret;
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * logger_read_batch - reads as many whole entries as fit in the buffer
+ * described by 'arg', blocking like read() until there is at least one.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static long logger_read_batch(struct file *file, struct logger_log *log,
+			      struct logger_batch __user *arg)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+	struct logger_reader *reader = file->private_data;
+	struct logger_batch batch;
+	size_t done = 0;
+	ssize_t ret;
 
-	return 0;
-}
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
 
-/*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
- */
-static void fix_up_readers(struct logger_log *log, size_t len)
-{
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	batch.count = 0;
+	do {
+		ret = logger_wait_readable(file, log, reader);
+		if (ret)
+			return ret;
+
+		mutex_lock(&reader->mutex);
+		while (done < batch.size) {
+			ret = logger_read_entry(log, reader,
+						(char __user *)batch.buf + done,
+						batch.size - done);
+			if (ret <= 0)
+				break;
+			done += ret;
+			batch.count++;
+		}
+		mutex_unlock(&reader->mutex);
+
+		/* the first entry not fitting is an error, as for read() */
+		if (ret < 0 && (!done || ret != -EINVAL))
+			return ret;
+	} while (!done);
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (put_user(batch.count, &arg->count))
+		return -EFAULT;
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	return done;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' at offset 'off' of 'log'
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off, const void *buf,
+			 size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * at offset 'off' of the log 'log'
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-#if 1
-/* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-	memset(klog_buf,0,255);
+	return count;
+}
+
+/*
+ * do_clear_log - zeroes 'count' bytes at offset 'off' of 'log'
+ */
+static void do_clear_log(struct logger_log *log, size_t off, size_t count)
+{
+	size_t len;
+
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
+
+	if (count != len)
+		memset(log->buffer, 0, count - len);
+}
+
+/*
+ * logger_reserve_slow - reserves 'len' bytes when the oldest entries have to
+ * be dropped first to make room. Dropping them is just moving head past
+ * them; readers still pointing there notice on their next read.
+ */
+static size_t logger_reserve_slow(struct logger_log *log, size_t len)
+{
+	size_t pos, need, head;
 
-	if(strncmp(log->buffer  + log->w_off,  "!@", 2) == 0) {
-		if (count < 255)
-			memcpy(klog_buf,log->buffer  + log->w_off, count);			
+	mutex_lock(&log->mutex);
+	for (;;) {
+		pos = ACCESS_ONCE(log->w_reserve);
+		if (pos + len - log->head <= log->size) {
+			if (cmpxchg(&log->w_reserve, pos, pos + len) == pos)
+				break;
+			continue;
+		}
+
+		/* head has to move to at least 'need' */
+		need = pos + len - log->size;
+		/* compress a whole block at once rather than entry by entry */
+		if (logger_compressed(log) &&
+		    logger_before(need, log->head + LOGGER_BLOCK_SIZE))
+			need = log->head + LOGGER_BLOCK_SIZE;
+
+		/* entries can only be skipped once their length is known */
+		wait_event(log->commit_wq,
+			   !logger_before(ACCESS_ONCE(log->w_off), need));
+		smp_rmb();
+
+		head = log->head;
+		while (logger_before(head, need))
+			head += get_entry_len(log, head);
+
+		if (logger_compressed(log))
+			logger_archive(log, log->head, head);
 		else
-			memcpy(klog_buf,log->buffer  + log->w_off, 255);			
+			log->first = head;
+		log->head = head;
+		/* publish the new head before anyone reuses the space */
+		smp_mb();
+	}
+	mutex_unlock(&log->mutex);
 
-		klog_buf[255]=0;
+	return pos;
 }
-/* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-#endif	
 
-	log->w_off = logger_offset(log->w_off + count);
+/*
+ * logger_reserve - reserves 'len' bytes for a new entry and returns the
+ * offset to write it at. The entry must be published with logger_commit().
+ */
+static size_t logger_reserve(struct logger_log *log, size_t len)
+{
+	size_t pos;
 
-	return count;
+	do {
+		pos = ACCESS_ONCE(log->w_reserve);
+		if (unlikely(pos + len - ACCESS_ONCE(log->head) > log->size))
+			return logger_reserve_slow(log, len);
+	} while (cmpxchg(&log->w_reserve, pos, pos + len) != pos);
+	/* order the head check before writing into the space */
+	smp_mb();
+
+	return pos;
+}
+
+/*
+ * logger_commit - publishes the 'len' byte entry at 'pos' to readers, once
+ * every entry reserved before it has been published.
+ */
+static void logger_commit(struct logger_log *log, size_t pos, size_t len)
+{
+	if (ACCESS_ONCE(log->w_off) != pos)
+		wait_event(log->commit_wq, ACCESS_ONCE(log->w_off) == pos);
+
+	/* the entry must be complete before readers can see it */
+	smp_wmb();
+	log->w_off = pos + len;
+	smp_mb();
+
+	if (waitqueue_active(&log->commit_wq))
+		wake_up_all(&log->commit_wq);
 }
 
 /*
@@ -395,9 +959,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	char klog_buf[256];
+	size_t pos, off;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -412,17 +977,12 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	klog_buf[0] = 0;
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	pos = logger_reserve(log, sizeof(struct logger_entry) + header.len);
+	off = pos + sizeof(struct logger_entry);
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	do_write_log(log, pos, &header, sizeof(struct logger_entry));
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -432,31 +992,46 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/*
+			 * Later writers may already have reserved the space
+			 * after ours, so the entry cannot be taken back.
+			 * Publish it with the rest of the payload zeroed.
+			 */
+			do_clear_log(log, off, header.len - ret);
+			ret = nr;
+			break;
 		}
 
+#if 1
+/* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
+		if (nr >= 2 && log->buffer[logger_offset(off)] == '!' &&
+		    log->buffer[logger_offset(off + 1)] == '@') {
+			len = min_t(size_t, nr, sizeof(klog_buf) - 1);
+			do_read_log(log, off, klog_buf, len);
+			klog_buf[len] = 0;
+		}
+/* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
+#endif
+
 		iov++;
+		off += nr;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
+	logger_commit(log, pos, sizeof(struct logger_entry) + header.len);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
 #if 1
 /* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-    if(strncmp(klog_buf, "!@", 2) == 0)
-	{
-		printk("%s\n",klog_buf);
-	}		
+	if (klog_buf[0])
+		printk("%s\n", klog_buf);
 /* [LINUSYS] added by khoonk for calculating boot-time  on 20070508  */
-#endif	
-	
+#endif
+
 	return ret;
 }
 
@@ -488,12 +1063,12 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_off = ACCESS_ONCE(log->first);
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		reader->block_buf = NULL;
+		reader->block_len = 0;
+#endif
 
 		file->private_data = reader;
 	} else
@@ -511,7 +1086,9 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		kfree(reader->block_buf);
+#endif
 		kfree(reader);
 	}
 
@@ -541,10 +1118,8 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (ACCESS_ONCE(log->w_off) != ACCESS_ONCE(reader->r_off))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
 
 	return ret;
 }
@@ -555,11 +1130,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
-
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
-		ret = log->size;
+		ret = logger_buffer_size(log);
 		break;
 	case LOGGER_GET_LOG_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -567,10 +1140,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		fix_up_reader(log, reader);
+		ret = ACCESS_ONCE(log->w_off) - reader->r_off;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -578,25 +1151,47 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
+		mutex_lock(&reader->mutex);
+		for (;;) {
+			fix_up_reader(log, reader);
 			ret = 0;
+			if (ACCESS_ONCE(log->w_off) == reader->r_off)
+				break;
+			if (logger_lapped(log, reader->r_off)) {
+				ret = logger_archived_entry_len(log, reader);
+				if (ret)
+					break;
+				continue;
+			}
+			smp_rmb();
+			ret = get_entry_len(log, reader->r_off);
+			if (!logger_lapped(log, reader->r_off))
+				break;
+		}
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* readers catch up with the new head on their next read */
+		mutex_lock(&log->mutex);
+		logger_compress_flush(log);
+		log->head = ACCESS_ONCE(log->w_off);
+		log->first = log->head;
+		mutex_unlock(&log->mutex);
 		ret = 0;
 		break;
+	case LOGGER_READ_BATCH:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		ret = logger_read_batch(file, log, (void __user *)arg);
+		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
@@ -627,10 +1222,12 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
 	.w_off = 0, \
+	.w_reserve = 0, \
 	.head = 0, \
+	.first = 0, \
 	.size = SIZE, \
 };
 
@@ -663,8 +1260,14 @@ static int __init init_log(struct logger_log *log)
 		return ret;
 	}
 
-	printk(KERN_INFO "logger: created %luK log '%s'\n",
-	       (unsigned long) log->size >> 10, log->misc.name);
+	ret = logger_compress_init(log);
+	if (unlikely(ret))
+		printk(KERN_ERR "logger: failed to create compression "
+		       "counters for log '%s'\n", log->misc.name);
+
+	printk(KERN_INFO "logger: created %luK log '%s'%s\n",
+	       (unsigned long) log->size >> 10, log->misc.name,
+	       logger_compressed(log) ? " with compressed history" : "");
 
 	return 0;
 }
@@ -683,6 +1286,10 @@ static int __init logger_init(void)
 
 	marks_ver_mark.log_mark_version = 1; 
 	
+	ret = logger_compress_alloc();
+	if (unlikely(ret))
+		goto out;
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
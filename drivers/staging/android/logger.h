@@ -45,5 +45,17 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_READ_BATCH		_IOWR(__LOGGERIO, 5, struct logger_batch)
+
+/*
+ * LOGGER_READ_BATCH reads as many whole entries as fit in 'buf', blocking
+ * like read() until there is at least one, and returns the number of bytes
+ * read. 'count' is set to the number of entries.
+ */
+struct logger_batch {
+	void		*buf;	/* buffer for the entries */
+	__u32		size;	/* size of buf in bytes */
+	__u32		count;	/* number of entries read */
+};
 
 #endif /* _LINUX_LOGGER_H */
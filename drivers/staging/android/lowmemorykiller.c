@@ -16,6 +16,25 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * With /sys/module/lowmemorykiller/parameters/pressure_mode set, the kill
+ * level comes from reclaim efficiency instead of minfree: the share of pages
+ * scanned by vmscan over the last second that could not be reclaimed, in
+ * percent. /sys/module/lowmemorykiller/parameters/pressure takes the matching
+ * thresholds for adj, in descending order. For example "95,90,80,60" with
+ * the adj values above kills processes with oom_adj 12 or higher once 60% of
+ * the scanned pages stay in memory, and down to oom_adj 0 above 95%.
+ *
+ * The pressure is tracked in both modes and shown, with the kills made and
+ * how long reclaim had been running before each one, in
+ * /sys/kernel/mm/lowmemorykiller/pressure. The file can be polled for
+ * POLLPRI; it changes whenever the pressure level changes or a process is
+ * killed.
+ *
+ * Processes are kept on one list per oom_adj value, so picking a victim only
+ * looks at the highest non-empty lists instead of walking every process.
+ * scan_count and scan_ns in /sys/module/lowmemorykiller/parameters count the
+ * victim searches and the total time they took; write 0 to reset them.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +54,12 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/swap.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -51,10 +76,63 @@ static size_t lowmem_minfree[6] = {
 	16 * 1024,	/* 64MB */
 };
 static int lowmem_minfree_size = 4;
+static int lowmem_pressure_mode;
+static int lowmem_pressure[6] = {
+	95,
+	90,
+	80,
+	60,
+};
+static int lowmem_pressure_size = 4;
 
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Thread group leaders by oom_adj, OOM_DISABLE first. The oom_adj notifier
+ * files a process when it is forked, refiles it when its oom_adj is written
+ * or another thread takes over as leader in exec, and drops a task when it
+ * is released. A task on a bucket is therefore never a released one.
+ */
+#define LOWMEM_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_bucket_lock);
+
+/* Both under lowmem_bucket_lock, so the 64 bit sum is never torn */
+static unsigned int lowmem_scan_count;
+static u64 lowmem_scan_ns;
+
+/*
+ * Reclaim efficiency over a sliding window of LOWMEM_PRESSURE_SLOTS time
+ * slots, fed by the reclaim notifier after every vmscan pass. Too little
+ * scanning in the window to tell counts as no pressure.
+ */
+#define LOWMEM_PRESSURE_SLOTS		8
+#define LOWMEM_PRESSURE_SLOT		(HZ / LOWMEM_PRESSURE_SLOTS ?: 1)
+#define LOWMEM_PRESSURE_MIN_SCAN	(SWAP_CLUSTER_MAX * 8)
+
+static struct lowmem_pressure_state {
+	unsigned long scanned[LOWMEM_PRESSURE_SLOTS];
+	unsigned long reclaimed[LOWMEM_PRESSURE_SLOTS];
+	int slot;
+	unsigned long slot_start;	/* jiffies */
+	int reclaiming;			/* any scanning in the window */
+	unsigned long reclaim_start;	/* jiffies, when reclaiming */
+	int pressure;			/* percent of scanned not reclaimed */
+	int level;			/* 0 or adj table entries reached */
+	int min_adj;
+	unsigned int kills;
+	pid_t kill_pid;
+	char kill_comm[TASK_COMM_LEN];
+	int kill_adj;
+	int kill_pages;
+	unsigned int kill_reclaim_ms;
+} lowmem_ps = {
+	.min_adj = OOM_ADJUST_MAX + 1,
+};
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static struct kobject *lowmem_kobj;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -68,6 +146,19 @@ static struct notifier_block task_nb = {
 	.notifier_call	= task_notify_func,
 };
 
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data);
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+static inline struct list_head *lowmem_bucket(int oom_adj)
+{
+	oom_adj = clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX);
+	return &lowmem_buckets[oom_adj - OOM_DISABLE];
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
@@ -77,6 +168,170 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+	unsigned long flags;
+
+	spin_lock(&lowmem_bucket_lock);
+	if (val == OOM_ADJ_RELEASE) {
+		list_del_init(&task->lowmem_node);
+	} else if (lock_task_sighand(task, &flags)) {
+		/*
+		 * The leader is released after task, and that has to wait
+		 * for lowmem_bucket_lock in oom_adj_release().
+		 */
+		list_move_tail(&task->group_leader->lowmem_node,
+			       lowmem_bucket(task->signal->oom_adj));
+		unlock_task_sighand(task, &flags);
+	}
+	spin_unlock(&lowmem_bucket_lock);
+	return NOTIFY_OK;
+}
+
+static int lowmem_table_size(int size)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (size < array_size)
+		array_size = size;
+	return array_size;
+}
+
+/*
+ * Drops slots that left the window and recomputes the pressure level.
+ * Called with lowmem_pressure_lock held, returns true if the level changed.
+ */
+static bool lowmem_pressure_update(void)
+{
+	struct lowmem_pressure_state *ps = &lowmem_ps;
+	unsigned long scanned = 0, reclaimed = 0;
+	unsigned long n = (jiffies - ps->slot_start) / LOWMEM_PRESSURE_SLOT;
+	int array_size = lowmem_table_size(lowmem_pressure_size);
+	int old_level = ps->level;
+	int i;
+
+	if (n) {
+		ps->slot_start += n * LOWMEM_PRESSURE_SLOT;
+		for (n = min(n, (unsigned long)LOWMEM_PRESSURE_SLOTS); n; n--) {
+			ps->slot = (ps->slot + 1) % LOWMEM_PRESSURE_SLOTS;
+			ps->scanned[ps->slot] = 0;
+			ps->reclaimed[ps->slot] = 0;
+		}
+	}
+	for (i = 0; i < LOWMEM_PRESSURE_SLOTS; i++) {
+		scanned += ps->scanned[i];
+		reclaimed += ps->reclaimed[i];
+	}
+	if (!scanned)
+		ps->reclaiming = 0;
+
+	ps->pressure = 0;
+	if (scanned >= LOWMEM_PRESSURE_MIN_SCAN) {
+		reclaimed = min(reclaimed, scanned);
+		ps->pressure = (scanned - reclaimed) * 100 / scanned;
+	}
+	ps->level = 0;
+	ps->min_adj = OOM_ADJUST_MAX + 1;
+	for (i = 0; i < array_size; i++) {
+		if (ps->pressure >= lowmem_pressure[i]) {
+			ps->level = array_size - i;
+			ps->min_adj = lowmem_adj[i];
+			break;
+		}
+	}
+	return ps->level != old_level;
+}
+
+static void lowmem_notify_fn(struct work_struct *work)
+{
+	if (lowmem_kobj)
+		sysfs_notify(lowmem_kobj, NULL, "pressure");
+}
+static DECLARE_WORK(lowmem_notify_work, lowmem_notify_fn);
+
+/* keeps the window moving while nothing reclaims */
+static void lowmem_decay_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_decay_work, lowmem_decay_fn);
+
+static void lowmem_decay_fn(struct work_struct *work)
+{
+	bool changed;
+	int reclaiming;
+
+	spin_lock(&lowmem_pressure_lock);
+	changed = lowmem_pressure_update();
+	reclaiming = lowmem_ps.reclaiming;
+	spin_unlock(&lowmem_pressure_lock);
+	if (changed)
+		lowmem_notify_fn(NULL);
+	if (reclaiming)
+		schedule_delayed_work(&lowmem_decay_work, LOWMEM_PRESSURE_SLOT);
+}
+
+/* sysfs_notify() may sleep and allocate, so it is never called from here */
+static int
+lowmem_reclaim_notify(struct notifier_block *self, unsigned long val,
+		      void *data)
+{
+	struct reclaim_progress *progress = data;
+	struct lowmem_pressure_state *ps = &lowmem_ps;
+	bool changed;
+
+	spin_lock(&lowmem_pressure_lock);
+	changed = lowmem_pressure_update();
+	if (!ps->reclaiming) {
+		ps->reclaiming = 1;
+		ps->reclaim_start = jiffies;
+	}
+	ps->scanned[ps->slot] += progress->nr_scanned;
+	ps->reclaimed[ps->slot] += progress->nr_reclaimed;
+	changed |= lowmem_pressure_update();
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (changed)
+		schedule_work(&lowmem_notify_work);
+	schedule_delayed_work(&lowmem_decay_work, LOWMEM_PRESSURE_SLOT);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_reclaim_nb = {
+	.notifier_call	= lowmem_reclaim_notify,
+};
+
+static int lowmem_pressure_min_adj(void)
+{
+	bool changed;
+	int min_adj;
+
+	spin_lock(&lowmem_pressure_lock);
+	changed = lowmem_pressure_update();
+	min_adj = lowmem_ps.min_adj;
+	spin_unlock(&lowmem_pressure_lock);
+	if (changed)
+		schedule_work(&lowmem_notify_work);
+	return min_adj;
+}
+
+static void lowmem_record_kill(struct task_struct *p, int oom_adj, int pages)
+{
+	struct lowmem_pressure_state *ps = &lowmem_ps;
+
+	spin_lock(&lowmem_pressure_lock);
+	ps->kills++;
+	ps->kill_pid = p->pid;
+	memcpy(ps->kill_comm, p->comm, sizeof(ps->kill_comm));
+	ps->kill_adj = oom_adj;
+	ps->kill_pages = pages;
+	ps->kill_reclaim_ms = ps->reclaiming ?
+		jiffies_to_msecs(jiffies - ps->reclaim_start) : 0;
+	spin_unlock(&lowmem_pressure_lock);
+	schedule_work(&lowmem_notify_work);
+}
+
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
@@ -87,8 +342,9 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int target_free = 0;
 	int selected_tasksize = 0;
-	int selected_target_offset;
 	int selected_oom_adj;
+	int oom_adj;
+	ktime_t start;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
@@ -103,10 +359,9 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	if (lowmem_deathpending && time_before_eq(jiffies, lowmem_deathpending_timeout))
 		return 0;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
+	array_size = lowmem_table_size(lowmem_minfree_size);
+	if (lowmem_pressure_mode)
+		array_size = 0;
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
@@ -115,6 +370,8 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			break;
 		}
 	}
+	if (lowmem_pressure_mode)
+		min_adj = lowmem_pressure_min_adj();
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -128,58 +385,58 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-		int target_offset;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+	start = ktime_get();
+	spin_lock(&lowmem_bucket_lock);
+	for (oom_adj = OOM_ADJUST_MAX; oom_adj >= min_adj; oom_adj--) {
+		/* the biggest process with the highest oom_adj goes first */
+		list_for_each_entry(p, lowmem_bucket(oom_adj), lowmem_node) {
+			task_lock(p);
+			if (!p->mm) {
+				task_unlock(p);
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    target_offset >= selected_target_offset)
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_target_offset = target_offset;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+		if (selected)
+			break;
 	}
+	selected_oom_adj = oom_adj;
+	if (selected) {
+		get_task_struct(selected);
+		lowmem_deathpending = selected;
+		lowmem_deathpending_timeout = jiffies + HZ;
+	}
+	lowmem_scan_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	lowmem_scan_count++;
+	spin_unlock(&lowmem_bucket_lock);
+
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
+		lowmem_record_kill(selected, selected_oom_adj,
+				   selected_tasksize);
+		/* ->sighand goes away under tasklist_lock when it is released */
+		read_lock(&tasklist_lock);
+		if (selected->sighand)
+			force_sig(SIGKILL, selected);
+		read_unlock(&tasklist_lock);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	} else
 		rem = -1;
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -188,9 +445,60 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static ssize_t lowmem_pressure_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	struct lowmem_pressure_state ps;
+
+	lowmem_pressure_min_adj();
+	spin_lock(&lowmem_pressure_lock);
+	ps = lowmem_ps;
+	spin_unlock(&lowmem_pressure_lock);
+
+	return sprintf(buf, "level %d\npressure %d\nmin_adj %d\n"
+		       "reclaim_ms %u\nkills %u\nlast_kill_pid %d\n"
+		       "last_kill_comm %s\nlast_kill_adj %d\n"
+		       "last_kill_pages %d\nlast_kill_reclaim_ms %u\n",
+		       ps.level, ps.pressure, ps.min_adj,
+		       ps.reclaiming ?
+				jiffies_to_msecs(jiffies - ps.reclaim_start) : 0,
+		       ps.kills, ps.kill_pid, ps.kill_comm, ps.kill_adj,
+		       ps.kill_pages, ps.kill_reclaim_ms);
+}
+
+static struct kobj_attribute lowmem_pressure_attr =
+	__ATTR(pressure, S_IRUGO, lowmem_pressure_show, NULL);
+
+/* file the processes that already exist, later ones come from fork */
+static void __init lowmem_fill_buckets(void)
+{
+	struct task_struct *p;
+
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		spin_lock(&lowmem_bucket_lock);
+		list_move_tail(&p->lowmem_node,
+			       lowmem_bucket(p->signal->oom_adj));
+		spin_unlock(&lowmem_bucket_lock);
+	}
+	read_unlock(&tasklist_lock);
+}
+
 static int __init lowmem_init(void)
 {
-	task_free_register(&task_nb);  
+	int i;
+
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+	task_free_register(&task_nb);
+	oom_adj_register(&oom_adj_nb);
+	lowmem_fill_buckets();
+	lowmem_ps.slot_start = jiffies;
+	lowmem_kobj = kobject_create_and_add("lowmemorykiller", mm_kobj);
+	if (!lowmem_kobj ||
+	    sysfs_create_file(lowmem_kobj, &lowmem_pressure_attr.attr))
+		printk(KERN_WARNING "lowmemorykiller: no pressure file\n");
+	register_reclaim_notifier(&lowmem_reclaim_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -198,15 +506,47 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	unregister_reclaim_notifier(&lowmem_reclaim_nb);
+	cancel_delayed_work_sync(&lowmem_decay_work);
+	cancel_work_sync(&lowmem_notify_work);
+	kobject_put(lowmem_kobj);
+	oom_adj_unregister(&oom_adj_nb);
 	task_free_unregister(&task_nb);
 }
 
+static int lowmem_set_scan_ns(const char *val, struct kernel_param *kp)
+{
+	u64 ns = simple_strtoull(val, NULL, 0);
+
+	spin_lock(&lowmem_bucket_lock);
+	lowmem_scan_ns = ns;
+	spin_unlock(&lowmem_bucket_lock);
+	return 0;
+}
+
+static int lowmem_get_scan_ns(char *buffer, struct kernel_param *kp)
+{
+	u64 ns;
+
+	spin_lock(&lowmem_bucket_lock);
+	ns = lowmem_scan_ns;
+	spin_unlock(&lowmem_bucket_lock);
+	return sprintf(buffer, "%llu", (unsigned long long)ns);
+}
+
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
 module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_mode, lowmem_pressure_mode, bool,
+		   S_IRUGO | S_IWUSR);
+module_param_array_named(pressure, lowmem_pressure, int,
+			 &lowmem_pressure_size, S_IRUGO | S_IWUSR);
+module_param_named(scan_count, lowmem_scan_count, uint, S_IRUGO | S_IWUSR);
+module_param_call(scan_ns, lowmem_set_scan_ns, lowmem_get_scan_ns, NULL,
+		  S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -58,6 +58,15 @@
 
 #define SVNET_DEV_ADDR 0xa0
 
+#define SVNET_NAPI_WEIGHT 64
+#define SVNET_NAPI_WEIGHT_MAX 256
+
+/* Transmit queues, one per PDP channel (1 to 15) */
+#define SVNET_PDP_QUEUES 15
+#define SVNET_TXQ_LIMIT 32 /* packets, the device is stopped beyond */
+#define SVNET_TX_QUANTUM 1600 /* bytes per round, one full sized packet */
+#define SVNET_TX_RETRY (HZ/10) /* if the modem never acks a full buffer */
+
 enum {
 	SVNET_NORMAL = 0,
 	SVNET_RESET,
@@ -73,9 +82,28 @@ struct svnet_stat {
 	unsigned long st_do_write;
 	unsigned long st_do_read;
 	unsigned long st_do_rx;
+	unsigned long st_do_poll;
+	unsigned long st_poll_pkt;
+	unsigned long st_poll_defer;
+	unsigned long st_tx_full;
+	unsigned long st_tx_ack;
+	unsigned long st_tx_retry;
 };
 static struct svnet_stat stat;
 
+/* Latencies in microseconds, bucket n counts [2^(n-1), 2^n) */
+#define SVNET_HIST_SIZE 16
+struct svnet_hist {
+	unsigned long cnt[SVNET_HIST_SIZE];
+};
+
+struct svnet_txq {
+	struct sk_buff_head q;
+	int deficit;
+	unsigned int max_len;
+	unsigned long stopped;
+};
+
 struct svnet_evt {
 	struct list_head list;
 	u32 event;
@@ -93,15 +121,22 @@ struct svnet {
 
 	struct workqueue_struct *wq;
 	struct work_struct work_read;
-	struct delayed_work work_write;
+	struct work_struct work_write;
 	struct delayed_work work_rx;
 
 	struct work_struct work_exit;
 	int exit_flag;
 
-	struct sk_buff_head txq;
+	struct sk_buff_head txq; /* phonet, ahead of the PDP queues */
+	struct svnet_txq pdpq[SVNET_PDP_QUEUES];
+	int pdpq_cur; /* deficit round robin position */
+	struct sipc_txq tx;
+	struct timer_list tx_timer;
+	unsigned long tx_flags;
 	struct svnet_evt_head rxq;
 
+	struct napi_struct napi;
+
 	struct sipc *si;
 #ifdef CONFIG_HAS_WAKELOCK
 	struct wake_lock wlock;
@@ -112,6 +147,9 @@ struct svnet {
 
 static struct svnet *svnet_dev;
 
+/* tx_flags */
+#define SVNET_TX_FULL 0 /* waiting for room in an out buffer */
+
 #ifdef CONFIG_HAS_WAKELOCK
 static inline void _wake_lock_init(struct svnet *sn)
 {
@@ -167,8 +205,10 @@ static inline long _wake_lock_gettime(struct svnet *sn)
 #endif
 
 static unsigned long long tmp_itor;
+static unsigned long long tmp_itow;
 static unsigned long long tmp_xtow;
-static unsigned long long time_max_itor;
+static struct svnet_hist hist_itop; /* interrupt to poll */
+static struct svnet_hist hist_itow; /* interrupt to read in the workqueue */
 static unsigned long long time_max_xtow;
 static unsigned long long time_max_read;
 static unsigned long long time_max_write;
@@ -177,6 +217,37 @@ extern unsigned long long time_max_semlat;
 
 static int _queue_evt(struct svnet_evt_head *h, u32 event);
 
+static void _hist_add(struct svnet_hist *h, unsigned long long ns)
+{
+	unsigned long us;
+	int i;
+
+	do_div(ns, 1000);
+	us = ns > ULONG_MAX ? ULONG_MAX : ns;
+
+	i = us ? fls_long(us) : 0;
+	if (i >= SVNET_HIST_SIZE)
+		i = SVNET_HIST_SIZE - 1;
+
+	h->cnt[i]++;
+}
+
+static int _hist_show(char *buf, const char *name, struct svnet_hist *h)
+{
+	char *p = buf;
+	int i;
+
+	p += sprintf(p, "%s (us):\n", name);
+	p += sprintf(p, "\t%8s %8u: %lu\n", "", 1, h->cnt[0]);
+	for (i = 1; i < SVNET_HIST_SIZE - 1; i++)
+		p += sprintf(p, "\t%8lu-%8lu: %lu\n", 1UL << (i - 1),
+				1UL << i, h->cnt[i]);
+	p += sprintf(p, "\t%8lu-%8s: %lu\n", 1UL << (i - 1), "",
+			h->cnt[i]);
+
+	return p - buf;
+}
+
 static ssize_t show_version(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
@@ -232,6 +303,12 @@ static inline int _show_stat(char *buf)
 	p += sprintf(p, "\twrite count: %lu\n", stat.st_do_write);
 	p += sprintf(p, "\tread count: %lu\n", stat.st_do_read);
 	p += sprintf(p, "\trx count: %lu\n", stat.st_do_rx);
+	p += sprintf(p, "\tpoll count: %lu\n", stat.st_do_poll);
+	p += sprintf(p, "\tpoll packet: %lu\n", stat.st_poll_pkt);
+	p += sprintf(p, "\tpoll deferred: %lu\n", stat.st_poll_defer);
+	p += sprintf(p, "\ttx buffer full: %lu\n", stat.st_tx_full);
+	p += sprintf(p, "\ttx acked: %lu\n", stat.st_tx_ack);
+	p += sprintf(p, "\ttx retried: %lu\n", stat.st_tx_retry);
 	p += sprintf(p, "\n");
 
 	return p - buf;
@@ -242,19 +319,50 @@ static ssize_t show_latency(struct device *d,
 {
 	char *p = buf;
 
-	p += sprintf(p, "Max read latency:  %12llu ns\n", time_max_itor);
 	p += sprintf(p, "Max read time:     %12llu ns\n", time_max_read);
 	p += sprintf(p, "Max write latency: %12llu ns\n", time_max_xtow);
 	p += sprintf(p, "Max write time:    %12llu ns\n", time_max_write);
 	p += sprintf(p, "Max sem. latency:  %12llu ns\n", time_max_semlat);
 
+	p += _hist_show(p, "Interrupt to poll", &hist_itop);
+	p += _hist_show(p, "Interrupt to read", &hist_itow);
+
 	return p - buf;
 }
 
+static ssize_t show_budget(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	if (!svnet_dev)
+		return 0;
+
+	return sprintf(buf, "%d\n", svnet_dev->napi.weight);
+}
+
+static ssize_t store_budget(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	unsigned long budget;
+	int r;
+
+	if (!svnet_dev)
+		return count;
+
+	r = strict_strtoul(buf, 10, &budget);
+	if (r || budget < 1 || budget > SVNET_NAPI_WEIGHT_MAX)
+		return -EINVAL;
+
+	/* picked up by the next poll */
+	svnet_dev->napi.weight = budget;
+
+	return count;
+}
+
 static ssize_t show_debug(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	char *p = buf;
+	int i;
 
 	if (!svnet_dev)
 		return 0;
@@ -265,6 +373,17 @@ static ssize_t show_debug(struct device *d,
 	p += sprintf(p, "\tTX queue\t%u\n", skb_queue_len(&svnet_dev->txq));
 	p += sprintf(p, "\tRX queue\t%u\n", svnet_dev->rxq.len);
 
+	p += sprintf(p, "PDP TX queue: len max stopped\n");
+	for (i=0;i<SVNET_PDP_QUEUES;i++) {
+		struct svnet_txq *q = &svnet_dev->pdpq[i];
+
+		if (!q->max_len)
+			continue;
+
+		p += sprintf(p, "\tpdp%d\t%u %u %lu\n", i,
+				skb_queue_len(&q->q), q->max_len, q->stopped);
+	}
+
 	p += sipc_debug_show(svnet_dev->si, p);
 
 	return p - buf;
@@ -311,6 +430,7 @@ static DEVICE_ATTR(latency, S_IRUGO, show_latency, NULL);
 static DEVICE_ATTR(waketime, S_IRUGO | S_IWUSR, show_waketime, store_waketime);
 static DEVICE_ATTR(debug, S_IRUGO | S_IWUSR, show_debug, store_debug);
 static DEVICE_ATTR(whitelist, S_IRUSR | S_IWUSR, NULL, store_whitelist);
+static DEVICE_ATTR(budget, S_IRUGO | S_IWUSR, show_budget, store_budget);
 
 static struct attribute *svnet_attributes[] = {
 	&dev_attr_version.attr,
@@ -318,6 +438,7 @@ static struct attribute *svnet_attributes[] = {
 	&dev_attr_debug.attr,
 	&dev_attr_latency.attr,
 	&dev_attr_whitelist.attr,
+	&dev_attr_budget.attr,
 	NULL
 };
 
@@ -326,10 +447,32 @@ static const struct attribute_group svnet_group = {
 };
 
 
+static inline void _kick_write(struct svnet *sn)
+{
+	/* Nothing to do until the modem makes room */
+	if (test_bit(SVNET_TX_FULL, &sn->tx_flags))
+		return;
+
+	_wake_process_lock_timeout(sn);
+	queue_work(sn->wq, &sn->work_write);
+}
+
+static inline struct svnet_txq *_pdpq(struct svnet *sn, struct sk_buff *skb)
+{
+	struct pdp_priv *priv = netdev_priv(skb->dev);
+
+	if (priv->channel < 1 || priv->channel > SVNET_PDP_QUEUES)
+		return NULL;
+
+	return &sn->pdpq[priv->channel - 1];
+}
+
 int vnet_start_xmit(struct sk_buff *skb, struct net_device *ndev)
 {
 	struct svnet *sn;
 	struct pdp_priv *priv;
+	struct svnet_txq *q;
+	unsigned int len;
 
 	dev_dbg(&ndev->dev, "recv inet packet %p: %d bytes\n", skb, skb->len);
 	stat.st_recv_pkt_pdp++;
@@ -342,17 +485,30 @@ int vnet_start_xmit(struct sk_buff *skb, struct net_device *ndev)
 	if (!sn)
 		goto drop;
 
+	q = _pdpq(sn, skb);
+	if (!q)
+		goto drop;
+
 	if (!tmp_xtow)
 		tmp_xtow = cpu_clock(smp_processor_id());
 
-	skb_queue_tail(&sn->txq, skb);
+	skb_queue_tail(&q->q, skb);
 
-	_wake_process_lock_timeout(sn);
-	queue_delayed_work(sn->wq, &sn->work_write, 0);
+	/* The qdisc keeps the rest, sipc wakes us when a packet is out */
+	len = skb_queue_len(&q->q);
+	if (len > q->max_len)
+		q->max_len = len;
+	if (len >= SVNET_TXQ_LIMIT) {
+		netif_stop_queue(ndev);
+		q->stopped++;
+	}
+
+	_kick_write(sn);
 
 	return NETDEV_TX_OK;
 
 drop:
+	dev_kfree_skb(skb);
 	ndev->stats.tx_dropped++;
 
 	return NETDEV_TX_OK;
@@ -382,8 +538,7 @@ static int svnet_xmit(struct sk_buff *skb, struct net_device *ndev)
 
 	skb_queue_tail(&sn->txq, skb);
 
-	_wake_process_lock_timeout(sn);
-	queue_delayed_work(sn->wq, &sn->work_write, 0);
+	_kick_write(sn);
 
 	return NETDEV_TX_OK;
 
@@ -463,6 +618,12 @@ static int _proc_private_event(struct svnet *sn, u32 evt)
 		dev_err(&sn->ndev->dev, "Modem reset message received\n");
 		sn->exit_flag = SVNET_RESET;
 		break;
+	case SIPC_TX_MB:
+		stat.st_tx_ack++;
+		del_timer(&sn->tx_timer);
+		clear_bit(SVNET_TX_FULL, &sn->tx_flags);
+		_kick_write(sn);
+		return 1;
 	default:
 		return 0;
 	}
@@ -478,7 +639,7 @@ static void svnet_queue_event(u32 evt, void *data)
 	struct svnet *sn;
 	int r;
 
-	if (!tmp_itor)
+	if (!tmp_itor && evt != SIPC_TX_MB)
 		tmp_itor = cpu_clock(smp_processor_id());
 
 	stat.st_recv_evt++;
@@ -494,14 +655,52 @@ static void svnet_queue_event(u32 evt, void *data)
 	if (r)
 		return;
 
-	r = _queue_evt(&sn->rxq, evt);
-	if (r) {
-		dev_err(&sn->ndev->dev, "Not enough memory: event skipped\n");
-		return;
+	/* sipc keeps the mailbox, back to back events make one poll */
+	_wake_process_lock_timeout(sn);
+	napi_schedule(&sn->napi);
+}
+
+static int svnet_poll(struct napi_struct *napi, int budget)
+{
+	struct svnet *sn = container_of(napi, struct svnet, napi);
+	unsigned long long t;
+	u32 defer;
+	int work;
+
+	t = cpu_clock(smp_processor_id());
+	if (tmp_itor) {
+		_hist_add(&hist_itop, t - tmp_itor);
+		t = tmp_itor;
+		tmp_itor = 0;
 	}
 
-	_wake_process_lock_timeout(sn);
-	queue_work(sn->wq, &sn->work_read);
+	stat.st_do_poll++;
+
+	work = sipc_poll(sn->si, budget, &defer);
+	stat.st_poll_pkt += work;
+
+	if (defer) {
+		/* FMT, RFS or waiting for the semaphore: process context */
+		stat.st_poll_defer++;
+		if (!tmp_itow)
+			tmp_itow = t;
+
+		if (_queue_evt(&sn->rxq, defer))
+			dev_err(&sn->ndev->dev,
+				"Not enough memory: event skipped\n");
+		else
+			queue_work(sn->wq, &sn->work_read);
+	}
+
+	if (work < budget) {
+		napi_complete(napi);
+
+		/* An interrupt between the poll and here found us scheduled */
+		if (sipc_rx_pending(sn->si))
+			napi_schedule(napi);
+	}
+
+	return work;
 }
 
 static int svnet_open(struct net_device *ndev)
@@ -521,6 +720,7 @@ static int svnet_open(struct net_device *ndev)
 		sn->exit_flag = SVNET_NORMAL;
 	}
 
+	napi_enable(&sn->napi);
 	netif_wake_queue(ndev);
 	return 0;
 }
@@ -531,7 +731,10 @@ static int svnet_close(struct net_device *ndev)
 
 	dev_dbg(&ndev->dev, "%s\n", __func__);
 
+	napi_disable(&sn->napi);
 	flush_workqueue(sn->wq);
+	del_timer_sync(&sn->tx_timer);
+	clear_bit(SVNET_TX_FULL, &sn->tx_flags);
 
 	if (sn->si)
 		sipc_close(&sn->si);
@@ -586,12 +789,11 @@ static void svnet_read_wq(struct work_struct *work)
 	unsigned long long t, d;
 
 	t = cpu_clock(smp_processor_id());
-	if (tmp_itor) {
-		d = t - tmp_itor;
+	if (tmp_itow) {
+		d = t - tmp_itow;
 		_dbg(&sn->ndev->dev, "int_to_read %llu ns\n", d);
-		tmp_itor = 0;
-		if (time_max_itor < d)
-			time_max_itor = d;
+		tmp_itow = 0;
+		_hist_add(&hist_itow, d);
 	}
 
 	dev_dbg(&sn->ndev->dev, "%s\n", __func__);
@@ -644,10 +846,100 @@ static void svnet_read_wq(struct work_struct *work)
 		time_max_read = d;
 }
 
+/*
+ * Deficit round robin over the PDP queues: each visit adds a quantum to
+ * a queue's deficit, and it sends while its head packet fits in it.
+ * Phonet packets (FMT, RFS and the rest) always go first.
+ */
+static struct sk_buff *svnet_tx_dequeue(struct sipc_txq *tx)
+{
+	struct svnet *sn = container_of(tx, struct svnet, tx);
+	struct svnet_txq *q;
+	struct sk_buff *skb;
+	unsigned long flags;
+	int idle = 0;
+
+	skb = skb_dequeue(&sn->txq);
+	if (skb)
+		return skb;
+
+	while (idle < SVNET_PDP_QUEUES) {
+		q = &sn->pdpq[sn->pdpq_cur];
+
+		spin_lock_irqsave(&q->q.lock, flags);
+		skb = skb_peek(&q->q);
+		if (skb && skb->len <= q->deficit) {
+			__skb_unlink(skb, &q->q);
+			q->deficit -= skb->len;
+			spin_unlock_irqrestore(&q->q.lock, flags);
+			return skb;
+		}
+		spin_unlock_irqrestore(&q->q.lock, flags);
+
+		if (skb)
+			idle = 0;
+		else {
+			/* An idle queue saves no credit */
+			q->deficit = 0;
+			idle++;
+		}
+
+		sn->pdpq_cur = (sn->pdpq_cur + 1) % SVNET_PDP_QUEUES;
+		sn->pdpq[sn->pdpq_cur].deficit += SVNET_TX_QUANTUM;
+	}
+
+	return NULL;
+}
+
+static void svnet_tx_requeue(struct sipc_txq *tx, struct sk_buff *skb)
+{
+	struct svnet *sn = container_of(tx, struct svnet, tx);
+	struct svnet_txq *q;
+
+	if (skb->protocol == __constant_htons(ETH_P_PHONET)) {
+		skb_queue_head(&sn->txq, skb);
+		return;
+	}
+
+	/* It was dequeued from here, so the queue is there */
+	q = _pdpq(sn, skb);
+	q->deficit += skb->len;
+	skb_queue_head(&q->q, skb);
+}
+
+static void _tx_purge(struct svnet *sn)
+{
+	int i;
+
+	skb_queue_purge(&sn->txq);
+	for (i=0;i<SVNET_PDP_QUEUES;i++) {
+		skb_queue_purge(&sn->pdpq[i].q);
+		sn->pdpq[i].deficit = 0;
+	}
+}
+
+/* Before the modem is asked to ack, so SIPC_TX_MB finds the flag set */
+static void svnet_tx_full(struct sipc_txq *tx)
+{
+	struct svnet *sn = container_of(tx, struct svnet, tx);
+
+	set_bit(SVNET_TX_FULL, &sn->tx_flags);
+	mod_timer(&sn->tx_timer, jiffies + SVNET_TX_RETRY);
+}
+
+static void svnet_tx_timer(unsigned long data)
+{
+	struct svnet *sn = (struct svnet *)data;
+
+	stat.st_tx_retry++;
+	clear_bit(SVNET_TX_FULL, &sn->tx_flags);
+	_kick_write(sn);
+}
+
 static void svnet_write_wq(struct work_struct *work)
 {
 	struct svnet *sn = container_of(work,
-			struct svnet, work_write.work);
+			struct svnet, work_write);
 	int r;
 	unsigned long long t, d;
 
@@ -663,19 +955,22 @@ static void svnet_write_wq(struct work_struct *work)
 	dev_dbg(&sn->ndev->dev, "%s\n", __func__);
 	stat.st_do_write++;
 
+	/* This run is the retry; a stale flag would block later kicks */
+	clear_bit(SVNET_TX_FULL, &sn->tx_flags);
+
 	stat.st_wq_state = 3;
 	if (sn->si)
-		r = sipc_write(sn->si, &sn->txq);
+		r = sipc_write_txq(sn->si, &sn->tx);
 	else {
-		skb_queue_purge(&sn->txq);
+		_tx_purge(sn);
 		dev_err(&sn->ndev->dev, "IPC not work, drop packet\n");
 		r = 0;
 	}
 
 	switch (r) {
 	case -ENOSPC:
-		dev_err(&sn->ndev->dev, "buffer is full, wait...\n");
-		queue_delayed_work(sn->wq, &sn->work_write, HZ/10);
+		/* Set by svnet_tx_full(), cleared by SIPC_TX_MB or the timer */
+		stat.st_tx_full++;
 		break;
 	case -EINVAL:
 		dev_err(&sn->ndev->dev, "Invalid arugment\n");
@@ -691,6 +986,9 @@ static void svnet_write_wq(struct work_struct *work)
 		break;
 	}
 
+	if (r >= 0)
+		clear_bit(SVNET_TX_FULL, &sn->tx_flags);
+
 	stat.st_wq_state = 4;
 	d = cpu_clock(smp_processor_id()) - t;
 	_dbg(&sn->ndev->dev, "write_time %llu ns\n", d);
@@ -737,7 +1035,7 @@ static void svnet_exit_wq(struct work_struct *work)
 	kobject_uevent_env(&sn->ndev->dev.kobj, KOBJ_OFFLINE, envs);
 
 	_queue_purge(&sn->rxq);
-	skb_queue_purge(&sn->txq);
+	_tx_purge(sn);
 
 	if (sn->exit_flag == SVNET_EXIT)
 		sipc_ramdump(sn->si);
@@ -752,8 +1050,10 @@ static void svnet_exit_wq(struct work_struct *work)
 
 static inline void _init_data(struct svnet *sn)
 {
+	int i;
+
 	INIT_WORK(&sn->work_read, svnet_read_wq);
-	INIT_DELAYED_WORK(&sn->work_write, svnet_write_wq);
+	INIT_WORK(&sn->work_write, svnet_write_wq);
 	INIT_DELAYED_WORK(&sn->work_rx, svnet_rx_wq);
 	INIT_WORK(&sn->work_exit, svnet_exit_wq);
 
@@ -761,6 +1061,13 @@ static inline void _init_data(struct svnet *sn)
 	spin_lock_init(&sn->rxq.lock);
 	sn->rxq.len = 0;
 	skb_queue_head_init(&sn->txq);
+
+	for (i=0;i<SVNET_PDP_QUEUES;i++)
+		skb_queue_head_init(&sn->pdpq[i].q);
+	sn->tx.dequeue = svnet_tx_dequeue;
+	sn->tx.requeue = svnet_tx_requeue;
+	sn->tx.full = svnet_tx_full;
+	setup_timer(&sn->tx_timer, svnet_tx_timer, (unsigned long)sn);
 }
 
 static void _free(struct svnet *sn)
@@ -775,6 +1082,7 @@ static void _free(struct svnet *sn)
 
 	if (sn->wq) {
 		flush_workqueue(sn->wq);
+		del_timer_sync(&sn->tx_timer);
 		destroy_workqueue(sn->wq);
 	}
 
@@ -805,6 +1113,8 @@ static int __init svnet_init(void)
 	netif_stop_queue(ndev);
 	sn = netdev_priv(ndev);
 
+	netif_napi_add(ndev, &sn->napi, svnet_poll, SVNET_NAPI_WEIGHT);
+
 	_wake_lock_init(sn);
 
 	r = register_netdev(ndev);
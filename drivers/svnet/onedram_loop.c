@@ -0,0 +1,412 @@
+/**
+ * Loopback modem for svnet testing
+ *
+ * Copyright (C) 2010 Samsung Electronics. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Stands in for the onedram driver and the modem behind it. The IPC
+ * region is plain memory and the modem is a kernel thread that
+ *  - echoes everything the AP writes to an out buffer back through the
+ *    matching in buffer, so traffic sent on pdpN comes back on pdpN, and
+ *  - on request, fills the RAW in buffer with a burst of PDP frames
+ *    carrying UDP packets from 192.0.2.2 to 192.0.2.1, and reports how
+ *    long the AP took to receive all of them.
+ *
+ * A burst is started through the module parameters, e.g.
+ *	echo 1 > /sys/class/net/svnet0/pdp/activate
+ *	echo 1400 > /sys/module/svnet/parameters/loop_gen_len
+ *	echo 100000 > /sys/module/svnet/parameters/loop_gen_frames
+ * and rx_inplace selects the receive path being measured.
+ */
+
+//#define DEBUG
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/circ_buf.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <net/checksum.h>
+#include <net/ip.h>
+
+#include "sipc4.h"
+#include "onedram_loop.h"
+
+static unsigned int loop_gen_len = 1400;
+module_param(loop_gen_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(loop_gen_len, "IP packet length of generated frames");
+
+static unsigned int loop_gen_chan = 1;
+module_param(loop_gen_chan, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(loop_gen_chan, "PDP channel of generated frames");
+
+static unsigned int loop_gen_frames;
+module_param(loop_gen_frames, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(loop_gen_frames, "frames in the next generated burst");
+
+#define LOOP_GEN_MIN (sizeof(struct iphdr) + sizeof(struct udphdr))
+#define LOOP_GEN_MAX (RAW_SZ / 4)
+#define LOOP_POLL (HZ / 10)
+
+static const struct {
+	unsigned int out_off;
+	unsigned int in_off;
+	unsigned int size;
+	u16 mask_send;
+	u16 mask_req_ack;
+	u16 mask_res_ack;
+} loop_rb[IPCIDX_MAX] = {
+	{ FMT_OUT, FMT_IN, FMT_SZ,
+		MBD_SEND_FMT, MBD_REQ_ACK_FMT, MBD_RES_ACK_FMT },
+	{ RAW_OUT, RAW_IN, RAW_SZ,
+		MBD_SEND_RAW, MBD_REQ_ACK_RAW, MBD_RES_ACK_RAW },
+	{ RFS_OUT, RFS_IN, RFS_SZ,
+		MBD_SEND_RFS, MBD_REQ_ACK_RFS, MBD_RES_ACK_RFS },
+};
+
+struct onedram_loop {
+	unsigned char *base;
+	struct resource res;
+
+	void (*handler)(u32, void *);
+	void *data;
+	struct task_struct *task;
+
+	/* The AP shares the region, the modem takes it alone */
+	struct rw_semaphore sem;
+
+	wait_queue_head_t wait;
+	u32 mailbox_ba; /* AP to modem, just a doorbell here */
+	u32 mailbox_ab; /* modem to AP */
+
+	/* generated burst */
+	unsigned char *gen_pkt;
+	unsigned int gen_len;
+	unsigned int gen_left;
+	unsigned int gen_frames;
+	unsigned long long gen_start;
+};
+
+static struct onedram_loop loop = {
+	.sem = __RWSEM_INITIALIZER(loop.sem),
+	.wait = __WAIT_QUEUE_HEAD_INITIALIZER(loop.wait),
+};
+
+static inline struct ringbuf_cont *_cont(struct onedram_loop *lp, int i)
+{
+	return &((struct sipc_mapped *)lp->base)->rbcont[i];
+}
+
+/* Append to an in buffer, the caller checked for space */
+static void _put(unsigned char *base, u32 size, u32 *head,
+		const void *data, u32 len)
+{
+	const unsigned char *buf = data;
+	u32 c = size - *head;
+
+	if (len < c)
+		c = len;
+
+	memcpy(base + *head, buf, c);
+	memcpy(base, buf + c, len - c);
+	*head = (*head + len) & (size - 1);
+}
+
+/* Move everything the AP wrote to an out buffer to the in buffer */
+static u32 _echo(struct onedram_loop *lp, int i)
+{
+	struct ringbuf_cont *c = _cont(lp, i);
+	unsigned char *out = lp->base + loop_rb[i].out_off;
+	unsigned char *in = lp->base + loop_rb[i].in_off;
+	u32 size = loop_rb[i].size;
+	u32 cnt, seg;
+
+	/* All or nothing, the AP only ever writes whole frames */
+	cnt = CIRC_CNT(c->out_head, c->out_tail, size);
+	if (!cnt || CIRC_SPACE(c->in_head, c->in_tail, size) < cnt)
+		return 0;
+
+	seg = CIRC_CNT_TO_END(c->out_head, c->out_tail, size);
+	_put(in, size, &c->in_head, out + c->out_tail, seg);
+	_put(in, size, &c->in_head, out, cnt - seg);
+	c->out_tail = c->out_head;
+
+	return loop_rb[i].mask_send;
+}
+
+static void _gen_start(struct onedram_loop *lp)
+{
+	struct iphdr *iph;
+	struct udphdr *uh;
+	unsigned int len = loop_gen_len;
+	unsigned int i;
+
+	len = clamp_t(unsigned int, len, LOOP_GEN_MIN, LOOP_GEN_MAX);
+
+	lp->gen_pkt = kmalloc(len, GFP_KERNEL);
+	if (!lp->gen_pkt) {
+		printk(KERN_ERR "svnet loop: no memory for a burst\n");
+		loop_gen_frames = 0;
+		return;
+	}
+
+	for (i = LOOP_GEN_MIN; i < len; i++)
+		lp->gen_pkt[i] = i;
+
+	iph = (struct iphdr *)lp->gen_pkt;
+	memset(iph, 0, sizeof(*iph));
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->tot_len = htons(len);
+	iph->frag_off = htons(IP_DF);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = htonl(0xc0000202);
+	iph->daddr = htonl(0xc0000201);
+	iph->check = ip_fast_csum((u8 *)iph, iph->ihl);
+
+	uh = (struct udphdr *)(iph + 1);
+	uh->source = htons(9);
+	uh->dest = htons(9);
+	uh->len = htons(len - sizeof(*iph));
+	uh->check = 0;
+
+	lp->gen_len = len;
+	lp->gen_frames = lp->gen_left = loop_gen_frames;
+	loop_gen_frames = 0;
+	lp->gen_start = cpu_clock(smp_processor_id());
+}
+
+/* Fill the RAW in buffer with as much of the burst as fits */
+static u32 _gen_fill(struct onedram_loop *lp)
+{
+	struct ringbuf_cont *c = _cont(lp, IPCIDX_RAW);
+	unsigned char *in = lp->base + RAW_IN;
+	u8 start = HDLC_START, end = HDLC_END;
+	struct raw_hdr h;
+	u32 frame_len;
+	int n = 0;
+
+	if (!lp->gen_left)
+		return 0;
+
+	h.len = sizeof(h) + lp->gen_len;
+	h.channel = CHID(PN_PDP(loop_gen_chan));
+	h.control = 0;
+	frame_len = sizeof(start) + h.len + sizeof(end);
+
+	while (lp->gen_left &&
+			CIRC_SPACE(c->in_head, c->in_tail, RAW_SZ) >= frame_len) {
+		_put(in, RAW_SZ, &c->in_head, &start, sizeof(start));
+		_put(in, RAW_SZ, &c->in_head, &h, sizeof(h));
+		_put(in, RAW_SZ, &c->in_head, lp->gen_pkt, lp->gen_len);
+		_put(in, RAW_SZ, &c->in_head, &end, sizeof(end));
+		lp->gen_left--;
+		n++;
+	}
+
+	/* The AP's ack is the cue to refill */
+	return n ? MBD_SEND_RAW | MBD_REQ_ACK_RAW : 0;
+}
+
+static void _gen_check(struct onedram_loop *lp)
+{
+	struct ringbuf_cont *c = _cont(lp, IPCIDX_RAW);
+	unsigned long long d;
+
+	if (!lp->gen_pkt || lp->gen_left ||
+			CIRC_CNT(c->in_head, c->in_tail, RAW_SZ))
+		return;
+
+	d = cpu_clock(smp_processor_id()) - lp->gen_start;
+	do_div(d, 1000);
+	printk(KERN_INFO "svnet loop: %u frames of %u bytes received"
+			" in %llu us\n", lp->gen_frames, lp->gen_len, d);
+
+	kfree(lp->gen_pkt);
+	lp->gen_pkt = NULL;
+}
+
+static int _loop_thread(void *data)
+{
+	struct onedram_loop *lp = data;
+	u32 mailbox, ba, echo;
+	int i;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible_timeout(lp->wait,
+				lp->mailbox_ba || kthread_should_stop(),
+				LOOP_POLL);
+		ba = xchg(&lp->mailbox_ba, 0);
+
+		if (!lp->gen_pkt && loop_gen_frames)
+			_gen_start(lp);
+
+		mailbox = 0;
+
+		down_write(&lp->sem);
+		for (i = 0; i < IPCIDX_MAX; i++) {
+			echo = _echo(lp, i);
+
+			/* The AP found the out buffer full and waits */
+			if (echo && (ba & loop_rb[i].mask_req_ack))
+				echo |= loop_rb[i].mask_res_ack;
+
+			mailbox |= echo;
+		}
+		mailbox |= _gen_fill(lp);
+		_gen_check(lp);
+		up_write(&lp->sem);
+
+		if (mailbox) {
+			lp->mailbox_ab = MB_DATA(mailbox);
+
+			/* Interrupt context, as the real onedram irq */
+			local_bh_disable();
+			local_irq_disable();
+			lp->handler(lp->mailbox_ab, lp->data);
+			local_irq_enable();
+			local_bh_enable();
+		}
+	}
+
+	kfree(lp->gen_pkt);
+	lp->gen_pkt = NULL;
+
+	return 0;
+}
+
+int onedram_loop_register_handler(void (*handler)(u32, void *), void *data)
+{
+	struct task_struct *task;
+
+	if (!handler || !loop.base)
+		return -EINVAL;
+
+	if (loop.handler)
+		return -EBUSY;
+
+	loop.handler = handler;
+	loop.data = data;
+
+	task = kthread_run(_loop_thread, &loop, "svnet-loop");
+	if (IS_ERR(task)) {
+		loop.handler = NULL;
+		return PTR_ERR(task);
+	}
+	loop.task = task;
+
+	return 0;
+}
+
+int onedram_loop_unregister_handler(void (*handler)(u32, void *))
+{
+	if (!handler || loop.handler != handler)
+		return -EINVAL;
+
+	kthread_stop(loop.task);
+	loop.task = NULL;
+	loop.handler = NULL;
+
+	return 0;
+}
+
+struct resource* onedram_loop_request_region(resource_size_t start,
+		resource_size_t size, const char *name)
+{
+	if (loop.base || start)
+		return NULL;
+
+	loop.base = vmalloc(size);
+	if (!loop.base)
+		return NULL;
+	memset(loop.base, 0, size);
+
+	loop.res.name = name;
+	loop.res.start = (unsigned long)loop.base;
+	loop.res.end = loop.res.start + size - 1;
+	loop.res.flags = IORESOURCE_MEM;
+
+	return &loop.res;
+}
+
+void onedram_loop_release_region(resource_size_t start,
+		resource_size_t size)
+{
+	vfree(loop.base);
+	loop.base = NULL;
+}
+
+int onedram_loop_read_mailbox(u32 *mb)
+{
+	if (!loop.mailbox_ab)
+		return -EAGAIN;
+
+	*mb = loop.mailbox_ab;
+	return 0;
+}
+
+int onedram_loop_write_mailbox(u32 mb)
+{
+	/* Semaphore requests and replies need no answer */
+	if (mb & MB_COMMAND)
+		return 0;
+
+	loop.mailbox_ba = mb;
+	wake_up(&loop.wait);
+
+	return 0;
+}
+
+int onedram_loop_get_auth(u32 cmd)
+{
+	if (cmd) {
+		down_read(&loop.sem);
+		return 0;
+	}
+
+	return down_read_trylock(&loop.sem) ? 0 : -EACCES;
+}
+
+int onedram_loop_put_auth(int release)
+{
+	up_read(&loop.sem);
+	return 0;
+}
+
+int onedram_loop_rel_sem(void)
+{
+	return 0;
+}
+
+int onedram_loop_read_sem(void)
+{
+	return 1;
+}
+
+void onedram_loop_get_vbase(void **vbase)
+{
+	*vbase = loop.base;
+}
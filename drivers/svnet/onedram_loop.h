@@ -0,0 +1,67 @@
+/**
+ * Loopback modem for svnet testing
+ *
+ * Copyright (C) 2010 Samsung Electronics. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef __ONEDRAM_LOOP_H__
+#define __ONEDRAM_LOOP_H__
+
+#if defined(CONFIG_SVNET_LOOPBACK)
+
+#include <linux/ioport.h>
+#include <linux/types.h>
+
+/*
+ * With CONFIG_SVNET_LOOPBACK the IPC layer talks to a fake onedram
+ * instead of the onedram driver: see onedram_loop.c
+ */
+extern int onedram_loop_register_handler(void (*handler)(u32, void *),
+		void *data);
+extern int onedram_loop_unregister_handler(void (*handler)(u32, void *));
+
+extern struct resource* onedram_loop_request_region(resource_size_t start,
+		resource_size_t size, const char *name);
+extern void onedram_loop_release_region(resource_size_t start,
+		resource_size_t size);
+
+extern int onedram_loop_read_mailbox(u32 *);
+extern int onedram_loop_write_mailbox(u32);
+
+extern int onedram_loop_get_auth(u32 cmd);
+extern int onedram_loop_put_auth(int release);
+
+extern int onedram_loop_rel_sem(void);
+extern int onedram_loop_read_sem(void);
+
+extern void onedram_loop_get_vbase(void **);
+
+#define onedram_register_handler	onedram_loop_register_handler
+#define onedram_unregister_handler	onedram_loop_unregister_handler
+#define onedram_request_region		onedram_loop_request_region
+#define onedram_release_region		onedram_loop_release_region
+#define onedram_read_mailbox		onedram_loop_read_mailbox
+#define onedram_write_mailbox		onedram_loop_write_mailbox
+#define onedram_get_auth		onedram_loop_get_auth
+#define onedram_put_auth		onedram_loop_put_auth
+#define onedram_rel_sem			onedram_loop_rel_sem
+#define onedram_read_sem		onedram_loop_read_sem
+#define onedram_get_vbase		onedram_loop_get_vbase
+
+#endif /* CONFIG_SVNET_LOOPBACK */
+
+#endif /* __ONEDRAM_LOOP_H__ */
@@ -37,6 +37,7 @@ extern const char *sipc_version;
 
 #define SIPC_RESET_MB 0xFFFFFF7E /* -2 & ~(INT_VALID) */
 #define SIPC_EXIT_MB 0xFFFFFF7F /* -1 & ~(INT_VALID) */
+#define SIPC_TX_MB 0xFFFFFF7D /* -3 & ~(INT_VALID), out buffer has room */
 
 struct sipc;
 
@@ -47,9 +48,27 @@ extern void sipc_close(struct sipc **);
 extern void sipc_exit(void);
 
 extern int sipc_write(struct sipc *, struct sk_buff_head *);
+
+/*
+ * sipc_write_txq() writes what dequeue gives until it runs dry or a
+ * buffer is full. The packet that did not fit goes back with requeue,
+ * and SIPC_TX_MB is queued once the modem has read that buffer. full,
+ * if set, is called before the modem is asked for that ack, so the
+ * ack cannot overtake it.
+ */
+struct sipc_txq {
+	struct sk_buff *(*dequeue)(struct sipc_txq *);
+	void (*requeue)(struct sipc_txq *, struct sk_buff *);
+	void (*full)(struct sipc_txq *);
+};
+extern int sipc_write_txq(struct sipc *, struct sipc_txq *);
 extern int sipc_read(struct sipc *, u32 mailbox, int *cond);
 extern int sipc_rx(struct sipc *);
 
+/* softirq receive, what it leaves in defer is for sipc_read() */
+extern int sipc_poll(struct sipc *, int budget, u32 *defer);
+extern int sipc_rx_pending(struct sipc *);
+
 
 /* TODO: use PN_CMD ?? */
 extern int sipc_check_skb(struct sipc *, struct sk_buff *skb);
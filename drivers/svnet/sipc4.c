@@ -39,6 +39,7 @@
 #include <net/phonet/phonet.h>
 
 #include <linux/onedram.h>
+#include "onedram_loop.h"
 
 #if defined(CONFIG_KERNEL_DEBUG_SEC)
 #include <linux/kernel_sec_common.h>
@@ -192,8 +193,32 @@ struct sipc {
 	const struct attribute_group *group;
 
 	struct sk_buff_head rfs_rx;
+
+	/* PDP frames received in place, and those wrapping the ring end */
+	unsigned long rx_inplace;
+	unsigned long rx_wrapped;
+
+	/* data mailboxes not seen by sipc_poll() yet */
+	spinlock_t mb_lock;
+	u32 rx_mailbox;
+
+	unsigned long rx_flags;
+	unsigned long rx_polls;
+	unsigned long rx_deferred;
+
+	/* out buffers found full, waiting for the modem's ack */
+	unsigned long tx_wait;
+	unsigned long tx_full[IPCIDX_MAX];
 };
 
+/* rx_flags */
+#define SIPC_RAW_BUSY 0 /* the RAW in buffer is being read */
+
+/* PDP packets go straight from onedram into their skb */
+static int rx_inplace = 1;
+module_param(rx_inplace, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rx_inplace, "parse PDP frames in place in onedram");
+
 /* sizeof(struct phonethdr) + NET_SKB_PAD > SMP_CACHE_BYTES */
 //#define RFS_MTU (PAGE_SIZE - sizeof(struct phonethdr) - NET_SKB_PAD)
 /* SMP_CACHE_BYTES > sizeof(struct phonethdr) + NET_SKB_PAD */
@@ -324,6 +349,18 @@ static int _get_auth_try(void)
 	return onedram_get_auth(0);
 }
 
+/* Pass a data mailbox on, noting it for the next poll */
+static void _queue_data(struct sipc *si, u32 mailbox)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&si->mb_lock, flags);
+	si->rx_mailbox |= mailbox;
+	spin_unlock_irqrestore(&si->mb_lock, flags);
+
+	si->queue(mailbox, si->queue_data);
+}
+
 static void _check_buffer(struct sipc *si)
 {
 	int i;
@@ -354,7 +391,7 @@ static void _check_buffer(struct sipc *si)
 	_put_auth(si);
 
 	if (mailbox)
-		si->queue(MB_DATA(mailbox), si->queue_data);
+		_queue_data(si, MB_DATA(mailbox));
 }
 
 static void _do_command(struct sipc *si, u32 mailbox)
@@ -398,6 +435,22 @@ static void _do_command(struct sipc *si, u32 mailbox)
 	}
 }
 
+/* The modem read an out buffer sipc_write_txq() found full */
+static void _check_tx_ack(struct sipc *si, u32 mailbox)
+{
+	int i;
+	int wake = 0;
+
+	for (i=0;i<IPCIDX_MAX;i++) {
+		if ((mailbox & mb_data[i].mask_res_ack)
+				&& test_and_clear_bit(i, &si->tx_wait))
+			wake = 1;
+	}
+
+	if (wake)
+		si->queue(SIPC_TX_MB, si->queue_data);
+}
+
 void sipc_handler(u32 mailbox, void *data)
 {
 	struct sipc *si = (struct sipc *)data;
@@ -425,7 +478,8 @@ void sipc_handler(u32 mailbox, void *data)
 		return;
 	}
 
-	si->queue(mailbox, si->queue_data);
+	_check_tx_ack(si, mailbox);
+	_queue_data(si, mailbox);
 }
 
 static inline void _init_data(struct sipc *si, unsigned char *base)
@@ -528,6 +582,7 @@ struct sipc* sipc_open(void (*queue)(u32, void*), struct net_device *ndev)
 	}
 	
 	skb_queue_head_init(&si->rfs_rx);
+	spin_lock_init(&si->mb_lock);
 
 	/* process init message */
 	_init_proc(si);
@@ -535,6 +590,20 @@ struct sipc* sipc_open(void (*queue)(u32, void*), struct net_device *ndev)
 	return si;
 }
 
+/*
+ * sipc_poll() looks the devices up under rcu_read_lock() only, the
+ * pointer is cleared first and unregister_netdev() waits for it.
+ */
+static void _remove_pdp(int idx)
+{
+	struct net_device *ndev = pdp_devs[idx];
+
+	rcu_assign_pointer(pdp_devs[idx], NULL);
+
+	/* unregister_netdev() waits for the RCU readers (synchronize_net) */
+	destroy_pdp(&ndev);
+}
+
 static void clear_pdp_wq(struct work_struct *work)
 {
 	int i;
@@ -543,7 +612,7 @@ static void clear_pdp_wq(struct work_struct *work)
 
 	for (i=0;i<sizeof(pdp_devs)/sizeof(pdp_devs[0]);i++) {
 		if (pdp_devs[i]) {
-			destroy_pdp(&pdp_devs[i]);
+			_remove_pdp(i);
 			clear_bit(i, pdp_bitmap);
 		}
 	}
@@ -870,6 +939,13 @@ static int _write(struct sipc *si, int res, struct sk_buff *skb, u32 *mailbox)
 	if(r > 0)
 		*mailbox |= mb_data[rid].mask_send;
 
+	if (r == -ENOSPC) {
+		/* Have the modem tell us when it has read the buffer */
+		set_bit(rid, &si->tx_wait);
+		si->tx_full[rid]++;
+		*mailbox |= mb_data[rid].mask_send | mb_data[rid].mask_req_ack;
+	}
+
 	_dbg("%s: return %d\n", __func__, r);
 	return r;
 }
@@ -898,17 +974,18 @@ static inline int _write_pn(struct sipc *si, struct sk_buff *skb, u32 *mb)
 	return r;
 }
 
-int sipc_write(struct sipc *si, struct sk_buff_head *sbh)
+int sipc_write_txq(struct sipc *si, struct sipc_txq *txq)
 {
 	int r;
 	u32 mailbox;
 	struct sk_buff *skb;
 
-	if (!sbh)
+	if (!txq)
 		return -EINVAL;
 
 	if (!si) {
-		skb_queue_purge(sbh);
+		while ((skb = txq->dequeue(txq)))
+			dev_kfree_skb_any(skb);
 		return -ENXIO;
 	}
 
@@ -917,7 +994,7 @@ int sipc_write(struct sipc *si, struct sk_buff_head *sbh)
 		return r;
 
 	r = mailbox = 0;
-	skb = skb_dequeue(sbh);
+	skb = txq->dequeue(txq);
 	while (skb) {
 		struct net_device *ndev = skb->dev;
 		int len = skb->len;
@@ -937,20 +1014,23 @@ int sipc_write(struct sipc *si, struct sk_buff_head *sbh)
 		_update_stat(ndev, len);
 		dev_kfree_skb_any(skb);
 
-		skb = skb_dequeue(sbh);
+		skb = txq->dequeue(txq);
 	}
 
 	_req_rel_auth(si);
 	_put_auth(si);
 
+	if (r == -ENOSPC && txq->full)
+		txq->full(txq);
+
 	if(mailbox)
 		onedram_write_mailbox(MB_DATA(mailbox));
 
 	if (r < 0) {
 		if (r == -ENOSPC) {
-			dev_err(&si->svndev->dev,
+			dev_dbg(&si->svndev->dev,
 					"write nospc queue %p\n", skb);
-			skb_queue_head(sbh, skb);
+			txq->requeue(txq, skb);
 			netif_stop_queue(skb->dev);
 		} else {
 			dev_err(&si->svndev->dev,
@@ -962,6 +1042,37 @@ int sipc_write(struct sipc *si, struct sk_buff_head *sbh)
 	return r;
 }
 
+struct sipc_skb_txq {
+	struct sipc_txq txq;
+	struct sk_buff_head *sbh;
+};
+
+static struct sk_buff *_sbh_dequeue(struct sipc_txq *txq)
+{
+	return skb_dequeue(container_of(txq, struct sipc_skb_txq, txq)->sbh);
+}
+
+static void _sbh_requeue(struct sipc_txq *txq, struct sk_buff *skb)
+{
+	skb_queue_head(container_of(txq, struct sipc_skb_txq, txq)->sbh, skb);
+}
+
+int sipc_write(struct sipc *si, struct sk_buff_head *sbh)
+{
+	struct sipc_skb_txq q = {
+		.txq = {
+			.dequeue = _sbh_dequeue,
+			.requeue = _sbh_requeue,
+		},
+		.sbh = sbh,
+	};
+
+	if (!sbh)
+		return -EINVAL;
+
+	return sipc_write_txq(si, &q.txq);
+}
+
 extern int __read(struct ringbuf *rb, unsigned char *buf, unsigned int size)
 {
 	int c;
@@ -1234,6 +1345,164 @@ static int _read_pdp(struct ringbuf *rb, int len,
 	return read_len;
 }
 
+/*
+ * In place receive of RAW frames: the frame is parsed where the modem put
+ * it and PDP packets are copied once, straight into their skb. The ring
+ * tail only moves when a whole frame is done with.
+ */
+static inline u8 _peek(struct ringbuf *rb, u32 off)
+{
+	return rb->in_base[(rb->rb_in_tail + off) & (rb->rb_size - 1)];
+}
+
+/* Copy out size bytes at off past the tail, in two parts if they wrap */
+static inline int _peek_copy(struct ringbuf *rb, u32 off, void *buf,
+		unsigned int size)
+{
+	u32 pos = (rb->rb_in_tail + off) & (rb->rb_size - 1);
+	unsigned int c = rb->rb_size - pos;
+
+	if (size <= c) {
+		memcpy(buf, rb->in_base + pos, size);
+		return 0;
+	}
+
+	memcpy(buf, rb->in_base + pos, c);
+	memcpy(buf + c, rb->in_base, size - c);
+	return 1;
+}
+
+static inline void _skip(struct ringbuf *rb, unsigned int size)
+{
+	rb->rb_in_tail = (rb->rb_in_tail + size) & (rb->rb_size - 1);
+}
+
+static int _rx_pdp_inplace(struct sipc *si, struct ringbuf *rb, int len,
+		int res, struct sk_buff_head *rxq)
+{
+	struct sk_buff *skb;
+	struct net_device *ndev;
+
+	ndev = rcu_dereference(pdp_devs[PDP_ID(res)]);
+	if (!ndev)
+		return 0; /* drop data */
+
+	skb = netdev_alloc_skb(ndev, len + NET_IP_ALIGN);
+	if (unlikely(!skb))
+		return -ENOMEM;
+
+	skb_reserve(skb, NET_IP_ALIGN);
+
+	if (_peek_copy(rb, sizeof(hdlc_start) + sizeof(struct raw_hdr),
+				skb_put(skb, len), len))
+		si->rx_wrapped++;
+	si->rx_inplace++;
+
+	ndev->stats.rx_packets++;
+	ndev->stats.rx_bytes += skb->len;
+
+	skb->protocol = __constant_htons(ETH_P_IP);
+	skb_reset_mac_header(skb);
+
+	__skb_queue_tail(rxq, skb);
+
+	return 0;
+}
+
+/*
+ * Returns the number of frames taken out, at most budget, and why it
+ * stopped short in *err. From sipc_poll() (napi set) the packets go
+ * straight up the stack, and frames that need process context make it
+ * stop with -EAGAIN.
+ */
+static int _read_raw_inplace(struct sipc *si, int inbuf, struct ringbuf *rb,
+		int budget, int napi, int *err)
+{
+	int r = 0;
+	int n = 0;
+	struct raw_hdr h;
+	struct sk_buff_head rxq;
+	struct sk_buff *skb;
+	int res, data_len, frame_len;
+	unsigned int len;
+	u32 tail;
+
+	__skb_queue_head_init(&rxq);
+
+	/* The devices can't go while their packets are being taken out */
+	rcu_read_lock();
+
+	while (inbuf > 0 && n < budget) {
+		if (inbuf < sizeof(hdlc_start) + sizeof(h) + sizeof(hdlc_end)
+				|| _peek(rb, 0) != HDLC_START) {
+			dev_err(&si->svndev->dev, "Bad message: %c %d\n",
+					_peek(rb, 0), inbuf);
+			r = -EBADMSG;
+			break;
+		}
+
+		/* 6 bytes, cheaper to copy than to read unaligned */
+		_peek_copy(rb, sizeof(hdlc_start), &h, sizeof(h));
+		_get_raw_hdr(&h, &res, &len, NULL);
+
+		frame_len = sizeof(hdlc_start) + len + sizeof(hdlc_end);
+		data_len = len - sizeof(struct raw_hdr);
+		if (len < sizeof(struct raw_hdr) || len >= inbuf ||
+				frame_len > inbuf ||
+				_peek(rb, frame_len - 1) != HDLC_END) {
+			dev_err(&si->svndev->dev, "Bad frame: len %d in %d\n",
+					data_len, inbuf);
+			r = -EBADMSG;
+			break;
+		}
+
+		if (res >= PN_PDP_START && res <= PN_PDP_END) {
+			r = _rx_pdp_inplace(si, rb, data_len, res, &rxq);
+			if (r < 0)
+				break;
+			_skip(rb, frame_len);
+		} else if (napi) {
+			r = -EAGAIN;
+			break;
+		} else {
+			/* Phonet frames are rare, take the copying path */
+			tail = rb->rb_in_tail;
+			_skip(rb, sizeof(hdlc_start) + sizeof(h));
+			r = _read_pn(si->svndev, rb, data_len, res);
+			if (r < 0) {
+				if (r == -ENOMEM)
+					rb->rb_in_tail = tail;
+				break;
+			}
+			r = 0;
+		}
+
+		inbuf -= frame_len;
+		n++;
+	}
+
+	skb = __skb_dequeue(&rxq);
+	while (skb) {
+		int rx;
+
+		_dbg("%s: pdp packet %p len %d\n", __func__, skb, skb->len);
+
+		if (napi)
+			rx = netif_receive_skb(skb);
+		else
+			rx = netif_rx_ni(skb);
+		if (rx != NET_RX_SUCCESS)
+			dev_err(&si->svndev->dev, "pdp rx error: %d\n", rx);
+
+		skb = __skb_dequeue(&rxq);
+	}
+
+	rcu_read_unlock();
+
+	*err = r < 0 ? r : 0;
+	return n;
+}
+
 static int _read_raw(struct sipc *si, int inbuf, struct ringbuf *rb)
 {
 	int r;
@@ -1241,6 +1510,11 @@ static int _read_raw(struct sipc *si, int inbuf, struct ringbuf *rb)
 	int res, data_len;
 	u32 tail;
 
+	if (rx_inplace) {
+		_read_raw_inplace(si, inbuf, rb, INT_MAX, 0, &r);
+		return r;
+	}
+
 	while (inbuf > 0) {
 		tail = rb->rb_in_tail;
 
@@ -1587,7 +1861,16 @@ int sipc_read(struct sipc *si, u32 mailbox, int *cond)
 
 		_dbg("%s: %d bytes in %d\n", __func__, inbuf, i);
 
+		/* sipc_poll() has it, and will hand back what it can't do */
+		if (i == IPCIDX_RAW && test_and_set_bit(SIPC_RAW_BUSY,
+					&si->rx_flags))
+			continue;
+
 		r = rb->rb_read(si, inbuf, rb);
+
+		if (i == IPCIDX_RAW)
+			clear_bit(SIPC_RAW_BUSY, &si->rx_flags);
+
 		if (r < 0) {
 			if (r == -EBADMSG)
 				purge_buffer(rb);
@@ -1611,6 +1894,110 @@ int sipc_read(struct sipc *si, u32 mailbox, int *cond)
 	return r;
 }
 
+/*
+ * Softirq side of the receive: PDP frames in the RAW in buffer, up to
+ * budget of them. This can neither wait for the onedram semaphore nor
+ * read the FMT and RFS buffers, which allocate with GFP_KERNEL, so
+ * whatever is left for process context is returned in *defer as a
+ * mailbox for sipc_read().
+ */
+int sipc_poll(struct sipc *si, int budget, u32 *defer)
+{
+	int r, i;
+	int inbuf;
+	int work = 0;
+	u32 mailbox;
+	u32 res = 0;
+	struct ringbuf *rb;
+	unsigned long flags;
+
+	*defer = 0;
+
+	if (!si)
+		return 0;
+
+	spin_lock_irqsave(&si->mb_lock, flags);
+	mailbox = si->rx_mailbox;
+	si->rx_mailbox = 0;
+	spin_unlock_irqrestore(&si->mb_lock, flags);
+
+	si->rx_polls++;
+
+	if (_get_auth_try()) {
+		/* The modem has it, ask for it from process context */
+		*defer = MB_DATA(mailbox | MBD_SEND_RAW);
+		si->rx_deferred++;
+		return 0;
+	}
+
+	for (i=0;i<IPCIDX_MAX;i++) {
+		rb = &si->rb[i];
+		inbuf = CIRC_CNT(rb->rb_in_head, rb->rb_in_tail, rb->rb_size);
+		if (!inbuf || i == IPCIDX_RAW)
+			continue;
+
+		*defer |= mb_data[i].mask_send
+			| (mailbox & mb_data[i].mask_req_ack);
+	}
+
+	rb = &si->rb[IPCIDX_RAW];
+	inbuf = CIRC_CNT(rb->rb_in_head, rb->rb_in_tail, rb->rb_size);
+
+	if (inbuf && test_and_set_bit(SIPC_RAW_BUSY, &si->rx_flags)) {
+		/* sipc_read() is at it, make sure it has another look */
+		*defer |= MBD_SEND_RAW | (mailbox & MBD_REQ_ACK_RAW);
+		mailbox &= ~MBD_REQ_ACK_RAW;
+	} else if (inbuf) {
+		_non_fmt_wakelock_timeout();
+
+		work = _read_raw_inplace(si, inbuf, rb, budget, 1, &r);
+
+		if (r == -EBADMSG) {
+			purge_buffer(rb);
+			dev_err(&si->svndev->dev, "read err %d\n", r);
+		}
+		inbuf = CIRC_CNT(rb->rb_in_head, rb->rb_in_tail, rb->rb_size);
+
+		smp_mb__before_clear_bit();
+		clear_bit(SIPC_RAW_BUSY, &si->rx_flags);
+
+		if (r < 0 && r != -EBADMSG) {
+			/* Phonet frame or no memory, let sipc_read() try */
+			*defer |= MBD_SEND_RAW
+				| (mailbox & MBD_REQ_ACK_RAW);
+			mailbox &= ~MBD_REQ_ACK_RAW;
+			si->rx_deferred++;
+		}
+	}
+
+	if (mailbox & MBD_REQ_ACK_RAW) {
+		if (inbuf) {
+			/* Out of budget, ack once the buffer is empty */
+			spin_lock_irqsave(&si->mb_lock, flags);
+			si->rx_mailbox |= MB_DATA(MBD_REQ_ACK_RAW);
+			spin_unlock_irqrestore(&si->mb_lock, flags);
+		} else
+			res = MBD_RES_ACK_RAW;
+	}
+
+	_req_rel_auth(si);
+	_put_auth(si);
+
+	if (res)
+		onedram_write_mailbox(MB_DATA(res));
+
+	if (*defer)
+		*defer = MB_DATA(*defer);
+
+	return work;
+}
+
+/* Anything come in since the last sipc_poll()? */
+int sipc_rx_pending(struct sipc *si)
+{
+	return si && si->rx_mailbox;
+}
+
 int sipc_rx(struct sipc *si)
 {
 	int tx_cnt;
@@ -1693,6 +2080,14 @@ ssize_t sipc_debug_show(struct sipc *si, char *buf)
 
 	p += _debug_show_pdp(si, p);
 
+	p += sprintf(p, "\nPDP rx in place: %lu (%lu wrapped)\n",
+			si->rx_inplace, si->rx_wrapped);
+	p += sprintf(p, "RX polls: %lu (%lu deferred)\n",
+			si->rx_polls, si->rx_deferred);
+	p += sprintf(p, "TX buffer full: fmt %lu raw %lu rfs %lu\n",
+			si->tx_full[IPCIDX_FMT], si->tx_full[IPCIDX_RAW],
+			si->tx_full[IPCIDX_RFS]);
+
 	p += sprintf(p, "\nDebug command -----------\n");
 	p += sprintf(p, "R0\tcopy FMT out to in\n");
 	p += sprintf(p, "R1\tcopy RAW out to in\n");
@@ -1717,7 +2112,7 @@ static void test_copy_buf(struct sipc *si, int idx)
 	rb->rb_out_tail = rb->rb_out_head;
 
 	if (si->queue)
-		si->queue(MB_DATA(mb_data[idx].mask_send), si->queue_data);
+		_queue_data(si, MB_DATA(mb_data[idx].mask_send));
 }
 
 int sipc_debug(struct sipc *si, const char *buf)
@@ -1821,7 +2216,7 @@ static int pdp_activate(struct net_device *svndev, int channel)
 		return PTR_ERR(ndev);
 	}
 
-	pdp_devs[idx] = ndev;
+	rcu_assign_pointer(pdp_devs[idx], ndev);
 	pdp_cnt++;
 
 	mutex_unlock(&pdp_mutex);
@@ -1845,7 +2240,7 @@ static int pdp_deactivate(int channel)
 		return -EBUSY;
 	}
 
-	destroy_pdp(&pdp_devs[idx]);
+	_remove_pdp(idx);
 	clear_bit(idx, pdp_bitmap);
 	pdp_cnt--;
 
@@ -36,6 +36,17 @@
 #endif /* LINUX_VERSION_CODE */
 #endif /* CONFIG_ARM */
 
+#if defined(CONFIG_TINY_FSR_DMA)
+#include <linux/completion.h>
+#include <linux/dma-mapping.h>
+#include <linux/hardirq.h>
+#include <linux/mutex.h>
+#include <mach/dma.h>
+#if defined(CONFIG_TINY_FSR_DMA_TEST)
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#endif
+#endif /* CONFIG_TINY_FSR_DMA */
 
 /* FSR include file */
 #include    "FSR.h"
@@ -51,6 +62,20 @@
     #define SZ_128K                         0x00020000
 #endif
 
+#if defined(CONFIG_TINY_FSR_DMA)
+    /* one memory-to-memory channel serves reads and writes */
+    #define FSR_DMA_CHANNEL                 DMACH_ONENAND_IN
+    #define FSR_DMA_TIMEOUT                 (HZ)
+    /* partial cache lines must not be invalidated under the CPU */
+    #define FSR_DMA_ALIGN                   (L1_CACHE_BYTES)
+#endif
+
+#if defined(CONFIG_TINY_FSR_DMA_TEST)
+    #define FSR_DMA_TEST_LOOPS              (256)
+    /* offset of the first main DataRAM buffer (nDataMB00) */
+    #define FSR_DMA_TEST_DATARAM            (0x400)
+#endif
+
 /*****************************************************************************/
 /* Local typedefs                                                            */
 /*****************************************************************************/
@@ -97,6 +122,22 @@ PRIVATE     UINT32          gnSMallocPtr[FSR_MAX_VOLS]          = {0,0};
 #define SHARED_MEMORY_RESET     (0x2)
 #endif
 
+#if defined(CONFIG_TINY_FSR_DMA)
+/* DataRAM window handed out by FSR_OAM_Pa2Va() */
+PRIVATE     UINT32          gnDevPhyAddr        = 0;
+PRIVATE     UINT32          gnDevVirAddr        = 0;
+PRIVATE     BOOL32          gbDMAInit           = FALSE32;
+PRIVATE     BOOL32          gbDMAReady          = FALSE32;
+PRIVATE     BOOL32          gbDMAError          = FALSE32;
+
+static DEFINE_MUTEX(fsr_dma_lock);
+static DECLARE_COMPLETION(fsr_dma_done);
+
+static struct s3c2410_dma_client fsr_dma_client = {
+    .name = "tfsr-onenand",
+};
+#endif
+
 /*****************************************************************************/
 /* Static function prototypes                                                */
 /*****************************************************************************/
@@ -637,6 +678,12 @@ FSR_OAM_Pa2Va(UINT32 nPAddr)
     FSR_STACK_END;
 
     ioaddr = (unsigned long) ioremap(nPAddr, SZ_128K);
+
+#if defined(CONFIG_TINY_FSR_DMA)
+    gnDevPhyAddr = nPAddr;
+    gnDevVirAddr = (UINT32) ioaddr;
+#endif
+
     return ioaddr;
 }
 
@@ -1004,8 +1051,262 @@ FSR_OAM_GetElapsedTime(VOID)
     return -1;
 }
 
+#if defined(CONFIG_TINY_FSR_DMA)
+static void
+fsr_dma_finish(struct s3c2410_dma_chan *pChan, void *pId, int nSize,
+               enum s3c2410_dma_buffresult eResult)
+{
+    if (eResult != S3C2410_RES_OK)
+    {
+        gbDMAError = TRUE32;
+    }
+    complete(&fsr_dma_done);
+}
+
+static inline BOOL32
+fsr_dma_in_dataram(UINT32 nVirAddr, UINT32 nSize)
+{
+    return (gnDevVirAddr != 0 && nVirAddr >= gnDevVirAddr &&
+            nVirAddr + nSize <= gnDevVirAddr + SZ_128K) ? TRUE32 : FALSE32;
+}
+
+/*
+ * Get the bus address of a DataRAM or system memory buffer. The DataRAM
+ * is mapped uncached and needs no cache maintenance; system memory must
+ * be physically contiguous lowmem and cache line aligned.
+ */
+static BOOL32
+fsr_dma_map(UINT32 nVirAddr, UINT32 nSize, enum dma_data_direction eDir,
+            dma_addr_t *pnBusAddr)
+{
+    if (fsr_dma_in_dataram(nVirAddr, nSize) == TRUE32)
+    {
+        *pnBusAddr = gnDevPhyAddr + (nVirAddr - gnDevVirAddr);
+        return TRUE32;
+    }
+
+    if (((nVirAddr | nSize) & (FSR_DMA_ALIGN - 1)) != 0 ||
+        !virt_addr_valid(nVirAddr) || !virt_addr_valid(nVirAddr + nSize - 1))
+    {
+        return FALSE32;
+    }
+
+    *pnBusAddr = dma_map_single(NULL, (void *) nVirAddr, nSize, eDir);
+    return TRUE32;
+}
+
+static void
+fsr_dma_unmap(UINT32 nVirAddr, UINT32 nSize, enum dma_data_direction eDir,
+              dma_addr_t nBusAddr)
+{
+    if (fsr_dma_in_dataram(nVirAddr, nSize) == FALSE32)
+    {
+        dma_unmap_single(NULL, nBusAddr, nSize, eDir);
+    }
+}
+
+/*
+ * Copy nSize bytes with the PL330 and wait for it. Returns FALSE32 without
+ * touching the data if the transfer has to be done by the CPU instead.
+ */
+static BOOL32
+fsr_dma_copy(UINT32 nVirDstAddr, UINT32 nVirSrcAddr, UINT32 nSize)
+{
+    dma_addr_t  nDst;
+    dma_addr_t  nSrc;
+    BOOL32      bRe = FALSE32;
+
+    if (gbDMAReady == FALSE32 || in_atomic() || irqs_disabled())
+    {
+        return FALSE32;
+    }
+
+    if (fsr_dma_map(nVirDstAddr, nSize, DMA_FROM_DEVICE, &nDst) == FALSE32)
+    {
+        return FALSE32;
+    }
+    if (fsr_dma_map(nVirSrcAddr, nSize, DMA_TO_DEVICE, &nSrc) == FALSE32)
+    {
+        fsr_dma_unmap(nVirDstAddr, nSize, DMA_FROM_DEVICE, nDst);
+        return FALSE32;
+    }
+
+    mutex_lock(&fsr_dma_lock);
+
+    INIT_COMPLETION(fsr_dma_done);
+    gbDMAError = FALSE32;
+
+    /* devconfig sets the control flags that config merges in */
+    s3c2410_dma_devconfig(FSR_DMA_CHANNEL, S3C_DMA_MEM2MEM, 1, nSrc);
+    s3c2410_dma_config(FSR_DMA_CHANNEL, 4, 0);
+
+    if (s3c2410_dma_enqueue(FSR_DMA_CHANNEL, NULL, nDst, nSize) == 0 &&
+        wait_for_completion_timeout(&fsr_dma_done, FSR_DMA_TIMEOUT) != 0 &&
+        gbDMAError == FALSE32)
+    {
+        bRe = TRUE32;
+    }
+    else
+    {
+        s3c2410_dma_ctrl(FSR_DMA_CHANNEL, S3C2410_DMAOP_FLUSH);
+        gbDMAReady = FALSE32;
+        printk(KERN_ERR "tfsr: DMA transfer failed, "
+               "OneNAND transfers fall back to the CPU\n");
+    }
+
+    mutex_unlock(&fsr_dma_lock);
+
+    fsr_dma_unmap(nVirSrcAddr, nSize, DMA_TO_DEVICE, nSrc);
+    fsr_dma_unmap(nVirDstAddr, nSize, DMA_FROM_DEVICE, nDst);
+
+    return bRe;
+}
+
+#if defined(CONFIG_TINY_FSR_DMA_TEST)
+/* KB/s for FSR_DMA_TEST_LOOPS copies of nSize bytes taking nNs */
+static inline UINT32
+fsr_dma_kbps(UINT32 nSize, s64 nNs)
+{
+    return (UINT32) div64_u64((u64) nSize * FSR_DMA_TEST_LOOPS * NSEC_PER_SEC,
+                              (u64) (nNs ? nNs : 1) * 1024);
+}
+
+/*
+ * Copy test patterns with both the DMA and memcpy32 between system memory
+ * and a kmalloc'ed buffer that stands in for the DataRAM, and check that
+ * the bytes come out identical. Report the throughput of both, and of
+ * reads from the real (uncached) DataRAM, which is what a page read costs.
+ */
+static void
+fsr_dma_selftest(void)
+{
+    static const UINT32 anSize[] = {FSR_SECTOR_SIZE, FSR_SECTOR_SIZE * 4,
+                                    FSR_SECTOR_SIZE * 8};
+    UINT8      *pDev;
+    UINT8      *pCPU;
+    UINT8      *pDMA;
+    UINT32      nIdx;
+    UINT32      nCnt;
+    UINT32      nSize;
+    ktime_t     stStart;
+    s64         nCPUNs;
+    s64         nDMANs;
+    BOOL32      bOk = TRUE32;
+
+    pDev = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    pCPU = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    pDMA = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (pDev == NULL || pCPU == NULL || pDMA == NULL)
+    {
+        goto out;
+    }
+
+    for (nIdx = 0; nIdx < anSize[ARRAY_SIZE(anSize) - 1]; nIdx++)
+    {
+        pDev[nIdx] = (UINT8) ((nIdx * 2654435761U) >> 24);
+    }
+
+    for (nIdx = 0; nIdx < ARRAY_SIZE(anSize) && bOk == TRUE32; nIdx++)
+    {
+        nSize = anSize[nIdx];
+
+        /* device to memory */
+        memset(pCPU, 0x00, nSize);
+        memset(pDMA, 0xff, nSize);
+        memcpy32(pCPU, pDev, nSize);
+        if (fsr_dma_copy((UINT32) pDMA, (UINT32) pDev, nSize) == FALSE32 ||
+            memcmp(pCPU, pDMA, nSize) != 0)
+        {
+            bOk = FALSE32;
+            break;
+        }
+
+        /* memory to device */
+        for (nCnt = 0; nCnt < nSize; nCnt++)
+        {
+            pDMA[nCnt] = ~pCPU[nCnt];
+        }
+        if (fsr_dma_copy((UINT32) pDev, (UINT32) pDMA, nSize) == FALSE32 ||
+            memcmp(pDev, pDMA, nSize) != 0)
+        {
+            bOk = FALSE32;
+            break;
+        }
+
+        stStart = ktime_get();
+        for (nCnt = 0; nCnt < FSR_DMA_TEST_LOOPS; nCnt++)
+        {
+            memcpy32(pCPU, pDev, nSize);
+        }
+        nCPUNs = ktime_to_ns(ktime_sub(ktime_get(), stStart));
+
+        stStart = ktime_get();
+        for (nCnt = 0; nCnt < FSR_DMA_TEST_LOOPS; nCnt++)
+        {
+            fsr_dma_copy((UINT32) pDMA, (UINT32) pDev, nSize);
+        }
+        nDMANs = ktime_to_ns(ktime_sub(ktime_get(), stStart));
+
+        printk(KERN_INFO "tfsr: DMA test %4u bytes, memory: "
+               "CPU %6u KB/s, DMA %6u KB/s\n", nSize,
+               fsr_dma_kbps(nSize, nCPUNs), fsr_dma_kbps(nSize, nDMANs));
+    }
+
+    if (bOk == TRUE32 && gnDevVirAddr != 0)
+    {
+        /* the DataRAM holds whatever was loaded last; only read it */
+        UINT32 nDataRAM = gnDevVirAddr + FSR_DMA_TEST_DATARAM;
+
+        for (nIdx = 1; nIdx < ARRAY_SIZE(anSize) && bOk == TRUE32; nIdx++)
+        {
+            nSize = anSize[nIdx];
+
+            memcpy32(pCPU, (VOID *) nDataRAM, nSize);
+            if (fsr_dma_copy((UINT32) pDMA, nDataRAM, nSize) == FALSE32 ||
+                memcmp(pCPU, pDMA, nSize) != 0)
+            {
+                bOk = FALSE32;
+                break;
+            }
+
+            stStart = ktime_get();
+            for (nCnt = 0; nCnt < FSR_DMA_TEST_LOOPS; nCnt++)
+            {
+                memcpy32(pCPU, (VOID *) nDataRAM, nSize);
+            }
+            nCPUNs = ktime_to_ns(ktime_sub(ktime_get(), stStart));
+
+            stStart = ktime_get();
+            for (nCnt = 0; nCnt < FSR_DMA_TEST_LOOPS; nCnt++)
+            {
+                fsr_dma_copy((UINT32) pDMA, nDataRAM, nSize);
+            }
+            nDMANs = ktime_to_ns(ktime_sub(ktime_get(), stStart));
+
+            printk(KERN_INFO "tfsr: DMA test %4u bytes, DataRAM: "
+                   "CPU %6u KB/s, DMA %6u KB/s\n", nSize,
+                   fsr_dma_kbps(nSize, nCPUNs), fsr_dma_kbps(nSize, nDMANs));
+        }
+    }
+
+    if (bOk == FALSE32)
+    {
+        gbDMAReady = FALSE32;
+        printk(KERN_ERR "tfsr: DMA test failed at %u bytes, "
+               "OneNAND transfers stay on the CPU\n", nSize);
+    }
+
+out:
+    kfree(pDev);
+    kfree(pCPU);
+    kfree(pDMA);
+}
+#endif /* CONFIG_TINY_FSR_DMA_TEST */
+#endif /* CONFIG_TINY_FSR_DMA */
+
 /**
- * @brief           This function initializes OMAP2420 DMA channel 1
+ * @brief           This function initializes the DMA channel for DataRAM
+ *                  transfers
  *
  * @return          FSR_OAM_SUCCESS;
  *
@@ -1013,6 +1314,7 @@ FSR_OAM_GetElapsedTime(VOID)
  * @version         1.0.0
  *
  * @remark          FSR_OAM_InitDMA() is called after FSR_OAM_Init() is called in FSR_BML_Init()
+ *                  Without a free channel, transfers are done by the CPU.
  */
 PUBLIC INT32
 FSR_OAM_InitDMA(VOID)
@@ -1021,7 +1323,28 @@ FSR_OAM_InitDMA(VOID)
 
     FSR_STACK_END;
 
-    /* initializes DMA registers */
+#if defined(CONFIG_TINY_FSR_DMA)
+    if (gbDMAInit == TRUE32)
+    {
+        return FSR_OAM_SUCCESS;
+    }
+    gbDMAInit = TRUE32;
+
+    if (s3c2410_dma_request(FSR_DMA_CHANNEL, &fsr_dma_client, NULL) < 0)
+    {
+        printk(KERN_WARNING "tfsr: no DMA channel, "
+               "OneNAND transfers stay on the CPU\n");
+        return FSR_OAM_SUCCESS;
+    }
+
+    s3c2410_dma_set_buffdone_fn(FSR_DMA_CHANNEL, fsr_dma_finish);
+    s3c2410_dma_setflags(FSR_DMA_CHANNEL, S3C2410_DMAF_AUTOSTART);
+    gbDMAReady = TRUE32;
+
+#if defined(CONFIG_TINY_FSR_DMA_TEST)
+    fsr_dma_selftest();
+#endif
+#endif /* CONFIG_TINY_FSR_DMA */
 
     return FSR_OAM_SUCCESS;
 }
@@ -1038,6 +1361,7 @@ FSR_OAM_InitDMA(VOID)
  * @author          SongHo Yoon
  * @version         1.0.0
  *
+ * @remark          The CPU copies the data if the DMA cannot.
  */
 PUBLIC INT32
 FSR_OAM_ReadDMA(UINT32     nVirDstAddr,
@@ -1048,6 +1372,13 @@ FSR_OAM_ReadDMA(UINT32     nVirDstAddr,
 
     FSR_STACK_END;
 
+#if defined(CONFIG_TINY_FSR_DMA)
+    if (fsr_dma_copy(nVirDstAddr, nVirSrcAddr, nSize) == TRUE32)
+    {
+        return FSR_OAM_SUCCESS;
+    }
+#endif
+
     memcpy32((void *) nVirDstAddr, (void *) nVirSrcAddr, nSize);
 
     return FSR_OAM_SUCCESS;
@@ -1065,6 +1396,7 @@ FSR_OAM_ReadDMA(UINT32     nVirDstAddr,
  * @author          SongHo Yoon
  * @version         1.0.0
  *
+ * @remark          The CPU copies the data if the DMA cannot.
  */
 PUBLIC INT32
 FSR_OAM_WriteDMA(UINT32     nVirDstAddr,
@@ -1075,6 +1407,13 @@ FSR_OAM_WriteDMA(UINT32     nVirDstAddr,
 
     FSR_STACK_END;
 
+#if defined(CONFIG_TINY_FSR_DMA)
+    if (fsr_dma_copy(nVirDstAddr, nVirSrcAddr, nSize) == TRUE32)
+    {
+        return FSR_OAM_SUCCESS;
+    }
+#endif
+
     memcpy32((void *) nVirDstAddr, (void *) nVirSrcAddr, nSize);
 
     return FSR_OAM_SUCCESS;
@@ -118,10 +118,16 @@
         #define     FSR_ONENAND_PHY_BASE_ADDR       CONFIG_FSR_FLASH_PHYS_ADDR
     #endif
 
+    #if defined(CONFIG_TINY_FSR_DMA)
+    /**< page-sized transfers go through the PL330 (see FSR_OAM_ReadDMA) */
+    #define     FSR_ENABLE_WRITE_DMA
+    #define     FSR_ENABLE_READ_DMA
+    #else
     /**< if FSR_ENABLE_WRITE_DMA is defined, write DMA is enabled */
     #undef      FSR_ENABLE_WRITE_DMA
     /**< if FSR_ENABLE_READ_DMA is defined, read DMA is enabled */
     #undef      FSR_ENABLE_READ_DMA
+    #endif
 
 #else /* RTOS (such as Nucleus) or OSLess */
 
@@ -169,6 +175,9 @@
 #define     FSR_OND_2K_PAGE         (1)
 #define     FSR_OND_4K_PAGE         (2)
 
+/* Transfers shorter than a 2KB page are not worth setting up a DMA for */
+#define     FSR_PAM_DMA_MIN_SIZE    (FSR_SECTOR_SIZE * 4)
+
 #define     DBG_PRINT(x)            FSR_DBG_PRINT(x)
 #define     RTL_PRINT(x)            FSR_RTL_PRINT(x)
 
@@ -604,8 +613,15 @@ FSR_PAM_TransToNAND(volatile VOID *pDst,
     FSR_ASSERT(((UINT32) pDst & 0x03) == 0x00000000);
     FSR_ASSERT(nSize > sizeof(UINT32));
 
-	FSR_PAM_Memcpy((VOID *)pDst, (VOID *)pSrc, nSize);
-	   
+    if ((gbUseWriteDMA == TRUE32) && (nSize >= FSR_PAM_DMA_MIN_SIZE))
+    {
+        /* falls back to the CPU for buffers the DMA cannot reach */
+        FSR_OAM_WriteDMA((UINT32) pDst, (UINT32) pSrc, nSize);
+    }
+    else
+    {
+        FSR_PAM_Memcpy((VOID *)pDst, (VOID *)pSrc, nSize);
+    }
 }
 
 /**
@@ -638,7 +654,15 @@ FSR_PAM_TransFromNAND(VOID          *pDst,
     FSR_ASSERT(((UINT32) pDst & 0x03) == 0x00000000);
     FSR_ASSERT(nSize > sizeof(UINT32));
 
-	FSR_PAM_Memcpy((VOID *)pDst, (VOID *)pSrc, nSize);
+    if ((gbUseReadDMA == TRUE32) && (nSize >= FSR_PAM_DMA_MIN_SIZE))
+    {
+        /* falls back to the CPU for buffers the DMA cannot reach */
+        FSR_OAM_ReadDMA((UINT32) pDst, (UINT32) pSrc, nSize);
+    }
+    else
+    {
+        FSR_PAM_Memcpy((VOID *)pDst, (VOID *)pSrc, nSize);
+    }
 }
 
 /**
@@ -232,6 +232,19 @@ static inline unsigned int fsr_stl_page_size(stl_info_t *ssp)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
 #include <linux/blkdev.h>
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+/* per device request statistics, protected by the queue lock */
+struct bml_stats
+{
+	u64			requests;	/* completed read requests */
+	u64			sectors;	/* sectors read */
+	u64			bml_reads;	/* FSR_BML_Read/ReadScts calls */
+	u64			depth;		/* sum of queue depths seen */
+	u64			busy_ns;	/* sum of request latencies */
+	u64			max_ns;		/* longest request latency */
+};
+#endif
+
 struct fsr_dev 
 {
 	struct request		*req;        
@@ -242,7 +255,33 @@ struct fsr_dev
 	struct gendisk		*gd;
 	int			dev_id;
 	struct scatterlist	*sg;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+	struct task_struct	*thread;	/* serves the request queue */
+	u32			first_vpn;	/* of the partition */
+	u32			last_vpn;	/* first one after it */
+	struct bml_stats	stats;
+	/* read-ahead state, used by the request thread only */
+	sector_t		ra_next;	/* sector after the last request */
+	u32			ra_window;	/* pages, 0 without a cache */
+	u32			ra_end;		/* page after the last read ahead */
+	u32			ra_vpn;		/* pending read-ahead */
+	u32			ra_pages;
+#endif
 };
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+int bml_cache_init(u32 volume);
+void bml_cache_free(u32 volume);
+u32 bml_cache_pages(u32 volume);
+int bml_cache_read_scts(u32 volume, u32 vpn, u32 off, u32 nsect, char *buf);
+int bml_cache_read_pages(u32 volume, u32 vpn, u32 npages, char *buf);
+int bml_cache_readahead(u32 volume, u32 vpn, u32 npages,
+		struct request_queue *q);
+void bml_cache_invalidate(u32 volume, u32 vpn, u32 npages);
+#ifdef CONFIG_SYSFS
+extern struct attribute_group bml_cache_group;
+#endif
+#endif
 #else
 /* Kernel 2.4 */
 #ifndef __user
@@ -26,6 +26,14 @@
 #include <linux/device.h>
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/scatterlist.h>
+#endif
+
 #include "tfsr_base.h"
 
 #define DEVICE_NAME             "tfsr"
@@ -52,6 +60,369 @@ EXPORT_SYMBOL(bml_module_resume);
 
 #endif /* end of CONFIG_PM */
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+/*
+ * Requests are served by one kernel thread per device instead of in the
+ * request function, so that the queue lock is not dropped and retaken
+ * around every segment and a request is read with as few BML calls as
+ * its memory layout allows.
+ */
+
+/* sectors per request and per merged segment */
+#define BML_MAX_SECTORS		1024
+
+/**
+ * read a run of sectors into a physically contiguous buffer
+ * @param volume        : device number
+ * @param dev           : fsr block device of the partition
+ * @param sector        : first sector, relative to the partition
+ * @param nsect         : number of sectors
+ * @param buf           : destination
+ * @return              number of BML reads on success, -EIO on failure
+ *
+ * A multi-page FSR_BML_Read pipelines the flash: BML transfers each page
+ * to memory while the next one is being loaded, so the whole pages of a
+ * run are read with a single call whenever possible. Partial pages at
+ * either end go through the page cache.
+ */
+static int bml_read_run(u32 volume, struct fsr_dev *dev,
+		unsigned long sector, unsigned long nsect, char *buf)
+{
+	FSRVolSpec *vs;
+	u32 spp_shift, spp_mask, vpn, off, n;
+	int ret, reads = 0;
+
+	vs = fsr_get_vol_spec(volume);
+	spp_shift = ffs(vs->nSctsPerPg) - 1;
+	spp_mask = vs->nSctsPerPg - 1;
+	vpn = dev->first_vpn + (sector >> spp_shift);
+	off = sector & spp_mask;
+
+	/* head, inside the first page */
+	if (off || nsect < vs->nSctsPerPg)
+	{
+		n = min_t(u32, nsect, vs->nSctsPerPg - off);
+		ret = bml_cache_read_scts(volume, vpn, off, n, buf);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		reads += ret;
+		vpn++;
+		nsect -= n;
+		buf += n << SECTOR_BITS;
+	}
+
+	/* whole pages */
+	n = nsect >> spp_shift;
+	if (n)
+	{
+		ret = bml_cache_read_pages(volume, vpn, n, buf);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		reads += ret;
+		vpn += n;
+		nsect &= spp_mask;
+		buf += n << (spp_shift + SECTOR_BITS);
+	}
+
+	/* tail, at the start of the last page */
+	if (nsect)
+	{
+		ret = bml_cache_read_scts(volume, vpn, 0, nsect, buf);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		reads += ret;
+	}
+
+	return reads;
+}
+
+/**
+ * plan read-ahead for a request that was just read
+ * @param dev           : fsr block device
+ * @param sector        : first sector of the request
+ * @param nsect         : number of sectors
+ * @param spp_shift     : log2 of sectors per page
+ *
+ * A request that starts where the previous one ended continues a
+ * sequential stream. The stream is kept up to ra_window pages ahead,
+ * refilled once less than half of that is left.
+ */
+static void bml_plan_readahead(struct fsr_dev *dev, sector_t sector,
+		unsigned int nsect, u32 spp_shift)
+{
+	int sequential = (sector == dev->ra_next);
+	u32 end, start, stop;
+
+	dev->ra_next = sector + nsect;
+	if (!dev->ra_window || !sequential)
+	{
+		return;
+	}
+
+	/* first page not read completely */
+	end = dev->first_vpn + (u32) ((sector + nsect) >> spp_shift);
+
+	if (end >= dev->ra_end || dev->ra_end - end > dev->ra_window)
+	{
+		/* a new stream, or one that caught up */
+		start = end;
+	}
+	else if (dev->ra_end - end > dev->ra_window / 2)
+	{
+		return;
+	}
+	else
+	{
+		start = dev->ra_end;
+	}
+
+	stop = min(end + dev->ra_window, dev->last_vpn);
+	if (start < stop)
+	{
+		dev->ra_vpn = start;
+		dev->ra_pages = stop - start;
+	}
+}
+
+/**
+ * read a whole request
+ * @param dev           : fsr block device
+ * @param req           : request description
+ * @return              number of BML reads on success, negative on error
+ *
+ * blk_rq_map_sg() merges the bios of the request into physically
+ * contiguous segments; each of them is read with as few BML reads as
+ * the page cache allows.
+ */
+static int bml_do_request(struct fsr_dev *dev, struct request *req)
+{
+	u32 volume;
+	unsigned long sector, nsect;
+	struct scatterlist *sg;
+	int nsg, i, ret, reads = 0;
+
+	volume = fsr_vol(dev->gd->first_minor);
+
+	DEBUG(DL3,"TINY[I]: volume(%d), sector(%lu)\n", volume,
+			(unsigned long) blk_rq_pos(req));
+
+	if (!blk_fs_request(req))
+	{
+		return -EIO;
+	}
+
+	if (rq_data_dir(req) != READ)
+	{
+		ERRPRINTK("Unknown request 0x%x\n", (u32) rq_data_dir(req));
+		return -EINVAL;
+	}
+
+	nsg = blk_rq_map_sg(dev->queue, req, dev->sg);
+	sector = blk_rq_pos(req);
+
+	for_each_sg(dev->sg, sg, nsg, i)
+	{
+		nsect = sg->length >> SECTOR_BITS;
+		ret = bml_read_run(volume, dev, sector, nsect, sg_virt(sg));
+		if (ret < 0)
+		{
+			return ret;
+		}
+		reads += ret;
+		sector += nsect;
+	}
+
+	bml_plan_readahead(dev, blk_rq_pos(req), blk_rq_sectors(req),
+			ffs(fsr_get_vol_spec(volume)->nSctsPerPg) - 1);
+
+	DEBUG(DL3,"TINY[O]: volume(%d)\n", volume);
+
+	return reads;
+}
+
+/**
+ * request thread of a device
+ * @param data          : fsr block device
+ * @return              0
+ */
+static int bml_queue_thread(void *data)
+{
+	struct fsr_dev *dev = data;
+	struct request_queue *q = dev->queue;
+	struct request *req;
+	struct bml_stats *st = &dev->stats;
+	u32 volume = fsr_vol(dev->gd->first_minor);
+	u32 ra_vpn, ra_pages;
+	unsigned int depth;
+	ktime_t start;
+	u64 ns;
+	int ret;
+
+	/* page-ins of executables may be needed to free memory */
+	current->flags |= PF_MEMALLOC;
+	set_freezable();
+
+	spin_lock_irq(q->queue_lock);
+	for (;;)
+	{
+		set_current_state(TASK_INTERRUPTIBLE);
+		req = blk_fetch_request(q);
+		if (!req)
+		{
+			if (kthread_should_stop())
+			{
+				__set_current_state(TASK_RUNNING);
+				break;
+			}
+			spin_unlock_irq(q->queue_lock);
+			schedule();
+			try_to_freeze();
+			spin_lock_irq(q->queue_lock);
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		/* requests allocated on the queue, this one included */
+		depth = q->rq.count[BLK_RW_SYNC] + q->rq.count[BLK_RW_ASYNC];
+		spin_unlock_irq(q->queue_lock);
+
+		start = ktime_get();
+		ret = bml_do_request(dev, req);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		spin_lock_irq(q->queue_lock);
+		if (ret >= 0)
+		{
+			st->requests++;
+			st->sectors += blk_rq_sectors(req);
+			st->bml_reads += ret;
+			st->depth += depth;
+			st->busy_ns += ns;
+			if (ns > st->max_ns)
+			{
+				st->max_ns = ns;
+			}
+		}
+		__blk_end_request_all(req, ret < 0 ? ret : 0);
+
+		/* read ahead only while no request is waiting */
+		if (dev->ra_pages && !blk_peek_request(q))
+		{
+			ra_vpn = dev->ra_vpn;
+			ra_pages = dev->ra_pages;
+			dev->ra_pages = 0;
+			spin_unlock_irq(q->queue_lock);
+
+			ret = bml_cache_readahead(volume, ra_vpn, ra_pages, q);
+			dev->ra_end = ra_vpn + (ret > 0 ? ret : 0);
+
+			spin_lock_irq(q->queue_lock);
+		}
+	}
+	spin_unlock_irq(q->queue_lock);
+
+	return 0;
+}
+
+/**
+ * request function, hands the requests to the device thread
+ * @param rq    : request queue which is created by blk_init_queue()
+ * @return              none
+ */
+static void bml_request(struct request_queue *rq)
+{
+	struct fsr_dev *dev = rq->queuedata;
+	struct request *req;
+
+	if (dev->thread)
+	{
+		wake_up_process(dev->thread);
+		return;
+	}
+
+	/* the device is going away */
+	while ((req = blk_fetch_request(rq)) != NULL)
+	{
+		__blk_end_request_all(req, -ENXIO);
+	}
+}
+
+#ifdef CONFIG_SYSFS
+static struct fsr_dev *bml_dev_to_fsr(struct device *dev)
+{
+	return dev_to_disk(dev)->queue->queuedata;
+}
+
+/* copy of the statistics, consistent on 32 bit machines */
+static void bml_get_stats(struct fsr_dev *dev, struct bml_stats *st)
+{
+	spin_lock_irq(&dev->lock);
+	*st = dev->stats;
+	spin_unlock_irq(&dev->lock);
+}
+
+#define BML_STAT_ATTR(name, expr)					\
+static ssize_t bml_##name##_show(struct device *dev,			\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct bml_stats st;						\
+									\
+	bml_get_stats(bml_dev_to_fsr(dev), &st);			\
+	return sprintf(buf, "%llu\n", (unsigned long long) (expr));	\
+}									\
+static DEVICE_ATTR(name, S_IRUGO, bml_##name##_show, NULL)
+
+BML_STAT_ATTR(requests, st.requests);
+BML_STAT_ATTR(sectors, st.sectors);
+BML_STAT_ATTR(bml_reads, st.bml_reads);
+BML_STAT_ATTR(depth_avg,
+	st.requests ? div64_u64(st.depth, st.requests) : 0);
+BML_STAT_ATTR(lat_avg_us,
+	st.requests ? div64_u64(st.busy_ns, st.requests * 1000) : 0);
+BML_STAT_ATTR(lat_max_us, div64_u64(st.max_ns, 1000));
+/* sectors / 2 KB in busy_ns / 10^9 s */
+BML_STAT_ATTR(throughput_kBps,
+	st.busy_ns ? div64_u64(st.sectors * 500000000ULL, st.busy_ns) : 0);
+
+static ssize_t bml_reset_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct fsr_dev *fdev = bml_dev_to_fsr(dev);
+
+	spin_lock_irq(&fdev->lock);
+	memset(&fdev->stats, 0, sizeof(fdev->stats));
+	spin_unlock_irq(&fdev->lock);
+
+	return len;
+}
+static DEVICE_ATTR(reset, S_IWUSR, NULL, bml_reset_store);
+
+static struct attribute *bml_stat_attrs[] = {
+	&dev_attr_requests.attr,
+	&dev_attr_sectors.attr,
+	&dev_attr_bml_reads.attr,
+	&dev_attr_depth_avg.attr,
+	&dev_attr_lat_avg_us.attr,
+	&dev_attr_lat_max_us.attr,
+	&dev_attr_throughput_kBps.attr,
+	&dev_attr_reset.attr,
+	NULL,
+};
+
+/* /sys/block/tfsr<minor>/bml/ */
+static struct attribute_group bml_stat_group = {
+	.name	= "bml",
+	.attrs	= bml_stat_attrs,
+};
+#endif /* CONFIG_SYSFS */
+
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 31) */
 /**
  * transger data from BML to buffer cache
  * @param volume        : device number
@@ -61,11 +432,7 @@ EXPORT_SYMBOL(bml_module_resume);
  *
  * It will erase a block before it do write the data
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-static int bml_transfer(u32 volume, u32 partno, const struct request *req, u32 data_len)
-#else
 static int bml_transfer(u32 volume, u32 partno, const struct request *req)
-#endif
 {
 	unsigned long sector, nsect;
 	char *buf;
@@ -81,13 +448,8 @@ static int bml_transfer(u32 volume, u32 partno, const struct request *req)
 		return 0;
 	}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	sector = blk_rq_pos(req);
-	nsect = data_len >> 9;
-#else
 	sector = req->sector;
 	nsect = req->current_nr_sectors;
-#endif
 	buf = req->buffer;
 	
 	vs = fsr_get_vol_spec(volume);
@@ -156,10 +518,6 @@ static void bml_request(struct request_queue *rq)
 	int ret;
 #endif
 	int trans_ret;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	int error = 0;
-	u32 len = 0;
-#endif
 
 	FSRVolSpec *vs;
 
@@ -169,11 +527,7 @@ static void bml_request(struct request_queue *rq)
 	if (dev->req)
 		return;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	while ((dev->req = req = blk_peek_request(rq)) != NULL)
-#else
 	while ((dev->req = req = elv_next_request(rq)) != NULL) 
-#endif
 	{
 		spin_unlock_irq(rq->queue_lock);
 		
@@ -185,23 +539,6 @@ static void bml_request(struct request_queue *rq)
 		
 		DEBUG(DL3,"TINY[I]: volume(%d), partno(%d)\n", volume, partno);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-		len = blk_rq_cur_bytes(req);
-		if (!( blk_rq_pos(req) & spp_mask) && ( blk_rq_cur_sectors(req) != blk_rq_sectors(req)))
-		{
-			blk_rq_map_sg(rq, req, dev->sg);
-			if (!((dev->sg->length >> SECTOR_BITS) & 0x7))
-			{
-				len = dev->sg->length;
-			}
-			if (len > blk_rq_bytes(req))
-			{
-				len = blk_rq_bytes(req);
-			}
-
-		}
-		trans_ret = bml_transfer(volume, partno, req, len);
-#else
 		if (!(req->sector & spp_mask) && (req->current_nr_sectors != req->nr_sectors))
 		{
 			blk_rq_map_sg(rq, req, dev->sg);
@@ -215,23 +552,9 @@ static void bml_request(struct request_queue *rq)
 			}
 		}
 		trans_ret = bml_transfer(volume, partno, req);
-#endif
 		
 		spin_lock_irq(rq->queue_lock);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-		if (trans_ret)
-		{
-			error = 0;
-		} else
-		{
-			error = -EIO;
-		}
-		/* don't need to check if request is finished */
-		if (blk_rq_sectors(req) <= (len >> 9))
-			list_del_init(&req->queuelist);
-		__blk_end_request(req, error, len);
-
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 25)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 25)
 		req->hard_cur_sectors = req->current_nr_sectors;
 		end_request(req, trans_ret);
 #else	
@@ -253,6 +576,7 @@ static void bml_request(struct request_queue *rq)
 
 	DEBUG(DL3,"TINY[O]\n");
 }
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31) */
 
 /**
  * add each partitions as disk
@@ -266,6 +590,10 @@ static int bml_add_disk(u32 volume, u32 partno)
 	u32 minor, sectors;
 	struct fsr_dev *dev;
 	FSRPartI *pi;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+	u32 nPgsPerUnit;
+	int ret;
+#endif
 	
 	DEBUG(DL3,"TINY[I]: volume(%d), partno(%d)\n", volume, partno);
 
@@ -351,14 +679,77 @@ static int bml_add_disk(u32 volume, u32 partno)
 		sectors = fsr_vol_sectors_nr(volume);
 	}
 	
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+	if (!fsr_is_whole_dev(partno) &&
+		FSR_BML_GetVirUnitInfo(volume, fsr_part_start(pi, partno),
+			&dev->first_vpn, &nPgsPerUnit) != FSR_BML_SUCCESS)
+	{
+		ERRPRINTK("FSR_BML_GetVirUnitInfo FAIL\n");
+		ret = -EIO;
+		goto out_free;
+	}
+
+	/* read ahead by up to a virtual unit */
+	if (fsr_is_whole_dev(partno))
+	{
+		dev->last_vpn = fsr_vol_pages_nr(volume);
+		nPgsPerUnit = fsr_get_vol_spec(volume)->nPgsPerSLCUnit;
+	}
+	else
+	{
+		dev->last_vpn = dev->first_vpn +
+			fsr_part_units_nr(pi, partno) * nPgsPerUnit;
+	}
+	dev->ra_window = min(nPgsPerUnit, bml_cache_pages(volume) / 2);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 34)
+	sg_init_table(dev->sg, dev->queue->limits.max_segments);
+	blk_queue_max_hw_sectors(dev->queue, BML_MAX_SECTORS);
+#else
+	sg_init_table(dev->sg, dev->queue->limits.max_phys_segments);
+	blk_queue_max_sectors(dev->queue, BML_MAX_SECTORS);
+#endif
+	/* let whole requests merge into as few BML reads as possible */
+	blk_queue_max_segment_size(dev->queue, BML_MAX_SECTORS << SECTOR_BITS);
+
+	dev->thread = kthread_run(bml_queue_thread, dev, "tfsrd%d", minor);
+	if (IS_ERR(dev->thread))
+	{
+		ret = PTR_ERR(dev->thread);
+		dev->thread = NULL;
+		goto out_free;
+	}
+#endif
+
 	/* setup block device parameter array */
 	set_capacity(dev->gd, sectors);
 	
 	add_disk(dev->gd);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31) && defined(CONFIG_SYSFS)
+	if (sysfs_create_group(&disk_to_dev(dev->gd)->kobj, &bml_stat_group) ||
+		sysfs_create_group(&disk_to_dev(dev->gd)->kobj, &bml_cache_group))
+	{
+		ERRPRINTK("Can't create statistics of %s\n",
+				dev->gd->disk_name);
+	}
+#endif
 	
 	DEBUG(DL3,"TINY[O]: volume(%d), partno(%d)\n", volume, partno);
 
 	return 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+out_free:
+	put_disk(dev->gd);
+	blk_cleanup_queue(dev->queue);
+	kfree(dev->sg);
+	down(&bml_list_mutex);
+	list_del(&dev->list);
+	up(&bml_list_mutex);
+	kfree(dev);
+	return ret;
+#endif
 }
 
 /**
@@ -373,10 +764,29 @@ static void bml_del_disk(struct fsr_dev *dev)
 
 	if (dev->gd) 
 	{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31) && defined(CONFIG_SYSFS)
+		sysfs_remove_group(&disk_to_dev(dev->gd)->kobj,
+				&bml_cache_group);
+		sysfs_remove_group(&disk_to_dev(dev->gd)->kobj,
+				&bml_stat_group);
+#endif
 		del_gendisk(dev->gd);
 		put_disk(dev->gd);
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+	if (dev->thread)
+	{
+		struct task_struct *thread = dev->thread;
+
+		/* from now on bml_request() fails requests by itself */
+		spin_lock_irq(&dev->lock);
+		dev->thread = NULL;
+		spin_unlock_irq(&dev->lock);
+		kthread_stop(thread);
+	}
+#endif
+
 	kfree(dev->sg);
 
 	if (dev->queue)
@@ -418,6 +828,12 @@ static int bml_blkdev_create(void)
 			FSR_BML_Close(volume, FSR_BML_FLAG_NONE);
 			continue;
 		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+		if (bml_cache_init(volume))
+		{
+			ERRPRINTK("No page cache for volume %d\n", volume);
+		}
+#endif
 		pi = fsr_get_part_spec(volume);
 		nparts = fsr_parts_nr(pi);
 		/*
@@ -521,6 +937,18 @@ static int tfsr_resume(struct device *dev, u32 level)
 			ERRPRINTK("TinyFSR: bml_module_resume fail\n");
 	} 
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+	{
+		u32 volume;
+
+		/* the flash may have been written while we were asleep */
+		for (volume = 0; volume < FSR_MAX_VOLUMES; volume++)
+		{
+			bml_cache_invalidate(volume, 0, ~0U);
+		}
+	}
+#endif
+
 	DEBUG(DL3,"TINY[I]\n");
 
 	return ret;
@@ -642,6 +1070,12 @@ void __exit bml_blkdev_exit(void)
 	driver_unregister(&tfsr_driver);
 #endif
 	bml_blkdev_free();
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+	for (volume = 0; volume < FSR_MAX_VOLUMES; volume++)
+	{
+		bml_cache_free(volume);
+	}
+#endif
 	unregister_blkdev(MAJOR_NR, DEVICE_NAME);
 }
 
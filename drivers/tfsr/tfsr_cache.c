@@ -0,0 +1,571 @@
+/*
+ *---------------------------------------------------------------------------*
+ *                                                                           *
+ * Copyright (C) 2003-2010 Samsung Electronics                               *
+ * This program is free software; you can redistribute it and/or modify      *
+ * it under the terms of the GNU General Public License version 2 as         *
+ * published by the Free Software Foundation.                                *
+ *                                                                           *
+ *---------------------------------------------------------------------------*
+*/
+/**
+ * @version	LinuStoreIII_1.2.0_b038-FSR_1.2.1p1_b139_RTM
+ * @file        drivers/tfsr/tfsr_cache.c
+ * @brief       This file keeps recently read NAND pages of each volume
+ *              for the BML block devices and reads ahead of sequential
+ *              streams
+ *
+*/
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/mutex.h>
+#include <linux/genhd.h>
+#include <linux/math64.h>
+
+#include "tfsr_base.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+
+#ifndef CONFIG_TINY_FSR_CACHE_PAGES
+#define CONFIG_TINY_FSR_CACHE_PAGES	0
+#endif
+
+#define BML_CACHE_HASH_BITS	6
+/* pages read ahead with one BML call */
+#define BML_RA_CHUNK		8
+
+struct bml_cache_page
+{
+	struct list_head	lru;
+	struct hlist_node	hash;
+	u32			vpn;
+	int			valid;
+	int			prefetched;	/* read ahead, not used yet */
+	char			*data;
+};
+
+struct bml_cache_stats
+{
+	u64			hits;		/* pages served from the cache */
+	u64			misses;		/* pages read from the flash */
+	u64			prefetched;	/* pages read ahead */
+	u64			prefetch_hits;	/* of those, pages used */
+	u64			invalidated;	/* pages dropped */
+};
+
+/* one per volume, shared by the whole device and its partitions */
+struct bml_cache
+{
+	struct mutex		lock;
+	u32			page_size;
+	u32			nr_pages;
+	u32			gen;		/* bumped by invalidations */
+	struct bml_cache_page	*pages;
+	struct list_head	lru;		/* most recently used first */
+	struct hlist_head	hash[1 << BML_CACHE_HASH_BITS];
+	struct mutex		ra_lock;	/* serializes ra_buf users */
+	char			*ra_buf;
+	struct bml_cache_stats	stats;
+};
+
+static struct bml_cache *bml_caches[FSR_MAX_VOLUMES];
+
+/**
+ * read whole pages from the flash
+ * @return              0 on success, -EIO on failure
+ */
+static int bml_cache_bml_read(u32 volume, u32 vpn, u32 npages, char *buf)
+{
+	int ret;
+
+	ret = FSR_BML_Read(volume, vpn, npages, buf, NULL, FSR_BML_FLAG_ECC_ON);
+	if (ret != FSR_BML_SUCCESS)
+	{
+		ERRPRINTK("TINY: transfer error = %X\n", ret);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static struct bml_cache_page *bml_cache_find(struct bml_cache *c, u32 vpn)
+{
+	struct bml_cache_page *p;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(p, node,
+			&c->hash[hash_32(vpn, BML_CACHE_HASH_BITS)], hash)
+	{
+		if (p->vpn == vpn)
+		{
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+static void bml_cache_hit(struct bml_cache *c, struct bml_cache_page *p)
+{
+	c->stats.hits++;
+	if (p->prefetched)
+	{
+		c->stats.prefetch_hits++;
+		p->prefetched = 0;
+	}
+	list_move(&p->lru, &c->lru);
+}
+
+/* recycle the least recently used page for vpn, the caller fills it */
+static struct bml_cache_page *bml_cache_get(struct bml_cache *c, u32 vpn)
+{
+	struct bml_cache_page *p;
+
+	p = list_entry(c->lru.prev, struct bml_cache_page, lru);
+	if (p->valid)
+	{
+		hlist_del(&p->hash);
+		p->valid = 0;
+	}
+	p->vpn = vpn;
+	p->prefetched = 0;
+	list_move(&p->lru, &c->lru);
+
+	return p;
+}
+
+static void bml_cache_add(struct bml_cache *c, struct bml_cache_page *p)
+{
+	hlist_add_head(&p->hash,
+			&c->hash[hash_32(p->vpn, BML_CACHE_HASH_BITS)]);
+	p->valid = 1;
+}
+
+/* invalid pages go to the tail, to be recycled first */
+static void bml_cache_drop(struct bml_cache *c, struct bml_cache_page *p)
+{
+	if (p->valid)
+	{
+		hlist_del(&p->hash);
+		p->valid = 0;
+	}
+	list_move_tail(&p->lru, &c->lru);
+}
+
+/**
+ * read sectors of one page through the cache
+ * @param volume        : volume number
+ * @param vpn           : virtual page of the volume
+ * @param off           : first sector in the page
+ * @param nsect         : number of sectors, off + nsect <= sectors per page
+ * @param buf           : destination
+ * @return              number of BML reads on success, -EIO on failure
+ *
+ * FSR_BML_ReadScts loads the whole page for a part of it, so a missing
+ * page is read completely and kept for the other parts.
+ */
+int bml_cache_read_scts(u32 volume, u32 vpn, u32 off, u32 nsect, char *buf)
+{
+	struct bml_cache *c = bml_caches[volume];
+	struct bml_cache_page *p;
+	int ret = 0;
+
+	if (!c)
+	{
+		ret = FSR_BML_ReadScts(volume, vpn, off, nsect, buf, NULL,
+				FSR_BML_FLAG_ECC_ON);
+		if (ret != FSR_BML_SUCCESS)
+		{
+			ERRPRINTK("TINY: transfer error = %X\n", ret);
+			return -EIO;
+		}
+		return 1;
+	}
+
+	mutex_lock(&c->lock);
+
+	p = bml_cache_find(c, vpn);
+	if (p)
+	{
+		bml_cache_hit(c, p);
+	}
+	else
+	{
+		c->stats.misses++;
+		p = bml_cache_get(c, vpn);
+		if (bml_cache_bml_read(volume, vpn, 1, p->data))
+		{
+			bml_cache_drop(c, p);
+			ret = -EIO;
+			goto out;
+		}
+		bml_cache_add(c, p);
+		ret = 1;
+	}
+
+	memcpy(buf, p->data + (off << SECTOR_BITS), nsect << SECTOR_BITS);
+
+out:
+	mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/**
+ * read whole pages, taking the cached ones from the cache
+ * @param volume        : volume number
+ * @param vpn           : first virtual page of the volume
+ * @param npages        : number of pages
+ * @param buf           : destination
+ * @return              number of BML reads on success, -EIO on failure
+ *
+ * Runs of missing pages are read straight into buf with one call each and
+ * are not cached: the page cache above keeps them.
+ */
+int bml_cache_read_pages(u32 volume, u32 vpn, u32 npages, char *buf)
+{
+	struct bml_cache *c = bml_caches[volume];
+	struct bml_cache_page *p;
+	u32 i, run = 0;
+	int ret, reads = 0;
+
+	if (!c)
+	{
+		return bml_cache_bml_read(volume, vpn, npages, buf) ? -EIO : 1;
+	}
+
+	mutex_lock(&c->lock);
+
+	for (i = 0; i < npages; i++)
+	{
+		p = bml_cache_find(c, vpn + i);
+		if (!p)
+		{
+			c->stats.misses++;
+			run++;
+			continue;
+		}
+
+		if (run)
+		{
+			ret = bml_cache_bml_read(volume, vpn + i - run, run,
+					buf + (i - run) * c->page_size);
+			if (ret)
+			{
+				goto out;
+			}
+			reads++;
+			run = 0;
+		}
+
+		bml_cache_hit(c, p);
+		memcpy(buf + i * c->page_size, p->data, c->page_size);
+	}
+
+	ret = 0;
+	if (run)
+	{
+		ret = bml_cache_bml_read(volume, vpn + i - run, run,
+				buf + (i - run) * c->page_size);
+		reads++;
+	}
+
+out:
+	mutex_unlock(&c->lock);
+
+	return ret ? ret : reads;
+}
+
+/**
+ * read pages ahead into the cache
+ * @param volume        : volume number
+ * @param vpn           : first virtual page of the volume
+ * @param npages        : number of pages
+ * @param q             : request queue of the reader
+ * @return              pages covered, negative on error
+ *
+ * Pages are read BML_RA_CHUNK at a time. Read-ahead stops between two
+ * chunks as soon as a request is waiting on the queue.
+ */
+int bml_cache_readahead(u32 volume, u32 vpn, u32 npages,
+		struct request_queue *q)
+{
+	struct bml_cache *c = bml_caches[volume];
+	struct bml_cache_page *p;
+	u32 done = 0, n, i, gen;
+	int busy, ret = 0;
+
+	if (!c)
+	{
+		return 0;
+	}
+
+	mutex_lock(&c->ra_lock);
+
+	while (done < npages)
+	{
+		spin_lock_irq(q->queue_lock);
+		busy = blk_peek_request(q) != NULL;
+		spin_unlock_irq(q->queue_lock);
+		if (busy)
+		{
+			break;
+		}
+
+		/* skip cached pages, then take a run of missing ones */
+		mutex_lock(&c->lock);
+		while (done < npages && bml_cache_find(c, vpn + done))
+		{
+			done++;
+		}
+		for (n = 0; n < BML_RA_CHUNK && done + n < npages &&
+				!bml_cache_find(c, vpn + done + n); n++)
+			;
+		gen = c->gen;
+		mutex_unlock(&c->lock);
+
+		if (!n)
+		{
+			break;
+		}
+
+		ret = bml_cache_bml_read(volume, vpn + done, n, c->ra_buf);
+		if (ret)
+		{
+			break;
+		}
+
+		mutex_lock(&c->lock);
+		/* an invalidation during the read makes the data stale */
+		for (i = 0; i < n && gen == c->gen; i++)
+		{
+			if (bml_cache_find(c, vpn + done + i))
+			{
+				continue;
+			}
+			p = bml_cache_get(c, vpn + done + i);
+			memcpy(p->data, c->ra_buf + i * c->page_size,
+					c->page_size);
+			bml_cache_add(c, p);
+			p->prefetched = 1;
+			c->stats.prefetched++;
+		}
+		mutex_unlock(&c->lock);
+
+		done += n;
+	}
+
+	mutex_unlock(&c->ra_lock);
+
+	return ret ? ret : done;
+}
+
+/**
+ * drop cached pages of a volume
+ * @param volume        : volume number
+ * @param vpn           : first virtual page
+ * @param npages        : number of pages, ~0 for all of them
+ *
+ * Anything that writes or erases the flash behind the block devices must
+ * call this for the pages it changes.
+ */
+void bml_cache_invalidate(u32 volume, u32 vpn, u32 npages)
+{
+	struct bml_cache *c;
+	u32 i;
+
+	if (volume >= FSR_MAX_VOLUMES || !(c = bml_caches[volume]))
+	{
+		return;
+	}
+
+	mutex_lock(&c->lock);
+	c->gen++;
+	for (i = 0; i < c->nr_pages; i++)
+	{
+		struct bml_cache_page *p = &c->pages[i];
+
+		if (p->valid && p->vpn - vpn < npages)
+		{
+			bml_cache_drop(c, p);
+			c->stats.invalidated++;
+		}
+	}
+	mutex_unlock(&c->lock);
+}
+EXPORT_SYMBOL(bml_cache_invalidate);
+
+/**
+ * @return              pages in the cache of the volume, 0 without one
+ */
+u32 bml_cache_pages(u32 volume)
+{
+	return bml_caches[volume] ? bml_caches[volume]->nr_pages : 0;
+}
+
+/**
+ * free the cache of a volume
+ * @param volume        : volume number
+ */
+void bml_cache_free(u32 volume)
+{
+	struct bml_cache *c = bml_caches[volume];
+	u32 i;
+
+	if (!c)
+	{
+		return;
+	}
+	bml_caches[volume] = NULL;
+
+	if (c->pages)
+	{
+		for (i = 0; i < c->nr_pages; i++)
+		{
+			kfree(c->pages[i].data);
+		}
+		kfree(c->pages);
+	}
+	kfree(c->ra_buf);
+	kfree(c);
+}
+
+/**
+ * allocate the cache of a volume
+ * @param volume        : volume number, its volume spec must be up to date
+ * @return              0 on success or with the cache configured out,
+ *                      -ENOMEM on failure
+ */
+int bml_cache_init(u32 volume)
+{
+	FSRVolSpec *vs = fsr_get_vol_spec(volume);
+	struct bml_cache *c;
+	u32 i;
+
+	if (CONFIG_TINY_FSR_CACHE_PAGES == 0 || bml_caches[volume])
+	{
+		return 0;
+	}
+
+	c = kzalloc(sizeof(struct bml_cache), GFP_KERNEL);
+	if (!c)
+	{
+		return -ENOMEM;
+	}
+	bml_caches[volume] = c;
+
+	mutex_init(&c->lock);
+	mutex_init(&c->ra_lock);
+	INIT_LIST_HEAD(&c->lru);
+	for (i = 0; i < ARRAY_SIZE(c->hash); i++)
+	{
+		INIT_HLIST_HEAD(&c->hash[i]);
+	}
+	c->page_size = vs->nSctsPerPg << SECTOR_BITS;
+	c->nr_pages = CONFIG_TINY_FSR_CACHE_PAGES;
+
+	/* kmalloc'ed buffers are cache line aligned, as BML DMA wants */
+	c->ra_buf = kmalloc(BML_RA_CHUNK * c->page_size, GFP_KERNEL);
+	c->pages = kzalloc(c->nr_pages * sizeof(struct bml_cache_page),
+			GFP_KERNEL);
+	if (!c->ra_buf || !c->pages)
+	{
+		goto out_free;
+	}
+
+	for (i = 0; i < c->nr_pages; i++)
+	{
+		struct bml_cache_page *p = &c->pages[i];
+
+		p->data = kmalloc(c->page_size, GFP_KERNEL);
+		if (!p->data)
+		{
+			goto out_free;
+		}
+		INIT_HLIST_NODE(&p->hash);
+		list_add_tail(&p->lru, &c->lru);
+	}
+
+	return 0;
+
+out_free:
+	bml_cache_free(volume);
+	return -ENOMEM;
+}
+
+#ifdef CONFIG_SYSFS
+static struct bml_cache *bml_dev_to_cache(struct device *dev)
+{
+	return bml_caches[fsr_vol(dev_to_disk(dev)->first_minor)];
+}
+
+static void bml_cache_get_stats(struct bml_cache *c,
+		struct bml_cache_stats *st)
+{
+	mutex_lock(&c->lock);
+	*st = c->stats;
+	mutex_unlock(&c->lock);
+}
+
+#define BML_CACHE_ATTR(name, expr)					\
+static ssize_t bml_cache_##name##_show(struct device *dev,		\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct bml_cache *c = bml_dev_to_cache(dev);			\
+	struct bml_cache_stats st;					\
+									\
+	if (!c)								\
+		return sprintf(buf, "0\n");				\
+	bml_cache_get_stats(c, &st);					\
+	return sprintf(buf, "%llu\n", (unsigned long long) (expr));	\
+}									\
+static struct device_attribute bml_cache_attr_##name =			\
+	__ATTR(name, S_IRUGO, bml_cache_##name##_show, NULL)
+
+BML_CACHE_ATTR(pages, c->nr_pages);
+BML_CACHE_ATTR(hits, st.hits);
+BML_CACHE_ATTR(misses, st.misses);
+BML_CACHE_ATTR(hit_pct,
+	st.hits ? div64_u64(st.hits * 100, st.hits + st.misses) : 0);
+/* NAND page loads and transfers the hits did not need */
+BML_CACHE_ATTR(bytes_saved, st.hits * c->page_size);
+BML_CACHE_ATTR(prefetched, st.prefetched);
+BML_CACHE_ATTR(prefetch_hits, st.prefetch_hits);
+BML_CACHE_ATTR(invalidated, st.invalidated);
+
+/* writing anything drops the whole cache of the volume */
+static ssize_t bml_cache_drop_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	bml_cache_invalidate(fsr_vol(dev_to_disk(dev)->first_minor), 0, ~0U);
+
+	return len;
+}
+static struct device_attribute bml_cache_attr_drop =
+	__ATTR(drop, S_IWUSR, NULL, bml_cache_drop_store);
+
+static struct attribute *bml_cache_attrs[] = {
+	&bml_cache_attr_pages.attr,
+	&bml_cache_attr_hits.attr,
+	&bml_cache_attr_misses.attr,
+	&bml_cache_attr_hit_pct.attr,
+	&bml_cache_attr_bytes_saved.attr,
+	&bml_cache_attr_prefetched.attr,
+	&bml_cache_attr_prefetch_hits.attr,
+	&bml_cache_attr_invalidated.attr,
+	&bml_cache_attr_drop.attr,
+	NULL,
+};
+
+/* /sys/block/tfsr<minor>/cache/, the counters are per volume */
+struct attribute_group bml_cache_group = {
+	.name	= "cache",
+	.attrs	= bml_cache_attrs,
+};
+#endif /* CONFIG_SYSFS */
+
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31) */
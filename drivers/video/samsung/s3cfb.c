@@ -27,6 +27,8 @@
 #include <linux/platform_device.h>
 #include <linux/io.h>
 #include <linux/memory.h>
+#include <linux/eventfd.h>
+#include <linux/hrtimer.h>
 #include <plat/clock.h>
 #include <linux/earlysuspend.h>
 #include <plat/power_clk_gating.h>
@@ -130,16 +132,145 @@ int fb_is_primary_device(struct fb_info *fb)
 }
 #endif
 
+static unsigned int s3cfb_frame_period_us(struct s3cfb_global *ctrl)
+{
+	unsigned int hz = ctrl->fake_vsync_hz;
+
+	if (!hz)
+		hz = ctrl->lcd->freq;
+
+	return hz ? USEC_PER_SEC / hz : 0;
+}
+
+/* flip_lock held: let go of the fence of a flip, latched or not */
+static void s3cfb_flip_release(struct s3cfb_global *ctrl,
+				struct s3cfb_window *win)
+{
+	if (win->flip_fence) {
+		eventfd_signal(win->flip_fence, 1);
+		eventfd_ctx_put(win->flip_fence);
+		win->flip_fence = NULL;
+	}
+
+	win->flip_pending = 0;
+	clear_bit(win->id, &ctrl->flip_wins);
+}
+
+/* flip_lock held */
+static void s3cfb_flip_latch(struct s3cfb_global *ctrl, int id, ktime_t now)
+{
+	struct fb_info *fb = ctrl->fb[id];
+	struct s3cfb_window *win = fb->par;
+	unsigned int period = s3cfb_frame_period_us(ctrl);
+	s64 lat;
+
+	/*
+	 * The address registers are shadowed, what is written here is
+	 * scanned out from the next frame on.
+	 */
+	fb->var.yoffset = win->flip_yoffset;
+	s3cfb_set_buffer_address(ctrl, id);
+
+	lat = ktime_to_us(ktime_sub(now, win->flip_time));
+	if (lat > UINT_MAX)
+		lat = UINT_MAX;
+
+	ctrl->flips++;
+	ctrl->flip_lat_sum += lat;
+	if (lat > ctrl->flip_lat_max)
+		ctrl->flip_lat_max = lat;
+
+	/* Should have gone out at the first frame after it was queued */
+	if (period && lat > period + period / 4)
+		ctrl->missed_frames += (unsigned int)lat / period;
+
+	s3cfb_flip_release(ctrl, win);
+}
+
+/* Drop the pending flips, e.g. when the frames stop */
+static void s3cfb_flip_flush(struct s3cfb_global *ctrl)
+{
+	unsigned long flags;
+	int id;
+
+	spin_lock_irqsave(&ctrl->flip_lock, flags);
+	for (id = 0; id < BITS_PER_LONG; id++) {
+		if (test_bit(id, &ctrl->flip_wins))
+			s3cfb_flip_release(ctrl, ctrl->fb[id]->par);
+	}
+	spin_unlock_irqrestore(&ctrl->flip_lock, flags);
+
+	wake_up_all(&ctrl->flip_wq);
+}
+
+static void s3cfb_frame(struct s3cfb_global *ctrl)
+{
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	int id, latched = 0;
+
+	spin_lock_irqsave(&ctrl->flip_lock, flags);
+	ctrl->frames++;
+	for (id = 0; id < BITS_PER_LONG; id++) {
+		if (test_bit(id, &ctrl->flip_wins)) {
+			s3cfb_flip_latch(ctrl, id, now);
+			latched = 1;
+		}
+	}
+	spin_unlock_irqrestore(&ctrl->flip_lock, flags);
+
+	if (latched)
+		wake_up_all(&ctrl->flip_wq);
+
+	ctrl->wq_count++;
+	wake_up_interruptible(&ctrl->wq);
+}
+
 static irqreturn_t s3cfb_irq_frame(int irq, void *dev_id)
 {
 	s3cfb_clear_interrupt(fbdev);
 
-	fbdev->wq_count++;
-	wake_up_interruptible(&fbdev->wq);
+	/* the timer does the frames instead */
+	if (!fbdev->fake_vsync_hz)
+		s3cfb_frame(fbdev);
 
 	return IRQ_HANDLED;
 }
 
+static enum hrtimer_restart s3cfb_fake_vsync(struct hrtimer *timer)
+{
+	struct s3cfb_global *ctrl = container_of(timer,
+					struct s3cfb_global, fake_vsync);
+
+	if (!ctrl->fake_vsync_hz)
+		return HRTIMER_NORESTART;
+
+	s3cfb_frame(ctrl);
+
+	hrtimer_forward_now(timer, ktime_set(0,
+				NSEC_PER_SEC / ctrl->fake_vsync_hz));
+
+	return HRTIMER_RESTART;
+}
+
+static void s3cfb_start_fake_vsync(struct s3cfb_global *ctrl)
+{
+	if (ctrl->fake_vsync_hz)
+		hrtimer_start(&ctrl->fake_vsync, ktime_set(0,
+				NSEC_PER_SEC / ctrl->fake_vsync_hz),
+				HRTIMER_MODE_REL);
+}
+
+static void s3cfb_init_flip(struct s3cfb_global *ctrl)
+{
+	spin_lock_init(&ctrl->flip_lock);
+	init_waitqueue_head(&ctrl->flip_wq);
+	ctrl->flip_wins = 0;
+
+	hrtimer_init(&ctrl->fake_vsync, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ctrl->fake_vsync.function = s3cfb_fake_vsync;
+}
+
 #ifdef CONFIG_FB_S3C_TRACE_UNDERRUN
 static irqreturn_t s3cfb_irq_fifo(int irq, void *dev_id)
 {
@@ -450,12 +581,20 @@ static int s3cfb_blank(int blank_mode, struct fb_info *fb)
 static int s3cfb_pan_display(struct fb_var_screeninfo *var, struct fb_info *fb)
 {
 	struct s3cfb_window *win = fb->par;
+	unsigned long flags;
 
-	if (var->yoffset + var->yres > var->yres_virtual) {
+	if (var->yres > var->yres_virtual ||
+	    var->yoffset > var->yres_virtual - var->yres) {
 		dev_err(fbdev->dev, "invalid yoffset value\n");
 		return -EINVAL;
 	}
 
+	spin_lock_irqsave(&fbdev->flip_lock, flags);
+
+	/* Panning overrides a flip still waiting for its frame */
+	if (win->flip_pending)
+		s3cfb_flip_release(fbdev, win);
+
 	fb->var.yoffset = var->yoffset;
 
 	#ifdef __SEC_FULL_DEBUG_MSG__	//sm.kim: prevent this message because it is printed too many times.
@@ -465,6 +604,9 @@ static int s3cfb_pan_display(struct fb_var_screeninfo *var, struct fb_info *fb)
 
 	s3cfb_set_buffer_address(fbdev, win->id);
 
+	spin_unlock_irqrestore(&fbdev->flip_lock, flags);
+	wake_up_all(&fbdev->flip_wq);
+
 	return 0;
 }
 
@@ -575,6 +717,69 @@ static int s3cfb_wait_for_vsync(void)
 	return 0;
 }
 
+/*
+ * Queue a buffer for the next frame interrupt. There is one flip in
+ * flight per window, a second one waits for the first to be latched.
+ */
+static int s3cfb_queue_flip(struct fb_info *fb, struct s3cfb_user_flip *flip)
+{
+	struct fb_var_screeninfo *var = &fb->var;
+	struct s3cfb_window *win = fb->par;
+	struct eventfd_ctx *fence = NULL;
+	unsigned long flags;
+	int ret;
+
+	/* yoffset comes from userspace: the sum could wrap past the check */
+	if (var->yres > var->yres_virtual ||
+	    flip->yoffset > var->yres_virtual - var->yres) {
+		dev_err(fbdev->dev, "invalid yoffset value\n");
+		return -EINVAL;
+	}
+
+	if (flip->fence_fd >= 0) {
+		fence = eventfd_ctx_fdget(flip->fence_fd);
+		if (IS_ERR(fence))
+			return PTR_ERR(fence);
+	}
+
+	for (;;) {
+		ret = wait_event_interruptible_timeout(fbdev->flip_wq,
+				!win->flip_pending, HZ / 10);
+		if (ret <= 0) {
+			ret = ret ? ret : -ETIMEDOUT;
+			goto err;
+		}
+
+		spin_lock_irqsave(&fbdev->flip_lock, flags);
+		if (!win->flip_pending)
+			break;
+		spin_unlock_irqrestore(&fbdev->flip_lock, flags);
+	}
+
+	win->flip_yoffset = flip->yoffset;
+	win->flip_fence   = fence;
+	win->flip_time    = ktime_get();
+	win->flip_pending = 1;
+	set_bit(win->id, &fbdev->flip_wins);
+
+	spin_unlock_irqrestore(&fbdev->flip_lock, flags);
+
+	if (flip->flags & S3CFB_FLIP_SYNC) {
+		ret = wait_event_interruptible_timeout(fbdev->flip_wq,
+				!win->flip_pending, HZ / 10);
+		if (ret <= 0)
+			return ret ? ret : -ETIMEDOUT;
+	}
+
+	return 0;
+
+err:
+	if (fence)
+		eventfd_ctx_put(fence);
+
+	return ret;
+}
+
 static int s3cfb_ioctl(struct fb_info *fb, unsigned int cmd, unsigned long arg)
 {
 	struct fb_var_screeninfo *var = &fb->var;
@@ -592,6 +797,7 @@ static int s3cfb_ioctl(struct fb_info *fb, unsigned int cmd, unsigned long arg)
 		struct s3cfb_user_window      user_window;
 		struct s3cfb_user_plane_alpha user_alpha;
 		struct s3cfb_user_chroma      user_chroma;
+		struct s3cfb_user_flip        user_flip;
 		int vsync;
 	} p;
 
@@ -657,6 +863,15 @@ static int s3cfb_ioctl(struct fb_info *fb, unsigned int cmd, unsigned long arg)
 		}
 		break;
 
+	case S3CFB_FLIP:
+		if (copy_from_user(&p.user_flip,
+			(struct s3cfb_user_flip __user *) arg,
+			sizeof(p.user_flip)))
+			ret = -EFAULT;
+		else
+			ret = s3cfb_queue_flip(fb, &p.user_flip);
+		break;
+
 	case S3CFB_SET_VSYNC_INT:
 		if (get_user(p.vsync, (int __user *) arg))
 			ret = -EFAULT;
@@ -1154,6 +1369,78 @@ static int s3cfb_sysfs_store_win_power(struct device *dev,
 
 static DEVICE_ATTR(win_power, 0644,
 		   s3cfb_sysfs_show_win_power, s3cfb_sysfs_store_win_power);
+
+static int s3cfb_sysfs_show_flip_stats(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	unsigned long flags;
+	unsigned long frames, flips, missed;
+	unsigned int lat_max;
+	u64 lat_avg;
+
+	spin_lock_irqsave(&fbdev->flip_lock, flags);
+	frames  = fbdev->frames;
+	flips   = fbdev->flips;
+	missed  = fbdev->missed_frames;
+	lat_avg = fbdev->flip_lat_sum;
+	lat_max = fbdev->flip_lat_max;
+	spin_unlock_irqrestore(&fbdev->flip_lock, flags);
+
+	if (flips)
+		do_div(lat_avg, flips);
+
+	return snprintf(buf, PAGE_SIZE,
+			"frames: %lu\n"
+			"flips: %lu\n"
+			"missed frames: %lu\n"
+			"flip latency: avg %llu us, max %u us\n",
+			frames, flips, missed, lat_avg, lat_max);
+}
+
+/* any write clears the stats */
+static int s3cfb_sysfs_store_flip_stats(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&fbdev->flip_lock, flags);
+	fbdev->frames        = 0;
+	fbdev->flips         = 0;
+	fbdev->missed_frames = 0;
+	fbdev->flip_lat_sum  = 0;
+	fbdev->flip_lat_max  = 0;
+	spin_unlock_irqrestore(&fbdev->flip_lock, flags);
+
+	return len;
+}
+
+static DEVICE_ATTR(flip_stats, 0644,
+		   s3cfb_sysfs_show_flip_stats, s3cfb_sysfs_store_flip_stats);
+
+static int s3cfb_sysfs_show_fake_vsync(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", fbdev->fake_vsync_hz);
+}
+
+/* frames per second from a timer instead of the frame interrupt, 0 is off */
+static int s3cfb_sysfs_store_fake_vsync(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	unsigned long hz;
+
+	if (strict_strtoul(buf, 10, &hz) || hz > 1000)
+		return -EINVAL;
+
+	hrtimer_cancel(&fbdev->fake_vsync);
+	fbdev->fake_vsync_hz = hz;
+	s3cfb_start_fake_vsync(fbdev);
+
+	return len;
+}
+
+static DEVICE_ATTR(fake_vsync, 0644,
+		   s3cfb_sysfs_show_fake_vsync, s3cfb_sysfs_store_fake_vsync);
 #if defined(CONFIG_FB_S3C_LMS300)||defined(CONFIG_FB_S3C_S6D04D1)
 /* sysfs export of baclight control */
 static int s3cfb_sysfs_show_lcd_power(struct device *dev, struct device_attribute *attr, char *buf)
@@ -1285,6 +1572,7 @@ static int s3cfb_probe(struct platform_device *pdev)
 
 	/* init global */
 	s3cfb_init_global();	
+	s3cfb_init_flip(fbdev);
 	
 	/* irq */
 	fbdev->irq = platform_get_irq(pdev, 0);
@@ -1366,6 +1654,14 @@ static int s3cfb_probe(struct platform_device *pdev)
 	ret = device_create_file(&(pdev->dev), &dev_attr_win_power);
 	if (ret < 0)
 		dev_err(fbdev->dev, "failed to add sysfs entries\n");
+
+	ret = device_create_file(&(pdev->dev), &dev_attr_flip_stats);
+	if (ret < 0)
+		dev_err(fbdev->dev, "failed to add sysfs entries\n");
+
+	ret = device_create_file(&(pdev->dev), &dev_attr_fake_vsync);
+	if (ret < 0)
+		dev_err(fbdev->dev, "failed to add sysfs entries\n");
 	
 #if defined(CONFIG_FB_S3C_LMS300)||defined(CONFIG_FB_S3C_S6D04D1)
 	 /* create device files */
@@ -1414,7 +1710,9 @@ static int s3cfb_remove(struct platform_device *pdev)
 
 #endif  /* CONFIG_HAS_EARLYSUSPEND */
 
+	hrtimer_cancel(&fbdev->fake_vsync);
 	free_irq(fbdev->irq, fbdev);
+	s3cfb_flip_flush(fbdev);
 	iounmap(fbdev->regs);
 	clk_disable(fbdev->clock);
 	clk_put(fbdev->clock);
@@ -1458,6 +1756,10 @@ static int s3cfb_suspend_sub(struct s3c_platform_fb *pdata)
 		}
 	}
 	
+	/* No more frames: nobody waits for the flips to be latched */
+	hrtimer_cancel(&fbdev->fake_vsync);
+	s3cfb_flip_flush(fbdev);
+
 	s3cfb_display_off(fbdev);
 	clk_disable(fbdev->clock);
 
@@ -1524,6 +1826,7 @@ static int s3cfb_resume_sub(struct s3c_platform_fb *pdata)
 	/* enable VSYNC */
 	s3cfb_set_vsync_interrupt (fbdev, 1);
 	s3cfb_set_global_interrupt(fbdev, 1);
+	s3cfb_start_fake_vsync(fbdev);
 
 	//[sm.kim: LCD on/off is controlled by platform
 	//s3cfb_set_lcd_power(ON);
@@ -16,8 +16,12 @@
 #ifdef __KERNEL__
 #include <linux/wait.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
 #include <linux/fb.h>
 #include <plat/fb.h>
+
+struct eventfd_ctx;
 #endif
 
 /*
@@ -178,6 +182,10 @@ struct s3cfb_lcd {
  * @pseudo_pal:		pseudo palette for fb layer
  * @alpha:		alpha blending structure
  * @chroma:		chroma key structure
+ * @flip_pending:	if a flip waits for the next frame interrupt
+ * @flip_yoffset:	yoffset of the pending flip
+ * @flip_fence:		eventfd signalled when the pending flip is latched
+ * @flip_time:		when the pending flip was queued
 */
 struct s3cfb_window {
 	int          id;
@@ -193,6 +201,11 @@ struct s3cfb_window {
 	struct       s3cfb_chroma chroma;
 	int         (*suspend_fifo)(void);
 	int         (*resume_fifo)(void);
+
+	int                  flip_pending;
+	unsigned int         flip_yoffset;
+	struct eventfd_ctx * flip_fence;
+	ktime_t              flip_time;
 };
 
 /*
@@ -205,6 +218,11 @@ struct s3cfb_window {
  * @output:		output path (RGB/I80/Etc)
  * @rgb_mode:		RGB mode
  * @lcd:		pointer to lcd structure
+ * @flip_lock:		protects the flip state of the windows and the stats
+ * @flip_wq:		woken when flips are latched
+ * @flip_wins:		windows with a pending flip
+ * @fake_vsync:		timer standing in for the frame interrupt
+ * @fake_vsync_hz:	its rate, 0 when the frame interrupt is used
 */
 struct s3cfb_global {
 	/* general */
@@ -224,6 +242,20 @@ struct s3cfb_global {
 	enum s3cfb_output_t   output;
 	enum s3cfb_rgb_mode_t rgb_mode;
 	struct s3cfb_lcd *    lcd;
+
+	/* flip queue */
+	spinlock_t        flip_lock;
+	wait_queue_head_t flip_wq;
+	unsigned long     flip_wins;
+	struct hrtimer    fake_vsync;
+	unsigned int      fake_vsync_hz;
+
+	/* flip stats */
+	unsigned long     frames;
+	unsigned long     flips;
+	unsigned long     missed_frames;
+	u64               flip_lat_sum;	/* us */
+	unsigned int      flip_lat_max;	/* us */
 };
 
 
@@ -250,6 +282,20 @@ struct s3cfb_user_chroma {
 	unsigned char blue;
 };
 
+/*
+ * struct s3cfb_user_flip
+ * @yoffset:		buffer to show from the next frame, as for pan display
+ * @fence_fd:		eventfd to signal once latched, or -1
+ * @flags:		S3CFB_FLIP_SYNC to return only once latched
+*/
+struct s3cfb_user_flip {
+	unsigned int yoffset;
+	int          fence_fd;
+	unsigned int flags;
+};
+
+#define S3CFB_FLIP_SYNC	(1 << 0)
+
 #if 1
 // added by jamie (2009.08.18)
 typedef struct {
@@ -282,6 +328,7 @@ typedef struct {
 // added by jamie (2009.08.18)
 #define S3CFB_GET_CURR_FB_INFO    _IOR ('F', 305, s3cfb_next_info_t)
 #endif
+#define S3CFB_FLIP                _IOW ('F', 306, struct s3cfb_user_flip)
 
 /*
  * E X T E R N S
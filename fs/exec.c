@@ -854,6 +854,8 @@ static int de_thread(struct task_struct *tsk)
 		BUG_ON(leader->exit_state != EXIT_ZOMBIE);
 		leader->exit_state = EXIT_DEAD;
 		write_unlock_irq(&tasklist_lock);
+		/* we are the thread group leader now */
+		oom_adj_notify(tsk);
 
 		release_task(leader);
 	}
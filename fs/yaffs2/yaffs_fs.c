@@ -51,6 +51,8 @@ extern const char *yaffs_guts_c_version;
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 
 #include "asm/div64.h"
 
@@ -368,14 +370,143 @@ static const struct super_operations yaffs_super_ops = {
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs locking %p\n", current));
-	down(&dev->grossLock);
+	down_write(&dev->grossLock);
 	T(YAFFS_TRACE_OS, ("yaffs locked %p\n", current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs unlocking %p\n", current));
-	up(&dev->grossLock);
+	up_write(&dev->grossLock);
+}
+
+/* File data is read and written with the gross lock shared and only the
+ * object locked, so that a large write to one file doesn't hold up
+ * readers of the others. yaffs_guts does the rest of the locking, see
+ * yaffs_Device.
+ */
+static void yaffs_SharedLock(yaffs_Device *dev)
+{
+	if (dev->concurrentData)
+		down_read(&dev->grossLock);
+	else
+		yaffs_GrossLock(dev);
+}
+
+static void yaffs_SharedUnlock(yaffs_Device *dev)
+{
+	if (dev->concurrentData)
+		up_read(&dev->grossLock);
+	else
+		yaffs_GrossUnlock(dev);
+}
+
+static void yaffs_DataLock(yaffs_Object *obj)
+{
+	yaffs_SharedLock(obj->myDev);
+	if (obj->myDev->concurrentData)
+		mutex_lock(&obj->lock);
+}
+
+static void yaffs_DataUnlock(yaffs_Object *obj)
+{
+	if (obj->myDev->concurrentData)
+		mutex_unlock(&obj->lock);
+	yaffs_SharedUnlock(obj->myDev);
+}
+
+/* With concurrent data the data path doesn't collect garbage. A thread
+ * per device does, at most every YAFFS_GC_INTERVAL while there are
+ * writes, and writers collect themselves when space gets tight.
+ */
+#define YAFFS_GC_INTERVAL	(HZ * 2)
+
+static int yaffs_BackgroundGC(void *data)
+{
+	yaffs_Device *dev = data;
+	int writes = dev->nPageWrites;
+	long timeout;
+	int more;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		yaffs_GrossLock(dev);
+		more = yaffs_BackgroundGarbageCollect(dev);
+		yaffs_GrossUnlock(dev);
+
+		if (more) {
+			cond_resched();
+			continue;
+		}
+
+		/* Nothing written since the last round, wait for a writer */
+		if (dev->nPageWrites == writes) {
+			dev->gcIdle = 1;
+			timeout = MAX_SCHEDULE_TIMEOUT;
+		} else
+			timeout = YAFFS_GC_INTERVAL;
+		writes = dev->nPageWrites;
+
+		wait_event_freezable_timeout(dev->gcWait,
+				dev->gcWake || kthread_should_stop(), timeout);
+		dev->gcWake = 0;
+		dev->gcIdle = 0;
+	}
+
+	return 0;
+}
+
+static void yaffs_MakeSpace(yaffs_Device *dev)
+{
+	int urgency;
+
+	if (!dev->gcThread)
+		return;
+
+	yaffs_SharedLock(dev);
+	urgency = yaffs_GarbageCollectionUrgency(dev);
+	yaffs_SharedUnlock(dev);
+
+	if (urgency > 1) {
+		yaffs_GrossLock(dev);
+		yaffs_BackgroundGarbageCollect(dev);
+		yaffs_GrossUnlock(dev);
+	} else if (urgency || dev->gcIdle) {
+		dev->gcWake = 1;
+		wake_up(&dev->gcWait);
+	}
+}
+
+static int yaffs_WriteData(yaffs_Object *obj, const __u8 *buf, loff_t pos,
+				int n)
+{
+	yaffs_Device *dev = obj->myDev;
+	int nWritten;
+	int more;
+
+	yaffs_MakeSpace(dev);
+
+	yaffs_DataLock(obj);
+	nWritten = yaffs_WriteDataToFile(obj, buf, pos, n, 0);
+	yaffs_DataUnlock(obj);
+
+	if (nWritten < n && dev->gcThread) {
+		/* The collector may be behind, catch up and go again */
+		yaffs_GrossLock(dev);
+		yaffs_BackgroundGarbageCollect(dev);
+		yaffs_GrossUnlock(dev);
+
+		yaffs_DataLock(obj);
+		more = yaffs_WriteDataToFile(obj, buf + nWritten,
+					pos + nWritten, n - nWritten, 0);
+		yaffs_DataUnlock(obj);
+
+		if (more > 0)
+			nWritten += more;
+	}
+
+	return nWritten;
 }
 
 
@@ -720,16 +851,12 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	unsigned char *pg_buf;
 	int ret;
 
-	yaffs_Device *dev;
-
 	T(YAFFS_TRACE_OS, ("yaffs_readpage at %08x, size %08x\n",
 			(unsigned)(pg->index << PAGE_CACHE_SHIFT),
 			(unsigned)PAGE_CACHE_SIZE));
 
 	obj = yaffs_DentryToObject(f->f_dentry);
 
-	dev = obj->myDev;
-
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 	BUG_ON(!PageLocked(pg));
 #else
@@ -740,13 +867,13 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	yaffs_DataLock(obj);
 
 	ret = yaffs_ReadDataFromFile(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_DataUnlock(obj);
 
 	if (ret >= 0)
 		ret = 0;
@@ -825,7 +952,6 @@ static int yaffs_writepage(struct page *page)
 	buffer = kmap(page);
 
 	obj = yaffs_InodeToObject(inode);
-	yaffs_GrossLock(obj->myDev);
 
 	T(YAFFS_TRACE_OS,
 		("yaffs_writepage at %08x, size %08x\n",
@@ -834,15 +960,13 @@ static int yaffs_writepage(struct page *page)
 		("writepag0: obj = %05x, ino = %05x\n",
 		(int)obj->variant.fileVariant.fileSize, (int)inode->i_size));
 
-	nWritten = yaffs_WriteDataToFile(obj, buffer,
-			page->index << PAGE_CACHE_SHIFT, nBytes, 0);
+	nWritten = yaffs_WriteData(obj, buffer,
+			page->index << PAGE_CACHE_SHIFT, nBytes);
 
 	T(YAFFS_TRACE_OS,
 		("writepag1: obj = %05x, ino = %05x\n",
 		(int)obj->variant.fileVariant.fileSize, (int)inode->i_size));
 
-	yaffs_GrossUnlock(obj->myDev);
-
 	kunmap(page);
 	SetPageUptodate(page);
 	UnlockPage(page);
@@ -1151,14 +1275,9 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 	yaffs_Object *obj;
 	int nWritten, ipos;
 	struct inode *inode;
-	yaffs_Device *dev;
 
 	obj = yaffs_DentryToObject(f->f_dentry);
 
-	dev = obj->myDev;
-
-	yaffs_GrossLock(dev);
-
 	inode = f->f_dentry->d_inode;
 
 	if (!S_ISBLK(inode->i_mode) && f->f_flags & O_APPEND)
@@ -1175,7 +1294,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 			"to object %d at %d\n",
 			n, obj->objectId, ipos));
 
-	nWritten = yaffs_WriteDataToFile(obj, buf, ipos, n, 0);
+	nWritten = yaffs_WriteData(obj, buf, ipos, n);
 
 	T(YAFFS_TRACE_OS,
 		("yaffs_file_write writing %zu bytes, %d written at %d\n",
@@ -1195,7 +1314,6 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 		}
 
 	}
-	yaffs_GrossUnlock(dev);
 	return (nWritten == 0) && (n > 0) ? -ENOSPC : nWritten;
 }
 
@@ -1215,11 +1333,11 @@ static ssize_t yaffs_hold_space(struct file *f)
 
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_SharedLock(dev);
 
 	nFreeChunks = yaffs_GetNumberOfFreeChunks(dev);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_SharedUnlock(dev);
 
 	return (nFreeChunks > 20) ? 1 : 0;
 }
@@ -1234,10 +1352,10 @@ static void yaffs_release_space(struct file *f)
 
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_SharedLock(dev);
 
 
-	yaffs_GrossUnlock(dev);
+	yaffs_SharedUnlock(dev);
 }
 
 static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
@@ -1881,8 +1999,17 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	if (dev->gcThread) {
+		kthread_stop(dev->gcThread);
+		dev->gcThread = NULL;
+	}
+
 	yaffs_GrossLock(dev);
 
+	/* Nothing else runs now, so collect inline again */
+	dev->concurrentData = 0;
+	dev->backgroundGC = 0;
+
 	yaffs_FlushEntireDeviceCache(dev);
 
 	yaffs_CheckpointSave(dev);
@@ -1933,8 +2060,23 @@ typedef struct {
 	int no_cache;
 	int empty_lost_and_found_overridden;
 	int empty_lost_and_found;
+	int block_summary_overridden;
+	int block_summary;
+	int flat_tnodes_overridden;
+	int flat_tnodes;
+	int concurrent_data_overridden;
+	int concurrent_data;
 } yaffs_options;
 
+/* Word-aligned tnodes may use up to 1/64th of RAM more than packed ones */
+static __u32 yaffs_flat_tnode_budget(void)
+{
+	unsigned long pages = min_t(unsigned long, totalram_pages,
+				    0xFFFFFFFFUL >> PAGE_SHIFT);
+
+	return (__u32)pages << (PAGE_SHIFT - 6);
+}
+
 #define MAX_OPT_LEN 20
 static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 {
@@ -1976,6 +2118,24 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 		} else if (!strcmp(cur_opt, "empty-lost-and-found-enable")) {
 			options->empty_lost_and_found = 1;
 			options->empty_lost_and_found_overridden = 1;
+		} else if (!strcmp(cur_opt, "summary")) {
+			options->block_summary = 1;
+			options->block_summary_overridden = 1;
+		} else if (!strcmp(cur_opt, "no-summary")) {
+			options->block_summary = 0;
+			options->block_summary_overridden = 1;
+		} else if (!strcmp(cur_opt, "flat-tnodes")) {
+			options->flat_tnodes = 1;
+			options->flat_tnodes_overridden = 1;
+		} else if (!strcmp(cur_opt, "packed-tnodes")) {
+			options->flat_tnodes = 0;
+			options->flat_tnodes_overridden = 1;
+		} else if (!strcmp(cur_opt, "concurrent-data")) {
+			options->concurrent_data = 1;
+			options->concurrent_data_overridden = 1;
+		} else if (!strcmp(cur_opt, "no-concurrent-data")) {
+			options->concurrent_data = 0;
+			options->concurrent_data_overridden = 1;
 		} else {
 			printk(KERN_INFO "yaffs: Bad mount option \"%s\"\n",
 					cur_opt);
@@ -2244,9 +2404,27 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	dev->wideTnodesDisabled = 1;
 #endif
 
+#ifdef CONFIG_YAFFS_FLAT_TNODES
+	dev->flatTnodeBudget = yaffs_flat_tnode_budget();
+#endif
+	if (options.flat_tnodes_overridden)
+		dev->flatTnodeBudget =
+			options.flat_tnodes ? yaffs_flat_tnode_budget() : 0;
+
+#ifdef CONFIG_YAFFS_CONCURRENT_DATA
+	if (!options.concurrent_data_overridden)
+		options.concurrent_data = 1;
+#endif
+
 	dev->skipCheckpointRead = options.skip_checkpoint_read;
 	dev->skipCheckpointWrite = options.skip_checkpoint_write;
 
+#ifdef CONFIG_YAFFS_BLOCK_SUMMARY
+	dev->blockSummaries = 1;
+#endif
+	if (options.block_summary_overridden)
+		dev->blockSummaries = options.block_summary;
+
 	/* we assume this is protected by lock_kernel() in mount/umount */
 	ylist_add_tail(&dev->devList, &yaffs_dev_list);
 
@@ -2254,7 +2432,8 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         YINIT_LIST_HEAD(&dev->searchContexts);
         dev->removeObjectCallback = yaffs_RemoveObjectCallback;
 
-	init_MUTEX(&dev->grossLock);
+	init_rwsem(&dev->grossLock);
+	init_waitqueue_head(&dev->gcWait);
 
 	yaffs_GrossLock(dev);
 
@@ -2293,6 +2472,23 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
+	/* Concurrent readers need the reentrant mtdif2 read path */
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+	if (options.concurrent_data && dev->isYaffs2 && !dev->inbandTags) {
+		struct task_struct *gc;
+
+		gc = kthread_run(yaffs_BackgroundGC, dev, "yaffs-gc/%d",
+				 mtd->index);
+		if (!IS_ERR(gc)) {
+			dev->gcThread = gc;
+			dev->backgroundGC = 1;
+			dev->concurrentData = 1;
+		}
+	}
+#endif
+	T(YAFFS_TRACE_OS, ("yaffs_read_super: concurrent data %d\n",
+			   dev->concurrentData));
+
 	T(YAFFS_TRACE_OS, ("yaffs_read_super: done\n"));
 	return sb;
 }
@@ -2425,6 +2621,10 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %d\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %d\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %d\n", dev->cacheHits);
+	buf += sprintf(buf, "tnodeWidth......... %d\n", dev->tnodeWidth);
+	buf += sprintf(buf, "tnodeFlat.......... %d\n", dev->tnodeFlat);
+	buf += sprintf(buf, "tnodeCursorHits.... %d\n", dev->tnodeCursorHits);
+	buf += sprintf(buf, "tnodeCursorMisses.. %d\n", dev->tnodeCursorMisses);
 	buf += sprintf(buf, "nDeletedFiles...... %d\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %d\n", dev->nUnlinkedFiles);
 	buf +=
@@ -2432,6 +2632,11 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "useNANDECC......... %d\n", dev->useNANDECC);
 	buf += sprintf(buf, "isYaffs2........... %d\n", dev->isYaffs2);
 	buf += sprintf(buf, "inbandTags......... %d\n", dev->inbandTags);
+	buf += sprintf(buf, "blockSummaries..... %d\n", dev->blockSummaries);
+	buf += sprintf(buf, "nSummaryWrites..... %d\n", dev->nSummaryWrites);
+	buf += sprintf(buf, "nSummaryBlocks..... %d\n", dev->nSummaryBlocks);
+	buf += sprintf(buf, "concurrentData..... %d\n", dev->concurrentData);
+	buf += sprintf(buf, "backgroundGC....... %d\n", dev->backgroundGC);
 
 	return buf;
 }
@@ -31,6 +31,8 @@ const char *yaffs_guts_c_version =
 
 #include "yaffs_nand.h"
 #include "yaffs_packedtags2.h"
+#include "yaffs_scan.h"
+#include "yaffs_summary.h"
 
 
 #define YAFFS_PASSIVE_GC_CHUNKS 2
@@ -189,6 +191,30 @@ static __u32 Shifts(__u32 x)
 
 
 
+/*
+ * Allocator lock. See yaffs_Device for what it covers.
+ */
+
+static void yaffs_LockAllocator(yaffs_Device *dev)
+{
+	if (dev->allocLockDepth && dev->allocLockOwner == Y_CURRENT_TASK) {
+		dev->allocLockDepth++;
+		return;
+	}
+
+	YMUTEX_LOCK(&dev->allocLock);
+	dev->allocLockOwner = Y_CURRENT_TASK;
+	dev->allocLockDepth = 1;
+}
+
+static void yaffs_UnlockAllocator(yaffs_Device *dev)
+{
+	if (--dev->allocLockDepth == 0) {
+		dev->allocLockOwner = NULL;
+		YMUTEX_UNLOCK(&dev->allocLock);
+	}
+}
+
 /*
  * Temporary buffer manipulations.
  */
@@ -213,6 +239,8 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 {
 	int i, j;
 
+	YMUTEX_LOCK(&dev->tempLock);
+
 	dev->tempInUse++;
 	if (dev->tempInUse > dev->maxTemp)
 		dev->maxTemp = dev->tempInUse;
@@ -227,6 +255,7 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 					    dev->tempBuffer[j].line;
 			}
 
+			YMUTEX_UNLOCK(&dev->tempLock);
 			return dev->tempBuffer[i].buffer;
 		}
 	}
@@ -245,6 +274,8 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 	 */
 
 	dev->unmanagedTempAllocations++;
+	YMUTEX_UNLOCK(&dev->tempLock);
+
 	return YMALLOC(dev->nDataBytesPerChunk);
 
 }
@@ -254,15 +285,20 @@ void yaffs_ReleaseTempBuffer(yaffs_Device *dev, __u8 *buffer,
 {
 	int i;
 
+	YMUTEX_LOCK(&dev->tempLock);
+
 	dev->tempInUse--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->tempBuffer[i].buffer == buffer) {
 			dev->tempBuffer[i].line = 0;
+			YMUTEX_UNLOCK(&dev->tempLock);
 			return;
 		}
 	}
 
+	YMUTEX_UNLOCK(&dev->tempLock);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		T(YAFFS_TRACE_BUFFERS,
@@ -918,6 +954,21 @@ static int yaffs_CheckChunkErased(struct yaffs_DeviceStruct *dev,
 
 }
 
+/*
+ * Called by a writer holding the allocator once: drop it while the chunk
+ * is programmed, so that other writers can allocate and update their
+ * files meanwhile. Deeper holders (and the device-wide paths, which hold
+ * the gross lock instead) keep what they have.
+ */
+static int yaffs_ReleaseAllocatorForWrite(yaffs_Device *dev)
+{
+	if (dev->allocLockOwner != Y_CURRENT_TASK || dev->allocLockDepth != 1)
+		return 0;
+
+	yaffs_UnlockAllocator(dev);
+	return 1;
+}
+
 static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 					const __u8 *data,
 					yaffs_ExtendedTags *tags,
@@ -932,6 +983,8 @@ static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 	do {
 		yaffs_BlockInfo *bi = 0;
 		int erasedOk = 0;
+		int released;
+		unsigned sequenceNumber;
 
 		chunk = yaffs_AllocateChunk(dev, useReserve, &bi);
 		if (chunk < 0) {
@@ -977,14 +1030,36 @@ static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 				(TSTR("**>> yaffs chunk %d was not erased"
 				TENDSTR), chunk));
 
+				yaffs_SummaryAbandon(dev, chunk);
+
 				/* try another chunk */
 				continue;
 			}
 			bi->skipErasedCheck = 1;
 		}
 
-		writeOk = yaffs_WriteChunkWithTagsToNAND(dev, chunk,
-				data, tags);
+		/* The summary takes the chunk before the program: once the
+		 * allocator is dropped, the block's summary chunk may be
+		 * handed out and written first.
+		 */
+		sequenceNumber = dev->sequenceNumber;
+		tags->sequenceNumber = sequenceNumber;
+		tags->chunkUsed = 1;
+		yaffs_SummaryAdd(dev, chunk, tags);
+
+		/* Programs go out in allocation order, see yaffs_Device */
+		YMUTEX_LOCK(&dev->progLock);
+		released = yaffs_ReleaseAllocatorForWrite(dev);
+
+		writeOk = yaffs_WriteChunkWithSequenceToNAND(dev, chunk,
+				data, tags, sequenceNumber);
+		if (writeOk != YAFFS_OK)
+			yaffs_SummaryAbandon(dev, chunk);
+
+		YMUTEX_UNLOCK(&dev->progLock);
+		if (released)
+			yaffs_LockAllocator(dev);
+
 		if (writeOk != YAFFS_OK) {
 			yaffs_HandleWriteChunkError(dev, chunk, erasedOk);
 			/* try another chunk */
@@ -1070,6 +1145,8 @@ static void yaffs_HandleUpdateChunk(yaffs_Device *dev, int chunkInNAND,
 
 void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi)
 {
+	yaffs_LockAllocator(dev);
+
 	if (!bi->gcPrioritise) {
 		bi->gcPrioritise = 1;
 		dev->hasPendingPrioritisedGCs = 1;
@@ -1081,6 +1158,8 @@ void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi)
 
 		}
 	}
+
+	yaffs_UnlockAllocator(dev);
 }
 
 static void yaffs_HandleWriteChunkError(yaffs_Device *dev, int chunkInNAND,
@@ -1089,6 +1168,7 @@ static void yaffs_HandleWriteChunkError(yaffs_Device *dev, int chunkInNAND,
 	int blockInNAND = chunkInNAND / dev->nChunksPerBlock;
 	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blockInNAND);
 
+	/* The summary was abandoned when the write failed */
 	yaffs_HandleChunkError(dev, bi);
 
 	if (erasedOk) {
@@ -1292,6 +1372,7 @@ static void yaffs_FreeTnode(yaffs_Device *dev, yaffs_Tnode *tn)
 		tn->internal[0] = dev->freeTnodes;
 		dev->freeTnodes = tn;
 		dev->nFreeTnodes++;
+		dev->tnodeGeneration++; /* drop any cursor that points at it */
 	}
 	dev->nCheckpointBlocksRequired = 0; /* force recalculation*/
 }
@@ -1320,6 +1401,7 @@ static void yaffs_InitialiseTnodes(yaffs_Device *dev)
 	dev->freeTnodes = NULL;
 	dev->nFreeTnodes = 0;
 	dev->nTnodesCreated = 0;
+	dev->tnodeGeneration = 0;
 }
 
 
@@ -1335,6 +1417,11 @@ void yaffs_PutLevel0Tnode(yaffs_Device *dev, yaffs_Tnode *tn, unsigned pos,
 	pos &= YAFFS_TNODES_LEVEL0_MASK;
 	val >>= dev->chunkGroupBits;
 
+	if (dev->tnodeWidth == 32) {
+		map[pos] = val;
+		return;
+	}
+
 	bitInMap = pos * dev->tnodeWidth;
 	wordInMap = bitInMap / 32;
 	bitInWord = bitInMap & (32 - 1);
@@ -1364,6 +1451,13 @@ static __u32 yaffs_GetChunkGroupBase(yaffs_Device *dev, yaffs_Tnode *tn,
 
 	pos &= YAFFS_TNODES_LEVEL0_MASK;
 
+	/* Word and half word entries never straddle a word */
+	if (dev->tnodeWidth == 32)
+		return map[pos] << dev->chunkGroupBits;
+	else if (dev->tnodeWidth == 16)
+		return ((map[pos >> 1] >> ((pos & 1) << 4)) & 0xFFFF) <<
+			dev->chunkGroupBits;
+
 	bitInMap = pos * dev->tnodeWidth;
 	wordInMap = bitInMap / 32;
 	bitInWord = bitInMap & (32 - 1);
@@ -1399,6 +1493,16 @@ static yaffs_Tnode *yaffs_FindLevel0Tnode(yaffs_Device *dev,
 	int requiredTallness;
 	int level = fStruct->topLevel;
 
+	/* Reads and writes mostly stay within the last level 0 tnode used */
+	if (fStruct->cursorTnode &&
+	    fStruct->cursorGeneration == dev->tnodeGeneration &&
+	    fStruct->cursorBase == (chunkId & ~YAFFS_TNODES_LEVEL0_MASK)) {
+		dev->tnodeCursorHits++;
+		return fStruct->cursorTnode;
+	}
+
+	dev->tnodeCursorMisses++;
+
 	/* Check sane level and chunk Id */
 	if (level < 0 || level > YAFFS_TNODES_MAX_LEVEL)
 		return NULL;
@@ -1428,6 +1532,12 @@ static yaffs_Tnode *yaffs_FindLevel0Tnode(yaffs_Device *dev,
 		level--;
 	}
 
+	if (tn) {
+		fStruct->cursorTnode = tn;
+		fStruct->cursorBase = chunkId & ~YAFFS_TNODES_LEVEL0_MASK;
+		fStruct->cursorGeneration = dev->tnodeGeneration;
+	}
+
 	return tn;
 }
 
@@ -1454,6 +1564,13 @@ static yaffs_Tnode *yaffs_AddOrFindLevel0Tnode(yaffs_Device *dev,
 
 	__u32 x;
 
+	if (!passedTn &&
+	    fStruct->cursorTnode &&
+	    fStruct->cursorGeneration == dev->tnodeGeneration &&
+	    fStruct->cursorBase == (chunkId & ~YAFFS_TNODES_LEVEL0_MASK)) {
+		dev->tnodeCursorHits++;
+		return fStruct->cursorTnode;
+	}
 
 	/* Check sane level and page Id */
 	if (fStruct->topLevel < 0 || fStruct->topLevel > YAFFS_TNODES_MAX_LEVEL)
@@ -1532,6 +1649,12 @@ static yaffs_Tnode *yaffs_AddOrFindLevel0Tnode(yaffs_Device *dev,
 		}
 	}
 
+	if (tn) {
+		fStruct->cursorTnode = tn;
+		fStruct->cursorBase = chunkId & ~YAFFS_TNODES_LEVEL0_MASK;
+		fStruct->cursorGeneration = dev->tnodeGeneration;
+	}
+
 	return tn;
 }
 
@@ -1913,6 +2036,7 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 		/* Now sweeten it up... */
 
 		memset(tn, 0, sizeof(yaffs_Object));
+		YMUTEX_INIT(&tn->lock);
 		tn->beingCreated = 1;
 
 		tn->myDev = dev;
@@ -2207,6 +2331,7 @@ yaffs_Object *yaffs_CreateNewObject(yaffs_Device *dev, int number,
 			theObject->variant.fileVariant.shrinkSize = 0xFFFFFFFF;	/* max __u32 */
 			theObject->variant.fileVariant.topLevel = 0;
 			theObject->variant.fileVariant.top = tn;
+			theObject->variant.fileVariant.cursorTnode = NULL;
 			break;
 		case YAFFS_OBJECT_TYPE_DIRECTORY:
 			YINIT_LIST_HEAD(&theObject->variant.directoryVariant.
@@ -2880,6 +3005,9 @@ static int yaffs_CheckSpaceForAllocation(yaffs_Device *dev)
 	int reservedChunks;
 	int reservedBlocks = dev->nReservedBlocks;
 	int checkpointBlocks;
+	int ok;
+
+	yaffs_LockAllocator(dev);
 
 	if (dev->isYaffs2) {
 		checkpointBlocks =  yaffs_CalcCheckpointBlocksRequired(dev) -
@@ -2892,7 +3020,11 @@ static int yaffs_CheckSpaceForAllocation(yaffs_Device *dev)
 
 	reservedChunks = ((reservedBlocks + checkpointBlocks) * dev->nChunksPerBlock);
 
-	return (dev->nFreeChunks > reservedChunks);
+	ok = (dev->nFreeChunks > reservedChunks);
+
+	yaffs_UnlockAllocator(dev);
+
+	return ok;
 }
 
 static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
@@ -2905,6 +3037,8 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		/* Get next block to allocate off */
 		dev->allocationBlock = yaffs_FindBlockForAllocation(dev);
 		dev->allocationPage = 0;
+		if (dev->allocationBlock >= 0)
+			yaffs_SummaryStart(dev, dev->allocationBlock);
 	}
 
 	if (!useReserve && !yaffs_CheckSpaceForAllocation(dev)) {
@@ -2921,6 +3055,20 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 	if (dev->allocationBlock >= 0) {
 		bi = yaffs_GetBlockInfo(dev, dev->allocationBlock);
 
+		if (yaffs_SummaryDue(dev)) {
+			/* The last chunk takes the block's summary. It is
+			 * never in use, so it stays counted as free (dirty)
+			 * space, like a deleted chunk.
+			 */
+			yaffs_SummaryWrite(dev,
+				dev->allocationBlock * dev->nChunksPerBlock +
+				dev->allocationPage);
+			bi->blockState = YAFFS_BLOCK_STATE_FULL;
+			dev->allocationBlock = -1;
+
+			return yaffs_AllocateChunk(dev, useReserve, blockUsedPtr);
+		}
+
 		retVal = (dev->allocationBlock * dev->nChunksPerBlock) +
 			dev->allocationPage;
 		bi->pagesInUse++;
@@ -3288,6 +3436,49 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/* Cheap enough to call on every write. Uses the last checkpoint size
+ * worked out rather than working it out again.
+ */
+int yaffs_GarbageCollectionUrgency(yaffs_Device *dev)
+{
+	int checkpointBlockAdjust;
+	int threshold;
+	int urgency = 0;
+
+	/* Writers sharing the device move the erased block count */
+	yaffs_LockAllocator(dev);
+
+	checkpointBlockAdjust = dev->nCheckpointBlocksRequired -
+				dev->blocksInCheckpoint;
+	if (checkpointBlockAdjust < 0)
+		checkpointBlockAdjust = 0;
+
+	/* Same threshold yaffs_CheckGarbageCollection() goes aggressive at */
+	threshold = dev->nReservedBlocks + checkpointBlockAdjust + 2;
+
+	if (dev->nErasedBlocks < threshold)
+		urgency = 2;
+	else if (dev->nErasedBlocks < threshold + 2)
+		urgency = 1;
+
+	yaffs_UnlockAllocator(dev);
+
+	return urgency;
+}
+
+/* Does one round of collection. Returns 1 if space is still short and
+ * collecting again straight away is worth it.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev)
+{
+	int collections = dev->garbageCollections;
+
+	yaffs_CheckGarbageCollection(dev);
+
+	return dev->garbageCollections != collections &&
+		yaffs_GarbageCollectionUrgency(dev) > 1;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3642,7 +3833,10 @@ static int yaffs_WriteChunkDataToObject(yaffs_Object *in, int chunkInInode,
 
 	yaffs_Device *dev = in->myDev;
 
-	yaffs_CheckGarbageCollection(dev);
+	if (!dev->backgroundGC)
+		yaffs_CheckGarbageCollection(dev);
+
+	yaffs_LockAllocator(dev);
 
 	/* Get the previous chunk at this location in the file if it exists */
 	prevChunkId = yaffs_FindChunkInFile(in, chunkInInode, &prevTags);
@@ -3674,6 +3868,9 @@ static int yaffs_WriteChunkDataToObject(yaffs_Object *in, int chunkInInode,
 
 		yaffs_CheckFileSanity(in);
 	}
+
+	yaffs_UnlockAllocator(dev);
+
 	return newChunkId;
 
 }
@@ -3977,7 +4174,8 @@ static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 	return NULL;
 }
 
-static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
+static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev,
+						yaffs_Object *in)
 {
 	yaffs_ChunkCache *cache;
 	yaffs_Object *theObj;
@@ -4016,8 +4214,16 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 			}
 
 			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
+				/* Flush and try again. Another object's data
+				 * can only be written out while nobody else is
+				 * using that object.
+				 */
+				if (theObj == in) {
+					yaffs_FlushFilesChunkCache(theObj);
+				} else if (theObj && YMUTEX_TRYLOCK(&theObj->lock)) {
+					yaffs_FlushFilesChunkCache(theObj);
+					YMUTEX_UNLOCK(&theObj->lock);
+				}
 				cache = yaffs_GrabChunkCacheWorker(dev);
 			}
 
@@ -4113,7 +4319,8 @@ static int yaffs_WriteCheckpointValidityMarker(yaffs_Device *dev, int head)
 
 	cp.structType = sizeof(cp);
 	cp.magic = YAFFS_MAGIC;
-	cp.version = YAFFS_CHECKPOINT_VERSION;
+	cp.version = dev->tnodeFlat ? YAFFS_CHECKPOINT_FLAT_VERSION :
+				      YAFFS_CHECKPOINT_VERSION;
 	cp.head = (head) ? 1 : 0;
 
 	return (yaffs_CheckpointWrite(dev, &cp, sizeof(cp)) == sizeof(cp)) ?
@@ -4130,7 +4337,9 @@ static int yaffs_ReadCheckpointValidityMarker(yaffs_Device *dev, int head)
 	if (ok)
 		ok = (cp.structType == sizeof(cp)) &&
 		     (cp.magic == YAFFS_MAGIC) &&
-		     (cp.version == YAFFS_CHECKPOINT_VERSION) &&
+		     (cp.version == (dev->tnodeFlat ?
+				     YAFFS_CHECKPOINT_FLAT_VERSION :
+				     YAFFS_CHECKPOINT_VERSION)) &&
 		     (cp.head == ((head) ? 1 : 0));
 	return ok ? 1 : 0;
 }
@@ -4707,6 +4916,8 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 		else
 			nToCopy = dev->nDataBytesPerChunk - start;
 
+		YMUTEX_LOCK(&dev->cacheLock);
+
 		cache = yaffs_FindChunkCache(in, chunk);
 
 		/* If the chunk is already in the cache or it is less than a whole chunk
@@ -4714,12 +4925,12 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 		 * else bypass the cache.
 		 */
 		if (cache || nToCopy != dev->nDataBytesPerChunk || dev->inbandTags) {
-			if (dev->nShortOpCaches > 0) {
 
-				/* If we can't find the data in the cache, then load it up. */
+			/* If we can't find the data in the cache, then load it up. */
 
-				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
+			if (!cache && dev->nShortOpCaches > 0) {
+				cache = yaffs_GrabChunkCache(in->myDev, in);
+				if (cache) {
 					cache->object = in;
 					cache->chunkId = chunk;
 					cache->dirty = 0;
@@ -4729,7 +4940,9 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 								      data);
 					cache->nBytes = 0;
 				}
+			}
 
+			if (cache) {
 				yaffs_UseChunkCache(dev, cache, 0);
 
 				cache->locked = 1;
@@ -4738,10 +4951,16 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 				memcpy(buffer, &cache->data[start], nToCopy);
 
 				cache->locked = 0;
+
+				YMUTEX_UNLOCK(&dev->cacheLock);
 			} else {
+				__u8 *localBuffer;
+
+				YMUTEX_UNLOCK(&dev->cacheLock);
+
 				/* Read into the local buffer then copy..*/
 
-				__u8 *localBuffer =
+				localBuffer =
 				    yaffs_GetTempBuffer(dev, __LINE__);
 				yaffs_ReadChunkDataFromObject(in, chunk,
 							      localBuffer);
@@ -4754,6 +4973,7 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 			}
 
 		} else {
+			YMUTEX_UNLOCK(&dev->cacheLock);
 
 			/* A full chunk. Read directly into the supplied buffer. */
 			yaffs_ReadChunkDataFromObject(in, chunk, buffer);
@@ -4841,22 +5061,33 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			/* An incomplete start or end chunk (or maybe both start and end chunk),
 			 * or we're using inband tags, so we want to use the cache buffers.
 			 */
-			if (dev->nShortOpCaches > 0) {
-				yaffs_ChunkCache *cache;
+			yaffs_ChunkCache *cache;
+			int bypassCache = (dev->nShortOpCaches <= 0);
+
+			if (!bypassCache) {
+				YMUTEX_LOCK(&dev->cacheLock);
+
 				/* If we can't find the data in the cache, then load the cache */
 				cache = yaffs_FindChunkCache(in, chunk);
 
 				if (!cache
 				    && yaffs_CheckSpaceForAllocation(in->
 								     myDev)) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->
-								      data);
+					cache = yaffs_GrabChunkCache(in->myDev, in);
+					if (cache) {
+						cache->object = in;
+						cache->chunkId = chunk;
+						cache->dirty = 0;
+						cache->locked = 0;
+						yaffs_ReadChunkDataFromObject(in, chunk,
+									      cache->
+									      data);
+					} else {
+						/* Every entry holds dirty data of
+						 * objects in use, go round the cache.
+						 */
+						bypassCache = 1;
+					}
 				} else if (cache &&
 					!cache->dirty &&
 					!yaffs_CheckSpaceForAllocation(in->myDev)) {
@@ -4888,10 +5119,14 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 						cache->dirty = 0;
 					}
 
-				} else {
+				} else if (!bypassCache) {
 					chunkWritten = -1;	/* fail the write */
 				}
-			} else {
+
+				YMUTEX_UNLOCK(&dev->cacheLock);
+			}
+
+			if (bypassCache) {
 				/* An incomplete start or end chunk (or maybe both start and end chunk)
 				 * Read into the local buffer then copy, then copy over and write back.
 				 */
@@ -4928,7 +5163,9 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 							 0);
 
 			/* Since we've overwritten the cached data, we better invalidate it. */
+			YMUTEX_LOCK(&dev->cacheLock);
 			yaffs_InvalidateChunkCache(in, chunk);
+			YMUTEX_UNLOCK(&dev->cacheLock);
 		}
 
 		if (chunkWritten >= 0) {
@@ -5384,12 +5621,6 @@ static void yaffs_HandleShadowedObject(yaffs_Device *dev, int objId,
 
 }
 
-typedef struct {
-	int seq;
-	int block;
-} yaffs_BlockIndex;
-
-
 static void yaffs_HardlinkFixup(yaffs_Device *dev, yaffs_Object *hardList)
 {
 	yaffs_Object *hl;
@@ -6119,12 +6350,22 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
 
+	yaffs_ScanReader *reader;
+	yaffs_ExtendedTags *blockTags;
+	yaffs_ExtendedTags *summaryTags = NULL;
+	int usedSummary;
+	int nReads;
+	int parallel = 0;
+	__u32 tStart, tQuery, tSort, tScan, tWait = 0;
+
 	if (!dev->isYaffs2) {
 		T(YAFFS_TRACE_SCAN,
 		  (TSTR("yaffs_ScanBackwards is only for YAFFS2!" TENDSTR)));
 		return YAFFS_FAIL;
 	}
 
+	tStart = Y_TIME_US();
+
 	T(YAFFS_TRACE_SCAN,
 	  (TSTR
 	   ("yaffs_ScanBackwards starts  intstartblk %d intendblk %d..."
@@ -6150,6 +6391,20 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
+	dev->nSummaryBlocks = 0;
+	if (dev->blockSummaries)
+		summaryTags = YMALLOC(dev->nChunksPerBlock * sizeof(yaffs_ExtendedTags));
+
+	/* If the device allows it, read the block states and tags with
+	 * several readers. Only the reads are parallel: the ordering and
+	 * the object reconstruction below stay serial.
+	 */
+	reader = yaffs_ScanReaderCreate(dev);
+	if (reader && yaffs_ScanReaderQuery(reader) != YAFFS_OK) {
+		yaffs_ScanReaderDestroy(reader);
+		reader = NULL;
+	}
+
 	/* Scan all the blocks to determine their state */
 	for (blk = dev->internalStartBlock; blk <= dev->internalEndBlock; blk++) {
 		bi = yaffs_GetBlockInfo(dev, blk);
@@ -6157,7 +6412,10 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 		bi->pagesInUse = 0;
 		bi->softDeletions = 0;
 
-		yaffs_QueryInitialBlockState(dev, blk, &state, &sequenceNumber);
+		if (!reader ||
+		    yaffs_ScanReaderBlockState(reader, blk, &state,
+					       &sequenceNumber) != YAFFS_OK)
+			yaffs_QueryInitialBlockState(dev, blk, &state, &sequenceNumber);
 
 		bi->blockState = state;
 		bi->sequenceNumber = sequenceNumber;
@@ -6207,6 +6465,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 		}
 	}
 
+	tQuery = Y_TIME_US();
+
 	T(YAFFS_TRACE_SCAN,
 	(TSTR("%d blocks to be sorted..." TENDSTR), nBlocksToScan));
 
@@ -6240,6 +6500,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	YYIELD();
 
+	tSort = Y_TIME_US();
+
 	T(YAFFS_TRACE_SCAN, (TSTR("...done" TENDSTR)));
 
 	/* Now scan the blocks looking at the data. */
@@ -6248,6 +6510,13 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	T(YAFFS_TRACE_SCAN_DEBUG,
 	  (TSTR("%d blocks to be scanned" TENDSTR), nBlocksToScan));
 
+	if (reader &&
+	    yaffs_ScanReaderStart(reader, blockIndex, nBlocksToScan) != YAFFS_OK) {
+		yaffs_ScanReaderDestroy(reader);
+		reader = NULL;
+	}
+	parallel = (reader != NULL);
+
 	/* For each block.... backwards */
 	for (blockIterator = endIterator; !alloc_failed && blockIterator >= startIterator;
 			blockIterator--) {
@@ -6265,6 +6534,25 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		blockTags = NULL;
+		usedSummary = 0;
+		if (reader) {
+			__u32 t = Y_TIME_US();
+			blockTags = yaffs_ScanReaderGet(reader, blockIterator,
+							&nReads, &usedSummary);
+			tWait += Y_TIME_US() - t;
+			if (blockTags)
+				dev->nPageReads += nReads;
+		} else if (summaryTags && state == YAFFS_BLOCK_STATE_NEEDS_SCANNING &&
+			   yaffs_SummaryRead(dev, blk, bi->sequenceNumber, chunkData,
+					     summaryTags) == YAFFS_OK) {
+			/* One page gave us the tags of the whole block */
+			blockTags = summaryTags;
+			usedSummary = 1;
+		}
+		if (usedSummary)
+			dev->nSummaryBlocks++;
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->nChunksPerBlock - 1;
@@ -6277,8 +6565,16 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (blockTags) {
+				/* Already read, just do the error handling
+				 * that yaffs_ReadChunkWithTagsFromNAND() would.
+				 */
+				tags = blockTags[c];
+				if (tags.eccResult > YAFFS_ECC_RESULT_NO_ERROR)
+					yaffs_HandleChunkError(dev, bi);
+			} else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
+								&tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -6338,6 +6634,13 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 				  dev->nFreeChunks++;
 
+			} else if (tags.objectId == YAFFS_OBJECTID_SUMMARY) {
+				/* The block's summary: written, but it holds
+				 * no data, so it is dirty space for the gc.
+				 */
+				foundChunksInBlock = 1;
+				dev->nFreeChunks++;
+
 			} else if (tags.chunkId > 0) {
 				/* chunkId > 0 so it is a data chunk... */
 				unsigned int endpos;
@@ -6725,8 +7028,19 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 			yaffs_BlockBecameDirty(dev, blk);
 		}
 
+		if (blockTags && reader)
+			yaffs_ScanReaderPut(reader, blockIterator);
+
 	}
 
+	/* Also stops any readers still running after a failed scan */
+	yaffs_ScanReaderDestroy(reader);
+
+	if (summaryTags)
+		YFREE(summaryTags);
+
+	tScan = Y_TIME_US();
+
 	if (altBlockIndex)
 		YFREE_ALT(blockIndex);
 	else
@@ -6742,6 +7056,15 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
 
+	T(YAFFS_TRACE_ALWAYS,
+	  (TSTR("yaffs: %s: scanned %d blocks (%s, %d from summaries), "
+		"query %u us, sort %u us, "
+		"rebuild %u us (%u us waiting for tags), fixup %u us" TENDSTR),
+	   dev->name ? dev->name : "", nBlocksToScan,
+	   parallel ? "parallel" : "serial", dev->nSummaryBlocks,
+	   tQuery - tStart, tSort - tQuery, tScan - tSort, tWait,
+	   Y_TIME_US() - tScan));
+
 	if (alloc_failed)
 		return YAFFS_FAIL;
 
@@ -7309,6 +7632,13 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 
 	dev->gcBlock = -1;
 
+	YMUTEX_INIT(&dev->cacheLock);
+	YMUTEX_INIT(&dev->allocLock);
+	YMUTEX_INIT(&dev->progLock);
+	YMUTEX_INIT(&dev->tempLock);
+	dev->allocLockOwner = NULL;
+	dev->allocLockDepth = 0;
+
 	if (dev->startBlock == 0) {
 		dev->internalStartBlock = dev->startBlock + 1;
 		dev->internalEndBlock = dev->endBlock + 1;
@@ -7406,7 +7736,29 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	} else
 		dev->tnodeWidth = 16;
 
-	dev->tnodeMask = (1<<dev->tnodeWidth)-1;
+	/* Word-aligned tnodes skip the bit shuffling of packed ones, but cost
+	 * up to twice the RAM. Only use them if the worst case, every chunk
+	 * mapped by a file, fits the budget we were given.
+	 */
+	dev->tnodeFlat = 0;
+	if (dev->flatTnodeBudget && dev->tnodeWidth != 16 &&
+	    dev->tnodeWidth < 32) {
+		__u32 extra = (x / YAFFS_NTNODES_LEVEL0) *
+			      (((32 - dev->tnodeWidth) * YAFFS_NTNODES_LEVEL0) / 8);
+
+		if (extra <= dev->flatTnodeBudget) {
+			dev->tnodeWidth = 32;
+			dev->tnodeFlat = 1;
+		} else
+			T(YAFFS_TRACE_ALWAYS,
+			  (TSTR("yaffs: flat tnodes would need %u more bytes,"
+				" keeping them packed" TENDSTR), extra));
+	}
+
+	if (dev->tnodeWidth < 32)
+		dev->tnodeMask = (1<<dev->tnodeWidth)-1;
+	else
+		dev->tnodeMask = 0xFFFFFFFF;
 
 	/* Level0 Tnodes are 16 bits or wider (if wide tnodes are enabled),
 	 * so if the bitwidth of the
@@ -7500,6 +7852,9 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	if (dev->isYaffs2)
 		dev->useHeaderFileSize = 1;
 
+	if (!init_failed && !yaffs_SummaryInit(dev))
+		init_failed = 1;
+
 	if (!init_failed && !yaffs_InitialiseBlocks(dev))
 		init_failed = 1;
 
@@ -7575,6 +7930,9 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 
 	dev->nRetiredBlocks = 0;
 
+	dev->tnodeCursorHits = 0;
+	dev->tnodeCursorMisses = 0;
+
 	yaffs_VerifyFreeChunks(dev);
 	yaffs_VerifyBlocks(dev);
 
@@ -7611,6 +7969,8 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 
 		YFREE(dev->gcCleanupList);
 
+		yaffs_SummaryDeinit(dev);
+
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
 			YFREE(dev->tempBuffer[i].buffer);
 
@@ -7658,6 +8018,8 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 	int blocksForCheckpoint;
 	int i;
 
+	yaffs_LockAllocator(dev);
+
 #if 1
 	nFree = dev->nFreeChunks;
 #else
@@ -7684,6 +8046,8 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 	nFree -= (blocksForCheckpoint * dev->nChunksPerBlock);
 
+	yaffs_UnlockAllocator(dev);
+
 	if (nFree < 0)
 		nFree = 0;
 
@@ -64,6 +64,10 @@
 #define YAFFS_OBJECT_SPACE		0x40000
 
 #define YAFFS_CHECKPOINT_VERSION 	3
+/* Checkpoints holding word-aligned tnodes. Code that only knows the packed
+ * layout rejects them and scans instead.
+ */
+#define YAFFS_CHECKPOINT_FLAT_VERSION	(0x100 | YAFFS_CHECKPOINT_VERSION)
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -86,6 +90,9 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
+/* Pseudo object id of block summary chunks */
+#define YAFFS_OBJECTID_SUMMARY		0x30
+
 /* */
 
 #define YAFFS_MAX_SHORT_OP_CACHES	20
@@ -383,6 +390,13 @@ typedef struct {
 	__u32 shrinkSize;
 	int topLevel;
 	yaffs_Tnode *top;
+
+	/* Last level 0 tnode looked up, valid while the device's
+	 * tnodeGeneration is unchanged.
+	 */
+	yaffs_Tnode *cursorTnode;
+	__u32 cursorBase;
+	__u32 cursorGeneration;
 } yaffs_FileStructure;
 
 typedef struct {
@@ -480,6 +494,8 @@ struct yaffs_ObjectStruct {
 
 	yaffs_ObjectVariant variant;
 
+	YMUTEX_T lock;		/* File data and tnodes, see yaffs_Device */
+
 };
 
 typedef struct yaffs_ObjectStruct yaffs_Object;
@@ -560,6 +576,8 @@ struct yaffs_DeviceStruct {
 
 	int emptyLostAndFound;  /* Flasg to determine if lst+found should be emptied on init */
 
+	int blockSummaries;	/* Flag to write and scan per-block tag summaries */
+
 	int useNANDECC;		/* Flag to decide whether or not to use NANDECC */
 
 	void *genericDevice;	/* Pointer to device context
@@ -605,6 +623,9 @@ struct yaffs_DeviceStruct {
 	void (*markSuperBlockDirty)(void *superblock);
 
 	int wideTnodesDisabled; /* Set to disable wide tnodes */
+	__u32 flatTnodeBudget;	/* RAM (bytes) word-aligned tnodes may cost over
+				 * packed ones. 0 keeps tnodes bit-packed.
+				 */
 
 	YCHAR *pathDividers;	/* String of legal path dividers */
 
@@ -623,6 +644,8 @@ struct yaffs_DeviceStruct {
 	/* Stuff to support wide tnodes */
 	__u32 tnodeWidth;
 	__u32 tnodeMask;
+	int tnodeFlat;		/* tnodeWidth was widened to 32 bits */
+	__u32 tnodeGeneration;	/* Bumped whenever a tnode is freed */
 
 	/* Stuff for figuring out file offset to chunk conversions */
 	__u32 chunkShift; /* Shift value */
@@ -636,7 +659,7 @@ struct yaffs_DeviceStruct {
 #ifdef __KERNEL__
 
 	struct semaphore sem;	/* Semaphore for waiting on erasure.*/
-	struct semaphore grossLock;	/* Gross locking semaphore */
+	struct rw_semaphore grossLock;	/* Gross lock, shared for file data */
 	struct rw_semaphore dirLock; /* Lock the directory structure */
 	__u8 *spareBuffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
@@ -645,6 +668,12 @@ struct yaffs_DeviceStruct {
 	void (*putSuperFunc) (struct super_block *sb);
         struct ylist_head searchContexts;
 
+	int concurrentData;	/* File data goes under the shared gross lock */
+	struct task_struct *gcThread;
+	wait_queue_head_t gcWait;
+	int gcWake;
+	int gcIdle;
+
 #endif
 
 	int isMounted;
@@ -752,6 +781,8 @@ struct yaffs_DeviceStruct {
 	int srLastUse;
 
 	int cacheHits;
+	int tnodeCursorHits;
+	int tnodeCursorMisses;
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -773,6 +804,39 @@ struct yaffs_DeviceStruct {
 	unsigned sequenceNumber;	/* Sequence number of currently allocating block */
 	unsigned oldestDirtySequence;
 
+	/* Block summaries, see yaffs_summary.c */
+	int summaryBlock;	/* Block the summary is being gathered for, or -1 */
+	__u8 *summaryBuffer;	/* Summary chunk being built */
+	int nSummaryWrites;
+	int nSummaryBlocks;	/* Blocks the last scan read from their summary */
+
+	/* Locking.
+	 * The OS either holds the whole device (its gross lock) or, to read
+	 * or write file data with yaffs_ReadDataFromFile() and
+	 * yaffs_WriteDataToFile(), shares the device and holds the object's
+	 * lock. On the data path yaffs then takes, in this order:
+	 *  cacheLock: the short op cache. Dirty entries of other objects are
+	 *             only flushed if their object lock can be had.
+	 *  allocLock: block info, chunk bits, the allocator, the tnode pool
+	 *             and the free chunk accounting. The holder may take it
+	 *             again, since chunk reads happen both inside and outside.
+	 *  progLock:  programming of newly allocated chunks and summaries.
+	 *             A writer takes it before dropping allocLock for the
+	 *             program, so chunks are programmed in allocation order,
+	 *             and never waits for allocLock while holding it.
+	 *  tempLock:  the temporary buffers.
+	 * Statistics are updated without locks.
+	 */
+	YMUTEX_T cacheLock;
+	YMUTEX_T allocLock;
+	void *allocLockOwner;
+	int allocLockDepth;
+	YMUTEX_T progLock;
+	YMUTEX_T tempLock;
+
+	int backgroundGC;	/* The OS collects garbage with the device held,
+				 * so don't collect on the data path.
+				 */
 };
 
 typedef struct yaffs_DeviceStruct yaffs_Device;
@@ -816,6 +880,12 @@ typedef struct {
 	__u32 head;
 } yaffs_CheckpointValidity;
 
+/* Sequence-ordered list of the blocks a yaffs2 scan has to look at */
+typedef struct {
+	int seq;
+	int block;
+} yaffs_BlockIndex;
+
 
 /*----------------------- YAFFS Functions -----------------------*/
 
@@ -895,6 +965,14 @@ void yfsd_WinFileTimeNow(__u32 target[2]);
 void yaffs_HandleDeferedFree(yaffs_Object *obj);
 #endif
 
+/* Background garbage collection, called with the device held; the
+ * urgency may also be asked with it shared. Urgency 2 means writes may
+ * run out of space before the next collection, 1 that free space is
+ * getting low.
+ */
+int yaffs_GarbageCollectionUrgency(yaffs_Device *dev);
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev);
+
 /* Debug dump  */
 int yaffs_DumpObject(yaffs_Object *obj);
 
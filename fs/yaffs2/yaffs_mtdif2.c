@@ -135,7 +135,10 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		ops.len = data ? dev->nDataBytesPerChunk : sizeof(pt);
 		ops.ooboffs = 0;
 		ops.datbuf = data;
-		ops.oobbuf = dev->spareBuffer;
+		/* Straight into the local copy so the parallel scan readers
+		 * don't share dev->spareBuffer.
+		 */
+		ops.oobbuf = (__u8 *)&pt;
 		retval = mtd->read_oob(mtd, addr, &ops);
 	}
 #else
@@ -165,7 +168,9 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		}
 	} else {
 		if (tags) {
+#if (LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 17))
 			memcpy(&pt, dev->spareBuffer, sizeof(pt));
+#endif
 			yaffs_UnpackTags2(tags, &pt);
 		}
 	}
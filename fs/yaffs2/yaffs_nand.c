@@ -58,6 +58,17 @@ int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   const __u8 *buffer,
 						   yaffs_ExtendedTags *tags)
 {
+	return yaffs_WriteChunkWithSequenceToNAND(dev, chunkInNAND, buffer,
+						  tags, dev->sequenceNumber);
+}
+
+/* For chunks programmed after the allocator moved on to a newer block */
+int yaffs_WriteChunkWithSequenceToNAND(yaffs_Device *dev,
+						   int chunkInNAND,
+						   const __u8 *buffer,
+						   yaffs_ExtendedTags *tags,
+						   unsigned sequenceNumber)
+{
 
 	dev->nPageWrites++;
 
@@ -65,7 +76,7 @@ int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 
 
 	if (tags) {
-		tags->sequenceNumber = dev->sequenceNumber;
+		tags->sequenceNumber = sequenceNumber;
 		tags->chunkUsed = 1;
 		if (!yaffs_ValidateTags(tags)) {
 			T(YAFFS_TRACE_ERROR,
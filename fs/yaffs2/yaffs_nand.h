@@ -28,6 +28,12 @@ int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						const __u8 *buffer,
 						yaffs_ExtendedTags *tags);
 
+int yaffs_WriteChunkWithSequenceToNAND(yaffs_Device *dev,
+						int chunkInNAND,
+						const __u8 *buffer,
+						yaffs_ExtendedTags *tags,
+						unsigned sequenceNumber);
+
 int yaffs_MarkBlockBad(yaffs_Device *dev, int blockNo);
 
 int yaffs_QueryInitialBlockState(yaffs_Device *dev,
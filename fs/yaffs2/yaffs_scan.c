@@ -0,0 +1,447 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2007 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* Parallel tag readers for the yaffs2 mount scan (Linux only) */
+
+const char *yaffs_scan_c_version =
+	"$Id$";
+
+#include "yportenv.h"
+
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+#include <linux/err.h>
+
+#include "yaffs_scan.h"
+#include "yaffs_nand.h"
+#include "yaffs_mtdif2.h"
+#include "yaffs_summary.h"
+
+/* Each reader can have this many blocks read ahead of the scan */
+#define YAFFS_SCAN_SLOTS_PER_READER	2
+
+typedef struct {
+	int blockIterator;	/* Block held in this slot, -1 when free */
+	int ready;
+	int nReads;		/* NAND reads it took to fill the tags */
+	int usedSummary;
+	yaffs_ExtendedTags *tags;	/* nChunksPerBlock entries */
+	__u8 *data;		/* For the summary chunk */
+} yaffs_ScanSlot;
+
+typedef struct {
+	yaffs_BlockState state;
+	__u32 sequenceNumber;
+} yaffs_ScanSummary;
+
+struct yaffs_ScanReaderStruct {
+	yaffs_Device *dev;
+	int nReaders;
+
+	spinlock_t lock;
+	wait_queue_head_t readerWait;	/* Readers waiting for a free slot */
+	wait_queue_head_t scanWait;	/* Scan waiting for a block's tags */
+	atomic_t running;
+	struct completion done;
+	int active;
+	int abort;
+
+	/* Block state query */
+	atomic_t nextQuery;
+	yaffs_ScanSummary *summary;
+	int altSummary;
+
+	/* Tag streaming. Read order k maps to blockIterator nBlocks - 1 - k */
+	const yaffs_BlockIndex *blockIndex;
+	int nBlocks;
+	int nextRead;
+	int nReleased;
+	int nSlots;
+	yaffs_ScanSlot *slots;
+	yaffs_ExtendedTags *tagBuffer;
+	int altTagBuffer;
+	__u8 *dataBuffer;
+	int altDataBuffer;
+};
+
+static void yaffs_ScanReaderExit(yaffs_ScanReader *r)
+{
+	if (atomic_dec_and_test(&r->running))
+		complete(&r->done);
+}
+
+/* Start the reader threads. Returns how many could be started. */
+static int yaffs_ScanReaderRun(yaffs_ScanReader *r, int (*fn)(void *),
+				const char *what)
+{
+	struct task_struct *t;
+	int i;
+
+	INIT_COMPLETION(r->done);
+	r->abort = 0;
+	r->active = 1;
+
+	/* Hold a reference so the threads can't complete us while starting */
+	atomic_set(&r->running, 1);
+
+	for (i = 0; i < r->nReaders; i++) {
+		atomic_inc(&r->running);
+		t = kthread_run(fn, r, "yaffs-%s/%d", what, i);
+		if (IS_ERR(t)) {
+			atomic_dec(&r->running);
+			break;
+		}
+	}
+
+	yaffs_ScanReaderExit(r);
+
+	return i;
+}
+
+static void yaffs_ScanReaderWait(yaffs_ScanReader *r)
+{
+	if (r->active) {
+		wait_for_completion(&r->done);
+		r->active = 0;
+	}
+}
+
+yaffs_ScanReader *yaffs_ScanReaderCreate(yaffs_Device *dev)
+{
+	yaffs_ScanReader *r;
+
+	/* The readers call the MTD layer concurrently, which is only safe
+	 * when the tags go through a local buffer (see yaffs_mtdif2.c).
+	 * Inband tags need the device temp buffers, so they scan serially.
+	 */
+#if (LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 17))
+	return NULL;
+#endif
+	if (!dev->isYaffs2 || dev->inbandTags ||
+	    dev->readChunkWithTagsFromNAND != nandmtd2_ReadChunkWithTagsFromNAND ||
+	    dev->queryNANDBlock != nandmtd2_QueryNANDBlock)
+		return NULL;
+
+	r = YMALLOC(sizeof(yaffs_ScanReader));
+	if (!r)
+		return NULL;
+
+	memset(r, 0, sizeof(yaffs_ScanReader));
+	r->dev = dev;
+	r->nReaders = CONFIG_YAFFS_SCAN_READERS;
+	spin_lock_init(&r->lock);
+	init_waitqueue_head(&r->readerWait);
+	init_waitqueue_head(&r->scanWait);
+	init_completion(&r->done);
+
+	return r;
+}
+
+static void yaffs_ScanReaderFreeSummary(yaffs_ScanReader *r)
+{
+	if (!r->summary)
+		return;
+
+	if (r->altSummary)
+		YFREE_ALT(r->summary);
+	else
+		YFREE(r->summary);
+	r->summary = NULL;
+}
+
+void yaffs_ScanReaderDestroy(yaffs_ScanReader *r)
+{
+	if (!r)
+		return;
+
+	spin_lock(&r->lock);
+	r->abort = 1;
+	spin_unlock(&r->lock);
+	wake_up_all(&r->readerWait);
+	wake_up_all(&r->scanWait);
+
+	yaffs_ScanReaderWait(r);
+
+	yaffs_ScanReaderFreeSummary(r);
+
+	if (r->tagBuffer) {
+		if (r->altTagBuffer)
+			YFREE_ALT(r->tagBuffer);
+		else
+			YFREE(r->tagBuffer);
+	}
+	if (r->dataBuffer) {
+		if (r->altDataBuffer)
+			YFREE_ALT(r->dataBuffer);
+		else
+			YFREE(r->dataBuffer);
+	}
+	if (r->slots)
+		YFREE(r->slots);
+	YFREE(r);
+}
+
+/*------------------------- Block state query -----------------------------*/
+
+static int yaffs_ScanQueryThread(void *data)
+{
+	yaffs_ScanReader *r = data;
+	yaffs_Device *dev = r->dev;
+	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+	int i;
+
+	while (!r->abort) {
+		i = atomic_inc_return(&r->nextQuery) - 1;
+		if (i >= nBlocks)
+			break;
+
+		yaffs_QueryInitialBlockState(dev, dev->internalStartBlock + i,
+					     &r->summary[i].state,
+					     &r->summary[i].sequenceNumber);
+	}
+
+	yaffs_ScanReaderExit(r);
+	return 0;
+}
+
+int yaffs_ScanReaderQuery(yaffs_ScanReader *r)
+{
+	yaffs_Device *dev = r->dev;
+	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+
+	r->summary = YMALLOC(nBlocks * sizeof(yaffs_ScanSummary));
+	if (!r->summary) {
+		r->summary = YMALLOC_ALT(nBlocks * sizeof(yaffs_ScanSummary));
+		r->altSummary = 1;
+	}
+	if (!r->summary)
+		return YAFFS_FAIL;
+
+	atomic_set(&r->nextQuery, 0);
+
+	if (yaffs_ScanReaderRun(r, yaffs_ScanQueryThread, "query") == 0) {
+		yaffs_ScanReaderWait(r);
+		yaffs_ScanReaderFreeSummary(r);
+		return YAFFS_FAIL;
+	}
+
+	yaffs_ScanReaderWait(r);
+
+	return YAFFS_OK;
+}
+
+int yaffs_ScanReaderBlockState(yaffs_ScanReader *r, int blk,
+				yaffs_BlockState *state,
+				__u32 *sequenceNumber)
+{
+	yaffs_ScanSummary *s;
+
+	if (!r->summary)
+		return YAFFS_FAIL;
+
+	s = &r->summary[blk - r->dev->internalStartBlock];
+	*state = s->state;
+	*sequenceNumber = s->sequenceNumber;
+
+	return YAFFS_OK;
+}
+
+/*--------------------------- Tag streaming -------------------------------*/
+
+static int yaffs_ScanSlotFree(yaffs_ScanReader *r, int k)
+{
+	int ret;
+
+	spin_lock(&r->lock);
+	ret = r->abort || k < r->nReleased + r->nSlots;
+	spin_unlock(&r->lock);
+
+	return ret;
+}
+
+static int yaffs_ScanTagsThread(void *data)
+{
+	yaffs_ScanReader *r = data;
+	yaffs_Device *dev = r->dev;
+	yaffs_ScanSlot *slot;
+	const yaffs_BlockIndex *bix;
+	int last = dev->nChunksPerBlock - 1;
+	int nTags;
+	int chunk;
+	int k;
+	int c;
+
+	for (;;) {
+		spin_lock(&r->lock);
+		k = r->abort ? r->nBlocks : r->nextRead++;
+		spin_unlock(&r->lock);
+
+		if (k >= r->nBlocks)
+			break;
+
+		wait_event(r->readerWait, yaffs_ScanSlotFree(r, k));
+		if (r->abort)
+			break;
+
+		slot = &r->slots[k % r->nSlots];
+		bix = &r->blockIndex[r->nBlocks - 1 - k];
+		chunk = bix->block * dev->nChunksPerBlock - dev->chunkOffset;
+
+		/* Page read counts and chunk error handling are left to the
+		 * scan, which owns the block info.
+		 */
+		slot->usedSummary = 0;
+		slot->nReads = 0;
+		nTags = dev->nChunksPerBlock;
+
+		/* With summaries, try the last chunk first: if it holds a
+		 * good summary that was the only read the block needs.
+		 */
+		if (slot->data) {
+			dev->readChunkWithTagsFromNAND(dev, chunk + last,
+						slot->data, &slot->tags[last]);
+			slot->nReads++;
+			nTags = last;
+			if (yaffs_SummaryUnpack(dev, slot->data, bix->seq,
+						slot->tags) == YAFFS_OK) {
+				slot->usedSummary = 1;
+				nTags = 0;
+			}
+		}
+
+		for (c = 0; c < nTags; c++)
+			dev->readChunkWithTagsFromNAND(dev, chunk + c, NULL,
+						       &slot->tags[c]);
+		slot->nReads += nTags;
+
+		spin_lock(&r->lock);
+		slot->blockIterator = r->nBlocks - 1 - k;
+		slot->ready = 1;
+		spin_unlock(&r->lock);
+
+		wake_up_all(&r->scanWait);
+	}
+
+	yaffs_ScanReaderExit(r);
+	return 0;
+}
+
+int yaffs_ScanReaderStart(yaffs_ScanReader *r,
+			  const yaffs_BlockIndex *blockIndex, int nBlocks)
+{
+	yaffs_Device *dev = r->dev;
+	int nTags;
+	int i;
+
+	/* The block states have all been consumed by now */
+	yaffs_ScanReaderFreeSummary(r);
+
+	if (nBlocks < 1)
+		return YAFFS_FAIL;
+
+	r->blockIndex = blockIndex;
+	r->nBlocks = nBlocks;
+	r->nextRead = 0;
+	r->nReleased = 0;
+	r->nSlots = r->nReaders * YAFFS_SCAN_SLOTS_PER_READER;
+
+	r->slots = YMALLOC(r->nSlots * sizeof(yaffs_ScanSlot));
+	if (!r->slots)
+		return YAFFS_FAIL;
+
+	nTags = r->nSlots * dev->nChunksPerBlock;
+	r->tagBuffer = YMALLOC(nTags * sizeof(yaffs_ExtendedTags));
+	if (!r->tagBuffer) {
+		r->tagBuffer = YMALLOC_ALT(nTags * sizeof(yaffs_ExtendedTags));
+		r->altTagBuffer = 1;
+	}
+	if (!r->tagBuffer)
+		return YAFFS_FAIL;
+
+	/* Summaries are read with the page data */
+	if (dev->blockSummaries) {
+		r->dataBuffer = YMALLOC(r->nSlots * dev->totalBytesPerChunk);
+		if (!r->dataBuffer) {
+			r->dataBuffer = YMALLOC_ALT(r->nSlots * dev->totalBytesPerChunk);
+			r->altDataBuffer = 1;
+		}
+		if (!r->dataBuffer)
+			return YAFFS_FAIL;
+	}
+
+	for (i = 0; i < r->nSlots; i++) {
+		r->slots[i].blockIterator = -1;
+		r->slots[i].ready = 0;
+		r->slots[i].tags = &r->tagBuffer[i * dev->nChunksPerBlock];
+		r->slots[i].data = r->dataBuffer ?
+			&r->dataBuffer[i * dev->totalBytesPerChunk] : NULL;
+	}
+
+	if (yaffs_ScanReaderRun(r, yaffs_ScanTagsThread, "scan") == 0)
+		return YAFFS_FAIL;
+
+	return YAFFS_OK;
+}
+
+static int yaffs_ScanSlotReady(yaffs_ScanReader *r, yaffs_ScanSlot *slot,
+				int blockIterator)
+{
+	int ret;
+
+	spin_lock(&r->lock);
+	ret = r->abort ||
+	      (slot->ready && slot->blockIterator == blockIterator);
+	spin_unlock(&r->lock);
+
+	return ret;
+}
+
+/* Wait for a block's tags. Blocks must be fetched in scan order,
+ * and each one handed back with yaffs_ScanReaderPut().
+ */
+yaffs_ExtendedTags *yaffs_ScanReaderGet(yaffs_ScanReader *r,
+					int blockIterator,
+					int *nReads, int *usedSummary)
+{
+	yaffs_ScanSlot *slot;
+
+	slot = &r->slots[(r->nBlocks - 1 - blockIterator) % r->nSlots];
+
+	wait_event(r->scanWait,
+		   yaffs_ScanSlotReady(r, slot, blockIterator));
+
+	if (r->abort)
+		return NULL;
+
+	*nReads = slot->nReads;
+	*usedSummary = slot->usedSummary;
+
+	return slot->tags;
+}
+
+void yaffs_ScanReaderPut(yaffs_ScanReader *r, int blockIterator)
+{
+	yaffs_ScanSlot *slot;
+
+	slot = &r->slots[(r->nBlocks - 1 - blockIterator) % r->nSlots];
+
+	spin_lock(&r->lock);
+	slot->ready = 0;
+	slot->blockIterator = -1;
+	r->nReleased++;
+	spin_unlock(&r->lock);
+
+	wake_up_all(&r->readerWait);
+}
@@ -0,0 +1,95 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2007 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+/*
+ * Parallel tag readers for the yaffs2 mount scan.
+ *
+ * The scan keeps its serial structure: the readers only fetch block states
+ * and chunk tags (from the block summary when there is one) ahead of the
+ * scanning thread, which still does the ordering and rebuilds the objects
+ * on its own.
+ */
+
+#ifndef __YAFFS_SCAN_H__
+#define __YAFFS_SCAN_H__
+
+#include "yaffs_guts.h"
+
+typedef struct yaffs_ScanReaderStruct yaffs_ScanReader;
+
+#ifdef CONFIG_YAFFS_PARALLEL_SCAN
+
+/* Returns NULL if the device can't be read concurrently */
+yaffs_ScanReader *yaffs_ScanReaderCreate(yaffs_Device *dev);
+void yaffs_ScanReaderDestroy(yaffs_ScanReader *r);
+
+/* Query the state of every block up front */
+int yaffs_ScanReaderQuery(yaffs_ScanReader *r);
+int yaffs_ScanReaderBlockState(yaffs_ScanReader *r, int blk,
+				yaffs_BlockState *state,
+				__u32 *sequenceNumber);
+
+/* Stream the tags of blockIndex[nBlocks - 1] down to blockIndex[0] */
+int yaffs_ScanReaderStart(yaffs_ScanReader *r,
+			  const yaffs_BlockIndex *blockIndex, int nBlocks);
+yaffs_ExtendedTags *yaffs_ScanReaderGet(yaffs_ScanReader *r,
+					int blockIterator,
+					int *nReads, int *usedSummary);
+void yaffs_ScanReaderPut(yaffs_ScanReader *r, int blockIterator);
+
+#else
+
+static Y_INLINE yaffs_ScanReader *yaffs_ScanReaderCreate(yaffs_Device *dev)
+{
+	return NULL;
+}
+
+static Y_INLINE void yaffs_ScanReaderDestroy(yaffs_ScanReader *r)
+{
+}
+
+static Y_INLINE int yaffs_ScanReaderQuery(yaffs_ScanReader *r)
+{
+	return YAFFS_FAIL;
+}
+
+static Y_INLINE int yaffs_ScanReaderBlockState(yaffs_ScanReader *r, int blk,
+				yaffs_BlockState *state,
+				__u32 *sequenceNumber)
+{
+	return YAFFS_FAIL;
+}
+
+static Y_INLINE int yaffs_ScanReaderStart(yaffs_ScanReader *r,
+			  const yaffs_BlockIndex *blockIndex, int nBlocks)
+{
+	return YAFFS_FAIL;
+}
+
+static Y_INLINE yaffs_ExtendedTags *yaffs_ScanReaderGet(yaffs_ScanReader *r,
+					int blockIterator,
+					int *nReads, int *usedSummary)
+{
+	return NULL;
+}
+
+static Y_INLINE void yaffs_ScanReaderPut(yaffs_ScanReader *r,
+					int blockIterator)
+{
+}
+
+#endif
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2007 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+const char *yaffs_summary_c_version =
+	"$Id$";
+
+#include "yportenv.h"
+#include "yaffs_summary.h"
+#include "yaffs_packedtags2.h"
+#include "yaffs_tagsvalidity.h"
+#include "yaffs_getblockinfo.h"
+#include "yaffs_nand.h"
+
+static int yaffs_SummaryBytes(yaffs_Device *dev)
+{
+	return sizeof(yaffs_SummaryHeader) +
+		(dev->nChunksPerBlock - 1) * sizeof(yaffs_PackedTags2);
+}
+
+static yaffs_PackedTags2 *yaffs_SummaryEntries(__u8 *data)
+{
+	return (yaffs_PackedTags2 *)(data + sizeof(yaffs_SummaryHeader));
+}
+
+/* Same sum and xor as the checkpoint uses */
+static __u32 yaffs_SummaryChecksum(const __u8 *data, int nBytes)
+{
+	__u32 sum = 0;
+	__u8 xorSum = 0;
+
+	while (nBytes--) {
+		sum += *data;
+		xorSum ^= *data;
+		data++;
+	}
+
+	return (sum << 8) | xorSum;
+}
+
+int yaffs_SummaryInit(yaffs_Device *dev)
+{
+	dev->summaryBlock = -1;
+	dev->summaryBuffer = NULL;
+	dev->nSummaryWrites = 0;
+	dev->nSummaryBlocks = 0;
+
+	if (!dev->isYaffs2 || !dev->blockSummaries)
+		return YAFFS_OK;
+
+	if (dev->nChunksPerBlock < 2 ||
+	    yaffs_SummaryBytes(dev) > dev->nDataBytesPerChunk) {
+		T(YAFFS_TRACE_ALWAYS,
+		  (TSTR("yaffs: %d chunks per block don't fit a summary,"
+			" block summaries disabled" TENDSTR),
+		   dev->nChunksPerBlock));
+		dev->blockSummaries = 0;
+		return YAFFS_OK;
+	}
+
+	dev->summaryBuffer = YMALLOC(dev->nDataBytesPerChunk);
+	if (!dev->summaryBuffer) {
+		dev->blockSummaries = 0;
+		return YAFFS_FAIL;
+	}
+
+	return YAFFS_OK;
+}
+
+void yaffs_SummaryDeinit(yaffs_Device *dev)
+{
+	if (dev->summaryBuffer)
+		YFREE(dev->summaryBuffer);
+	dev->summaryBuffer = NULL;
+	dev->summaryBlock = -1;
+}
+
+/* A fresh block is being allocated from: gather its summary */
+void yaffs_SummaryStart(yaffs_Device *dev, int blk)
+{
+	if (!dev->summaryBuffer)
+		return;
+
+	memset(dev->summaryBuffer, 0xff, dev->nDataBytesPerChunk);
+	dev->summaryBlock = blk;
+}
+
+void yaffs_SummaryAdd(yaffs_Device *dev, int chunkInNAND,
+			const yaffs_ExtendedTags *tags)
+{
+	int blk = chunkInNAND / dev->nChunksPerBlock;
+	int c = chunkInNAND % dev->nChunksPerBlock;
+	yaffs_PackedTags2 *pt;
+
+	if (!dev->summaryBuffer || blk != dev->summaryBlock ||
+	    c >= dev->nChunksPerBlock - 1)
+		return;
+
+	pt = &yaffs_SummaryEntries(dev->summaryBuffer)[c];
+	memset(pt, 0, sizeof(yaffs_PackedTags2));
+	yaffs_PackTags2(pt, tags);
+}
+
+/* Something went wrong writing the block, so what is on the flash may
+ * not match what the summary would say. Leave it to the full scan.
+ */
+void yaffs_SummaryAbandon(yaffs_Device *dev, int chunkInNAND)
+{
+	if (chunkInNAND / dev->nChunksPerBlock == dev->summaryBlock)
+		dev->summaryBlock = -1;
+}
+
+/* Is the next chunk the allocator hands out the summary's? */
+int yaffs_SummaryDue(yaffs_Device *dev)
+{
+	return dev->summaryBuffer &&
+		dev->allocationBlock >= 0 &&
+		dev->allocationBlock == dev->summaryBlock &&
+		dev->allocationPage == dev->nChunksPerBlock - 1;
+}
+
+int yaffs_SummaryWrite(yaffs_Device *dev, int chunkInNAND)
+{
+	yaffs_SummaryHeader *hdr = (yaffs_SummaryHeader *)dev->summaryBuffer;
+	int nEntries = dev->nChunksPerBlock - 1;
+	yaffs_ExtendedTags tags;
+	int result;
+
+	/* Wait for the block's other chunks to be programmed; a failure
+	 * among them abandons the summary.
+	 */
+	YMUTEX_LOCK(&dev->progLock);
+	if (dev->summaryBlock != chunkInNAND / dev->nChunksPerBlock) {
+		YMUTEX_UNLOCK(&dev->progLock);
+		return YAFFS_FAIL;
+	}
+
+	hdr->magic = YAFFS_SUMMARY_MAGIC;
+	hdr->version = YAFFS_SUMMARY_VERSION;
+	hdr->sequenceNumber = dev->sequenceNumber;
+	hdr->nChunks = nEntries;
+	hdr->checksum =
+	    yaffs_SummaryChecksum((__u8 *)yaffs_SummaryEntries(dev->summaryBuffer),
+				  nEntries * sizeof(yaffs_PackedTags2));
+
+	yaffs_InitialiseTags(&tags);
+	tags.objectId = YAFFS_OBJECTID_SUMMARY;
+	tags.chunkId = 1;
+	tags.byteCount = yaffs_SummaryBytes(dev);
+
+	result = yaffs_WriteChunkWithTagsToNAND(dev, chunkInNAND,
+						dev->summaryBuffer, &tags);
+
+	dev->summaryBlock = -1;
+	YMUTEX_UNLOCK(&dev->progLock);
+
+	if (result == YAFFS_OK) {
+		dev->nSummaryWrites++;
+	} else {
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs: failed to write summary chunk %d" TENDSTR),
+		   chunkInNAND));
+		yaffs_HandleChunkError(dev,
+			yaffs_GetBlockInfo(dev, chunkInNAND / dev->nChunksPerBlock));
+	}
+
+	return result;
+}
+
+/*
+ * Fill in tags[0..nChunksPerBlock - 2] from the summary in data.
+ * tags[nChunksPerBlock - 1] must hold the tags the summary chunk itself
+ * was read with.
+ */
+int yaffs_SummaryUnpack(yaffs_Device *dev, const __u8 *data,
+			__u32 sequenceNumber, yaffs_ExtendedTags *tags)
+{
+	const yaffs_SummaryHeader *hdr = (const yaffs_SummaryHeader *)data;
+	const yaffs_ExtendedTags *own = &tags[dev->nChunksPerBlock - 1];
+	int nEntries = dev->nChunksPerBlock - 1;
+	yaffs_PackedTags2 pt;
+	int c;
+
+	if (!own->chunkUsed ||
+	    own->eccResult == YAFFS_ECC_RESULT_UNFIXED ||
+	    own->objectId != YAFFS_OBJECTID_SUMMARY ||
+	    own->sequenceNumber != sequenceNumber)
+		return YAFFS_FAIL;
+
+	if (hdr->magic != YAFFS_SUMMARY_MAGIC ||
+	    hdr->version != YAFFS_SUMMARY_VERSION ||
+	    hdr->sequenceNumber != sequenceNumber ||
+	    hdr->nChunks != nEntries ||
+	    hdr->checksum != yaffs_SummaryChecksum(data + sizeof(*hdr),
+				nEntries * sizeof(yaffs_PackedTags2)))
+		return YAFFS_FAIL;
+
+	for (c = 0; c < nEntries; c++) {
+		/* Copied out as unpacking may correct the tags in place */
+		memcpy(&pt, data + sizeof(*hdr) + c * sizeof(pt), sizeof(pt));
+		yaffs_UnpackTags2(&tags[c], &pt);
+
+		if (tags[c].chunkUsed &&
+		    tags[c].sequenceNumber != sequenceNumber)
+			return YAFFS_FAIL;
+	}
+
+	return YAFFS_OK;
+}
+
+int yaffs_SummaryRead(yaffs_Device *dev, int blk, __u32 sequenceNumber,
+			__u8 *buffer, yaffs_ExtendedTags *tags)
+{
+	int chunk = (blk + 1) * dev->nChunksPerBlock - 1;
+
+	if (!dev->blockSummaries)
+		return YAFFS_FAIL;
+
+	if (yaffs_ReadChunkWithTagsFromNAND(dev, chunk, buffer,
+				&tags[dev->nChunksPerBlock - 1]) != YAFFS_OK)
+		return YAFFS_FAIL;
+
+	return yaffs_SummaryUnpack(dev, buffer, sequenceNumber, tags);
+}
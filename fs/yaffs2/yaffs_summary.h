@@ -0,0 +1,63 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2007 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+/*
+ * Per-block tag summaries for yaffs2.
+ *
+ * The last chunk of each block written by the allocator holds the packed
+ * tags of the other chunks in the block, so that a mount scan can read
+ * one page per block instead of the tags of every chunk. The summary chunk
+ * is tagged with YAFFS_OBJECTID_SUMMARY and is never in use, so blocks
+ * without a summary (older images, mkyaffs2image output, blocks that were
+ * being written when the summary was started) just get the full scan.
+ */
+
+#ifndef __YAFFS_SUMMARY_H__
+#define __YAFFS_SUMMARY_H__
+
+#include "yaffs_guts.h"
+
+#define YAFFS_SUMMARY_MAGIC	0x5953554d	/* "YSUM" */
+#define YAFFS_SUMMARY_VERSION	1
+
+/* Followed by nChunks yaffs_PackedTags2 in the chunk data */
+typedef struct {
+	__u32 magic;
+	__u32 version;
+	__u32 sequenceNumber;	/* Of the block the summary describes */
+	__u32 nChunks;
+	__u32 checksum;		/* Of the packed tags */
+} yaffs_SummaryHeader;
+
+int yaffs_SummaryInit(yaffs_Device *dev);
+void yaffs_SummaryDeinit(yaffs_Device *dev);
+
+/* Write side, driven by the chunk allocator */
+void yaffs_SummaryStart(yaffs_Device *dev, int blk);
+void yaffs_SummaryAdd(yaffs_Device *dev, int chunkInNAND,
+			const yaffs_ExtendedTags *tags);
+void yaffs_SummaryAbandon(yaffs_Device *dev, int chunkInNAND);
+int yaffs_SummaryDue(yaffs_Device *dev);
+int yaffs_SummaryWrite(yaffs_Device *dev, int chunkInNAND);
+
+/* Scan side. yaffs_SummaryUnpack() only touches its arguments, so the
+ * parallel scan readers can use it too.
+ */
+int yaffs_SummaryUnpack(yaffs_Device *dev, const __u8 *data,
+			__u32 sequenceNumber, yaffs_ExtendedTags *tags);
+int yaffs_SummaryRead(yaffs_Device *dev, int blk, __u32 sequenceNumber,
+			__u8 *buffer, yaffs_ExtendedTags *tags);
+
+#endif
@@ -47,6 +47,8 @@
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
 
 #define YCHAR char
 #define YUCHAR unsigned char
@@ -85,6 +87,17 @@
 #define Y_TIME_CONVERT(x) (x)
 #endif
 
+/* Microsecond stamp, only used for mount-time instrumentation */
+#define Y_TIME_US() ((__u32)ktime_to_us(ktime_get()))
+
+/* Locks inside yaffs_guts, see yaffs_guts.h */
+#define YMUTEX_T		struct mutex
+#define YMUTEX_INIT(m)		mutex_init(m)
+#define YMUTEX_LOCK(m)		mutex_lock(m)
+#define YMUTEX_TRYLOCK(m)	mutex_trylock(m)
+#define YMUTEX_UNLOCK(m)	mutex_unlock(m)
+#define Y_CURRENT_TASK		((void *)current)
+
 #define yaffs_SumCompare(x, y) ((x) == (y))
 #define yaffs_strcmp(a, b) strcmp(a, b)
 
@@ -158,6 +171,20 @@
 
 #endif
 
+#ifndef Y_TIME_US
+#define Y_TIME_US() 0
+#endif
+
+/* Single threaded ports get by without the guts locks */
+#ifndef YMUTEX_T
+#define YMUTEX_T		int
+#define YMUTEX_INIT(m)		do { } while (0)
+#define YMUTEX_LOCK(m)		do { } while (0)
+#define YMUTEX_TRYLOCK(m)	1
+#define YMUTEX_UNLOCK(m)	do { } while (0)
+#define Y_CURRENT_TASK		NULL
+#endif
+
 /* see yaffs_fs.c */
 extern unsigned int yaffs_traceMask;
 extern unsigned int yaffs_wr_attempts;
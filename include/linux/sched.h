@@ -1267,6 +1267,9 @@ struct task_struct {
 
 	struct list_head tasks;
 	struct plist_node pushable_tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct list_head lowmem_node;	/* oom_adj bucket of a group leader */
+#endif
 
 	struct mm_struct *mm, *active_mm;
 
@@ -1726,6 +1729,14 @@ extern cputime_t task_gtime(struct task_struct *p);
 
 extern int task_free_register(struct notifier_block *n);
 extern int task_free_unregister(struct notifier_block *n);
+extern int oom_adj_register(struct notifier_block *n);
+extern int oom_adj_unregister(struct notifier_block *n);
+extern void oom_adj_notify(struct task_struct *tsk);
+extern void oom_adj_release(struct task_struct *tsk);
+
+/* oom_adj notifier actions */
+#define OOM_ADJ_CHANGE	0	/* process forked, exec'd or oom_adj written */
+#define OOM_ADJ_RELEASE	1	/* task released by release_task() */
 
 /*
  * Per process flags
@@ -250,6 +250,14 @@ extern int vm_swappiness;
 extern int remove_mapping(struct address_space *mapping, struct page *page);
 extern long vm_total_pages;
 
+/* passed to reclaim notifiers after each page scanning pass */
+struct reclaim_progress {
+	unsigned long nr_scanned;	/* LRU pages scanned */
+	unsigned long nr_reclaimed;	/* of which were reclaimed */
+};
+extern int register_reclaim_notifier(struct notifier_block *nb);
+extern int unregister_reclaim_notifier(struct notifier_block *nb);
+
 #ifdef CONFIG_NUMA
 extern int zone_reclaim_mode;
 extern int sysctl_min_unmapped_ratio;
@@ -207,6 +207,7 @@ repeat:
 	}
 
 	write_unlock_irq(&tasklist_lock);
+	oom_adj_release(p);
 	release_thread(p);
 	call_rcu(&p->rcu, delayed_put_task_struct);
 
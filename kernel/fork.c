@@ -141,6 +141,9 @@ static struct kmem_cache *mm_cachep;
 /* Notifier list called when a task struct is freed */
 static ATOMIC_NOTIFIER_HEAD(task_free_notifier);
 
+/* Notifier list called when a process is created, released or its oom_adj changes */
+static ATOMIC_NOTIFIER_HEAD(oom_adj_notifier);
+
 static void account_kernel_stack(struct thread_info *ti, int account)
 {
 	struct zone *zone = page_zone(virt_to_page(ti));
@@ -171,6 +174,29 @@ int task_free_unregister(struct notifier_block *n)
 }
 EXPORT_SYMBOL(task_free_unregister);
 
+int oom_adj_register(struct notifier_block *n)
+{
+	return atomic_notifier_chain_register(&oom_adj_notifier, n);
+}
+EXPORT_SYMBOL(oom_adj_register);
+
+int oom_adj_unregister(struct notifier_block *n)
+{
+	return atomic_notifier_chain_unregister(&oom_adj_notifier, n);
+}
+EXPORT_SYMBOL(oom_adj_unregister);
+
+void oom_adj_notify(struct task_struct *tsk)
+{
+	atomic_notifier_call_chain(&oom_adj_notifier, OOM_ADJ_CHANGE, tsk);
+}
+
+/* Called in process context once tsk is unhashed and before it is freed */
+void oom_adj_release(struct task_struct *tsk)
+{
+	atomic_notifier_call_chain(&oom_adj_notifier, OOM_ADJ_RELEASE, tsk);
+}
+
 void __put_task_struct(struct task_struct *tsk)
 {
 	WARN_ON(!tsk->exit_state);
@@ -1071,6 +1097,9 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	copy_flags(clone_flags, p);
 	INIT_LIST_HEAD(&p->children);
 	INIT_LIST_HEAD(&p->sibling);
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	INIT_LIST_HEAD(&p->lowmem_node);
+#endif
 	rcu_copy_process(p);
 	p->vfork_done = NULL;
 	spin_lock_init(&p->alloc_lock);
@@ -1320,6 +1349,8 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	proc_fork_connector(p);
 	cgroup_post_fork(p);
 	perf_event_fork(p);
+	if (!(clone_flags & CLONE_THREAD))
+		oom_adj_notify(p);
 	return p;
 
 bad_fork_free_pid:
@@ -133,6 +133,8 @@ long vm_total_pages;	/* The total number of pages which the VM controls */
 static LIST_HEAD(shrinker_list);
 static DECLARE_RWSEM(shrinker_rwsem);
 
+static ATOMIC_NOTIFIER_HEAD(reclaim_notifier);
+
 #ifdef CONFIG_CGROUP_MEM_RES_CTLR
 #define scanning_global_lru(sc)	(!(sc)->mem_cgroup)
 #else
@@ -181,6 +183,35 @@ void unregister_shrinker(struct shrinker *shrinker)
 }
 EXPORT_SYMBOL(unregister_shrinker);
 
+/*
+ * Reclaim notifiers are told how many pages each pass of kswapd or direct
+ * reclaim scanned and reclaimed, right before the shrinkers are called.
+ * They run in the reclaiming task and must not sleep or allocate memory.
+ */
+int register_reclaim_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&reclaim_notifier, nb);
+}
+EXPORT_SYMBOL(register_reclaim_notifier);
+
+int unregister_reclaim_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&reclaim_notifier, nb);
+}
+EXPORT_SYMBOL(unregister_reclaim_notifier);
+
+static void reclaim_notify(unsigned long nr_scanned,
+			   unsigned long nr_reclaimed)
+{
+	struct reclaim_progress progress = {
+		.nr_scanned = nr_scanned,
+		.nr_reclaimed = nr_reclaimed,
+	};
+
+	if (nr_scanned)
+		atomic_notifier_call_chain(&reclaim_notifier, 0, &progress);
+}
+
 #define SHRINK_BATCH 128
 /*
  * Call the shrink functions to age shrinkable caches
@@ -1763,6 +1794,8 @@ static unsigned long do_try_to_free_pages(struct zonelist *zonelist,
 	}
 
 	for (priority = DEF_PRIORITY; priority >= 0; priority--) {
+		unsigned long nr_reclaimed = sc->nr_reclaimed;
+
 		sc->nr_scanned = 0;
 		if (!priority)
 			disable_swap_token();
@@ -1772,6 +1805,8 @@ static unsigned long do_try_to_free_pages(struct zonelist *zonelist,
 		 * over limit cgroups
 		 */
 		if (scanning_global_lru(sc)) {
+			reclaim_notify(sc->nr_scanned,
+				       sc->nr_reclaimed - nr_reclaimed);
 			shrink_slab(sc->nr_scanned, sc->gfp_mask, lru_pages);
 			if (reclaim_state) {
 				sc->nr_reclaimed += reclaim_state->reclaimed_slab;
@@ -2022,6 +2057,7 @@ loop_again:
 		 */
 		for (i = 0; i <= end_zone; i++) {
 			struct zone *zone = pgdat->node_zones + i;
+			unsigned long nr_reclaimed;
 			int nr_slab;
 			int nid, zid;
 
@@ -2051,9 +2087,12 @@ loop_again:
 			 * We put equal pressure on every zone, unless one
 			 * zone has way too many pages free already.
 			 */
+			nr_reclaimed = sc.nr_reclaimed;
 			if (!zone_watermark_ok(zone, order,
 					8*high_wmark_pages(zone), end_zone, 0))
 				shrink_zone(priority, zone, &sc);
+			reclaim_notify(sc.nr_scanned,
+				       sc.nr_reclaimed - nr_reclaimed);
 			reclaim_state->reclaimed_slab = 0;
 			nr_slab = shrink_slab(sc.nr_scanned, GFP_KERNEL,
 						lru_pages);
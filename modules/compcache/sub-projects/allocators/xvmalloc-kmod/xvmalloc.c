@@ -14,6 +14,8 @@
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 
@@ -274,9 +276,11 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 	if (unlikely(!page))
 		return -ENOMEM;
 
+	spin_lock(&pool->lock);
 	pool->total_pages++;
+	set_page_private(page, 0);
+	list_add_tail(&page->lru, &pool->pages);
 
-	spin_lock(&pool->lock);
 	block = get_ptr_atomic(page, 0, KM_USER0);
 
 	block->size = PAGE_SIZE - XV_ALIGN;
@@ -307,6 +311,7 @@ struct xv_pool *xv_create_pool(void)
 		return NULL;
 
 	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->pages);
 
 	return pool;
 }
@@ -316,53 +321,24 @@ void xv_destroy_pool(struct xv_pool *pool)
 	kfree(pool);
 }
 
-/**
- * xv_malloc - Allocate block of given size from pool.
- * @pool: pool to allocate from
- * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
- *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
- *
- * Allocation requests with size > XV_MAX_ALLOC_SIZE will fail.
+/*
+ * Carve a block of the given size out of the free blocks of the pool,
+ * without growing it. Called with the pool locked.
  */
-int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
-		u32 *offset, gfp_t flags)
+static int alloc_block(struct xv_pool *pool, u32 size, struct page **page,
+			u32 *offset)
 {
-	int error;
 	u32 index, tmpsize, origsize, tmpoffset;
 	struct block_header *block, *tmpblock;
 
 	*page = NULL;
 	*offset = 0;
 	origsize = size;
-
-	if (unlikely(!size || size > XV_MAX_ALLOC_SIZE))
-		return -ENOMEM;
-
 	size = ALIGN(size, XV_ALIGN);
 
-	spin_lock(&pool->lock);
-
 	index = find_block(pool, size, page, offset);
-
-	if (!*page) {
-		spin_unlock(&pool->lock);
-		error = grow_pool(pool, flags);
-		if (unlikely(error))
-			return error;
-
-		spin_lock(&pool->lock);
-		index = find_block(pool, size, page, offset);
-	}
-
-	if (!*page) {
-		spin_unlock(&pool->lock);
+	if (!*page)
 		return -ENOMEM;
-	}
 
 	block = get_ptr_atomic(*page, *offset, KM_USER0);
 
@@ -395,25 +371,72 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 	clear_flag(block, BLOCK_FREE);
 
 	put_ptr_atomic(block, KM_USER0);
-	spin_unlock(&pool->lock);
+
+	set_page_private(*page, page_private(*page) + size + XV_ALIGN);
+	pool->used_bytes += size + XV_ALIGN;
 
 	*offset += XV_ALIGN;
 
 	return 0;
 }
 
+/**
+ * xv_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @page: page no. that holds the object
+ * @offset: location of object within page
+ *
+ * On success, <page, offset> identifies block allocated
+ * and 0 is returned. On failure, <page, offset> is set to
+ * 0 and -ENOMEM is returned.
+ *
+ * Allocation requests with size > XV_MAX_ALLOC_SIZE will fail.
+ */
+int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
+		u32 *offset, gfp_t flags)
+{
+	int error;
+
+	*page = NULL;
+	*offset = 0;
+
+	if (unlikely(!size || size > XV_MAX_ALLOC_SIZE))
+		return -ENOMEM;
+
+	spin_lock(&pool->lock);
+
+	error = alloc_block(pool, size, page, offset);
+	if (error) {
+		spin_unlock(&pool->lock);
+		error = grow_pool(pool, flags);
+		if (unlikely(error))
+			return error;
+
+		spin_lock(&pool->lock);
+		error = alloc_block(pool, size, page, offset);
+	}
+
+	spin_unlock(&pool->lock);
+
+	return error;
+}
+
 /*
- * Free block identified with <page, offset>
+ * Free block identified with <page, offset>. Called with the pool locked.
+ * Free blocks of an isolated page are not on the freelists (see
+ * isolate_page()), so they are merged without touching the lists.
+ * Returns 1 if the page is left without used objects: it is then off
+ * the pool and the caller frees it.
  */
-void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
+static int free_block(struct xv_pool *pool, struct page *page, u32 offset,
+			int isolated)
 {
 	void *page_start;
 	struct block_header *block, *tmpblock;
 
 	offset -= XV_ALIGN;
 
-	spin_lock(&pool->lock);
-
 	page_start = get_ptr_atomic(page, 0, KM_USER0);
 	block = (struct block_header *)((char *)page_start + offset);
 
@@ -422,6 +445,9 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 
 	block->size = ALIGN(block->size, XV_ALIGN);
 
+	set_page_private(page, page_private(page) - block->size - XV_ALIGN);
+	pool->used_bytes -= block->size + XV_ALIGN;
+
 	tmpblock = BLOCK_NEXT(block);
 	if (offset + block->size + XV_ALIGN == PAGE_SIZE)
 		tmpblock = NULL;
@@ -432,7 +458,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 		 * Blocks smaller than XV_MIN_ALLOC_SIZE
 		 * are not inserted in any free list.
 		 */
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE) {
+		if (tmpblock->size >= XV_MIN_ALLOC_SIZE && !isolated) {
 			remove_block(pool, page,
 				    offset + block->size + XV_ALIGN, tmpblock,
 				    get_index_for_insert(tmpblock->size));
@@ -446,7 +472,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 						get_blockprev(block));
 		offset = offset - tmpblock->size - XV_ALIGN;
 
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE)
+		if (tmpblock->size >= XV_MIN_ALLOC_SIZE && !isolated)
 			remove_block(pool, page, offset, tmpblock,
 				    get_index_for_insert(tmpblock->size));
 
@@ -457,15 +483,14 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	/* No used objects in this page. Free it. */
 	if (block->size == PAGE_SIZE - XV_ALIGN) {
 		put_ptr_atomic(page_start, KM_USER0);
-		spin_unlock(&pool->lock);
 
-		__free_page(page);
+		list_del(&page->lru);
 		pool->total_pages--;
-		return;
+		return 1;
 	}
 
 	set_flag(block, BLOCK_FREE);
-	if (block->size >= XV_MIN_ALLOC_SIZE)
+	if (block->size >= XV_MIN_ALLOC_SIZE && !isolated)
 		insert_block(pool, page, offset, block);
 
 	if (offset + block->size + XV_ALIGN != PAGE_SIZE) {
@@ -475,7 +500,156 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	}
 
 	put_ptr_atomic(page_start, KM_USER0);
+
+	return 0;
+}
+
+/*
+ * Free block identified with <page, offset>
+ */
+void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
+{
+	int empty;
+
+	spin_lock(&pool->lock);
+	empty = free_block(pool, page, offset, 0);
+	spin_unlock(&pool->lock);
+
+	if (empty)
+		__free_page(page);
+}
+
+/*
+ * Take the free blocks of a page off the freelists, or put them back,
+ * so that objects moved out of the page are not allocated in it again.
+ */
+static void isolate_page(struct xv_pool *pool, struct page *page,
+			int isolate)
+{
+	u32 offset = 0, size;
+	struct block_header *block;
+
+	while (offset < PAGE_SIZE) {
+		block = get_ptr_atomic(page, offset, KM_USER0);
+		size = block->size;
+		if (test_flag(block, BLOCK_FREE) && size >= XV_MIN_ALLOC_SIZE) {
+			if (isolate)
+				remove_block(pool, page, offset, block,
+					    get_index_for_insert(size));
+			else
+				insert_block(pool, page, offset, block);
+		}
+		put_ptr_atomic(block, KM_USER0);
+		offset += ALIGN(size, XV_ALIGN) + XV_ALIGN;
+	}
+}
+
+/*
+ * Move every object out of a page and free it. If an object cannot be
+ * moved, the ones already moved stay in their new place and the page
+ * goes back to the pool. Called with the pool locked.
+ */
+static int compact_page(struct xv_pool *pool, struct page *page,
+			xv_move_fn move, void *private)
+{
+	int ret = -EBUSY;
+	u32 offset = 0, next, size, noffset;
+	struct page *npage;
+	struct block_header *block;
+	void *src, *dst;
+
+	isolate_page(pool, page, 1);
+
+	while (offset < PAGE_SIZE) {
+		block = get_ptr_atomic(page, offset, KM_USER0);
+		size = block->size;
+		next = offset + ALIGN(size, XV_ALIGN) + XV_ALIGN;
+		if (test_flag(block, BLOCK_FREE)) {
+			put_ptr_atomic(block, KM_USER0);
+			offset = next;
+			continue;
+		}
+		put_ptr_atomic(block, KM_USER0);
+
+		ret = alloc_block(pool, size, &npage, &noffset);
+		if (ret)
+			goto out;
+
+		src = get_ptr_atomic(page, offset + XV_ALIGN, KM_USER0);
+		dst = get_ptr_atomic(npage, noffset, KM_USER1);
+		memcpy(dst, src, size);
+		put_ptr_atomic(dst, KM_USER1);
+		ret = move(src, npage, noffset, private);
+		put_ptr_atomic(src, KM_USER0);
+
+		if (ret) {
+			if (free_block(pool, npage, noffset, 0))
+				__free_page(npage);
+			goto out;
+		}
+
+		/*
+		 * A following free block merged into this one keeps its
+		 * header, so the walk can go on from next.
+		 */
+		if (free_block(pool, page, offset + XV_ALIGN, 1)) {
+			__free_page(page);
+			return 0;
+		}
+		offset = next;
+	}
+
+out:
+	isolate_page(pool, page, 0);
+	return ret;
+}
+
+/**
+ * xv_compact - Release sparsely used pages of a pool.
+ * @pool: pool to compact
+ * @nr_pages: stop after freeing this many pages
+ * @move: called for each object moved, to update its owner
+ * @private: passed to @move
+ *
+ * Objects are moved out of pages that have at most XV_COMPACT_THRESHOLD
+ * bytes in use into free space of other pages, and the emptied pages are
+ * freed. The pool never grows doing this. Pages are visited in a round
+ * robin, so repeated calls go over the whole pool.
+ *
+ * Returns the number of pages freed.
+ */
+int xv_compact(struct xv_pool *pool, unsigned int nr_pages,
+		xv_move_fn move, void *private)
+{
+	int ret;
+	unsigned int freed = 0;
+	unsigned long nr_scan;
+	struct page *page;
+
+	spin_lock(&pool->lock);
+
+	nr_scan = pool->total_pages;
+	while (freed < nr_pages && nr_scan-- && !list_empty(&pool->pages)) {
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_move_tail(&page->lru, &pool->pages);
+
+		if (page_private(page) > XV_COMPACT_THRESHOLD)
+			continue;
+
+		ret = compact_page(pool, page, move, private);
+		if (!ret)
+			freed++;
+		else if (ret == -ENOMEM)
+			break;	/* no free space left elsewhere */
+
+		spin_unlock(&pool->lock);
+		cond_resched();
+		spin_lock(&pool->lock);
+	}
+
 	spin_unlock(&pool->lock);
+
+	return freed;
 }
 
 u32 xv_get_object_size(void *obj)
@@ -493,3 +667,11 @@ u64 xv_get_total_size_bytes(struct xv_pool *pool)
 {
 	return pool->total_pages << PAGE_SHIFT;
 }
+
+/*
+ * Returns memory taken by objects and their headers
+ */
+u64 xv_get_used_size_bytes(struct xv_pool *pool)
+{
+	return pool->used_bytes;
+}
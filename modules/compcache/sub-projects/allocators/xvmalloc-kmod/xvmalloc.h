@@ -17,6 +17,14 @@
 
 struct xv_pool;
 
+/*
+ * Called by xv_compact(), with the pool locked, after it copied the
+ * object at obj to <page, offset>. Returns 0 once the owner refers to
+ * the new location, or an error to keep the object where it was.
+ */
+typedef int (*xv_move_fn)(void *obj, struct page *page, u32 offset,
+			void *private);
+
 struct xv_pool *xv_create_pool(void);
 void xv_destroy_pool(struct xv_pool *pool);
 
@@ -26,5 +34,9 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset);
 
 u32 xv_get_object_size(void *obj);
 u64 xv_get_total_size_bytes(struct xv_pool *pool);
+u64 xv_get_used_size_bytes(struct xv_pool *pool);
+
+int xv_compact(struct xv_pool *pool, unsigned int nr_pages,
+		xv_move_fn move, void *private);
 
 #endif
@@ -14,6 +14,7 @@
 #define _XV_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/types.h>
 
 /* User configurable params */
@@ -36,6 +37,9 @@
 
 #define MAX_FLI		DIV_ROUND_UP(NUM_FREE_LISTS, BITS_PER_LONG)
 
+/* Compaction only empties pages with at most this many bytes in use */
+#define XV_COMPACT_THRESHOLD	(PAGE_SIZE / 2)
+
 /* End of user params */
 
 enum blockflags {
@@ -79,8 +83,15 @@ struct xv_pool {
 
 	struct freelist_entry freelist[NUM_FREE_LISTS];
 
+	/*
+	 * All pages of the pool, linked through page->lru; page_private()
+	 * is the number of bytes used by objects and their headers.
+	 */
+	struct list_head pages;
+
 	/* stats */
 	u64 total_pages;
+	u64 used_bytes;
 };
 
 #endif
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Swap a synthetic heap with a known duplicate ratio out to zram0 and
+# check the dedup counters. Other swap devices are turned off so that
+# everything goes to zram0.
+# usage: zram_dedup_test.sh [heap_MB] [dup_percent]
+
+set -e
+heap="${1:-64}"
+dup="${2:-50}"
+test="$(dirname "$0")/zram_dedup_test/zram_dedup_test_bin"
+
+[ -x "$test" ] || make -C "$(dirname "$0")/zram_dedup_test"
+
+swapoff -a
+echo 1 >/sys/block/zram0/reset
+sleep 2
+memkb="$(awk '/^MemTotal:/ { print $2 }' /proc/meminfo)"
+echo "$((memkb * 2 * 1024))" >/sys/block/zram0/disksize
+mkswap /dev/zram0
+swapon /dev/zram0
+
+ret=0
+"$test" -z zram0 -m "$heap" -d "$dup" || ret=$?
+
+for stat in orig_data_size compr_data_size dedup_hits dup_pages \
+		dup_data_size mem_used_total; do
+	echo "$stat: $(cat /sys/block/zram0/$stat)"
+done
+
+swapoff /dev/zram0
+echo 1 >/sys/block/zram0/reset
+exit $ret
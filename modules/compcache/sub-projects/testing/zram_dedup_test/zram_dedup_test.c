@@ -0,0 +1,231 @@
+/*
+ * Swap out a synthetic heap with a known ratio of duplicate pages and check
+ * that zram merges them.
+ *
+ * dup_percent of the heap pages are copies of a few pattern pages: one
+ * repeated word, as in freshly initialized arrays, or a run of small
+ * identical "objects" with a header, as in duplicated dalvik heap pages.
+ * The remaining pages are unique, and half random so they do not look
+ * like anything else. A balloon then pushes the heap out to swap, which
+ * must be on the zram device. mincore() tells which heap pages went out;
+ * among those, every duplicate beyond the first copy of each pattern
+ * should show up in the device's dup_pages counter. Finally the balloon is
+ * freed and the heap is read back and verified.
+ *
+ * Usage: zram_dedup_test [-z zram_name] [-m heap_MB] [-d dup_percent]
+ *			  [-b balloon_MB]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PAGE_SIZE	4096
+#define NR_PATTERNS	16
+#define WORDS		(PAGE_SIZE / sizeof(unsigned int))
+
+static const char *zram = "zram0";
+static unsigned long heap_mb = 64;
+static unsigned long balloon_mb;
+static int dup_percent = 50;
+
+static long long read_stat(const char *name)
+{
+	char path[128];
+	long long val;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", zram, name);
+	f = fopen(path, "r");
+	if (!f || fscanf(f, "%lld", &val) != 1) {
+		perror(path);
+		exit(1);
+	}
+	fclose(f);
+	return val;
+}
+
+static unsigned long mem_free_mb(void)
+{
+	char line[128];
+	unsigned long kb, total = 0;
+	FILE *f = fopen("/proc/meminfo", "r");
+
+	if (!f) {
+		perror("/proc/meminfo");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "MemFree: %lu", &kb) == 1 ||
+		    sscanf(line, "Cached: %lu", &kb) == 1)
+			total += kb;
+	fclose(f);
+	return total >> 10;
+}
+
+static void fill_pattern(unsigned int *p, int pattern)
+{
+	unsigned int i;
+
+	if (pattern & 1) {
+		/* 32-byte objects: class pointer, lock word, fields */
+		for (i = 0; i < WORDS; i += 8) {
+			p[i] = 0x40000000 + pattern * 0x100;
+			p[i + 1] = 0;
+			p[i + 2] = i & 0xff;
+			p[i + 3] = pattern;
+			p[i + 4] = p[i + 5] = p[i + 6] = p[i + 7] = 0;
+		}
+	} else {
+		for (i = 0; i < WORDS; i++)
+			p[i] = 0x01010101 * (pattern + 1);
+	}
+}
+
+static void fill_unique(unsigned int *p, unsigned long index)
+{
+	unsigned int i;
+
+	for (i = 0; i < WORDS / 2; i++)
+		p[i] = rand();
+	for (; i < WORDS; i++)
+		p[i] = index;
+}
+
+static unsigned int checksum(unsigned int *p)
+{
+	unsigned int i, sum = 2166136261u;
+
+	for (i = 0; i < WORDS; i++)
+		sum = (sum ^ p[i]) * 16777619;
+	return sum;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-z zram_name] [-m heap_MB] "
+		"[-d dup_percent] [-b balloon_MB]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long i, nr_pages, nr_dup = 0, out = 0, out_dup = 0, bad = 0;
+	long long dup_before, hits_before, dup_delta, hits_delta, expected;
+	int pattern_out[NR_PATTERNS] = { 0 };
+	unsigned int *sums;
+	unsigned char *vec;
+	signed char *kind;
+	char *heap, *balloon;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "z:m:d:b:")) != -1) {
+		switch (opt) {
+		case 'z':
+			zram = optarg;
+			break;
+		case 'm':
+			heap_mb = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			dup_percent = atoi(optarg);
+			break;
+		case 'b':
+			balloon_mb = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!heap_mb || dup_percent < 0 || dup_percent > 100)
+		usage(argv[0]);
+
+	nr_pages = (heap_mb << 20) / PAGE_SIZE;
+	heap = mmap(NULL, nr_pages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	sums = malloc(nr_pages * sizeof(*sums));
+	kind = malloc(nr_pages);
+	vec = malloc(nr_pages);
+	if (heap == MAP_FAILED || !sums || !kind || !vec) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	srand(1);
+	for (i = 0; i < nr_pages; i++) {
+		unsigned int *p = (unsigned int *)(heap + i * PAGE_SIZE);
+
+		if (rand() % 100 < dup_percent) {
+			kind[i] = rand() % NR_PATTERNS;
+			fill_pattern(p, kind[i]);
+			nr_dup++;
+		} else {
+			kind[i] = -1;
+			fill_unique(p, i);
+		}
+		sums[i] = checksum(p);
+	}
+
+	dup_before = read_stat("dup_pages");
+	hits_before = read_stat("dedup_hits");
+
+	/* Push the heap out to swap */
+	if (!balloon_mb)
+		balloon_mb = mem_free_mb() + heap_mb;
+	balloon = mmap(NULL, balloon_mb << 20, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (balloon == MAP_FAILED) {
+		perror("mmap balloon");
+		return 1;
+	}
+	/* distinct contents, so the balloon itself is not merged */
+	for (i = 0; i < (balloon_mb << 20); i += PAGE_SIZE)
+		*(unsigned long *)(balloon + i) = i + 1;
+
+	if (mincore(heap, nr_pages * PAGE_SIZE, vec)) {
+		perror("mincore");
+		return 1;
+	}
+	for (i = 0; i < nr_pages; i++) {
+		if (vec[i] & 1)
+			continue;
+		out++;
+		if (kind[i] >= 0) {
+			out_dup++;
+			pattern_out[(int)kind[i]] = 1;
+		}
+	}
+	expected = out_dup;
+	for (i = 0; i < NR_PATTERNS; i++)
+		expected -= pattern_out[i];
+
+	dup_delta = read_stat("dup_pages") - dup_before;
+	hits_delta = read_stat("dedup_hits") - hits_before;
+
+	munmap(balloon, balloon_mb << 20);
+	for (i = 0; i < nr_pages; i++)
+		if (checksum((unsigned int *)(heap + i * PAGE_SIZE)) != sums[i])
+			bad++;
+
+	printf("heap pages:        %lu (%lu duplicates, %d%%)\n",
+	       nr_pages, nr_dup, dup_percent);
+	printf("swapped out:       %lu (%lu duplicates)\n", out, out_dup);
+	printf("expected merged:   %lld\n", expected);
+	printf("dup_pages delta:   %lld\n", dup_delta);
+	printf("dedup_hits delta:  %lld\n", hits_delta);
+	printf("corrupted pages:   %lu\n", bad);
+
+	/*
+	 * Pages of other processes can only add merges, and a heap page
+	 * may be swapped in again before the counters are read, so allow
+	 * a little slack below the expected count.
+	 */
+	if (bad || dup_delta < expected * 9 / 10) {
+		printf("FAIL\n");
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
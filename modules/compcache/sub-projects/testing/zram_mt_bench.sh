@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Run zram_mt_bench against a freshly reset zram0, for 1..N writers.
+# usage: zram_mt_bench.sh [max_writers] [MB_per_writer] [max_comp_streams]
+
+set -e
+writers="${1:-$(grep -c ^processor /proc/cpuinfo)}"
+mb="${2:-64}"
+streams="$3"
+disksize="$((writers*mb*1024*1024))"
+bench="$(dirname "$0")/zram_mt_bench/zram_mt_bench_bin"
+
+[ -x "$bench" ] || make -C "$(dirname "$0")/zram_mt_bench"
+
+echo 1 >/sys/block/zram0/reset
+sleep 2
+[ -n "$streams" ] && echo "$streams" >/sys/block/zram0/max_comp_streams
+echo "$disksize" >/sys/block/zram0/disksize
+echo "max_comp_streams: $(cat /sys/block/zram0/max_comp_streams)"
+
+"$bench" -d /dev/zram0 -t "$writers" -s "$mb"
+
+echo "stream_waits: $(cat /sys/block/zram0/stream_waits)"
+echo "mem_used_total: $(cat /sys/block/zram0/mem_used_total)"
+echo 1 >/sys/block/zram0/reset
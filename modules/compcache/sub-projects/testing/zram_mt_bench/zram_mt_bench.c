@@ -0,0 +1,221 @@
+/*
+ * zram write throughput and latency with 1..N concurrent writers.
+ *
+ * Each writer thread owns a disjoint region of the device and writes it
+ * page by page with O_DIRECT, so every write goes straight to zram_write.
+ * Page contents are half random and half a repeated pattern, which LZO
+ * compresses to a bit over half a page. For every writer count the total
+ * MB/s and the per-write latency (mean, 50th/99th percentile, max) are
+ * reported. Latency percentiles come from a log2 histogram in microseconds
+ * and are rounded up to the bucket limit.
+ *
+ * Usage: zram_mt_bench [-d device] [-t max_writers] [-s MB_per_writer]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE_SIZE	4096
+#define NR_PATTERNS	64
+#define NR_BUCKETS	32
+
+struct writer {
+	pthread_t thread;
+	int fd;
+	off_t start;
+	unsigned long nr_pages;
+	unsigned char *pages;		/* NR_PATTERNS pages of test data */
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+	unsigned long hist[NR_BUCKETS];	/* [i]: latency < 2^i us */
+	int error;
+};
+
+static const char *device = "/dev/zram0";
+static int max_writers;
+static unsigned long mb_per_writer = 64;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_pages(unsigned char *pages, unsigned int seed)
+{
+	int i, j;
+
+	for (i = 0; i < NR_PATTERNS; i++) {
+		unsigned char *p = pages + i * PAGE_SIZE;
+
+		for (j = 0; j < PAGE_SIZE / 2; j++)
+			p[j] = rand_r(&seed);
+		for (; j < PAGE_SIZE; j++)
+			p[j] = "zram"[j & 3] + i;
+	}
+}
+
+static int bucket(unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int b = 0;
+
+	while (us && b < NR_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	unsigned long i;
+
+	for (i = 0; i < w->nr_pages; i++) {
+		unsigned long long t0, ns;
+		void *buf = w->pages + (i % NR_PATTERNS) * PAGE_SIZE;
+
+		t0 = now_ns();
+		if (pwrite(w->fd, buf, PAGE_SIZE,
+				w->start + (off_t)i * PAGE_SIZE) != PAGE_SIZE) {
+			w->error = errno ? errno : EIO;
+			break;
+		}
+		ns = now_ns() - t0;
+
+		w->total_ns += ns;
+		if (ns > w->max_ns)
+			w->max_ns = ns;
+		w->hist[bucket(ns)]++;
+	}
+	return NULL;
+}
+
+/* upper limit, in us, of the bucket holding the given percentile */
+static unsigned long percentile(unsigned long *hist, unsigned long total,
+				int pct)
+{
+	unsigned long sum = 0, want = (total * pct + 99) / 100;
+	int b;
+
+	for (b = 0; b < NR_BUCKETS; b++) {
+		sum += hist[b];
+		if (sum >= want)
+			break;
+	}
+	return 1UL << b;
+}
+
+static int run(struct writer *w, int nr)
+{
+	unsigned long hist[NR_BUCKETS] = { 0 };
+	unsigned long long start, elapsed, lat_ns = 0, max_ns = 0;
+	unsigned long pages = 0;
+	int i, b;
+
+	start = now_ns();
+	for (i = 0; i < nr; i++) {
+		w[i].total_ns = w[i].max_ns = 0;
+		memset(w[i].hist, 0, sizeof(w[i].hist));
+		if (pthread_create(&w[i].thread, NULL, writer_fn, &w[i])) {
+			perror("pthread_create");
+			return -1;
+		}
+	}
+	for (i = 0; i < nr; i++)
+		pthread_join(w[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < nr; i++) {
+		if (w[i].error) {
+			fprintf(stderr, "write: %s\n", strerror(w[i].error));
+			return -1;
+		}
+		pages += w[i].nr_pages;
+		lat_ns += w[i].total_ns;
+		if (w[i].max_ns > max_ns)
+			max_ns = w[i].max_ns;
+		for (b = 0; b < NR_BUCKETS; b++)
+			hist[b] += w[i].hist[b];
+	}
+
+	printf("%7d %9.1f %9.1f %8lu %8lu %9.1f\n", nr,
+		(double)pages * PAGE_SIZE / (1 << 20) / (elapsed / 1e9),
+		(double)lat_ns / pages / 1000,
+		percentile(hist, pages, 50), percentile(hist, pages, 99),
+		(double)max_ns / 1000);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-t max_writers] "
+		"[-s MB_per_writer]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct writer *w;
+	int opt, i;
+
+	max_writers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "d:t:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			max_writers = atoi(optarg);
+			break;
+		case 's':
+			mb_per_writer = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_writers < 1 || !mb_per_writer)
+		usage(argv[0]);
+
+	w = calloc(max_writers, sizeof(*w));
+	if (!w) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < max_writers; i++) {
+		w[i].fd = open(device, O_WRONLY | O_DIRECT);
+		if (w[i].fd < 0) {
+			perror(device);
+			return 1;
+		}
+		if (posix_memalign((void **)&w[i].pages, PAGE_SIZE,
+				NR_PATTERNS * PAGE_SIZE)) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		fill_pages(w[i].pages, i + 1);
+		w[i].nr_pages = (mb_per_writer << 20) / PAGE_SIZE;
+		w[i].start = (off_t)i * (mb_per_writer << 20);
+	}
+
+	printf("%7s %9s %9s %8s %8s %9s\n", "writers", "MB/s",
+		"avg(us)", "p50(us)", "p99(us)", "max(us)");
+	for (i = 1; i <= max_writers; i++)
+		if (run(w, i))
+			return 1;
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# Check zram writeback with a loop device as the backing device.
+# zram0 is filled with half random (incompressible) and half text data,
+# then the incompressible pages and after that the idle ones are written
+# back. After each step the data is read back and compared, and the
+# writeback counters are checked. zram0 must not be in use.
+# usage: zram_writeback_test.sh [size_MB]
+
+set -e
+size="${1:-64}"
+sys=/sys/block/zram0
+img="$(mktemp /tmp/zram_wb_img.XXXXXX)"
+data="$(mktemp /tmp/zram_wb_data.XXXXXX)"
+loop=
+
+cleanup()
+{
+	echo 1 >$sys/reset || true
+	[ -n "$loop" ] && losetup -d "$loop"
+	rm -f "$img" "$data"
+}
+trap cleanup EXIT
+
+stat()
+{
+	cat $sys/$1
+}
+
+# writeback <mode>: queue a writeback and wait for it to finish
+writeback()
+{
+	echo "$1" >$sys/writeback
+	while [ "$(stat writeback)" -ne 0 ]; do
+		sleep 1
+	done
+}
+
+check()
+{
+	if dd if=/dev/zram0 bs=1M count="$size" iflag=direct 2>/dev/null |
+			cmp -s - "$data"; then
+		echo "$1: data ok"
+	else
+		echo "$1: data differs"
+		exit 1
+	fi
+}
+
+dd if=/dev/zero of="$img" bs=1M count="$size" 2>/dev/null
+loop="$(losetup -f --show "$img")"
+
+echo 1 >$sys/reset
+echo "$loop" >$sys/backing_dev
+echo "$((size << 20))" >$sys/disksize
+echo "backing_dev: $(stat backing_dev)"
+
+head -c "$((size << 19))" /dev/urandom >"$data"
+yes "zram writeback test line" | head -c "$((size << 19))" >>"$data"
+dd if="$data" of=/dev/zram0 bs=1M oflag=direct 2>/dev/null
+check "written"
+
+mem="$(stat mem_used_total)"
+writeback huge
+echo "huge: bd_count $(stat bd_count), mem_used_total $mem ->" \
+	"$(stat mem_used_total)"
+[ "$(stat bd_count)" -eq "$((size * 128))" ]
+check "huge"
+
+# Only pages not touched since the last idle mark go out
+echo 1 >$sys/idle
+dd if=/dev/zram0 of=/dev/null bs=1M count=1 skip="$((size - 1))" \
+	iflag=direct 2>/dev/null
+before="$(stat bd_count)"
+writeback idle
+after="$(stat bd_count)"
+echo "idle: bd_count $before -> $after, mem_used_total" \
+	"$(stat mem_used_total)"
+[ "$after" -eq "$((size * 256 - 256))" ]
+check "idle"
+
+# Overwriting written back pages frees their blocks
+dd if="$data" of=/dev/zram0 bs=1M count=1 oflag=direct 2>/dev/null
+echo "overwrite: bd_count $after -> $(stat bd_count)"
+[ "$(stat bd_count)" -eq "$((after - 256))" ]
+check "overwrite"
+
+echo "bd_reads: $(stat bd_reads), bd_writes: $(stat bd_writes)"
+echo PASS
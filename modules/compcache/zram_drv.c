@@ -24,6 +24,8 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/slab.h>
 #include <linux/lzo.h>
 #include <linux/string.h>
@@ -34,18 +36,23 @@
 /* Globals */
 static int zram_major;
 struct zram *devices;
+static struct kmem_cache *zram_obj_cache;
 
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(struct zram *zram, u32 *v)
 {
+	spin_lock(&zram->stat64_lock);
 	*v = *v + 1;
+	spin_unlock(&zram->stat64_lock);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(struct zram *zram, u32 *v)
 {
+	spin_lock(&zram->stat64_lock);
 	*v = *v - 1;
+	spin_unlock(&zram->stat64_lock);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -129,22 +136,335 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
-static void zram_free_page(struct zram *zram, size_t index)
+static void zram_stream_free(struct zram_stream *zstrm)
+{
+	kfree(zstrm->workmem);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+static struct zram_stream *zram_stream_alloc(void)
+{
+	struct zram_stream *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (!zstrm->workmem || !zstrm->buffer) {
+		zram_stream_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/*
+ * Get an idle compression stream, sleeping until another writer
+ * releases one if they are all busy. Streams are not per-CPU since
+ * the writer may sleep allocating the compressed object while it
+ * still holds the stream's buffer.
+ */
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+
+	spin_lock(&zram->stream_lock);
+	while (list_empty(&zram->idle_streams)) {
+		spin_unlock(&zram->stream_lock);
+		zram_stat64_inc(zram, &zram->stats.stream_waits);
+		wait_event(zram->stream_wait,
+			!list_empty(&zram->idle_streams));
+		spin_lock(&zram->stream_lock);
+	}
+	zstrm = list_first_entry(&zram->idle_streams,
+				struct zram_stream, list);
+	list_del(&zstrm->list);
+	spin_unlock(&zram->stream_lock);
+
+	return zstrm;
+}
+
+static void zram_stream_put(struct zram *zram, struct zram_stream *zstrm)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&zstrm->list, &zram->idle_streams);
+	spin_unlock(&zram->stream_lock);
+
+	wake_up(&zram->stream_wait);
+}
+
+static u32 zram_checksum(void *mem)
+{
+	return jhash2(mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_hash[checksum & zram->dedup_mask];
+}
+
+static void zram_obj_insert(struct zram *zram, struct zram_obj *zobj)
+{
+	spin_lock(&zram->dedup_lock);
+	hlist_add_head(&zobj->node, zram_dedup_bucket(zram, zobj->checksum));
+	spin_unlock(&zram->dedup_lock);
+}
+
+/*
+ * Drop a reference to a compressed object, freeing it with the last one.
+ * Returns 1 if the object was freed.
+ */
+static int zram_obj_put(struct zram *zram, struct zram_obj *zobj)
+{
+	u32 refcount;
+
+	spin_lock(&zram->dedup_lock);
+	refcount = --zobj->refcount;
+	if (!refcount)
+		hlist_del(&zobj->node);
+	spin_unlock(&zram->dedup_lock);
+
+	if (refcount)
+		return 0;
+
+	xv_free(zram->mem_pool, zobj->page, zobj->offset);
+	kmem_cache_free(zram_obj_cache, zobj);
+	return 1;
+}
+
+/* Decompresses zobj into buffer and compares it against page. */
+static int zram_obj_same(struct zram_obj *zobj, struct page *page,
+			unsigned char *buffer)
+{
+	int ret;
+	size_t len = PAGE_SIZE;
+	unsigned char *user_mem, *cmem;
+
+	cmem = kmap_atomic(zobj->page, KM_USER1) + zobj->offset;
+	ret = lzo1x_decompress_safe(cmem + sizeof(struct zobj_header),
+				zobj->clen, buffer, &len);
+	kunmap_atomic(cmem, KM_USER1);
+
+	if (unlikely(ret != LZO_E_OK || len != PAGE_SIZE))
+		return 0;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = !memcmp(user_mem, buffer, PAGE_SIZE);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	return ret;
+}
+
+/*
+ * Find a stored object with the same content as page and take a
+ * reference to it. The first candidate with a matching checksum is
+ * pinned with a reference and compared without dedup_lock, so writers
+ * only serialize on the hash walk. A real checksum collision is rare
+ * enough that the page is then simply stored on its own.
+ */
+static struct zram_obj *zram_dedup_find(struct zram *zram, struct page *page,
+				u32 checksum, unsigned char *buffer)
 {
+	struct zram_obj *zobj, *found = NULL;
+	struct hlist_node *pos;
 	u32 clen;
-	void *obj;
 
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(zobj, pos, zram_dedup_bucket(zram, checksum),
+				node) {
+		if (zobj->checksum == checksum) {
+			zobj->refcount++;
+			found = zobj;
+			break;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	if (!found || zram_obj_same(found, page, buffer))
+		return found;
+
+	/* The other owners may have let go meanwhile */
+	clen = found->clen;
+	if (zram_obj_put(zram, found))
+		zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+
+	return NULL;
+}
+
+/*
+ * Called by xv_compact() once it copied an object to <page, offset>.
+ * An object whose last reference is gone is about to be freed by
+ * zram_obj_put(), which waits for the pool lock held by our caller,
+ * so it is left alone.
+ */
+static int zram_obj_move(void *obj, struct page *page, u32 offset,
+			void *private)
+{
+	int ret = -EBUSY;
+	struct zram *zram = private;
+	struct zram_obj *zobj = ((struct zobj_header *)obj)->zobj;
+
+	spin_lock(&zram->dedup_lock);
+	if (zobj->refcount) {
+		zobj->page = page;
+		zobj->offset = offset;
+		ret = 0;
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return ret;
+}
+
+/* Percentage of the memory pool not holding objects */
+unsigned int zram_frag_perc(struct zram *zram)
+{
+	u64 total, used;
+
+	total = xv_get_total_size_bytes(zram->mem_pool);
+	used = xv_get_used_size_bytes(zram->mem_pool);
+	if (!total || used >= total)
+		return 0;
+
+	return div64_u64((total - used) * 100, total);
+}
+
+/*
+ * Move objects out of sparsely used pool pages and free up to nr_pages
+ * of them. Called with init_lock held, on an initialized device, and with
+ * compact_lock held for writing so no I/O is looking at the objects.
+ */
+int zram_compact(struct zram *zram, unsigned int nr_pages)
+{
+	int freed;
+
+	zram->stats.frag_before = zram_frag_perc(zram);
+	freed = xv_compact(zram->mem_pool, nr_pages, zram_obj_move, zram);
+	zram->stats.frag_after = zram_frag_perc(zram);
+	zram_stat64_add(zram, &zram->stats.compact_pages, freed);
+
+	pr_debug("Compaction freed %d pages, fragmentation %u%% -> %u%%\n",
+		freed, zram->stats.frag_before, zram->stats.frag_after);
+	return freed;
+}
+
+/*
+ * Blocks of the backing device are handed out with a rotating hint so
+ * that the pages of one writeback batch tend to be contiguous. Only
+ * writeback allocates, under init_lock; blocks are freed from any context.
+ */
+static unsigned long zram_bd_alloc_block(struct zram *zram)
+{
+	unsigned long block, start = zram->bd_next;
+
+	for (;;) {
+		block = find_next_zero_bit(zram->bd_map, zram->bd_blocks,
+					start);
+		if (block >= zram->bd_blocks) {
+			if (!start)
+				return zram->bd_blocks;	/* device is full */
+			start = 0;
+			continue;
+		}
+		if (!test_and_set_bit(block, zram->bd_map))
+			break;
+	}
+
+	zram->bd_next = block + 1;
+	return block;
+}
+
+static void zram_bd_free_block(struct zram *zram, unsigned long block)
+{
+	clear_bit(block, zram->bd_map);
+}
+
+/*
+ * A read bio with pages on the backing device completes once the last
+ * of the bios reading them does.
+ */
+struct zram_bd_read {
+	struct bio *parent;
+	atomic_t pending;
+	int error;
+};
+
+static void zram_bd_read_put(struct zram_bd_read *rd)
+{
+	if (!atomic_dec_and_test(&rd->pending))
+		return;
+
+	if (rd->error) {
+		bio_io_error(rd->parent);
+	} else {
+		set_bit(BIO_UPTODATE, &rd->parent->bi_flags);
+		bio_endio(rd->parent, 0);
+	}
+	kfree(rd);
+}
+
+static void zram_bd_read_end(struct bio *bio, int err)
+{
+	struct zram_bd_read *rd = bio->bi_private;
+
+	if (err)
+		rd->error = err;
+	else
+		flush_dcache_page(bio->bi_io_vec[0].bv_page);
+
+	bio_put(bio);
+	zram_bd_read_put(rd);
+}
+
+/*
+ * We are called from zram_make_request(), so the bio is only queued by
+ * generic_make_request() until we return: it cannot be waited for here.
+ */
+static void zram_bd_read(struct zram *zram, struct zram_bd_read *rd,
+			struct bio_vec *bvec, unsigned long block)
+{
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_bdev = zram->backing_bdev;
+	bio->bi_sector = (sector_t)block << SECTORS_PER_PAGE_SHIFT;
+	bio_add_page(bio, bvec->bv_page, bvec->bv_len, bvec->bv_offset);
+	bio->bi_end_io = zram_bd_read_end;
+	bio->bi_private = rd;
+
+	atomic_inc(&rd->pending);
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	submit_bio(READ, bio);
+}
+
+/* Called with slot_lock held */
+static void __zram_free_page(struct zram *zram, size_t index)
+{
+	u32 clen;
 	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	struct zram_obj *zobj = zram->table[index].obj;
+
+	/* Writeback finds out from this that the page changed under it */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_bd_free_block(zram, zram->table[index].block);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram->table[index].block = 0;
+		zram_stat_dec(zram, &zram->stats.bd_count);
+		return;
+	}
 
-	if (unlikely(!page)) {
+	if (unlikely(!page && !zobj)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
 		 */
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
 			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
+			zram_stat_dec(zram, &zram->stats.pages_zero);
 		}
 		return;
 	}
@@ -153,26 +473,39 @@ static void zram_free_page(struct zram *zram, size_t index)
 		clen = PAGE_SIZE;
 		__free_page(page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
+		zram_stat_dec(zram, &zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	clen = zobj->clen;
+	zram->table[index].obj = NULL;
 
-	xv_free(zram->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+		zram_stat_dec(zram, &zram->stats.good_compress);
+
+	/* Other pages still share the object: only this copy goes away */
+	if (!zram_obj_put(zram, zobj)) {
+		zram_stat_dec(zram, &zram->stats.pages_dup);
+		zram_stat64_sub(zram, &zram->stats.dup_size, clen);
+		goto out_dup;
+	}
 
 out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
-	zram_stat_dec(&zram->stats.pages_stored);
+out_dup:
+	zram_stat_dec(zram, &zram->stats.pages_stored);
 
 	zram->table[index].page = NULL;
 	zram->table[index].offset = 0;
 }
 
+static void zram_free_page(struct zram *zram, size_t index)
+{
+	spin_lock(&zram->slot_lock);
+	__zram_free_page(zram, index);
+	spin_unlock(&zram->slot_lock);
+}
+
 static void handle_zero_page(struct page *page)
 {
 	void *user_mem;
@@ -206,6 +539,7 @@ static int zram_read(struct zram *zram, struct bio *bio)
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_bd_read *rd = NULL;
 
 	if (unlikely(!zram->init_done)) {
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
@@ -216,14 +550,19 @@ static int zram_read(struct zram *zram, struct bio *bio)
 	zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	down_read(&zram->compact_lock);
+
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
 		size_t clen;
 		struct page *page;
+		struct zram_obj *zobj;
 		struct zobj_header *zheader;
 		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
+		zobj = zram->table[index].obj;
+		zram->table[index].age = 0;
 
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
 			handle_zero_page(page);
@@ -231,8 +570,25 @@ static int zram_read(struct zram *zram, struct bio *bio)
 			continue;
 		}
 
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			if (!rd) {
+				rd = kmalloc(sizeof(*rd), GFP_NOIO);
+				if (unlikely(!rd)) {
+					zram_stat64_inc(zram,
+						&zram->stats.failed_reads);
+					goto out;
+				}
+				rd->parent = bio;
+				atomic_set(&rd->pending, 1);
+				rd->error = 0;
+			}
+			zram_bd_read(zram, rd, bvec, zram->table[index].block);
+			index++;
+			continue;
+		}
+
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		if (unlikely(!zram->table[index].page && !zobj)) {
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
@@ -250,8 +606,7 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		user_mem = kmap_atomic(page, KM_USER0);
 		clen = PAGE_SIZE;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = kmap_atomic(zobj->page, KM_USER1) + zobj->offset;
 
 		ret = lzo1x_decompress_safe(
 			cmem + sizeof(*zheader),
@@ -273,11 +628,24 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		index++;
 	}
 
+	up_read(&zram->compact_lock);
+
+	if (rd) {
+		zram_bd_read_put(rd);
+		return 0;
+	}
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
 out:
+	up_read(&zram->compact_lock);
+	if (rd) {
+		rd->error = -EIO;
+		zram_bd_read_put(rd);
+		return 0;
+	}
 	bio_io_error(bio);
 	return 0;
 }
@@ -297,46 +665,73 @@ static int zram_write(struct zram *zram, struct bio *bio)
 	zram_stat64_inc(zram, &zram->stats.num_writes);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	down_read(&zram->compact_lock);
+
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
+		u32 offset, checksum;
 		size_t clen;
 		struct zobj_header *zheader;
 		struct page *page, *page_store;
+		struct zram_stream *zstrm;
+		struct zram_obj *zobj = NULL;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
+		zram->table[index].age = 0;
 
 		/*
 		 * System overwrites unused sectors. Free memory associated
 		 * with this sector now.
 		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
+		if (zram->table[index].page || zram->table[index].obj ||
+				zram_test_flag(zram, index, ZRAM_ZERO) ||
+				zram_test_flag(zram, index, ZRAM_WB))
 			zram_free_page(zram, index);
 
-		mutex_lock(&zram->lock);
-
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
+			zram_stat_inc(zram, &zram->stats.pages_zero);
 			zram_set_flag(zram, index, ZRAM_ZERO);
 			index++;
 			continue;
 		}
+		checksum = zram_checksum(user_mem);
+		kunmap_atomic(user_mem, KM_USER0);
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		zstrm = zram_stream_get(zram);
+		src = zstrm->buffer;
+
+		/* Share the object of an identical page if there is one */
+		zobj = zram_dedup_find(zram, page, checksum, src);
+		if (zobj) {
+			zram_stream_put(zram, zstrm);
+			clen = zobj->clen;
+			spin_lock(&zram->slot_lock);
+			zram->table[index].obj = zobj;
+			spin_unlock(&zram->slot_lock);
+
+			zram_stat64_inc(zram, &zram->stats.dedup_hits);
+			zram_stat64_add(zram, &zram->stats.dup_size, clen);
+			zram_stat_inc(zram, &zram->stats.pages_dup);
+			zram_stat_inc(zram, &zram->stats.pages_stored);
+			if (clen <= PAGE_SIZE / 2)
+				zram_stat_inc(zram,
+					&zram->stats.good_compress);
+			index++;
+			continue;
+		}
 
+		user_mem = kmap_atomic(page, KM_USER0);
+		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
+					zstrm->workmem);
 		kunmap_atomic(user_mem, KM_USER0);
 
 		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+			zram_stream_put(zram, zstrm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+			goto out_unlock;
 		}
 
 		/*
@@ -348,46 +743,55 @@ static int zram_write(struct zram *zram, struct bio *bio)
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
+				zram_stream_put(zram, zstrm);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
 					&zram->stats.failed_writes);
-				goto out;
+				goto out_unlock;
 			}
 
 			offset = 0;
 			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
+			zram_stat_inc(zram, &zram->stats.pages_expand);
 			src = kmap_atomic(page, KM_USER0);
 			goto memstore;
 		}
 
 		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
+				&page_store, &offset,
 				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+			zram_stream_put(zram, zstrm);
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+			goto out_unlock;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		zobj = kmem_cache_alloc(zram_obj_cache, GFP_NOIO);
+		if (unlikely(!zobj)) {
+			xv_free(zram->mem_pool, page_store, offset);
+			zram_stream_put(zram, zstrm);
+			pr_info("Error allocating object for page: %u\n",
+				index);
+			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			goto out_unlock;
+		}
+		zobj->checksum = checksum;
+		zobj->refcount = 1;
+		zobj->page = page_store;
+		zobj->offset = offset;
+		zobj->clen = clen;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+memstore:
+		cmem = kmap_atomic(page_store, KM_USER1) + offset;
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		/* Back-reference needed for memory compaction */
+		if (zobj) {
 			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
+			zheader->zobj = zobj;
 			cmem += sizeof(*zheader);
 		}
-#endif
 
 		memcpy(cmem, src, clen);
 
@@ -395,25 +799,341 @@ memstore:
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			kunmap_atomic(src, KM_USER0);
 
+		if (zobj)
+			zram_obj_insert(zram, zobj);
+
+		/* Writeback may look at the entry as soon as it is set */
+		spin_lock(&zram->slot_lock);
+		if (zobj) {
+			zram->table[index].obj = zobj;
+		} else {
+			zram->table[index].page = page_store;
+			zram->table[index].offset = offset;
+		}
+		spin_unlock(&zram->slot_lock);
+
 		/* Update stats */
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
-		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat_inc(zram, &zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
+			zram_stat_inc(zram, &zram->stats.good_compress);
 
-		mutex_unlock(&zram->lock);
+		zram_stream_put(zram, zstrm);
 		index++;
 	}
 
+	up_read(&zram->compact_lock);
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
+out_unlock:
+	up_read(&zram->compact_lock);
 out:
 	bio_io_error(bio);
 	return 0;
 }
 
+static void zram_put_backing_dev(struct zram *zram)
+{
+	if (!zram->backing_bdev)
+		return;
+
+	close_bdev_exclusive(zram->backing_bdev, FMODE_READ | FMODE_WRITE);
+	zram->backing_bdev = NULL;
+
+	vfree(zram->bd_map);
+	zram->bd_map = NULL;
+	zram->bd_blocks = 0;
+	zram->bd_next = 0;
+
+	kfree(zram->backing_path);
+	zram->backing_path = NULL;
+}
+
+/*
+ * Open the block device that writeback will send pages to, replacing
+ * any previous one. Called with init_lock held, before the device is
+ * initialized.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	char *name;
+	unsigned long blocks, *map;
+	struct block_device *bdev;
+
+	name = kstrndup(path, strcspn(path, "\n"), GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	bdev = open_bdev_exclusive(name, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out_free;
+	}
+
+	blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (!blocks) {
+		ret = -EINVAL;
+		goto out_close;
+	}
+
+	map = vmalloc(BITS_TO_LONGS(blocks) * sizeof(*map));
+	if (!map) {
+		ret = -ENOMEM;
+		goto out_close;
+	}
+	memset(map, 0, BITS_TO_LONGS(blocks) * sizeof(*map));
+
+	zram_put_backing_dev(zram);
+	zram->backing_bdev = bdev;
+	zram->backing_path = name;
+	zram->bd_map = map;
+	zram->bd_blocks = blocks;
+
+	pr_info("Using %s (%lu pages) as backing device\n", name, blocks);
+	return 0;
+
+out_close:
+	close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+out_free:
+	kfree(name);
+	return ret;
+}
+
+/*
+ * Age every page by one 'idle' mark; reads and writes reset the age.
+ * A mark racing with I/O to the same page may get lost, or count for
+ * data that was just written, which only shifts that page's writeback
+ * by one round. Called with init_lock held, on an initialized device.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		struct table *entry = &zram->table[index];
+
+		if (entry->age != (u8)~0)
+			entry->age++;
+	}
+}
+
+/*
+ * Copy page index into dst and mark it under writeback, if it is one
+ * the current writeback wants. slot_lock keeps the page and its object
+ * from being freed while they are copied; the caller holds compact_lock
+ * for reading so the object does not move either.
+ */
+static int zram_wb_pick(struct zram *zram, u32 index, struct page *dst,
+			int huge, u8 min_age)
+{
+	int ret = 0;
+	size_t clen = PAGE_SIZE;
+	struct zram_obj *zobj;
+	struct table *entry = &zram->table[index];
+	unsigned char *dst_mem, *cmem;
+
+	spin_lock(&zram->slot_lock);
+
+	zobj = entry->obj;
+	if (entry->flags & (BIT(ZRAM_ZERO) | BIT(ZRAM_WB) |
+			BIT(ZRAM_UNDER_WB)))
+		goto out;
+	if (!zobj && !entry->page)
+		goto out;
+	if (huge && !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		goto out;
+	if (entry->age < min_age)
+		goto out;
+
+	dst_mem = kmap_atomic(dst, KM_USER0);
+	if (zobj) {
+		cmem = kmap_atomic(zobj->page, KM_USER1) + zobj->offset;
+		ret = lzo1x_decompress_safe(cmem + sizeof(struct zobj_header),
+					zobj->clen, dst_mem, &clen);
+		ret = (ret == LZO_E_OK && clen == PAGE_SIZE);
+	} else {
+		cmem = kmap_atomic(entry->page, KM_USER1) + entry->offset;
+		memcpy(dst_mem, cmem, PAGE_SIZE);
+		ret = 1;
+	}
+	kunmap_atomic(cmem, KM_USER1);
+	kunmap_atomic(dst_mem, KM_USER0);
+
+	if (ret)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+	else
+		pr_err("Decompression failed for writeback, page=%u\n",
+			index);
+out:
+	spin_unlock(&zram->slot_lock);
+	return ret;
+}
+
+struct zram_wb_batch {
+	atomic_t pending;
+	int error;
+	struct completion done;
+};
+
+static void zram_wb_end(struct bio *bio, int err)
+{
+	struct zram_wb_batch *wb = bio->bi_private;
+
+	if (err)
+		wb->error = err;
+
+	bio_put(bio);
+	if (atomic_dec_and_test(&wb->pending))
+		complete(&wb->done);
+}
+
+/*
+ * Write nr pages to the given blocks of the backing device, pages with
+ * consecutive blocks sharing a bio, and wait for all the bios.
+ */
+static int zram_wb_submit(struct zram *zram, struct page **pages,
+			unsigned long *blocks, unsigned int nr)
+{
+	unsigned int i;
+	struct bio *bio = NULL;
+	struct zram_wb_batch wb;
+
+	atomic_set(&wb.pending, 1);
+	wb.error = 0;
+	init_completion(&wb.done);
+
+	for (i = 0; i < nr; i++) {
+		if (bio && blocks[i] == blocks[i - 1] + 1 &&
+				bio_add_page(bio, pages[i], PAGE_SIZE, 0) ==
+				PAGE_SIZE)
+			continue;
+
+		if (bio) {
+			atomic_inc(&wb.pending);
+			submit_bio(WRITE, bio);
+		}
+
+		bio = bio_alloc(GFP_KERNEL, nr - i);
+		bio->bi_bdev = zram->backing_bdev;
+		bio->bi_sector = (sector_t)blocks[i] << SECTORS_PER_PAGE_SHIFT;
+		bio->bi_end_io = zram_wb_end;
+		bio->bi_private = &wb;
+		bio_add_page(bio, pages[i], PAGE_SIZE, 0);
+	}
+
+	atomic_inc(&wb.pending);
+	submit_bio(WRITE, bio);
+
+	if (!atomic_dec_and_test(&wb.pending))
+		wait_for_completion(&wb.done);
+
+	return wb.error;
+}
+
+/*
+ * Write pages out to the backing device and free their memory: the
+ * incompressible ones if huge is set, and those marked idle at least
+ * min_age times since they were last accessed. Pages are copied in
+ * batches of wb_batch_pages, and a page is only released if it was not
+ * freed or overwritten while its copy was being written. Called with
+ * init_lock held, on an initialized device that has a backing device.
+ * Returns the number of pages written back.
+ */
+static unsigned long zram_writeback(struct zram *zram, int huge, u8 min_age)
+{
+	int err = 0;
+	u32 *slots;
+	size_t index, num_pages;
+	unsigned int i, nr, nr_bounce;
+	unsigned long *blocks, written = 0;
+	struct page **pages;
+
+	pages = kcalloc(wb_batch_pages, sizeof(*pages), GFP_KERNEL);
+	slots = kcalloc(wb_batch_pages, sizeof(*slots), GFP_KERNEL);
+	blocks = kcalloc(wb_batch_pages, sizeof(*blocks), GFP_KERNEL);
+	if (!pages || !slots || !blocks)
+		goto out;
+
+	/* Bounce pages for one batch; make do with fewer if we must */
+	for (nr_bounce = 0; nr_bounce < wb_batch_pages; nr_bounce++) {
+		pages[nr_bounce] = alloc_page(GFP_KERNEL | __GFP_NOWARN);
+		if (!pages[nr_bounce])
+			break;
+	}
+
+	num_pages = zram->disksize >> PAGE_SHIFT;
+	index = 0;
+	while (nr_bounce && index < num_pages) {
+		nr = 0;
+		down_read(&zram->compact_lock);
+		for (; index < num_pages && nr < nr_bounce; index++) {
+			if (!zram_wb_pick(zram, index, pages[nr], huge,
+					min_age))
+				continue;
+
+			blocks[nr] = zram_bd_alloc_block(zram);
+			if (blocks[nr] == zram->bd_blocks) {
+				pr_info("Backing device is full\n");
+				spin_lock(&zram->slot_lock);
+				zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+				spin_unlock(&zram->slot_lock);
+				num_pages = index;
+				break;
+			}
+			slots[nr++] = index;
+		}
+		up_read(&zram->compact_lock);
+
+		if (!nr)
+			break;
+
+		err = zram_wb_submit(zram, pages, blocks, nr);
+		if (!err)
+			zram_stat64_add(zram, &zram->stats.bd_writes, nr);
+
+		/* Readers may be decompressing what we are about to free */
+		down_write(&zram->compact_lock);
+		for (i = 0; i < nr; i++) {
+			u32 slot = slots[i];
+
+			spin_lock(&zram->slot_lock);
+			if (!err && zram_test_flag(zram, slot, ZRAM_UNDER_WB)) {
+				__zram_free_page(zram, slot);
+				zram_set_flag(zram, slot, ZRAM_WB);
+				zram->table[slot].block = blocks[i];
+				zram_stat_inc(zram, &zram->stats.bd_count);
+				written++;
+			} else {
+				zram_clear_flag(zram, slot, ZRAM_UNDER_WB);
+				zram_bd_free_block(zram, blocks[i]);
+			}
+			spin_unlock(&zram->slot_lock);
+		}
+		up_write(&zram->compact_lock);
+
+		if (err) {
+			pr_err("Writeback to backing device failed: err=%d\n",
+				err);
+			break;
+		}
+		cond_resched();
+	}
+
+	for (i = 0; i < nr_bounce; i++)
+		__free_page(pages[i]);
+out:
+	kfree(blocks);
+	kfree(slots);
+	kfree(pages);
+
+	pr_debug("Wrote back %lu pages\n", written);
+	return written;
+}
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -458,43 +1178,80 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+static void zram_writeback_work(struct work_struct *work)
+{
+	unsigned long seq;
+	struct zram *zram = container_of(work, struct zram, wb_work);
+
+	mutex_lock(&zram->init_lock);
+	seq = zram->wb_requests;
+	if (zram->init_done && zram->backing_bdev)
+		zram_writeback(zram, zram->wb_huge, zram->wb_min_age);
+	zram->wb_done = seq;
+	mutex_unlock(&zram->init_lock);
+}
+
+/*
+ * Start writeback in the background; the caller does not wait for the
+ * I/O. A request made while one is queued only updates its mode. Called
+ * with init_lock held.
+ */
+void zram_queue_writeback(struct zram *zram, int huge, u8 min_age)
+{
+	zram->wb_huge = huge;
+	zram->wb_min_age = min_age;
+	zram->wb_requests++;
+	schedule_work(&zram->wb_work);
+}
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
+	/* A queued writeback finds the device reset and does nothing */
+	flush_work(&zram->wb_work);
+
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	/* Free compression streams; there are no writers left by now */
+	while (!list_empty(&zram->idle_streams)) {
+		struct zram_stream *zstrm;
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+		zstrm = list_first_entry(&zram->idle_streams,
+					struct zram_stream, list);
+		list_del(&zstrm->list);
+		zram_stream_free(zstrm);
+	}
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+	for (index = 0; zram->table &&
+			index < zram->disksize >> PAGE_SHIFT; index++) {
 		struct page *page;
-		u16 offset;
 
 		page = zram->table[index].page;
-		offset = zram->table[index].offset;
 
-		if (!page)
+		/* Their blocks go away with the whole map below */
+		if (zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
+		if (zram->table[index].obj)
+			zram_obj_put(zram, zram->table[index].obj);
+		else if (page)
 			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
+	vfree(zram->dedup_hash);
+	zram->dedup_hash = NULL;
+
 	xv_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+	zram_put_backing_dev(zram);
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -505,7 +1262,8 @@ void zram_reset_device(struct zram *zram)
 int zram_init_device(struct zram *zram)
 {
 	int ret;
-	size_t num_pages;
+	unsigned int i;
+	size_t num_pages, num_buckets;
 
 	mutex_lock(&zram->init_lock);
 
@@ -516,18 +1274,18 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
+	if (!zram->max_streams)
+		zram->max_streams = num_online_cpus();
 
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail;
+	for (i = 0; i < zram->max_streams; i++) {
+		struct zram_stream *zstrm = zram_stream_alloc();
+
+		if (!zstrm) {
+			pr_err("Error allocating compression stream %u\n", i);
+			ret = -ENOMEM;
+			goto fail;
+		}
+		list_add(&zstrm->list, &zram->idle_streams);
 	}
 
 	num_pages = zram->disksize >> PAGE_SHIFT;
@@ -541,6 +1299,18 @@ int zram_init_device(struct zram *zram)
 	}
 	memset(zram->table, 0, num_pages * sizeof(*zram->table));
 
+	/* About one hash bucket for every four disk pages */
+	num_buckets = roundup_pow_of_two(max_t(size_t, num_pages / 4, 1));
+	zram->dedup_hash = vmalloc(num_buckets * sizeof(*zram->dedup_hash));
+	if (!zram->dedup_hash) {
+		pr_err("Error allocating zram dedup hash\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < num_buckets; i++)
+		INIT_HLIST_HEAD(&zram->dedup_hash[i]);
+	zram->dedup_mask = num_buckets - 1;
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
@@ -589,9 +1359,15 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->stream_lock);
+	INIT_LIST_HEAD(&zram->idle_streams);
+	init_waitqueue_head(&zram->stream_wait);
+	spin_lock_init(&zram->dedup_lock);
+	init_rwsem(&zram->compact_lock);
+	spin_lock_init(&zram->slot_lock);
+	INIT_WORK(&zram->wb_work, zram_writeback_work);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -652,6 +1428,8 @@ out:
 
 static void destroy_device(struct zram *zram)
 {
+	cancel_work_sync(&zram->wb_work);
+
 #ifdef CONFIG_SYSFS
 	sysfs_remove_group(&disk_to_dev(zram->disk)->kobj,
 			&zram_disk_attr_group);
@@ -666,6 +1444,46 @@ static void destroy_device(struct zram *zram)
 		blk_cleanup_queue(zram->queue);
 }
 
+/*
+ * Under memory pressure, compact the pools of devices where a good part
+ * of the memory is not holding objects. Devices busy with I/O, init or
+ * reset are skipped rather than waited for.
+ */
+static int zram_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	int i, nr = 0;
+	struct zram *zram;
+
+	for (i = 0; i < num_devices; i++) {
+		zram = &devices[i];
+
+		if (!mutex_trylock(&zram->init_lock))
+			continue;
+
+		if (!zram->init_done ||
+				zram_frag_perc(zram) < compact_frag_perc) {
+			mutex_unlock(&zram->init_lock);
+			continue;
+		}
+
+		if (nr_to_scan > 0 && down_write_trylock(&zram->compact_lock)) {
+			nr_to_scan -= zram_compact(zram, nr_to_scan);
+			up_write(&zram->compact_lock);
+		}
+
+		nr += (xv_get_total_size_bytes(zram->mem_pool) -
+			xv_get_used_size_bytes(zram->mem_pool)) >> PAGE_SHIFT;
+		mutex_unlock(&zram->init_lock);
+	}
+
+	return nr;
+}
+
+static struct shrinker zram_shrinker = {
+	.shrink = zram_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static int __init zram_init(void)
 {
 	int ret, dev_id;
@@ -677,11 +1495,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_obj_cache = KMEM_CACHE(zram_obj, 0);
+	if (!zram_obj_cache) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto free_cache;
 	}
 
 	if (!num_devices) {
@@ -703,6 +1527,8 @@ static int __init zram_init(void)
 			goto free_devices;
 	}
 
+	register_shrinker(&zram_shrinker);
+
 	return 0;
 
 free_devices:
@@ -711,6 +1537,8 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+free_cache:
+	kmem_cache_destroy(zram_obj_cache);
 out:
 	return ret;
 }
@@ -720,17 +1548,20 @@ static void __exit zram_exit(void)
 	int i;
 	struct zram *zram;
 
+	unregister_shrinker(&zram_shrinker);
+
 	for (i = 0; i < num_devices; i++) {
 		zram = &devices[i];
 
 		destroy_device(zram);
-		if (zram->init_done)
+		if (zram->init_done || zram->backing_bdev)
 			zram_reset_device(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(devices);
+	kmem_cache_destroy(zram_obj_cache);
 	pr_debug("Cleanup done!\n");
 }
 
@@ -17,6 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/jhash.h>
+#include <linux/workqueue.h>
 
 #include "sub-projects/allocators/xvmalloc-kmod/xvmalloc.h"
 
@@ -26,16 +31,16 @@
  */
 static const unsigned max_num_devices = 32;
 
+struct zram_obj;
+
 /*
  * Stored at beginning of each compressed object.
  *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
+ * It stores back-reference to the descriptor of this object, so
+ * that compaction can tell it when the object moves.
  */
 struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
+	struct zram_obj *zobj;
 };
 
 /*-- Configurable parameters */
@@ -55,6 +60,15 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
  * otherwise, xv_malloc() would always return failure.
  */
 
+/*
+ * The shrinker compacts the memory pool only when at least this
+ * percentage of it is not holding objects.
+ */
+static const unsigned compact_frag_perc = 25;
+
+/* Pages written to the backing device with one batch of bios */
+static const unsigned wb_batch_pages = 32;
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -70,16 +84,44 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page lives on the backing device, at block table[].block */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
-/* Allocated for each disk page */
-struct table {
+/*
+ * A compressed object. Disk pages with the same content share one,
+ * found through zram->dedup_hash by a checksum of the page.
+ */
+struct zram_obj {
+	struct hlist_node node;
+	u32 checksum;
+	u32 refcount;		/* protected by zram->dedup_lock */
 	struct page *page;
 	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	u16 clen;
+};
+
+/*
+ * Allocated for each disk page. Compressed pages are found through obj,
+ * whose location changes when the pool is compacted; page and offset
+ * are used only for uncompressed pages, block only for written back ones.
+ * age counts the 'idle' marks since the page was last read or written.
+ */
+struct table {
+	union {
+		struct page *page;
+		unsigned long block;
+	};
+	u16 offset;
+	struct zram_obj *obj;	/* NULL for zero and uncompressed pages */
+	u8 age;
 	u8 flags;
 } __attribute__((aligned(4)));
 
@@ -91,20 +133,70 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 stream_waits;	/* writes that waited for a compression stream */
+	u64 dedup_hits;		/* writes that found their data already stored */
+	u64 dup_size;		/* compressed size of pages sharing an object */
+	u64 compact_pages;	/* no. of pages released by compaction */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
 	u32 pages_zero;		/* no. of zero filled pages */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_dup;		/* no. of pages sharing another's object */
+	u32 frag_before;	/* % of pool not holding objects, before... */
+	u32 frag_after;		/* ...and after the last compaction */
+	u32 bd_count;		/* no. of pages on the backing device */
+};
+
+/* Compressor working memory and output buffer for one writer */
+struct zram_stream {
+	struct list_head list;
+	void *workmem;
+	void *buffer;
 };
 
 struct zram {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	spinlock_t stat64_lock;	/* protect stats */
+	/*
+	 * Writers compress in parallel, each with a stream taken from
+	 * the idle list; they wait on stream_wait when all are busy.
+	 */
+	spinlock_t stream_lock;
+	struct list_head idle_streams;
+	wait_queue_head_t stream_wait;
+	unsigned int max_streams;
+	/* Compressed objects by page checksum, for same-page merging */
+	spinlock_t dedup_lock;
+	struct hlist_head *dedup_hash;
+	u32 dedup_mask;
+	/*
+	 * Held for reading by I/O, for writing by pool compaction and
+	 * when writeback releases the memory of pages it wrote out.
+	 */
+	struct rw_semaphore compact_lock;
+	/*
+	 * Orders freeing a table entry against writeback, which picks
+	 * and replaces entries behind the back of I/O.
+	 */
+	spinlock_t slot_lock;
+	/* Optional device that idle or incompressible pages go out to */
+	struct block_device *backing_bdev;
+	char *backing_path;
+	unsigned long *bd_map;	/* one bit per backing device block */
+	unsigned long bd_blocks;
+	unsigned long bd_next;	/* where to look for a free block */
+	/*
+	 * Writeback runs from wb_work with the mode last written to
+	 * 'writeback'; it is busy while wb_done lags wb_requests.
+	 */
+	struct work_struct wb_work;
+	int wb_huge;
+	u8 wb_min_age;
+	unsigned long wb_requests;
+	unsigned long wb_done;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -127,5 +219,10 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern unsigned int zram_frag_perc(struct zram *zram);
+extern int zram_compact(struct zram *zram, unsigned int nr_pages);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern void zram_queue_writeback(struct zram *zram, int huge, u8 min_age);
 
 #endif
@@ -73,6 +73,71 @@ static ssize_t disksize_store(struct device *dev,
 	return len;
 }
 
+static ssize_t max_comp_streams_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", zram->max_streams);
+}
+
+static ssize_t max_comp_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long num;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (zram->init_done) {
+		pr_info("Cannot change max_comp_streams for initialized "
+			"device\n");
+		return -EBUSY;
+	}
+
+	ret = strict_strtoul(buf, 10, &num);
+	if (ret)
+		return ret;
+
+	if (!num)
+		return -EINVAL;
+
+	zram->max_streams = num;
+
+	return len;
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	ssize_t ret;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	ret = sprintf(buf, "%s\n",
+		zram->backing_path ? zram->backing_path : "none");
+	mutex_unlock(&zram->init_lock);
+
+	return ret;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change backing_dev for initialized device\n");
+		ret = -EBUSY;
+	} else {
+		ret = zram_set_backing_dev(zram, buf);
+	}
+	mutex_unlock(&zram->init_lock);
+
+	return ret ? ret : len;
+}
+
 static ssize_t initstate_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -107,12 +172,111 @@ static ssize_t reset_store(struct device *dev,
 	if (bdev)
 		fsync_bdev(bdev);
 
-	if (zram->init_done)
+	if (zram->init_done || zram->backing_bdev)
 		zram_reset_device(zram);
 
 	return len;
 }
 
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long do_compact;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &do_compact);
+	if (ret)
+		return ret;
+
+	if (!do_compact)
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		down_write(&zram->compact_lock);
+		zram_compact(zram, UINT_MAX);
+		up_write(&zram->compact_lock);
+	}
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long do_mark;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &do_mark);
+	if (ret)
+		return ret;
+
+	if (!do_mark)
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		zram_mark_idle(zram);
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+/* 1 while a writeback is queued or running */
+static ssize_t writeback_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int busy;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	busy = zram->wb_done != zram->wb_requests;
+	mutex_unlock(&zram->init_lock);
+
+	return sprintf(buf, "%d\n", busy);
+}
+
+/*
+ * "idle" writes back pages marked idle since their last access, "idle N"
+ * those marked at least N times, "huge" the incompressible pages and
+ * "huge_idle" the incompressible pages that are also idle. The writeback
+ * itself runs in the background.
+ */
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret = 0, huge = 0;
+	unsigned long min_age = 1;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (sysfs_streq(buf, "huge")) {
+		huge = 1;
+		min_age = 0;
+	} else if (sysfs_streq(buf, "huge_idle")) {
+		huge = 1;
+	} else if (!strncmp(buf, "idle ", 5)) {
+		ret = strict_strtoul(buf + 5, 10, &min_age);
+		if (ret)
+			return ret;
+		if (!min_age || min_age > (u8)~0)
+			return -EINVAL;
+	} else if (!sysfs_streq(buf, "idle")) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->backing_bdev)
+		ret = -EINVAL;
+	else
+		zram_queue_writeback(zram, huge, min_age);
+	mutex_unlock(&zram->init_lock);
+
+	return ret ? ret : len;
+}
+
 static ssize_t num_reads_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -149,6 +313,41 @@ static ssize_t notify_free_show(struct device *dev,
 		zram_stat64_read(zram, &zram->stats.notify_free));
 }
 
+static ssize_t stream_waits_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.stream_waits));
+}
+
+static ssize_t dedup_hits_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.dedup_hits));
+}
+
+static ssize_t dup_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", zram->stats.pages_dup);
+}
+
+static ssize_t dup_data_size_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.dup_size));
+}
+
 static ssize_t zero_pages_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -175,6 +374,69 @@ static ssize_t compr_data_size_show(struct device *dev,
 		zram_stat64_read(zram, &zram->stats.compr_size));
 }
 
+static ssize_t frag_perc_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	unsigned int val = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (zram->init_done)
+		val = zram_frag_perc(zram);
+
+	return sprintf(buf, "%u\n", val);
+}
+
+static ssize_t compact_frag_before_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", zram->stats.frag_before);
+}
+
+static ssize_t compact_frag_after_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", zram->stats.frag_after);
+}
+
+static ssize_t compact_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.compact_pages));
+}
+
+static ssize_t bd_count_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", zram->stats.bd_count);
+}
+
+static ssize_t bd_reads_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.bd_reads));
+}
+
+static ssize_t bd_writes_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.bd_writes));
+}
+
 static ssize_t mem_used_total_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -191,29 +453,66 @@ static ssize_t mem_used_total_show(struct device *dev,
 
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 		disksize_show, disksize_store);
+static DEVICE_ATTR(max_comp_streams, S_IRUGO | S_IWUSR,
+		max_comp_streams_show, max_comp_streams_store);
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
 static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+static DEVICE_ATTR(writeback, S_IRUGO | S_IWUSR,
+		writeback_show, writeback_store);
 static DEVICE_ATTR(num_reads, S_IRUGO, num_reads_show, NULL);
 static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
 static DEVICE_ATTR(invalid_io, S_IRUGO, invalid_io_show, NULL);
 static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
+static DEVICE_ATTR(stream_waits, S_IRUGO, stream_waits_show, NULL);
+static DEVICE_ATTR(dedup_hits, S_IRUGO, dedup_hits_show, NULL);
+static DEVICE_ATTR(dup_pages, S_IRUGO, dup_pages_show, NULL);
+static DEVICE_ATTR(dup_data_size, S_IRUGO, dup_data_size_show, NULL);
 static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(frag_perc, S_IRUGO, frag_perc_show, NULL);
+static DEVICE_ATTR(compact_frag_before, S_IRUGO,
+		compact_frag_before_show, NULL);
+static DEVICE_ATTR(compact_frag_after, S_IRUGO,
+		compact_frag_after_show, NULL);
+static DEVICE_ATTR(compact_pages, S_IRUGO, compact_pages_show, NULL);
+static DEVICE_ATTR(bd_count, S_IRUGO, bd_count_show, NULL);
+static DEVICE_ATTR(bd_reads, S_IRUGO, bd_reads_show, NULL);
+static DEVICE_ATTR(bd_writes, S_IRUGO, bd_writes_show, NULL);
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
+	&dev_attr_max_comp_streams.attr,
+	&dev_attr_backing_dev.attr,
 	&dev_attr_initstate.attr,
 	&dev_attr_reset.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_writeback.attr,
 	&dev_attr_num_reads.attr,
 	&dev_attr_num_writes.attr,
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
+	&dev_attr_stream_waits.attr,
+	&dev_attr_dedup_hits.attr,
+	&dev_attr_dup_pages.attr,
+	&dev_attr_dup_data_size.attr,
 	&dev_attr_zero_pages.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_frag_perc.attr,
+	&dev_attr_compact_frag_before.attr,
+	&dev_attr_compact_frag_after.attr,
+	&dev_attr_compact_pages.attr,
+	&dev_attr_bd_count.attr,
+	&dev_attr_bd_reads.attr,
+	&dev_attr_bd_writes.attr,
 	NULL,
 };
 